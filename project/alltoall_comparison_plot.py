@@ -1,41 +1,43 @@
+import csv
+import sys
+from collections import defaultdict
+
 import numpy as np
 import matplotlib.pyplot as plt
 
-# Data
-stages = np.array([100, 1000, 10000])
-
-# RDMA data
-rdma_data = {
-    100: [1.332, 0.625, 0.933],
-    1000: [4.923, 8.165, 6.903],
-    10000: [68.447, 65.470, 67.065]
-}
-
-# MPI data
-mpi_data = {
-    100: [1.718, 1.734, 1.749],
-    1000: [4.468, 3.923, 4.131],
-    10000: [27.979, 27.669, 31.357]
+# Results appended by driver/alltoall_mpi and driver/alltoall_rdma
+results_file = sys.argv[1] if len(sys.argv) > 1 else 'alltoall_results.csv'
+
+# (impl, ranks, size) -> stages -> total seconds of every run
+runs = defaultdict(lambda: defaultdict(list))
+with open(results_file, newline='') as f:
+    for row in csv.DictReader(f):
+        key = (row['impl'], int(row['ranks']), int(row['size']))
+        runs[key][int(row['stages'])].append(float(row['total_s']))
+
+labels = {'rdma': 'SoftRoCE', 'rdma_plan': 'SoftRoCE (plan)',
+          'rdma_window': 'SoftRoCE (windowed plan)', 'mpi': 'MPI'}
+styles = {
+    'rdma': dict(fmt='o-', color='blue', ecolor='lightblue'),
+    'rdma_plan': dict(fmt='D-', color='green', ecolor='lightgreen'),
+    'rdma_window': dict(fmt='^-', color='purple', ecolor='plum'),
+    'mpi': dict(fmt='s-', color='red', ecolor='lightcoral'),
 }
 
-# Calculate means and standard deviations
-rdma_means = np.array([np.mean(rdma_data[s]) for s in stages])
-rdma_std = np.array([np.std(rdma_data[s]) for s in stages])
-mpi_means = np.array([np.mean(mpi_data[s]) for s in stages])
-mpi_std = np.array([np.std(mpi_data[s]) for s in stages])
-
 # Create the plot
 plt.figure(figsize=(10, 6))
 
-# Plot RDMA data with error bars
-plt.errorbar(stages, rdma_means, yerr=rdma_std, fmt='o-', label='SoftRoCE', 
-             capsize=5, capthick=1.5, elinewidth=1.5, markersize=8, 
-             color='blue', ecolor='lightblue')
+for (impl, ranks, size), by_stages in sorted(runs.items()):
+    stages = np.array(sorted(by_stages))
+
+    # Calculate means and standard deviations over repeated runs
+    means = np.array([np.mean(by_stages[s]) for s in stages])
+    std = np.array([np.std(by_stages[s]) for s in stages])
 
-# Plot MPI data with error bars
-plt.errorbar(stages, mpi_means, yerr=mpi_std, fmt='s-', label='MPI',
-             capsize=5, capthick=1.5, elinewidth=1.5, markersize=8,
-             color='red', ecolor='lightcoral')
+    plt.errorbar(stages, means, yerr=std,
+                 label=f'{labels.get(impl, impl)} ({ranks} ranks, {size} B)',
+                 capsize=5, capthick=1.5, elinewidth=1.5, markersize=8,
+                 **styles.get(impl, dict(fmt='^-')))
 
 # Set logarithmic scale for x-axis
 plt.xscale('log')
@@ -43,7 +45,7 @@ plt.xscale('log')
 # Customize the plot
 plt.grid(True, which="both", ls="-", alpha=0.2)
 plt.xlabel('Number of Stages', fontsize=12)
-plt.ylabel('Completion Time (seconds)', fontsize=12)
+plt.ylabel('Collective Time (seconds)', fontsize=12)
 plt.title('SoftRoCE vs MPI All-to-All Performance Comparison', fontsize=14)
 plt.legend(fontsize=10)
 
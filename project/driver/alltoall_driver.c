@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef USE_MPI
+#include <mpi.h>
+#else
+#include "rdma_lib.h"
+#endif
+
+// Collective benchmark driver shared by the MPI and the rdma_lib flavor.
+// Both flavors exchange the same blocks (size bytes per rank, NUL terminated
+// strings so rdma_sequential_alltoall can combine them), run the same warm-up
+// and barriers, and time only the collective region with a monotonic clock.
+// Every rank ends up with all blocks, so the MPI counterpart is MPI_Allgather.
+// With -P the rdma flavor runs a persistent plan instead, which exchanges the
+// raw blocks with RDMA writes and has the MPI_Allgather shape exactly. -W
+// keeps several of those stages in flight; each stage is then timed from its
+// start to the start of the next one, and the window is drained before the
+// clock stops.
+
+#define DEFAULT_SIZE 64
+#define DEFAULT_STAGES 10000
+#define DEFAULT_WARMUP 100
+#define DEFAULT_OUTPUT "alltoall_results.csv"
+
+#ifdef USE_MPI
+#define IMPL_NAME "mpi"
+#else
+#define IMPL_NAME "rdma"
+#define DEFAULT_PORT_TCP 5555
+#define CONNECT_RETRIES 500
+#define CONNECT_RETRY_US 10000
+#endif
+
+static bool impl_plan;
+static int impl_window;     // Stages in flight, 0 without a windowed plan
+
+typedef struct {
+    size_t size;
+    int stages;
+    int warmup;
+    bool stage_barrier;     // Barrier after every stage, like the original MPI program
+    const char *output;
+#ifndef USE_MPI
+    int rank;
+    int nranks;
+    const char *server_ip;
+    const char *local_ip;
+    int port;
+    bool plan;              // Persistent plan instead of rdma_sequential_alltoall
+    int window;             // Stages in flight of a windowed plan, 0 for none
+#endif
+} driver_opts;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Communication backend, one implementation per flavor
+#ifdef USE_MPI
+
+static int rank_id, num_ranks;
+
+static int coll_init(int *argc, char ***argv, driver_opts *opts) {
+    (void)opts;
+    MPI_Init(argc, argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank_id);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    return 0;
+}
+
+static int coll_barrier(void) {
+    return MPI_Barrier(MPI_COMM_WORLD) == MPI_SUCCESS ? 0 : -1;
+}
+
+static int coll_prepare(const char *send, char *recv, size_t size) {
+    (void)send;
+    (void)recv;
+    (void)size;
+    return 0;
+}
+
+static int coll_flush(char *recv, size_t size) {
+    (void)recv;
+    (void)size;
+    return 0;
+}
+
+static int coll_exchange(const char *send, char *recv, size_t size) {
+    return MPI_Allgather(send, size, MPI_CHAR, recv, size, MPI_CHAR,
+                         MPI_COMM_WORLD) == MPI_SUCCESS ? 0 : -1;
+}
+
+// Maximum of a value over all ranks, valid on rank 0
+static int coll_max(double value, double *max) {
+    return MPI_Reduce(&value, max, 1, MPI_DOUBLE, MPI_MAX, 0,
+                      MPI_COMM_WORLD) == MPI_SUCCESS ? 0 : -1;
+}
+
+static void coll_finalize(void) {
+    MPI_Finalize();
+}
+
+static const char *coll_error(void) {
+    return "MPI error";
+}
+
+#else
+
+static int rank_id, num_ranks;
+static rdma_context *ctx;
+static rdma_plan *plan;
+
+// Rank 0 serves, every other rank connects to it
+static int coll_init(int *argc, char ***argv, driver_opts *opts) {
+    (void)argc;
+    (void)argv;
+    rank_id = opts->rank;
+    num_ranks = opts->nranks;
+    impl_plan = opts->plan || opts->window > 0;
+    impl_window = opts->window;
+
+    bool is_server = rank_id == 0;
+    const char *ip = is_server ? opts->server_ip : opts->local_ip;
+    ctx = rdma_init(ip, opts->port, BUFFER_SIZE * 4, is_server);
+    if (!ctx) return -1;
+
+    if (is_server) {
+        for (int i = 1; i < num_ranks; i++) {
+            if (rdma_accept_peer(ctx) < 0) return -1;
+        }
+    } else {
+        int retries = 0;
+        while (rdma_connect_peer(ctx, opts->server_ip, opts->port) < 0) {
+            if (++retries == CONNECT_RETRIES) return -1;
+            usleep(CONNECT_RETRY_US);
+        }
+    }
+    return 0;
+}
+
+static int coll_barrier(void) {
+    return rdma_barrier(ctx);
+}
+
+// Plans are built once, outside the timed region
+static int coll_prepare(const char *send, char *recv, size_t size) {
+    if (!impl_plan) return 0;
+    if (impl_window) return rdma_alltoall_init_window(ctx, size, impl_window, &plan);
+    return rdma_alltoall_init(ctx, send, recv, (size_t)num_ranks * size, size, &plan);
+}
+
+// Complete the oldest stage of a windowed plan, its result lands in recv
+static int window_complete(char *recv, size_t size) {
+    if (rdma_plan_wait(plan) < 0) return -1;
+    memcpy(recv, rdma_plan_result(plan), (size_t)num_ranks * size);
+    return 0;
+}
+
+// Complete every stage still in flight
+static int coll_flush(char *recv, size_t size) {
+    while (impl_window && rdma_plan_inflight(plan) > 0) {
+        if (window_complete(recv, size) < 0) return -1;
+    }
+    return 0;
+}
+
+static int coll_exchange(const char *send, char *recv, size_t size) {
+    if (impl_window) {
+        if (rdma_plan_inflight(plan) == impl_window && window_complete(recv, size) < 0) return -1;
+        memcpy(rdma_plan_send_buf(plan), send, size);
+        return rdma_plan_start(plan);
+    }
+    if (plan) {
+        if (rdma_plan_start(plan) < 0) return -1;
+        return rdma_plan_wait(plan);
+    }
+    return rdma_sequential_alltoall(ctx, send, recv, size);
+}
+
+static int coll_max(double value, double *max) {
+    *max = value;
+    if (rank_id != 0) {
+        return rdma_send(ctx, 0, &value, sizeof(value)) < 0 ? -1 : 0;
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        double other;
+        if (rdma_recv(ctx, i, &other, sizeof(other)) < 0) return -1;
+        if (other > *max) *max = other;
+    }
+    return 0;
+}
+
+static void coll_finalize(void) {
+    rdma_plan_free(plan);
+    rdma_cleanup(ctx);
+}
+
+static const char *coll_error(void) {
+    return rdma_get_error();
+}
+
+#endif
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s <bytes>     block size per rank (default %d)\n"
+            "  -t <stages>    timed collective stages (default %d)\n"
+            "  -w <stages>    warm-up stages (default %d)\n"
+            "  -b             barrier after every stage\n"
+            "  -o <file>      CSV file results are appended to (default %s)\n"
+#ifndef USE_MPI
+            "  -r <rank>      rank of this process, 0 is the server (required)\n"
+            "  -n <ranks>     total number of ranks (required)\n"
+            "  -a <ip>        server IP address (required)\n"
+            "  -l <ip>        local IP address (clients, default: server IP)\n"
+            "  -p <port>      TCP port for connection setup (default %d)\n"
+            "  -P             use a persistent all-to-all plan\n"
+            "  -W <window>    use a plan keeping up to <window> stages in flight\n"
+#endif
+            , prog, DEFAULT_SIZE, DEFAULT_STAGES, DEFAULT_WARMUP, DEFAULT_OUTPUT
+#ifndef USE_MPI
+            , DEFAULT_PORT_TCP
+#endif
+            );
+}
+
+static int parse_opts(int argc, char *argv[], driver_opts *opts) {
+    *opts = (driver_opts){
+        .size = DEFAULT_SIZE,
+        .stages = DEFAULT_STAGES,
+        .warmup = DEFAULT_WARMUP,
+        .output = DEFAULT_OUTPUT,
+#ifndef USE_MPI
+        .rank = -1,
+        .port = DEFAULT_PORT_TCP
+#endif
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:w:bo:r:n:a:l:p:PW:h")) != -1) {
+        switch (opt) {
+        case 's': opts->size = strtoul(optarg, NULL, 0); break;
+        case 't': opts->stages = atoi(optarg); break;
+        case 'w': opts->warmup = atoi(optarg); break;
+        case 'b': opts->stage_barrier = true; break;
+        case 'o': opts->output = optarg; break;
+#ifndef USE_MPI
+        case 'r': opts->rank = atoi(optarg); break;
+        case 'n': opts->nranks = atoi(optarg); break;
+        case 'a': opts->server_ip = optarg; break;
+        case 'l': opts->local_ip = optarg; break;
+        case 'p': opts->port = atoi(optarg); break;
+        case 'P': opts->plan = true; break;
+        case 'W': opts->window = atoi(optarg); break;
+#endif
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (opts->size < 2 || opts->stages <= 0 || opts->warmup < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+#ifndef USE_MPI
+    if (opts->rank < 0 || opts->nranks < 2 || opts->rank >= opts->nranks || !opts->server_ip ||
+        opts->window < 0 || opts->window > RDMA_PLAN_MAX_WINDOW) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (!opts->local_ip) {
+        opts->local_ip = opts->server_ip;
+    }
+    // The combined message of the sequential all-to-all is bounded by BUFFER_SIZE
+    if (!opts->plan && !opts->window && (size_t)opts->nranks * (opts->size + 2) + 2 > BUFFER_SIZE) {
+        fprintf(stderr, "%d blocks of %zu bytes exceed the %d byte combined message\n",
+                opts->nranks, opts->size, BUFFER_SIZE);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Append one result row, writing the header into a new file
+static int write_row(const driver_opts *opts, double total_s, uint64_t *samples) {
+    FILE *out = fopen(opts->output, "a");
+    if (!out) {
+        perror(opts->output);
+        return -1;
+    }
+    if (ftell(out) == 0) {
+        fprintf(out, "impl,ranks,size,stages,warmup,stage_barrier,total_s,mean_us,p50_us,p99_us\n");
+    }
+
+    const char *impl = impl_window ? IMPL_NAME "_window"
+                     : impl_plan ? IMPL_NAME "_plan" : IMPL_NAME;
+    qsort(samples, opts->stages, sizeof(*samples), cmp_u64);
+    fprintf(out, "%s,%d,%zu,%d,%d,%d,%.6f,%.3f,%.3f,%.3f\n",
+            impl, num_ranks, opts->size, opts->stages, opts->warmup,
+            opts->stage_barrier, total_s, total_s * 1e6 / opts->stages,
+            samples[opts->stages / 2] / 1000.0,
+            samples[(int)(opts->stages * 0.99)] / 1000.0);
+    fclose(out);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    driver_opts opts;
+    if (parse_opts(argc, argv, &opts) < 0) return 1;
+
+    if (coll_init(&argc, &argv, &opts) < 0) {
+        fprintf(stderr, "Failed to initialize: %s\n", coll_error());
+        return 1;
+    }
+
+    // Same layout for both flavors: one string block out, every block back
+    size_t recv_size = (size_t)num_ranks * opts.size;
+#ifndef USE_MPI
+    if (!impl_plan) recv_size = BUFFER_SIZE;
+#endif
+    char *send_buf = malloc(opts.size);
+    char *recv_buf = malloc(recv_size);
+    uint64_t *samples = malloc(opts.stages * sizeof(*samples));
+    if (!send_buf || !recv_buf || !samples) {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        return 1;
+    }
+    memset(send_buf, 'a' + rank_id % 26, opts.size - 1);
+    send_buf[opts.size - 1] = '\0';
+
+    int ret = coll_prepare(send_buf, recv_buf, opts.size);
+    for (int i = 0; i < opts.warmup && ret == 0; i++) {
+        ret = coll_exchange(send_buf, recv_buf, opts.size);
+        if (ret == 0 && opts.stage_barrier) ret = coll_barrier();
+    }
+    if (ret == 0) ret = coll_flush(recv_buf, opts.size);
+    if (ret == 0) ret = coll_barrier();
+
+    // Timed region: only the collective stages (and their barriers)
+    uint64_t start = clock_ns();
+    for (int i = 0; i < opts.stages && ret == 0; i++) {
+        uint64_t stage_start = clock_ns();
+        ret = coll_exchange(send_buf, recv_buf, opts.size);
+        if (ret == 0 && opts.stage_barrier) ret = coll_barrier();
+        samples[i] = clock_ns() - stage_start;
+    }
+    if (ret == 0) ret = coll_flush(recv_buf, opts.size);
+    double elapsed = (clock_ns() - start) / 1e9;
+
+    double total_s = 0;
+    if (ret == 0) ret = coll_max(elapsed, &total_s);
+    if (ret == 0 && rank_id == 0) ret = write_row(&opts, total_s, samples);
+    if (ret < 0) {
+        fprintf(stderr, "Rank %d failed: %s\n", rank_id, coll_error());
+    }
+
+    free(send_buf);
+    free(recv_buf);
+    free(samples);
+    coll_finalize();
+    return ret < 0 ? 1 : 0;
+}
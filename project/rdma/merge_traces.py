@@ -0,0 +1,14 @@
+import json
+import sys
+
+# Merge the per-rank files written by rdma_trace_dump into one timeline
+if len(sys.argv) < 3:
+    sys.exit('usage: merge_traces.py <out.json> <trace.rankN.json>...')
+
+events = []
+for path in sys.argv[2:]:
+    with open(path) as f:
+        events.extend(json.load(f)['traceEvents'])
+
+with open(sys.argv[1], 'w') as f:
+    json.dump({'displayTimeUnit': 'ns', 'traceEvents': events}, f)
@@ -0,0 +1,381 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Remote atomics: every RC context registers a small window with remote
+// atomic access and advertises it in the connection info. Counters, locks and
+// work queues live in the window of the peer that owns them (their "home") and
+// are operated on by the NICs without involving the home's CPU. The home has
+// no QP to itself and reaches its own words (RDMA_HOME_SELF) with CPU atomics.
+
+#define ATOMIC_SCRATCH_SIZE 64      // Local landing area for fetched words
+
+// Local buffer receiving the results of one-sided operations
+static void *atomic_scratch(rdma_context *ctx) {
+    return (char *)ctx->atomic_buf + ATOMIC_WINDOW_SIZE;
+}
+
+// Register the atomic window, a no-op when the device or transport lacks atomics
+int atomic_init(rdma_context *ctx) {
+    if (ctx->transport != RDMA_TRANSPORT_RC || ctx->dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+        return 0;
+    }
+
+    size_t size = ATOMIC_WINDOW_SIZE + ATOMIC_SCRATCH_SIZE;
+    ctx->atomic_buf = aligned_alloc(4096, size);
+    if (!ctx->atomic_buf) {
+        set_error("Failed to allocate atomic window");
+        return -1;
+    }
+    memset(ctx->atomic_buf, 0, size);
+
+    ctx->atomic_mr = ibv_reg_mr(ctx->pd, ctx->atomic_buf, size,
+                                IBV_ACCESS_LOCAL_WRITE |
+                                IBV_ACCESS_REMOTE_READ |
+                                IBV_ACCESS_REMOTE_WRITE |
+                                IBV_ACCESS_REMOTE_ATOMIC);
+    if (!ctx->atomic_mr) {
+        set_error("Failed to register atomic window: %s", strerror(errno));
+        free(ctx->atomic_buf);
+        ctx->atomic_buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void atomic_cleanup(rdma_context *ctx) {
+    if (ctx->atomic_mr) {
+        ibv_dereg_mr(ctx->atomic_mr);
+        ctx->atomic_mr = NULL;
+    }
+    free(ctx->atomic_buf);
+    ctx->atomic_buf = NULL;
+}
+
+// Get the local atomic window, NULL if atomics are unavailable
+void *rdma_atomic_window(rdma_context *ctx) {
+    if (!ctx->atomic_mr) {
+        set_error("Remote atomics are not available on this context");
+        return NULL;
+    }
+    return ctx->atomic_buf;
+}
+
+// Validate that a range of a peer's window, or of our own, can be accessed
+static int check_window(rdma_context *ctx, int peer_idx, size_t offset, size_t len) {
+    if (peer_idx == RDMA_HOME_SELF) {
+        if (!rdma_atomic_window(ctx)) return -1;
+    } else if (peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
+        return -1;
+    } else {
+        rdma_peer_conn *peer = &ctx->peers[peer_idx];
+        if (peer->state != RDMA_CONN_CONNECTED) {
+            set_error("Peer not connected");
+            return -1;
+        }
+        if (!ctx->atomic_mr || !peer->remote_info.atomic_rkey) {
+            set_error("Remote atomics need the RC transport and atomic support on both sides");
+            return -1;
+        }
+    }
+    if (offset % sizeof(uint64_t) || offset > ATOMIC_WINDOW_SIZE ||
+        len > ATOMIC_WINDOW_SIZE - offset) {
+        set_error("Atomic window range %zu+%zu is out of bounds or unaligned", offset, len);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t *local_words(rdma_context *ctx, size_t offset) {
+    return (uint64_t *)((char *)ctx->atomic_buf + offset);
+}
+
+// Atomic on a word of our own window. CPU atomics only exclude the NIC's
+// when the device makes its atomics global, otherwise the home rank is refused
+static int local_atomic(rdma_context *ctx, size_t offset, enum ibv_wr_opcode opcode,
+                        uint64_t compare_add, uint64_t swap, uint64_t *old) {
+    if (ctx->dev_attr.atomic_cap != IBV_ATOMIC_GLOB) {
+        set_error("The home rank needs a device with IBV_ATOMIC_GLOB, "
+                  "its remote atomics are not atomic against the CPU");
+        return -1;
+    }
+
+    uint64_t *word = local_words(ctx, offset);
+    uint64_t prev = compare_add;
+    if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        prev = __atomic_fetch_add(word, compare_add, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_compare_exchange_n(word, &prev, swap, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    if (old) *old = prev;
+    return 0;
+}
+
+// Read or write whole words of our own window, each one untorn
+static void local_access(rdma_context *ctx, size_t offset, void *data, size_t len,
+                         enum ibv_wr_opcode opcode) {
+    uint64_t *words = local_words(ctx, offset);
+    for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+        uint64_t value;
+        if (opcode == IBV_WR_RDMA_WRITE) {
+            memcpy(&value, (char *)data + i * sizeof(value), sizeof(value));
+            __atomic_store_n(&words[i], value, __ATOMIC_RELEASE);
+        } else {
+            value = __atomic_load_n(&words[i], __ATOMIC_ACQUIRE);
+            memcpy((char *)data + i * sizeof(value), &value, sizeof(value));
+        }
+    }
+}
+
+// Post a single signaled one-sided operation and wait for its completion. It
+// goes over the control QP, so lock handoffs never wait behind bulk data
+static int post_one_sided(rdma_context *ctx, int peer_idx, struct ibv_send_wr *wr) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+
+    uint64_t start = stat_start();
+    TRACE_INSTANT("post_one_sided", peer_idx, wr->opcode);
+
+    if (post_ctrl(ctx, peer_idx, wr) < 0) return -1;
+
+    if (wait_ctrl(ctx, peer_idx) < 0) return -1;
+    stat_op(peer, RDMA_OP_ATOMIC, wr->sg_list->length, start);
+    return 0;
+}
+
+// Execute a fetch-and-add or compare-and-swap on a word of a peer's window
+static int remote_atomic(rdma_context *ctx, int peer_idx, size_t offset,
+                         enum ibv_wr_opcode opcode, uint64_t compare_add,
+                         uint64_t swap, uint64_t *old) {
+    if (check_window(ctx, peer_idx, offset, sizeof(uint64_t)) < 0) return -1;
+    if (peer_idx == RDMA_HOME_SELF) {
+        return local_atomic(ctx, offset, opcode, compare_add, swap, old);
+    }
+
+    rdma_conn_info *remote = &ctx->peers[peer_idx].remote_info;
+    struct ibv_sge sge = {
+        .addr = (uint64_t)atomic_scratch(ctx),
+        .length = sizeof(uint64_t),
+        .lkey = ctx->atomic_mr->lkey
+    };
+    struct ibv_send_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = opcode,
+        .wr.atomic = {
+            .remote_addr = remote->atomic_addr + offset,
+            .compare_add = compare_add,
+            .swap = swap,
+            .rkey = remote->atomic_rkey
+        }
+    };
+
+    if (post_one_sided(ctx, peer_idx, &wr) < 0) return -1;
+    if (old) {
+        memcpy(old, atomic_scratch(ctx), sizeof(uint64_t));
+    }
+    return 0;
+}
+
+// Read or write a few words of a peer's window through the scratch buffer
+static int remote_access(rdma_context *ctx, int peer_idx, size_t offset,
+                         void *data, size_t len, enum ibv_wr_opcode opcode) {
+    if (check_window(ctx, peer_idx, offset, len) < 0) return -1;
+    if (peer_idx == RDMA_HOME_SELF) {
+        local_access(ctx, offset, data, len, opcode);
+        return 0;
+    }
+    if (len > ATOMIC_SCRATCH_SIZE) {
+        set_error("Window access of %zu bytes exceeds the scratch buffer", len);
+        return -1;
+    }
+
+    if (opcode == IBV_WR_RDMA_WRITE) {
+        memcpy(atomic_scratch(ctx), data, len);
+    }
+
+    rdma_conn_info *remote = &ctx->peers[peer_idx].remote_info;
+    struct ibv_sge sge = {
+        .addr = (uint64_t)atomic_scratch(ctx),
+        .length = len,
+        .lkey = ctx->atomic_mr->lkey
+    };
+    struct ibv_send_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = opcode,
+        .wr.rdma = {
+            .remote_addr = remote->atomic_addr + offset,
+            .rkey = remote->atomic_rkey
+        }
+    };
+
+    if (post_one_sided(ctx, peer_idx, &wr) < 0) return -1;
+    if (opcode == IBV_WR_RDMA_READ) {
+        memcpy(data, atomic_scratch(ctx), len);
+    }
+    return 0;
+}
+
+static int remote_read(rdma_context *ctx, int peer_idx, size_t offset, void *data, size_t len) {
+    return remote_access(ctx, peer_idx, offset, data, len, IBV_WR_RDMA_READ);
+}
+
+static int remote_write(rdma_context *ctx, int peer_idx, size_t offset, const void *data, size_t len) {
+    return remote_access(ctx, peer_idx, offset, (void *)data, len, IBV_WR_RDMA_WRITE);
+}
+
+// Atomically add to a word of a peer's window, returning its previous value
+int rdma_fetch_add(rdma_context *ctx, int peer_idx, size_t offset, uint64_t add, uint64_t *old) {
+    return remote_atomic(ctx, peer_idx, offset, IBV_WR_ATOMIC_FETCH_AND_ADD, add, 0, old);
+}
+
+// Atomically replace a word of a peer's window if it equals 'compare'
+int rdma_cmp_swap(rdma_context *ctx, int peer_idx, size_t offset,
+                  uint64_t compare, uint64_t swap, uint64_t *old) {
+    return remote_atomic(ctx, peer_idx, offset, IBV_WR_ATOMIC_CMP_AND_SWP, compare, swap, old);
+}
+
+// Draw the next ticket from a counter in the home's window
+int rdma_ticket_next(rdma_context *ctx, int home, size_t offset, uint64_t *ticket) {
+    return rdma_fetch_add(ctx, home, offset, 1, ticket);
+}
+
+// Window offset of a lock queue node: {locked, next}
+static size_t lock_node(const rdma_lock *lock, uint64_t id) {
+    return lock->offset + sizeof(uint64_t) * (1 + 2 * (id - 1));
+}
+
+// Bind a lock handle to the lock words at 'offset' in the home's window
+int rdma_lock_init(rdma_context *ctx, rdma_lock *lock, int home, size_t offset, int max_ranks) {
+    if (max_ranks <= 0) {
+        set_error("Lock needs at least one rank");
+        return -1;
+    }
+    if (check_window(ctx, home, offset, RDMA_LOCK_SIZE(max_ranks)) < 0) return -1;
+
+    // The home takes node 1 and numbers its peers, which gives every rank a
+    // distinct queue node
+    uint64_t id = home == RDMA_HOME_SELF ? 1 : ctx->peers[home].remote_info.peer_id + 2;
+    if (id > (uint64_t)max_ranks) {
+        set_error("Rank %llu exceeds the %d queue nodes of the lock",
+                  (unsigned long long)id, max_ranks);
+        return -1;
+    }
+
+    *lock = (rdma_lock){
+        .home = home,
+        .offset = offset,
+        .id = id
+    };
+    return 0;
+}
+
+// Acquire the lock, queueing behind the current holder
+int rdma_lock_acquire(rdma_context *ctx, rdma_lock *lock) {
+    size_t node = lock_node(lock, lock->id);
+    uint64_t init[2] = {1, 0};
+    if (remote_write(ctx, lock->home, node, init, sizeof(init)) < 0) return -1;
+
+    // Verbs have no atomic swap, so CAS ourselves in as the queue tail
+    uint64_t pred = 0, old;
+    for (;;) {
+        if (rdma_cmp_swap(ctx, lock->home, lock->offset, pred, lock->id, &old) < 0) return -1;
+        if (old == pred) break;
+        pred = old;
+    }
+    if (pred == 0) return 0;
+
+    // Link behind the predecessor and wait until it hands the lock over
+    if (remote_write(ctx, lock->home, lock_node(lock, pred) + sizeof(uint64_t),
+                     &lock->id, sizeof(lock->id)) < 0) {
+        return -1;
+    }
+    uint64_t locked = 1;
+    while (locked) {
+        if (remote_read(ctx, lock->home, node, &locked, sizeof(locked)) < 0) return -1;
+    }
+    return 0;
+}
+
+// Release the lock, handing it to the next queued rank if there is one
+int rdma_lock_release(rdma_context *ctx, rdma_lock *lock) {
+    size_t next_word = lock_node(lock, lock->id) + sizeof(uint64_t);
+    uint64_t next;
+    if (remote_read(ctx, lock->home, next_word, &next, sizeof(next)) < 0) return -1;
+
+    if (next == 0) {
+        uint64_t old;
+        if (rdma_cmp_swap(ctx, lock->home, lock->offset, lock->id, 0, &old) < 0) return -1;
+        if (old == lock->id) return 0;
+
+        // A successor swapped itself in but has not linked its node yet
+        while (next == 0) {
+            if (remote_read(ctx, lock->home, next_word, &next, sizeof(next)) < 0) return -1;
+        }
+    }
+
+    uint64_t unlocked = 0;
+    return remote_write(ctx, lock->home, lock_node(lock, next), &unlocked, sizeof(unlocked));
+}
+
+// Bind a work queue handle to the queue words at 'offset' in the owner's window
+int rdma_workq_init(rdma_context *ctx, rdma_workq *q, int home, size_t offset, uint32_t capacity) {
+    if (capacity == 0) {
+        set_error("Work queue needs a non-zero capacity");
+        return -1;
+    }
+    if (check_window(ctx, home, offset, RDMA_WORKQ_SIZE(capacity)) < 0) return -1;
+
+    *q = (rdma_workq){
+        .home = home,
+        .offset = offset,
+        .capacity = capacity
+    };
+    return 0;
+}
+
+// Owner side: append a task, returns 1 if queued and 0 if the queue is full
+int rdma_workq_push(rdma_context *ctx, const rdma_workq *q, uint64_t task) {
+    if (q->home != RDMA_HOME_SELF) {
+        set_error("Only the owner pushes to a work queue");
+        return -1;
+    }
+
+    // Layout: {head, tail, tasks[capacity]}, thieves advance head remotely
+    uint64_t *words = local_words(ctx, q->offset);
+    uint64_t head = __atomic_load_n(&words[0], __ATOMIC_ACQUIRE);
+    uint64_t tail = words[1];
+    if (tail - head >= q->capacity) return 0;
+
+    words[2 + tail % q->capacity] = task;
+    __atomic_store_n(&words[1], tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Thief side: take the oldest task, returns 1 if one was taken and 0 if empty
+int rdma_workq_steal(rdma_context *ctx, const rdma_workq *q, uint64_t *task) {
+    if (q->home == RDMA_HOME_SELF) {
+        set_error("Work queues are stolen from remote owners");
+        return -1;
+    }
+
+    for (;;) {
+        uint64_t ends[2];
+        if (remote_read(ctx, q->home, q->offset, ends, sizeof(ends)) < 0) return -1;
+        if (ends[0] >= ends[1]) return 0;
+
+        // Read the task before claiming it: once head moves the owner may reuse the slot
+        uint64_t value;
+        size_t slot = q->offset + sizeof(uint64_t) * (2 + ends[0] % q->capacity);
+        if (remote_read(ctx, q->home, slot, &value, sizeof(value)) < 0) return -1;
+
+        uint64_t old;
+        if (rdma_cmp_swap(ctx, q->home, q->offset, ends[0], ends[0] + 1, &old) < 0) return -1;
+        if (old == ends[0]) {
+            *task = value;
+            return 1;
+        }
+    }
+}
@@ -0,0 +1,679 @@
+#include "rdma_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Microbenchmarks for the rdma_lib primitives. The process forks one client
+// per peer and acts as the server itself, so a single machine with a loopback
+// rxe device is enough. Only the server measures; results go to a CSV or JSON
+// file with min/p50/p99/p99.9 latency and throughput per (test, peers, size).
+
+#define PORT 5555
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_MIN_SIZE 1
+#define DEFAULT_MAX_SIZE (64UL << 20)
+#define DEFAULT_ITERS 1000
+#define DEFAULT_WARMUP 50
+#define MIN_ITERS 5
+#define BYTES_PER_POINT (256UL << 20)   // Caps the iterations of large messages
+#define CONNECT_RETRIES 500
+#define CONNECT_RETRY_US 10000
+#define MAX_PEER_COUNTS 16
+
+enum {
+    TEST_PINGPONG = 1 << 0,
+    TEST_BW = 1 << 1,
+    TEST_BCAST = 1 << 2,
+    TEST_ALLTOALL = 1 << 3,
+    TEST_ALL = (1 << 4) - 1
+};
+
+static const struct {
+    unsigned id;
+    const char *name;
+} test_names[] = {
+    {TEST_PINGPONG, "pingpong"},
+    {TEST_BW, "bw"},
+    {TEST_BCAST, "bcast"},
+    {TEST_ALLTOALL, "alltoall"}
+};
+
+#define NUM_TESTS (int)(sizeof(test_names) / sizeof(test_names[0]))
+
+// Indexed by rdma_codec
+static const char *codec_names[RDMA_CODEC_COUNT] = {
+    "none", "lz", "shuffle", "fp16", "bf16", "int8", "topk"
+};
+
+typedef struct {
+    const char *ip;
+    int port;
+    int peer_counts[MAX_PEER_COUNTS];
+    int num_peer_counts;
+    size_t min_size;
+    size_t max_size;
+    int iters;
+    int warmup;
+    unsigned tests;
+    rdma_transport transport;
+    bool mcast;
+    bool timestamps;
+    size_t chunk_size;      // Streaming chunk of large sends, 0 for the library default
+    rdma_codec codec;       // Ping-pong, bandwidth and broadcast messages go through it
+    uint64_t rate_mbit;     // Send rate limit of every context, 0 for none
+    rdma_affinity affinity; // Placement of every rank next to the NIC
+    bool json;
+    const char *output;
+} bench_opts;
+
+// Buffers and context shared by every test of one peer count
+typedef struct {
+    rdma_context *ctx;
+    int npeers;
+    bool pingpong_peer;     // This client is the server's peer 0
+    bool coded;             // Messages use the coded sends
+    char *sbuf;
+    char *rbuf;
+    uint64_t *samples;
+} bench_state;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a <ip>        address of the RDMA netdev (default %s)\n"
+            "  -p <port>      TCP port for connection setup (default %d)\n"
+            "  -n <list>      comma separated peer counts (default 1,2)\n"
+            "  -s <bytes>     smallest message size (default %d)\n"
+            "  -S <bytes>     largest message size (default %lu)\n"
+            "  -i <iters>     timed iterations per point (default %d)\n"
+            "  -w <iters>     warmup iterations per point (default %d)\n"
+            "  -t <list>      tests: pingpong,bw,bcast,alltoall (default all)\n"
+            "  -u             use the UD transport\n"
+            "  -m             enable hardware multicast for broadcasts\n"
+            "  -T             timestamp completions (NIC clock if available)\n"
+            "  -k <bytes>     chunk size of streamed large messages (default: one receive slot)\n"
+            "  -c <codec>     codec for pingpong, bw and bcast messages:\n"
+            "                 none,lz,shuffle,fp16,bf16,int8,topk (default none)\n"
+            "  -r <Mbit/s>    send rate limit of every rank (default none)\n"
+            "  -N <mode>      pin ranks next to the NIC: none,node,core (default none)\n"
+            "  -j             write JSON instead of CSV\n"
+            "  -o <file>      output file (default bench_results.csv/.json)\n",
+            prog, DEFAULT_IP, PORT, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE,
+            DEFAULT_ITERS, DEFAULT_WARMUP);
+}
+
+static int parse_tests(const char *arg, unsigned *tests) {
+    char *copy = strdup(arg);
+    if (!copy) return -1;
+
+    *tests = 0;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        int i;
+        for (i = 0; i < NUM_TESTS; i++) {
+            if (strcmp(tok, test_names[i].name) == 0) break;
+        }
+        if (i == NUM_TESTS) {
+            fprintf(stderr, "Unknown test '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+        *tests |= test_names[i].id;
+    }
+    free(copy);
+    return 0;
+}
+
+static int parse_peer_counts(const char *arg, bench_opts *opts) {
+    char *copy = strdup(arg);
+    if (!copy) return -1;
+
+    opts->num_peer_counts = 0;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n <= 0 || opts->num_peer_counts == MAX_PEER_COUNTS) {
+            fprintf(stderr, "Invalid peer count '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+        opts->peer_counts[opts->num_peer_counts++] = n;
+    }
+    free(copy);
+    return opts->num_peer_counts > 0 ? 0 : -1;
+}
+
+// Iterations for one point, fewer for large messages
+static int iters_for(const bench_opts *opts, size_t size) {
+    size_t cap = BYTES_PER_POINT / size;
+    int iters = cap < (size_t)opts->iters ? (int)cap : opts->iters;
+    return iters < MIN_ITERS ? MIN_ITERS : iters;
+}
+
+// The combined all-to-all message has to fit in BUFFER_SIZE
+static bool alltoall_fits(int npeers, size_t size) {
+    return (size_t)(npeers + 1) * (size + 2) + 2 <= BUFFER_SIZE;
+}
+
+static int parse_codec(const char *arg, rdma_codec *codec) {
+    for (int i = 0; i < RDMA_CODEC_COUNT; i++) {
+        if (strcmp(arg, codec_names[i]) == 0) {
+            *codec = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown codec '%s'\n", arg);
+    return -1;
+}
+
+static int parse_affinity(const char *arg, rdma_affinity *affinity) {
+    static const char *names[] = {"none", "node", "core"};
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            *affinity = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown affinity '%s'\n", arg);
+    return -1;
+}
+
+// The library streams large messages in chunks, coded or not
+static int send_msg(bench_state *st, int peer, const char *buf, size_t len) {
+    if (st->coded) return rdma_send_coded(st->ctx, peer, buf, len) < 0 ? -1 : 0;
+    return rdma_send(st->ctx, peer, buf, len) < 0 ? -1 : 0;
+}
+
+static int recv_msg(bench_state *st, int peer, char *buf, size_t len) {
+    if (st->coded) return rdma_recv_coded(st->ctx, peer, buf, len) < 0 ? -1 : 0;
+    return rdma_recv(st->ctx, peer, buf, len) < 0 ? -1 : 0;
+}
+
+// Multicast broadcasts are bounded, so broadcasts go out as a train of messages
+static int bcast_msg(bench_state *st, const char *buf, size_t len) {
+    rdma_context *ctx = st->ctx;
+    if (st->coded) return rdma_broadcast_coded(ctx, buf, len) < 0 ? -1 : 0;
+
+    size_t chunk = rdma_max_msg_size(ctx);
+    size_t off = 0;
+    do {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if (rdma_broadcast(ctx, buf + off, n) < 0) return -1;
+        off += n;
+    } while (off < len);
+    return 0;
+}
+
+static int bcast_recv_msg(bench_state *st, char *buf, size_t len) {
+    rdma_context *ctx = st->ctx;
+    if (st->coded) return rdma_broadcast_recv_coded(ctx, buf, len) < 0 ? -1 : 0;
+
+    size_t off = 0;
+    do {
+        int n = rdma_broadcast_recv(ctx, buf + off, len - off);
+        if (n < 0) return -1;
+        off += n;
+    } while (off < len);
+    return 0;
+}
+
+// One iteration of a test; on the server 'ns' receives its duration
+static int run_iter(bench_state *st, unsigned test, size_t size, uint64_t *ns) {
+    rdma_context *ctx = st->ctx;
+    char ack = 0;
+    uint64_t start = clock_ns();
+
+    switch (test) {
+    case TEST_PINGPONG:
+        if (ctx->is_server) {
+            if (send_msg(st, 0, st->sbuf, size) < 0) return -1;
+            if (recv_msg(st, 0, st->rbuf, size) < 0) return -1;
+        } else if (st->pingpong_peer) {
+            if (recv_msg(st, 0, st->rbuf, size) < 0) return -1;
+            if (send_msg(st, 0, st->sbuf, size) < 0) return -1;
+        }
+        break;
+    case TEST_BW:
+        // Streaming: the receiver acknowledges once per run, see run_point
+        if (ctx->is_server) {
+            if (send_msg(st, 0, st->sbuf, size) < 0) return -1;
+        } else if (st->pingpong_peer) {
+            if (recv_msg(st, 0, st->rbuf, size) < 0) return -1;
+        }
+        break;
+    case TEST_BCAST:
+        // Completion is known once every client acknowledged
+        if (ctx->is_server) {
+            if (bcast_msg(st, st->sbuf, size) < 0) return -1;
+            for (int i = 0; i < st->npeers; i++) {
+                if (rdma_recv(ctx, i, &ack, sizeof(ack)) < 0) return -1;
+            }
+        } else {
+            if (bcast_recv_msg(st, st->rbuf, size) < 0) return -1;
+            if (rdma_send(ctx, 0, &ack, sizeof(ack)) < 0) return -1;
+        }
+        break;
+    case TEST_ALLTOALL:
+        if (rdma_sequential_alltoall(ctx, st->sbuf, st->rbuf, size) < 0) return -1;
+        break;
+    }
+
+    *ns = clock_ns() - start;
+    return 0;
+}
+
+// Payload bytes the server moves per iteration, used for the throughput column
+static double bytes_per_iter(unsigned test, int npeers, size_t size) {
+    switch (test) {
+    case TEST_PINGPONG:
+        return 2.0 * size;
+    case TEST_BW:
+        return size;
+    case TEST_BCAST:
+        return (double)size * npeers;
+    default:
+        // Every client's block in, the combined message out to every client
+        return (double)size * npeers + (double)(npeers + 1) * (size + 2) * npeers;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, int n, double q) {
+    int idx = (int)(q * n + 0.999999) - 1;
+    if (idx < 0) idx = 0;
+    if (idx >= n) idx = n - 1;
+    return sorted[idx] / 1000.0;
+}
+
+// Median of log2 histograms summed over the peers, at bucket resolution
+static double hist_p50_us(const rdma_stats *stats, bool wire) {
+    uint64_t hist[RDMA_HIST_BUCKETS] = {0}, total = 0, seen = 0;
+    for (int i = 0; i < stats->num_peers; i++) {
+        const uint64_t *h = wire ? stats->peers[i].wire_hist : stats->peers[i].deliver_hist;
+        for (int b = 0; b < RDMA_HIST_BUCKETS; b++) {
+            hist[b] += h[b];
+            total += h[b];
+        }
+    }
+    for (int b = 0; b < RDMA_HIST_BUCKETS && total > 0; b++) {
+        seen += hist[b];
+        if (2 * seen >= total) {
+            return 1.5 * (1ULL << b) / 1000.0;  // Middle of [2^b, 2^(b+1)) ns
+        }
+    }
+    return 0;
+}
+
+static void write_result(FILE *out, const bench_opts *opts, bool *first, const char *test,
+                         int npeers, size_t size, int iters, const uint64_t *sorted,
+                         double gbps, const rdma_counters *delta) {
+    const char *transport = opts->transport == RDMA_TRANSPORT_UD ? "ud" : "rc";
+    const char *codec = strcmp(test, "alltoall") ? codec_names[opts->codec] : "none";
+    double min = sorted[0] / 1000.0;
+    double p50 = percentile_us(sorted, iters, 0.50);
+    double p99 = percentile_us(sorted, iters, 0.99);
+    double p999 = percentile_us(sorted, iters, 0.999);
+
+    // Host side counters of the timed region, summed over the peers
+    unsigned long long empty_polls = 0, rnr_events = 0, retransmits = 0;
+    for (int i = 0; i < delta->lib.num_peers; i++) {
+        empty_polls += delta->lib.peers[i].empty_polls;
+        rnr_events += delta->lib.peers[i].rnr_events;
+        retransmits += delta->lib.peers[i].retransmits;
+    }
+    double wire_p50 = hist_p50_us(&delta->lib, true);
+    double deliver_p50 = hist_p50_us(&delta->lib, false);
+
+    if (opts->json) {
+        fprintf(out, "%s\n  {\"test\": \"%s\", \"transport\": \"%s\", \"mcast\": %s, "
+                "\"codec\": \"%s\", \"peers\": %d, \"size\": %zu, \"iters\": %d, \"min_us\": %.3f, "
+                "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"gbps\": %.4f, "
+                "\"hw_tx_bytes\": %llu, \"hw_rx_bytes\": %llu, \"hw_retransmits\": %llu, "
+                "\"hw_rnr_naks\": %llu, \"hw_out_of_sequence\": %llu, \"hw_cnp_sent\": %llu, "
+                "\"hw_cnp_handled\": %llu, \"hw_ecn\": %llu, \"empty_polls\": %llu, "
+                "\"rnr_events\": %llu, \"retransmits\": %llu, \"wire_p50_us\": %.3f, \"deliver_p50_us\": %.3f}",
+                *first ? "" : ",", test, transport, opts->mcast ? "true" : "false", codec,
+                npeers, size, iters, min, p50, p99, p999, gbps,
+                (unsigned long long)delta->tx_bytes, (unsigned long long)delta->rx_bytes,
+                (unsigned long long)delta->retransmits, (unsigned long long)delta->rnr_naks,
+                (unsigned long long)delta->out_of_sequence, (unsigned long long)delta->cnp_sent,
+                (unsigned long long)delta->cnp_handled, (unsigned long long)delta->ecn_marked,
+                empty_polls, rnr_events, retransmits,
+                wire_p50, deliver_p50);
+    } else {
+        fprintf(out, "%s,%s,%d,%s,%d,%zu,%d,%.3f,%.3f,%.3f,%.3f,%.4f,"
+                "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%.3f\n",
+                test, transport, opts->mcast, codec, npeers, size, iters,
+                min, p50, p99, p999, gbps,
+                (unsigned long long)delta->tx_bytes, (unsigned long long)delta->rx_bytes,
+                (unsigned long long)delta->retransmits, (unsigned long long)delta->rnr_naks,
+                (unsigned long long)delta->out_of_sequence, (unsigned long long)delta->cnp_sent,
+                (unsigned long long)delta->cnp_handled, (unsigned long long)delta->ecn_marked,
+                empty_polls, rnr_events, retransmits,
+                wire_p50, deliver_p50);
+    }
+    *first = false;
+    fflush(out);
+}
+
+// Streaming runs end when the receiver has acknowledged everything
+static int bw_ack(bench_state *st) {
+    char ack = 0;
+
+    if (st->ctx->is_server) {
+        return rdma_recv(st->ctx, 0, &ack, sizeof(ack)) < 0 ? -1 : 0;
+    }
+    if (st->pingpong_peer) {
+        return rdma_send(st->ctx, 0, &ack, sizeof(ack)) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// Warm up, then time one (test, size) point
+static int run_point(bench_state *st, const bench_opts *opts, int t, size_t size,
+                     FILE *out, bool *first) {
+    unsigned test = test_names[t].id;
+    int iters = iters_for(opts, size);
+    uint64_t ns;
+
+    for (int i = 0; i < opts->warmup; i++) {
+        if (run_iter(st, test, size, &ns) < 0) return -1;
+    }
+    if (test == TEST_BW && opts->warmup > 0 && bw_ack(st) < 0) return -1;
+    if (rdma_barrier(st->ctx) < 0) return -1;
+
+    // Only the server reports, it alone snapshots the counters
+    rdma_counters before, after, delta;
+    if (st->ctx->is_server && rdma_read_counters(st->ctx, &before) < 0) return -1;
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < iters; i++) {
+        if (run_iter(st, test, size, &st->samples[i]) < 0) return -1;
+    }
+    if (test == TEST_BW && bw_ack(st) < 0) return -1;
+    uint64_t elapsed = clock_ns() - start;
+
+    if (st->ctx->is_server) {
+        int ret = rdma_read_counters(st->ctx, &after);
+        if (ret == 0) {
+            ret = rdma_counters_delta(&before, &after, &delta);
+            rdma_free_counters(&after);
+        }
+        rdma_free_counters(&before);
+        if (ret < 0) return -1;
+
+        // Ping-pong latency is reported one way
+        if (test == TEST_PINGPONG) {
+            for (int i = 0; i < iters; i++) st->samples[i] /= 2;
+        }
+        qsort(st->samples, iters, sizeof(*st->samples), cmp_u64);
+        double gbps = bytes_per_iter(test, st->npeers, size) * iters / elapsed;
+        write_result(out, opts, first, test_names[t].name, st->npeers, size, iters,
+                     st->samples, gbps, &delta);
+        rdma_free_counters(&delta);
+    }
+    return rdma_barrier(st->ctx);
+}
+
+// Run every selected test and size on a connected context
+static int run_tests(bench_state *st, const bench_opts *opts, FILE *out, bool *first) {
+    for (int t = 0; t < NUM_TESTS; t++) {
+        if (!(opts->tests & test_names[t].id)) continue;
+
+        for (size_t size = opts->min_size; size <= opts->max_size; size *= 2) {
+            if (test_names[t].id == TEST_ALLTOALL) {
+                if (!alltoall_fits(st->npeers, size)) break;
+                // Blocks are strings, keep them free of NULs
+                memset(st->sbuf, 'a', size - 1);
+                st->sbuf[size - 1] = '\0';
+            } else if (opts->codec >= RDMA_CODEC_FP16 && size % sizeof(float)) {
+                continue;   // Lossy codecs take whole floats
+            }
+            if (run_point(st, opts, t, size, out, first) < 0) {
+                fprintf(stderr, "%s: %s with %zu bytes failed: %s\n",
+                        st->ctx->is_server ? "server" : "client",
+                        test_names[t].name, size, rdma_get_error());
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Create a context and connect it, clients retry until the server listens
+static rdma_context *setup_context(const bench_opts *opts, int npeers, bool is_server) {
+    rdma_init_attr attr = {
+        .ip = opts->ip,
+        .port = opts->port,
+        .buf_size = BUFFER_SIZE * 4,
+        .is_server = is_server,
+        .transport = opts->transport,
+        .timestamps = opts->timestamps,
+        .chunk_size = opts->chunk_size,
+        .affinity = opts->affinity
+    };
+    rdma_context *ctx = rdma_init_ex(&attr);
+    if (!ctx) {
+        fprintf(stderr, "Failed to initialize RDMA: %s\n", rdma_get_error());
+        return NULL;
+    }
+
+    if (is_server) {
+        for (int i = 0; i < npeers; i++) {
+            if (rdma_accept_peer(ctx) < 0) {
+                fprintf(stderr, "Failed to accept client %d: %s\n", i + 1, rdma_get_error());
+                goto err;
+            }
+        }
+    } else {
+        int retries = 0;
+        while (rdma_connect_peer(ctx, opts->ip, opts->port) < 0) {
+            if (++retries == CONNECT_RETRIES) {
+                fprintf(stderr, "Failed to connect to server: %s\n", rdma_get_error());
+                goto err;
+            }
+            usleep(CONNECT_RETRY_US);
+        }
+    }
+
+    if (opts->mcast && rdma_mcast_enable(ctx) < 0) {
+        fprintf(stderr, "Failed to enable multicast: %s\n", rdma_get_error());
+        goto err;
+    }
+    if (opts->rate_mbit &&
+        rdma_set_rate_limit(ctx, -1, opts->rate_mbit * 1000000 / 8, 0) < 0) {
+        fprintf(stderr, "Failed to set rate limit: %s\n", rdma_get_error());
+        goto err;
+    }
+    rdma_codec_attr codec = {.codec = opts->codec};
+    if (opts->codec != RDMA_CODEC_NONE && rdma_set_codec(ctx, &codec) < 0) {
+        fprintf(stderr, "Failed to set codec: %s\n", rdma_get_error());
+        goto err;
+    }
+
+    // Clients forked onto the same machine would share the server's core,
+    // so only the server's polling thread takes it
+    if (is_server && rdma_pin_thread(ctx) < 0) {
+        fprintf(stderr, "Failed to pin thread: %s\n", rdma_get_error());
+        goto err;
+    }
+
+    // The server reports where its rank ended up
+    rdma_placement placement;
+    if (is_server && opts->affinity != RDMA_AFFINITY_NONE &&
+        rdma_get_placement(ctx, &placement) == 0) {
+        rdma_print_placement(stdout, &placement);
+    }
+    return ctx;
+
+err:
+    rdma_cleanup(ctx);
+    return NULL;
+}
+
+// Run all tests as the server or as one client of a group of 'npeers'
+static int run_role(const bench_opts *opts, int npeers, bool is_server, FILE *out, bool *first) {
+    bench_state st = {.npeers = npeers};
+    int ret = -1;
+
+    st.ctx = setup_context(opts, npeers, is_server);
+    if (!st.ctx) return -1;
+    st.pingpong_peer = !is_server && st.ctx->peers[0].remote_info.peer_id == 0;
+    st.coded = opts->codec != RDMA_CODEC_NONE;
+
+    // Registered buffers let every send go out without a staging copy
+    st.sbuf = aligned_alloc(4096, opts->max_size);
+    st.rbuf = aligned_alloc(4096, opts->max_size < BUFFER_SIZE ? BUFFER_SIZE : opts->max_size);
+    st.samples = malloc(opts->iters > MIN_ITERS ? opts->iters * sizeof(uint64_t)
+                                                : MIN_ITERS * sizeof(uint64_t));
+    if (!st.sbuf || !st.rbuf || !st.samples) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        goto out;
+    }
+    memset(st.sbuf, 'a', opts->max_size);
+    if (rdma_reg_buffer(st.ctx, st.sbuf, opts->max_size) < 0) {
+        fprintf(stderr, "Failed to register send buffer: %s\n", rdma_get_error());
+        goto out;
+    }
+
+    if (rdma_barrier(st.ctx) < 0) {
+        fprintf(stderr, "Start barrier failed: %s\n", rdma_get_error());
+        goto out;
+    }
+    ret = run_tests(&st, opts, out, first);
+
+out:
+    free(st.sbuf);
+    free(st.rbuf);
+    free(st.samples);
+    rdma_cleanup(st.ctx);
+    return ret;
+}
+
+// Fork the clients of one group before touching the device, then serve them
+static int run_group(const bench_opts *opts, int npeers, FILE *out, bool *first) {
+    pid_t *pids = calloc(npeers, sizeof(*pids));
+    if (!pids) return -1;
+
+    fflush(out);
+    for (int i = 0; i < npeers; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            npeers = i;
+            break;
+        }
+        if (pids[i] == 0) {
+            exit(run_role(opts, npeers, false, NULL, NULL) < 0 ? 1 : 0);
+        }
+    }
+
+    int ret = run_role(opts, npeers, true, out, first);
+    for (int i = 0; i < npeers; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            ret = -1;
+        }
+    }
+    free(pids);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    bench_opts opts = {
+        .ip = DEFAULT_IP,
+        .port = PORT,
+        .peer_counts = {1, 2},
+        .num_peer_counts = 2,
+        .min_size = DEFAULT_MIN_SIZE,
+        .max_size = DEFAULT_MAX_SIZE,
+        .iters = DEFAULT_ITERS,
+        .warmup = DEFAULT_WARMUP,
+        .tests = TEST_ALL,
+        .transport = RDMA_TRANSPORT_RC
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:n:s:S:i:w:t:umTk:c:r:N:jo:h")) != -1) {
+        switch (opt) {
+        case 'a': opts.ip = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'n':
+            if (parse_peer_counts(optarg, &opts) < 0) return 1;
+            break;
+        case 's': opts.min_size = strtoul(optarg, NULL, 0); break;
+        case 'S': opts.max_size = strtoul(optarg, NULL, 0); break;
+        case 'i': opts.iters = atoi(optarg); break;
+        case 'w': opts.warmup = atoi(optarg); break;
+        case 't':
+            if (parse_tests(optarg, &opts.tests) < 0) return 1;
+            break;
+        case 'u': opts.transport = RDMA_TRANSPORT_UD; break;
+        case 'm': opts.mcast = true; break;
+        case 'T': opts.timestamps = true; break;
+        case 'k': opts.chunk_size = strtoul(optarg, NULL, 0); break;
+        case 'c':
+            if (parse_codec(optarg, &opts.codec) < 0) return 1;
+            break;
+        case 'r': opts.rate_mbit = strtoull(optarg, NULL, 0); break;
+        case 'N':
+            if (parse_affinity(optarg, &opts.affinity) < 0) return 1;
+            break;
+        case 'j': opts.json = true; break;
+        case 'o': opts.output = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.min_size == 0 || opts.max_size < opts.min_size || opts.iters <= 0 || opts.warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!opts.output) {
+        opts.output = opts.json ? "bench_results.json" : "bench_results.csv";
+    }
+
+    FILE *out = fopen(opts.output, "w");
+    if (!out) {
+        perror(opts.output);
+        return 1;
+    }
+    if (opts.json) {
+        fprintf(out, "[");
+    } else {
+        fprintf(out, "test,transport,mcast,codec,peers,size,iters,min_us,p50_us,p99_us,p999_us,gbps,"
+                "hw_tx_bytes,hw_rx_bytes,hw_retransmits,hw_rnr_naks,hw_out_of_sequence,hw_cnp_sent,"
+                "hw_cnp_handled,hw_ecn,empty_polls,rnr_events,retransmits,wire_p50_us,"
+                "deliver_p50_us\n");
+    }
+
+    bool first = true;
+    int ret = 0;
+    for (int i = 0; i < opts.num_peer_counts && ret == 0; i++) {
+        ret = run_group(&opts, opts.peer_counts[i], out, &first);
+    }
+
+    if (opts.json) {
+        fprintf(out, "\n]\n");
+    }
+    fclose(out);
+
+    if (ret < 0) {
+        fprintf(stderr, "Benchmark failed, partial results in %s\n", opts.output);
+        return 1;
+    }
+    printf("Results written to %s\n", opts.output);
+    return 0;
+}
@@ -0,0 +1,769 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+// Codec stage for coded sends and broadcasts. A message is cut into chunks
+// that fit one send; every chunk carries a small header naming its codec, so
+// receivers need no configuration. Chunks are encoded into a ring of
+// registered buffers: chunk k+1 is encoded while chunk k is on the wire.
+//
+// Lossless codecs (LZ, shuffle+RLE) are only used while they pay: the link
+// rate is measured from streams sent raw, the encoder rate and ratio from
+// streams sent encoded, and every CODEC_PROBE_STREAMS streams the other choice
+// is tried to refresh the loser's estimate. Lossy codecs are opt-in and always
+// applied, so the precision a receiver sees does not depend on link speed.
+
+#define CODEC_SLOTS 4               // Encode buffers in flight per stream
+#define CODEC_PROBE_STREAMS 64      // Streams between probes of the other choice
+#define CODEC_MAX_RATIO 0.9         // Encoded/raw size below which compression counts
+#define CODEC_EWMA_SHIFT 3          // Estimates move 1/8 towards every sample
+#define CODEC_TOPK_DEFAULT 0.01f
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+#define TOPK_MAX_VALUES 65536       // Indices travel as 16 bits
+
+// Header in front of every chunk
+typedef struct {
+    uint8_t codec;          // rdma_codec of the payload
+    uint8_t last;           // Final chunk of the message
+    uint16_t reserved;
+    uint32_t raw_len;       // Chunk bytes after decoding
+} codec_hdr;
+
+struct rdma_codec_ctx {
+    rdma_codec_attr attr;
+    size_t wire_cap;        // Largest chunk, header included
+    char *bufs;             // CODEC_SLOTS encode buffers of wire_cap bytes
+    struct ibv_mr *mr;
+    unsigned next_buf;
+    char *scratch;          // Shuffle, top-k selection and received chunks
+    size_t scratch_len;
+    double link_bps;        // Estimates, 0 until measured
+    double enc_bps;
+    double ratio;
+    bool active;            // Last decision for lossless codecs
+    uint64_t streams;
+    rdma_codec_stats stats;
+};
+
+static bool codec_lossy(rdma_codec codec) {
+    return codec >= RDMA_CODEC_FP16;
+}
+
+static void ewma(double *est, double sample) {
+    *est = *est == 0 ? sample : *est + (sample - *est) / (1 << CODEC_EWMA_SHIFT);
+}
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// --- LZ: LZ4-style sequences of literals followed by a back reference ---
+
+// Lengths above a nibble continue in bytes of 255
+static size_t lz_put_len(uint8_t *dst, size_t out, size_t cap, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (out >= cap) return 0;
+        dst[out++] = 255;
+    }
+    if (out >= cap) return 0;
+    dst[out++] = (uint8_t)len;
+    return out;
+}
+
+// One sequence; a match length of 0 ends the block after its literals
+static size_t lz_put_seq(uint8_t *dst, size_t out, size_t cap, const uint8_t *lit,
+                         size_t lit_len, size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (out >= cap) return 0;
+    dst[out++] = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && !(out = lz_put_len(dst, out, cap, lit_len - 15))) return 0;
+    if (lit_len > cap - out) return 0;
+    memcpy(dst + out, lit, lit_len);
+    out += lit_len;
+    if (!match_len) return out;
+
+    if (cap - out < 2) return 0;
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    if (ml >= 15 && !(out = lz_put_len(dst, out, cap, ml - 15))) return 0;
+    return out;
+}
+
+// Returns the encoded size, 0 if it does not fit in 'cap'
+static size_t lz_encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t pos = 0, anchor = 0, out = 0;
+
+    while (pos + LZ_MIN_MATCH <= n) {
+        uint32_t seq = load32(src + pos);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = pos;
+
+        if (cand >= pos || pos - cand > LZ_MAX_OFFSET || load32(src + cand) != seq) {
+            pos++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (pos + len < n && src[cand + len] == src[pos + len]) len++;
+
+        out = lz_put_seq(dst, out, cap, src + anchor, pos - anchor, pos - cand, len);
+        if (!out) return 0;
+        pos += len;
+        anchor = pos;
+    }
+    return lz_put_seq(dst, out, cap, src + anchor, n - anchor, 0, 0);
+}
+
+static int lz_get_len(const uint8_t *src, size_t n, size_t *in, size_t *len) {
+    uint8_t b;
+    do {
+        if (*in >= n) return -1;
+        b = src[(*in)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decoded size, -1 for a malformed block
+static ssize_t lz_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t in = 0, out = 0;
+
+    while (in < n) {
+        uint8_t token = src[in++];
+        size_t lit = token >> 4, ml = token & 15;
+        if (lit == 15 && lz_get_len(src, n, &in, &lit) < 0) return -1;
+        if (lit > n - in || lit > cap - out) return -1;
+        memcpy(dst + out, src + in, lit);
+        in += lit;
+        out += lit;
+        if (in == n) break;
+
+        if (n - in < 2) return -1;
+        size_t offset = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+        if (ml == 15 && lz_get_len(src, n, &in, &ml) < 0) return -1;
+        ml += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || ml > cap - out) return -1;
+
+        // Matches may overlap their own output
+        for (size_t i = 0; i < ml; i++, out++) {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out;
+}
+
+// --- Shuffle + RLE: byte planes of 32-bit words, then PackBits runs ---
+
+static void shuffle(const uint8_t *src, size_t n, uint8_t *dst) {
+    size_t words = n / 4;
+    for (size_t i = 0; i < words; i++) {
+        for (int b = 0; b < 4; b++) {
+            dst[b * words + i] = src[4 * i + b];
+        }
+    }
+    memcpy(dst + 4 * words, src + 4 * words, n - 4 * words);
+}
+
+static void unshuffle(const uint8_t *src, size_t n, uint8_t *dst) {
+    size_t words = n / 4;
+    for (size_t i = 0; i < words; i++) {
+        for (int b = 0; b < 4; b++) {
+            dst[4 * i + b] = src[b * words + i];
+        }
+    }
+    memcpy(dst + 4 * words, src + 4 * words, n - 4 * words);
+}
+
+// Control byte c < 128: c + 1 literals follow; otherwise a run of c - 126 copies
+static size_t rle_encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t in = 0, out = 0;
+
+    while (in < n) {
+        size_t run = 1;
+        while (in + run < n && run < 129 && src[in + run] == src[in]) run++;
+        if (run >= 2) {
+            if (cap - out < 2) return 0;
+            dst[out++] = (uint8_t)(run + 126);
+            dst[out++] = src[in];
+            in += run;
+            continue;
+        }
+
+        // Literals up to the next run of at least two
+        size_t lit = 1;
+        while (in + lit < n && lit < 128 &&
+               !(in + lit + 1 < n && src[in + lit] == src[in + lit + 1])) {
+            lit++;
+        }
+        if (cap - out < lit + 1) return 0;
+        dst[out++] = (uint8_t)(lit - 1);
+        memcpy(dst + out, src + in, lit);
+        out += lit;
+        in += lit;
+    }
+    return out;
+}
+
+static ssize_t rle_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t in = 0, out = 0;
+
+    while (in < n) {
+        uint8_t c = src[in++];
+        if (c < 128) {
+            size_t lit = c + 1;
+            if (lit > n - in || lit > cap - out) return -1;
+            memcpy(dst + out, src + in, lit);
+            in += lit;
+            out += lit;
+        } else {
+            size_t run = c - 126;
+            if (in >= n || run > cap - out) return -1;
+            memset(dst + out, src[in++], run);
+            out += run;
+        }
+    }
+    return out;
+}
+
+// --- Float conversions ---
+
+// float32 to IEEE half, round to nearest even
+static uint16_t fp32_to_fp16(uint32_t x) {
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exp = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+
+    if (exp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int e = (int)exp - 127 + 15;
+    if (e >= 31) return sign | 0x7c00;
+    if (e <= 0) {
+        // Subnormal half or zero
+        if (e < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - e;
+        uint32_t half = mant >> shift, rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return sign | half;
+    }
+    // A carry out of the mantissa moves into the exponent, up to infinity
+    uint32_t half = (uint32_t)e << 10 | mant >> 13, rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+static uint32_t fp16_to_fp32(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+
+    if (exp == 0x1f) return sign | 0x7f800000 | mant << 13;
+    if (exp == 0) {
+        if (!mant) return sign;
+        uint32_t e = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            e--;
+        }
+        return sign | e << 23 | (mant & 0x3ff) << 13;
+    }
+    return sign | (exp + 112) << 23 | mant << 13;
+}
+
+// float32 to bfloat16, round to nearest even, NaNs stay quiet NaNs
+static uint16_t fp32_to_bf16(uint32_t x) {
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static size_t half_encode(const uint8_t *src, size_t n, uint8_t *dst, bool bf16) {
+    for (size_t i = 0; i < n / 4; i++) {
+        uint32_t x = load32(src + 4 * i);
+        uint16_t h = bf16 ? fp32_to_bf16(x) : fp32_to_fp16(x);
+        memcpy(dst + 2 * i, &h, sizeof(h));
+    }
+    return n / 2;
+}
+
+static void half_decode(const uint8_t *src, size_t n, uint8_t *dst, bool bf16) {
+    for (size_t i = 0; i < n / 4; i++) {
+        uint16_t h;
+        memcpy(&h, src + 2 * i, sizeof(h));
+        uint32_t x = bf16 ? (uint32_t)h << 16 : fp16_to_fp32(h);
+        memcpy(dst + 4 * i, &x, sizeof(x));
+    }
+}
+
+// --- int8 with one scale per chunk ---
+
+static size_t int8_encode(const float *src, size_t count, uint8_t *dst) {
+    float max = 0;
+    for (size_t i = 0; i < count; i++) {
+        float a = src[i] < 0 ? -src[i] : src[i];
+        if (a > max && a <= 3.4e38f) max = a;
+    }
+    float scale = max / 127;
+    float inv = scale > 0 ? 1 / scale : 0;
+    memcpy(dst, &scale, sizeof(scale));
+
+    int8_t *q = (int8_t *)(dst + sizeof(scale));
+    for (size_t i = 0; i < count; i++) {
+        float v = src[i] * inv;
+        if (!(v == v)) v = 0;           // NaN
+        if (v > 127) v = 127;
+        if (v < -127) v = -127;
+        q[i] = (int8_t)(v + (v >= 0 ? 0.5f : -0.5f));
+    }
+    return sizeof(scale) + count;
+}
+
+static void int8_decode(const uint8_t *src, size_t count, float *dst) {
+    float scale;
+    memcpy(&scale, src, sizeof(scale));
+    const int8_t *q = (const int8_t *)(src + sizeof(scale));
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = q[i] * scale;
+    }
+}
+
+// --- Top-k: the k largest magnitudes as (16-bit index, value) pairs ---
+
+static size_t topk_keep(size_t count, float ratio) {
+    size_t k = (size_t)(count * ratio);
+    if (k < count * ratio) k++;
+    return k < 1 ? 1 : k > count ? count : k;
+}
+
+static void swap_float(float *a, float *b) {
+    float t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// k-th largest of 'mags' (reordered): quickselect with a three-way partition
+// into [lo, lt) above, [lt, gt] equal to and (gt, hi] below the pivot
+static float kth_largest(float *mags, size_t n, size_t k) {
+    size_t lo = 0, hi = n - 1, want = k - 1;
+    while (lo < hi) {
+        float pivot = mags[lo + (hi - lo) / 2];
+        size_t lt = lo, i = lo, gt = hi;
+        while (i <= gt) {
+            if (mags[i] > pivot) {
+                swap_float(&mags[lt++], &mags[i++]);
+            } else if (mags[i] < pivot) {
+                swap_float(&mags[i], &mags[gt--]);
+            } else {
+                i++;
+            }
+        }
+        if (want < lt) hi = lt - 1;
+        else if (want > gt) lo = gt + 1;
+        else return pivot;
+    }
+    return mags[want];
+}
+
+static size_t topk_encode(const float *src, size_t count, float ratio, float *mags, uint8_t *dst) {
+    size_t k = topk_keep(count, ratio);
+    for (size_t i = 0; i < count; i++) {
+        float a = src[i] < 0 ? -src[i] : src[i];
+        mags[i] = a == a ? a : 0;
+    }
+    float thr = kth_largest(mags, count, k);
+
+    // Everything above the threshold, then ties until k values are kept
+    uint32_t kept = 0;
+    uint8_t *idx = dst + sizeof(kept), *val = idx + 2 * k;
+    for (int pass = 0; pass < 2 && kept < k; pass++) {
+        for (size_t i = 0; i < count && kept < k; i++) {
+            float a = src[i] < 0 ? -src[i] : src[i];
+            if (pass == 0 ? !(a > thr) : a != thr) continue;
+            uint16_t ix = i;
+            memcpy(idx + 2 * kept, &ix, sizeof(ix));
+            memcpy(val + 4 * kept, &src[i], sizeof(float));
+            kept++;
+        }
+    }
+    memcpy(dst, &kept, sizeof(kept));
+    return sizeof(kept) + 6 * k;
+}
+
+static int topk_decode(const uint8_t *src, size_t n, float *dst, size_t count) {
+    uint32_t kept;
+    if (n < sizeof(kept)) return -1;
+    memcpy(&kept, src, sizeof(kept));
+    if (kept > count || n < sizeof(kept) + 6 * (size_t)kept) return -1;
+
+    // The slots are sized for k, the pairs fill the first 'kept'
+    size_t k = (n - sizeof(kept)) / 6;
+    const uint8_t *idx = src + sizeof(kept), *val = idx + 2 * k;
+    memset(dst, 0, count * sizeof(float));
+    for (uint32_t i = 0; i < kept; i++) {
+        uint16_t ix;
+        memcpy(&ix, idx + 2 * i, sizeof(ix));
+        if (ix >= count) return -1;
+        memcpy(&dst[ix], val + 4 * i, sizeof(float));
+    }
+    return 0;
+}
+
+// --- Chunk stage ---
+
+// Raw bytes per chunk so the encoded chunk fits one send
+static size_t raw_chunk(const struct rdma_codec_ctx *c, rdma_codec codec) {
+    size_t cap = c->wire_cap - sizeof(codec_hdr);
+    switch (codec) {
+    case RDMA_CODEC_FP16:
+    case RDMA_CODEC_BF16:
+        return cap / 2 * 4;
+    case RDMA_CODEC_INT8:
+        return (cap - sizeof(float)) * 4;
+    case RDMA_CODEC_TOPK: {
+        size_t kmax = (cap - sizeof(uint32_t)) / 6;
+        size_t count = (size_t)(kmax / c->attr.topk_ratio);
+        if (count > TOPK_MAX_VALUES) count = TOPK_MAX_VALUES;
+        while (count > 1 && topk_keep(count, c->attr.topk_ratio) > kmax) count--;
+        return count * 4;
+    }
+    default:
+        return cap;
+    }
+}
+
+// Encode one chunk behind its header, falling back to raw bytes where a
+// lossless codec does not shrink it. Returns the wire size
+static size_t encode_chunk(struct rdma_codec_ctx *c, rdma_codec codec, const uint8_t *src,
+                           size_t n, bool last, uint8_t *dst) {
+    codec_hdr *hdr = (codec_hdr *)dst;
+    uint8_t *out = dst + sizeof(*hdr);
+    size_t cap = c->wire_cap - sizeof(*hdr), len = 0;
+
+    switch (codec) {
+    case RDMA_CODEC_LZ:
+        len = lz_encode(src, n, out, n < cap ? n : cap);
+        break;
+    case RDMA_CODEC_SHUFFLE_RLE:
+        shuffle(src, n, (uint8_t *)c->scratch);
+        len = rle_encode((uint8_t *)c->scratch, n, out, n < cap ? n : cap);
+        break;
+    case RDMA_CODEC_FP16:
+    case RDMA_CODEC_BF16:
+        len = half_encode(src, n, out, codec == RDMA_CODEC_BF16);
+        break;
+    case RDMA_CODEC_INT8:
+        len = int8_encode((const float *)src, n / 4, out);
+        break;
+    case RDMA_CODEC_TOPK:
+        len = topk_encode((const float *)src, n / 4, c->attr.topk_ratio, (float *)c->scratch, out);
+        break;
+    default:
+        break;
+    }
+    if (codec == RDMA_CODEC_NONE || (!codec_lossy(codec) && (len == 0 || len >= n))) {
+        codec = RDMA_CODEC_NONE;
+        memcpy(out, src, n);
+        len = n;
+    }
+
+    *hdr = (codec_hdr){.codec = codec, .last = last, .raw_len = n};
+    return sizeof(*hdr) + len;
+}
+
+// Decode one chunk into 'dst', returns its raw size
+static int decode_chunk(struct rdma_codec_ctx *c, const uint8_t *src, size_t n, uint8_t *dst,
+                        size_t max_len, bool *last) {
+    codec_hdr hdr;
+    if (n < sizeof(hdr)) {
+        set_error("Coded chunk of %zu bytes is too short", n);
+        return -1;
+    }
+    memcpy(&hdr, src, sizeof(hdr));
+    src += sizeof(hdr);
+    n -= sizeof(hdr);
+    if (hdr.raw_len > max_len) {
+        set_error("Coded message exceeds the %zu byte receive buffer", max_len);
+        return -1;
+    }
+
+    size_t raw = hdr.raw_len;
+    bool ok;
+    switch (hdr.codec) {
+    case RDMA_CODEC_NONE:
+        ok = n == raw;
+        if (ok) memcpy(dst, src, n);
+        break;
+    case RDMA_CODEC_LZ:
+        ok = lz_decode(src, n, dst, raw) == (ssize_t)raw;
+        break;
+    case RDMA_CODEC_SHUFFLE_RLE:
+        ok = raw <= c->scratch_len && rle_decode(src, n, (uint8_t *)c->scratch, raw) == (ssize_t)raw;
+        if (ok) unshuffle((uint8_t *)c->scratch, raw, dst);
+        break;
+    case RDMA_CODEC_FP16:
+    case RDMA_CODEC_BF16:
+        ok = raw % 4 == 0 && n == raw / 2;
+        if (ok) half_decode(src, raw, dst, hdr.codec == RDMA_CODEC_BF16);
+        break;
+    case RDMA_CODEC_INT8:
+        ok = raw % 4 == 0 && n == sizeof(float) + raw / 4;
+        if (ok) int8_decode(src, raw / 4, (float *)dst);
+        break;
+    case RDMA_CODEC_TOPK:
+        ok = raw % 4 == 0 && raw / 4 <= TOPK_MAX_VALUES &&
+             topk_decode(src, n, (float *)dst, raw / 4) == 0;
+        break;
+    default:
+        ok = false;
+    }
+    if (!ok) {
+        set_error("Malformed chunk for codec %d", hdr.codec);
+        return -1;
+    }
+    *last = hdr.last;
+    return raw;
+}
+
+// Codec state, created on first use with the context's message size
+static struct rdma_codec_ctx *codec_get(rdma_context *ctx) {
+    if (ctx->codec) return ctx->codec;
+
+    struct rdma_codec_ctx *c = calloc(1, sizeof(*c));
+    if (!c) {
+        set_error("Failed to allocate codec state");
+        return NULL;
+    }
+    c->attr.topk_ratio = CODEC_TOPK_DEFAULT;
+    c->wire_cap = rdma_max_msg_size(ctx);
+    c->scratch_len = TOPK_MAX_VALUES * sizeof(float);
+    if (c->scratch_len < 4 * c->wire_cap) c->scratch_len = 4 * c->wire_cap;
+
+    c->bufs = aligned_alloc(4096, (CODEC_SLOTS * c->wire_cap + 4095) & ~(size_t)4095);
+    c->scratch = malloc(c->scratch_len);
+    if (!c->bufs || !c->scratch) {
+        set_error("Failed to allocate codec buffers");
+        goto err;
+    }
+    c->mr = ibv_reg_mr(ctx->pd, c->bufs, CODEC_SLOTS * c->wire_cap, IBV_ACCESS_LOCAL_WRITE);
+    if (!c->mr) {
+        set_error("Failed to register codec buffers: %s", strerror(errno));
+        goto err;
+    }
+    ctx->codec = c;
+    return c;
+
+err:
+    free(c->bufs);
+    free(c->scratch);
+    free(c);
+    return NULL;
+}
+
+// Pick the codec of the next stream
+static rdma_codec codec_decide(struct rdma_codec_ctx *c) {
+    rdma_codec codec = c->attr.codec;
+    if (codec == RDMA_CODEC_NONE || codec_lossy(codec) || c->attr.always) return codec;
+
+    // Measure the link first, then the codec, then compare
+    if (c->link_bps == 0) return RDMA_CODEC_NONE;
+    if (c->enc_bps == 0) return codec;
+    c->active = c->enc_bps > c->link_bps && c->ratio < CODEC_MAX_RATIO;
+    bool use = c->active;
+    if (++c->streams % CODEC_PROBE_STREAMS == 0) use = !use;
+    return use ? codec : RDMA_CODEC_NONE;
+}
+
+// Progress until every target has room for another chunk in flight. Chunks
+// to one peer complete in order, so buffer k is free once fewer than
+// CODEC_SLOTS sends are outstanding
+static int codec_wait_buf(rdma_context *ctx, const int *peers, int npeers) {
+    if (ctx->transport == RDMA_TRANSPORT_UD) return 0;  // Datagrams are copied out
+
+    for (int i = 0; i < npeers; i++) {
+        rdma_peer_conn *peer = &ctx->peers[peers[i]];
+        while (peer->send_inflight >= CODEC_SLOTS) {
+            if (peer->state != RDMA_CONN_CONNECTED) {
+                set_error("Peer %d not connected", peers[i]);
+                return -1;
+            }
+            if (progress(ctx) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Encode 'data' once and send it chunk by chunk to every peer in 'peers',
+// or as multicast broadcasts when 'peers' is NULL
+static int codec_stream(rdma_context *ctx, const int *peers, int npeers, const void *data,
+                        size_t len, rdma_op op) {
+    struct rdma_codec_ctx *c = codec_get(ctx);
+    if (!c) return -1;
+
+    rdma_codec codec = codec_decide(c);
+    if (codec_lossy(codec) && len % sizeof(float)) {
+        set_error("Lossy codecs need float32 data, got %zu bytes", len);
+        return -1;
+    }
+
+    uint64_t start = now_ns(), enc_ns = 0;
+    size_t chunk = raw_chunk(c, codec), off = 0, wire = 0;
+    const uint8_t *src = data;
+    TRACE_BEGIN("codec_stream", -1);
+    do {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if (peers && codec_wait_buf(ctx, peers, npeers) < 0) return -1;
+
+        uint8_t *buf = (uint8_t *)c->bufs + (c->next_buf++ % CODEC_SLOTS) * c->wire_cap;
+        uint64_t t0 = now_ns();
+        size_t w = encode_chunk(c, codec, src + off, n, off + n == len, buf);
+        enc_ns += now_ns() - t0;
+
+        if (!peers) {
+            if (mcast_broadcast(ctx, buf, w) < 0) return -1;
+        } else {
+            for (int i = 0; i < npeers; i++) {
+                if (post_send(ctx, peers[i], buf, w, c->mr->lkey, false) < 0) return -1;
+            }
+        }
+        if (((codec_hdr *)buf)->codec != RDMA_CODEC_NONE) c->stats.compressed_chunks++;
+        c->stats.chunks++;
+        off += n;
+        wire += w;
+    } while (off < len);
+
+    for (int i = 0; peers && i < npeers; i++) {
+        if (wait_sends(ctx, peers[i]) < 0) return -1;
+    }
+    TRACE_END("codec_stream", -1);
+
+    // Raw streams measure the link, encoded ones the codec
+    uint64_t elapsed = now_ns() - start;
+    if (codec == RDMA_CODEC_NONE && elapsed > 0) {
+        ewma(&c->link_bps, wire * 1e9 / elapsed);
+    } else if (len > 0) {
+        if (enc_ns > 0) ewma(&c->enc_bps, len * 1e9 / enc_ns);
+        ewma(&c->ratio, (double)wire / len);
+    }
+    c->stats.raw_bytes += len;
+    c->stats.wire_bytes += wire;
+
+    int count = peers ? npeers : ctx->num_peers;
+    for (int i = 0; i < count; i++) {
+        stat_op(&ctx->peers[peers ? peers[i] : i], op, wire, start);
+    }
+    return len;
+}
+
+// Receive and decode chunks from a peer, or broadcasts if 'peer_idx' is -1,
+// until the last chunk of a message
+static int codec_receive(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
+    struct rdma_codec_ctx *c = codec_get(ctx);
+    if (!c) return -1;
+
+    // Compressed chunks land after the largest decoded chunk in the scratch area
+    char *wire = c->scratch + c->scratch_len - c->wire_cap;
+    size_t off = 0;
+    bool last = false;
+    while (!last) {
+        int n = peer_idx < 0 ? rdma_broadcast_recv(ctx, wire, c->wire_cap)
+                             : rdma_recv(ctx, peer_idx, wire, c->wire_cap);
+        if (n < 0) return -1;
+        int raw = decode_chunk(c, (uint8_t *)wire, n, (uint8_t *)data + off, max_len - off, &last);
+        if (raw < 0) return -1;
+        off += raw;
+    }
+    return off;
+}
+
+int rdma_set_codec(rdma_context *ctx, const rdma_codec_attr *attr) {
+    if (attr && (attr->codec < RDMA_CODEC_NONE || attr->codec >= RDMA_CODEC_COUNT ||
+                 attr->topk_ratio < 0 || attr->topk_ratio > 1)) {
+        set_error("Invalid codec attributes");
+        return -1;
+    }
+    struct rdma_codec_ctx *c = codec_get(ctx);
+    if (!c) return -1;
+
+    c->attr = attr ? *attr : (rdma_codec_attr){0};
+    if (c->attr.topk_ratio == 0) c->attr.topk_ratio = CODEC_TOPK_DEFAULT;
+    c->enc_bps = c->ratio = 0;
+    c->active = false;
+    return 0;
+}
+
+int rdma_send_coded(rdma_context *ctx, int peer_idx, const void *data, size_t len) {
+    if (peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
+        return -1;
+    }
+    if (ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+        set_error("Peer not connected");
+        return -1;
+    }
+    return codec_stream(ctx, &peer_idx, 1, data, len, RDMA_OP_SEND);
+}
+
+int rdma_recv_coded(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
+    if (peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
+        return -1;
+    }
+    return codec_receive(ctx, peer_idx, data, max_len);
+}
+
+// Every chunk is encoded once and posted to all clients
+int rdma_broadcast_coded(rdma_context *ctx, const void *data, size_t len) {
+    if (mcast_active(ctx)) {
+        return codec_stream(ctx, NULL, 0, data, len, RDMA_OP_BCAST);
+    }
+
+    int *peers = malloc(ctx->num_peers * sizeof(*peers));
+    if (!peers) {
+        set_error("Failed to allocate peer list");
+        return -1;
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        peers[i] = i;
+    }
+    int ret = codec_stream(ctx, peers, ctx->num_peers, data, len, RDMA_OP_BCAST);
+    free(peers);
+    return ret;
+}
+
+int rdma_broadcast_recv_coded(rdma_context *ctx, void *data, size_t max_len) {
+    if (ctx->is_server || ctx->num_peers <= 0) {
+        set_error("Broadcasts are received by clients from their server");
+        return -1;
+    }
+    return codec_receive(ctx, -1, data, max_len);
+}
+
+int rdma_get_codec_stats(rdma_context *ctx, rdma_codec_stats *stats) {
+    struct rdma_codec_ctx *c = codec_get(ctx);
+    if (!c) return -1;
+
+    *stats = c->stats;
+    stats->link_gbps = c->link_bps * 8 / 1e9;
+    stats->encode_gbps = c->enc_bps * 8 / 1e9;
+    stats->ratio = c->ratio;
+    stats->active = codec_lossy(c->attr.codec) || c->attr.always ||
+                    (c->attr.codec != RDMA_CODEC_NONE && c->active);
+    return 0;
+}
+
+void codec_cleanup(rdma_context *ctx) {
+    struct rdma_codec_ctx *c = ctx->codec;
+    if (!c) return;
+    if (c->mr) ibv_dereg_mr(c->mr);
+    free(c->bufs);
+    free(c->scratch);
+    free(c);
+    ctx->codec = NULL;
+}
@@ -0,0 +1,640 @@
+#include "rdma_internal.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Communicators: groups of ranks that share the device, PD, memory regions,
+// QPs, SRQ and CQ of one context but have their own id, rank numbering and
+// message space. Every message names its communicator and its source and
+// destination world rank in the immediate, so it is queued in the inbox of
+// its communicator and never matched by a receive on another one. Clients are
+// only connected to the server, which relays messages between clients.
+//
+// Threads may run collectives on different communicators at the same time.
+// The CQ is polled, and posts and inboxes are touched, under one short lock;
+// whichever thread polls delivers completions for all of them.
+
+// Immediate of a communicator message: flag, id, source and destination
+#define COMM_IMM(id, src, dst) (COMM_IMM_FLAG | (uint32_t)(id) << 21 | \
+                                (uint32_t)(src) << 11 | (uint32_t)(dst) << 1)
+#define COMM_IMM_ID(imm) (((imm) >> 21) & 0x3FF)
+#define COMM_IMM_SRC(imm) (((imm) >> 11) & 0x3FF)
+#define COMM_IMM_DST(imm) (((imm) >> 1) & 0x3FF)
+
+struct rdma_comm_ctx {
+    pthread_mutex_t lock;
+    int inbox_head[RDMA_MAX_COMMS];     // Received slots per communicator id (-1 if none)
+    int inbox_tail[RDMA_MAX_COMMS];
+    int relay_head;         // Slots the server forwards to another client (-1 if none)
+    int relay_tail;
+    uint32_t next_id;       // Lowest communicator id this rank has not seen in use
+    rdma_comm *world;
+};
+
+struct rdma_comm {
+    rdma_context *ctx;
+    uint32_t id;
+    int rank;
+    int size;
+    uint16_t *world_ranks;  // World rank of every member, by communicator rank
+    char *stage;            // Copy of sends from unregistered memory
+    struct ibv_mr *stage_mr;
+};
+
+// Split request of a member and the reply of the parent's rank 0
+struct split_req {
+    int32_t color;
+    int32_t key;
+    uint32_t next_id;
+};
+
+struct split_reply {
+    int32_t status;         // 0, or -1 if the ids ran out
+    uint32_t id;            // RDMA_MAX_COMMS if the member got no communicator
+    int32_t rank;
+    int32_t size;
+    uint32_t next_id;
+    uint16_t world_ranks[];
+};
+
+// Rank of this process among the server and its clients
+static int world_rank(rdma_context *ctx) {
+    return ctx->is_server ? 0 : (int)ctx->peers[0].remote_info.peer_id + 1;
+}
+
+static void slot_list_push(rdma_context *ctx, int *head, int *tail, int slot) {
+    ctx->slots[slot].next = -1;
+    if (*tail >= 0) {
+        ctx->slots[*tail].next = slot;
+    } else {
+        *head = slot;
+    }
+    *tail = slot;
+}
+
+int comm_init(rdma_context *ctx) {
+    struct rdma_comm_ctx *cc = calloc(1, sizeof(*cc));
+    if (!cc) {
+        set_error("Failed to allocate communicator state");
+        return -1;
+    }
+    if (pthread_mutex_init(&cc->lock, NULL)) {
+        free(cc);
+        set_error("Failed to create communicator lock");
+        return -1;
+    }
+    for (int i = 0; i < RDMA_MAX_COMMS; i++) {
+        cc->inbox_head[i] = cc->inbox_tail[i] = -1;
+    }
+    cc->relay_head = cc->relay_tail = -1;
+    ctx->comm = cc;
+    return 0;
+}
+
+// Route a received communicator message to its inbox, or to the relay queue
+// when the server only passes it on
+int comm_handle_recv(rdma_context *ctx, int slot, uint32_t imm) {
+    struct rdma_comm_ctx *cc = ctx->comm;
+    if (!cc) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    ctx->slots[slot].imm = imm;
+    if ((int)COMM_IMM_DST(imm) != world_rank(ctx)) {
+        if (!ctx->is_server) {
+            log_warn("dropping communicator message for rank %u", COMM_IMM_DST(imm));
+            release_slot(ctx, slot);
+            return 0;
+        }
+        slot_list_push(ctx, &cc->relay_head, &cc->relay_tail, slot);
+        return 0;
+    }
+
+    uint32_t id = COMM_IMM_ID(imm);
+    slot_list_push(ctx, &cc->inbox_head[id], &cc->inbox_tail[id], slot);
+    return 0;
+}
+
+// Forward queued messages to their clients while their send queues have room
+int comm_relay(rdma_context *ctx) {
+    struct rdma_comm_ctx *cc = ctx->comm;
+    if (!cc) return 0;
+
+    while (cc->relay_head >= 0) {
+        int slot = cc->relay_head;
+        uint32_t imm = ctx->slots[slot].imm;
+        int peer_idx = (int)COMM_IMM_DST(imm) - 1;
+        bool reachable = peer_idx < ctx->num_peers &&
+                         ctx->peers[peer_idx].state == RDMA_CONN_CONNECTED;
+
+        // The head waits for its peer's send queue, later messages wait behind it
+        if (reachable && ctx->peers[peer_idx].send_inflight >= (int)ctx->tune.send_wr) break;
+
+        cc->relay_head = ctx->slots[slot].next;
+        if (cc->relay_head < 0) cc->relay_tail = -1;
+        if (!reachable) {
+            log_warn("dropping relayed message for rank %u", COMM_IMM_DST(imm));
+            release_slot(ctx, slot);
+            continue;
+        }
+
+        rdma_peer_conn *peer = &ctx->peers[peer_idx];
+        struct ibv_sge sge = {
+            .addr = (uintptr_t)slot_data(ctx, slot),
+            .length = ctx->slots[slot].len,
+            .lkey = ctx->srq_mr->lkey
+        };
+        struct ibv_send_wr wr = {
+            .wr_id = WRID(WR_KIND_RELAY, (uint64_t)peer_idx << 16 | (uint64_t)slot),
+            .sg_list = &sge,
+            .num_sge = 1,
+            .opcode = IBV_WR_SEND_WITH_IMM,
+            .send_flags = IBV_SEND_SIGNALED,
+            .imm_data = htonl(imm)
+        };
+        struct ibv_send_wr *bad_wr;
+        if (ibv_post_send(peer->qp, &wr, &bad_wr)) {
+            release_slot(ctx, slot);
+            set_error("Failed to relay message");
+            return -1;
+        }
+        peer->send_inflight++;
+        STAT_ADD(peer->stats.posted_wrs, 1);
+    }
+    return 0;
+}
+
+// A relayed message left, its slot can take the next receive
+int comm_handle_relay(rdma_context *ctx, struct ibv_wc *wc) {
+    int peer_idx = (int)(WRID_VAL(wc->wr_id) >> 16);
+    int slot = (int)(WRID_VAL(wc->wr_id) & 0xFFFF);
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+
+    peer->send_inflight--;
+    release_slot(ctx, slot);
+    if (wc->status != IBV_WC_SUCCESS && !wc_drained(ctx, wc)) {
+        peer->state = RDMA_CONN_ERROR;
+        set_error("Relay failed with status: %d", wc->status);
+        return -1;
+    }
+    return 0;
+}
+
+// Remove the first message from 'src' in the inbox of 'id', -1 if none
+static int inbox_take(rdma_context *ctx, uint32_t id, int src) {
+    struct rdma_comm_ctx *cc = ctx->comm;
+    int prev = -1;
+
+    for (int slot = cc->inbox_head[id]; slot >= 0; prev = slot, slot = ctx->slots[slot].next) {
+        if ((int)COMM_IMM_SRC(ctx->slots[slot].imm) != src) continue;
+
+        int next = ctx->slots[slot].next;
+        if (prev >= 0) {
+            ctx->slots[prev].next = next;
+        } else {
+            cc->inbox_head[id] = next;
+        }
+        if (cc->inbox_tail[id] == slot) cc->inbox_tail[id] = prev;
+        return slot;
+    }
+    return -1;
+}
+
+// Peer a message to world rank 'dst' leaves through
+static int route(rdma_context *ctx, int dst) {
+    int peer_idx = ctx->is_server ? dst - 1 : 0;
+    if (peer_idx < 0 || peer_idx >= ctx->num_peers ||
+        ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+        set_error("Rank %d not reachable", dst);
+        return -1;
+    }
+    return peer_idx;
+}
+
+// Send one message of up to rdma_max_msg_size to world rank 'dst'
+static int comm_post(rdma_comm *comm, int dst, const void *data, size_t len) {
+    rdma_context *ctx = comm->ctx;
+    struct rdma_comm_ctx *cc = ctx->comm;
+    int src = world_rank(ctx);
+
+    if (len > RECV_SLOT_SIZE) {
+        set_error("Message of %zu bytes exceeds the slot size", len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    int peer_idx = route(ctx, dst);
+    if (peer_idx < 0) {
+        pthread_mutex_unlock(&cc->lock);
+        return -1;
+    }
+
+    // Registered memory is sent in place, anything else through the stage
+    uint32_t lkey;
+    if (!find_lkey(ctx, data, len, &lkey)) {
+        memcpy(comm->stage, data, len);
+        data = comm->stage;
+        lkey = comm->stage_mr->lkey;
+    }
+
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)data,
+        .length = (uint32_t)len,
+        .lkey = lkey
+    };
+    struct ibv_send_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND_WITH_IMM,
+        .imm_data = htonl(COMM_IMM(comm->id, src, dst))
+    };
+    int ret = post_signaled(ctx, peer_idx, &wr);
+    pthread_mutex_unlock(&cc->lock);
+    if (ret < 0) return -1;
+
+    // The send buffer may be reused once the send has completed
+    uint64_t start = stat_start();
+    for (;;) {
+        pthread_mutex_lock(&cc->lock);
+        bool done = ctx->peers[peer_idx].send_inflight == 0;
+        if (!done) ret = progress(ctx);
+        pthread_mutex_unlock(&cc->lock);
+        if (done) break;
+        if (ret < 0) return -1;
+    }
+    stat_op(&ctx->peers[peer_idx], RDMA_OP_SEND, len, start);
+    return 0;
+}
+
+// Receive one message from world rank 'src' on the communicator
+static int comm_take(rdma_comm *comm, int src, void *data, size_t max_len) {
+    rdma_context *ctx = comm->ctx;
+    struct rdma_comm_ctx *cc = ctx->comm;
+    int peer_idx = ctx->is_server ? src - 1 : 0;
+
+    for (;;) {
+        pthread_mutex_lock(&cc->lock);
+        int slot = inbox_take(ctx, comm->id, src);
+        if (slot >= 0) {
+            uint32_t len = ctx->slots[slot].len;
+            int ret = len <= max_len ? (int)len : -1;
+            if (ret >= 0) {
+                memcpy(data, slot_data(ctx, slot), len);
+            } else {
+                set_error("Message of %u bytes exceeds the %zu byte buffer", len, max_len);
+            }
+            release_slot(ctx, slot);
+            pthread_mutex_unlock(&cc->lock);
+            return ret;
+        }
+
+        if (peer_idx < 0 || peer_idx >= ctx->num_peers ||
+            ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+            pthread_mutex_unlock(&cc->lock);
+            set_error("Rank %d not reachable", src);
+            return -1;
+        }
+        int ret = progress(ctx);
+        pthread_mutex_unlock(&cc->lock);
+        if (ret < 0) return -1;
+    }
+}
+
+static rdma_comm *comm_create(rdma_context *ctx, uint32_t id, int rank, int size,
+                              const uint16_t *world_ranks) {
+    rdma_comm *comm = calloc(1, sizeof(*comm));
+    if (!comm) {
+        set_error("Failed to allocate communicator");
+        return NULL;
+    }
+    comm->ctx = ctx;
+    comm->id = id;
+    comm->rank = rank;
+    comm->size = size;
+    comm->world_ranks = malloc(size * sizeof(*comm->world_ranks));
+    comm->stage = malloc(RECV_SLOT_SIZE);
+    if (!comm->world_ranks || !comm->stage) {
+        set_error("Failed to allocate communicator");
+        goto fail;
+    }
+    for (int r = 0; r < size; r++) {
+        comm->world_ranks[r] = world_ranks ? world_ranks[r] : (uint16_t)r;
+    }
+
+    comm->stage_mr = ibv_reg_mr(ctx->pd, comm->stage, RECV_SLOT_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    if (!comm->stage_mr) {
+        set_error("Failed to register communicator buffer");
+        goto fail;
+    }
+    return comm;
+
+fail:
+    free(comm->stage);
+    free(comm->world_ranks);
+    free(comm);
+    return NULL;
+}
+
+// Communicator of the server and all of its clients
+rdma_comm *rdma_comm_world(rdma_context *ctx) {
+    if (!ctx || !ctx->comm) {
+        set_error("Communicators need the RC transport");
+        return NULL;
+    }
+    struct rdma_comm_ctx *cc = ctx->comm;
+    if (cc->world) return cc->world;
+
+    if (ctx->num_peers + 1 > RDMA_COMM_MAX_RANKS) {
+        set_error("More than %d ranks", RDMA_COMM_MAX_RANKS);
+        return NULL;
+    }
+
+    int32_t size;
+    rdma_comm *world;
+    if (ctx->is_server) {
+        // Clients only know their own index, the server tells them the size
+        size = ctx->num_peers + 1;
+        world = comm_create(ctx, 0, 0, size, NULL);
+        if (!world) return NULL;
+        for (int r = 1; r < size; r++) {
+            if (comm_post(world, r, &size, sizeof(size)) < 0) goto fail;
+        }
+    } else {
+        if (ctx->num_peers <= 0) {
+            set_error("No server connected");
+            return NULL;
+        }
+        rdma_comm probe = { .ctx = ctx, .id = 0 };
+        if (comm_take(&probe, 0, &size, sizeof(size)) != sizeof(size)) return NULL;
+        world = comm_create(ctx, 0, world_rank(ctx), size, NULL);
+        if (!world) return NULL;
+    }
+
+    cc->world = world;
+    if (cc->next_id < 1) cc->next_id = 1;
+    return world;
+
+fail:
+    rdma_comm_free(world);
+    return NULL;
+}
+
+static int cmp_split(const void *a, const void *b) {
+    const int32_t *x = a;
+    const int32_t *y = b;
+
+    // Entries are {color, key, parent rank}
+    for (int i = 0; i < 3; i++) {
+        if (x[i] != y[i]) return x[i] < y[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Rank 0 of the parent assigns ids and ranks and answers every member
+static int split_root(rdma_comm *comm, const struct split_req *reqs, struct split_reply *mine) {
+    int n = comm->size;
+    size_t reply_len = sizeof(struct split_reply) + n * sizeof(uint16_t);
+    int32_t (*order)[3] = malloc(n * sizeof(*order));
+    struct split_reply *reply = malloc(reply_len);
+    int ret = -1;
+
+    if (!order || !reply) {
+        set_error("Failed to allocate communicator split");
+        goto out;
+    }
+
+    uint32_t base = 0;
+    for (int r = 0; r < n; r++) {
+        order[r][0] = reqs[r].color;
+        order[r][1] = reqs[r].key;
+        order[r][2] = r;
+        if (reqs[r].next_id > base) base = reqs[r].next_id;
+    }
+    qsort(order, n, sizeof(*order), cmp_split);
+
+    // Every color gets the next free id, in color order
+    uint32_t colors = 0;
+    for (int i = 0; i < n; i++) {
+        if (order[i][0] >= 0 && (i == 0 || order[i][0] != order[i - 1][0])) colors++;
+    }
+    int32_t status = base + colors > RDMA_MAX_COMMS ? -1 : 0;
+
+    uint32_t id = base;
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j < n && order[j][0] == order[i][0]) j++;
+
+        // Members of one color, ranked by key and parent rank
+        for (int k = i; k < j; k++) {
+            memset(reply, 0, reply_len);
+            reply->status = status;
+            reply->next_id = base + colors;
+            reply->id = RDMA_MAX_COMMS;
+            if (order[i][0] >= 0) {
+                reply->id = id;
+                reply->rank = k - i;
+                reply->size = j - i;
+                for (int m = i; m < j; m++) {
+                    reply->world_ranks[m - i] = comm->world_ranks[order[m][2]];
+                }
+            }
+
+            int member = order[k][2];
+            size_t len = sizeof(*reply) + reply->size * sizeof(uint16_t);
+            if (member == comm->rank) {
+                memcpy(mine, reply, len);
+            } else if (comm_post(comm, comm->world_ranks[member], reply, len) < 0) {
+                goto out;
+            }
+        }
+        if (order[i][0] >= 0) id++;
+        i = j;
+    }
+    ret = 0;
+
+out:
+    free(order);
+    free(reply);
+    return ret;
+}
+
+// Split a communicator by color, ranks ordered by key and then parent rank
+int rdma_comm_split(rdma_comm *comm, int color, int key, rdma_comm **newcomm) {
+    if (!comm || !newcomm || color < RDMA_COMM_UNDEFINED) {
+        set_error("Invalid communicator split");
+        return -1;
+    }
+    *newcomm = NULL;
+
+    rdma_context *ctx = comm->ctx;
+    struct rdma_comm_ctx *cc = ctx->comm;
+    pthread_mutex_lock(&cc->lock);
+    struct split_req req = { color, key, cc->next_id };
+    pthread_mutex_unlock(&cc->lock);
+    struct split_reply *reply = malloc(sizeof(*reply) + comm->size * sizeof(uint16_t));
+    if (!reply) {
+        set_error("Failed to allocate communicator split");
+        return -1;
+    }
+
+    int ret = -1;
+    if (comm->rank == 0) {
+        struct split_req *reqs = malloc(comm->size * sizeof(*reqs));
+        if (!reqs) {
+            set_error("Failed to allocate communicator split");
+            goto out;
+        }
+        reqs[0] = req;
+        for (int r = 1; r < comm->size; r++) {
+            if (comm_take(comm, comm->world_ranks[r], &reqs[r], sizeof(reqs[r])) != sizeof(reqs[r])) {
+                free(reqs);
+                goto out;
+            }
+        }
+        int root = split_root(comm, reqs, reply);
+        free(reqs);
+        if (root < 0) goto out;
+    } else {
+        size_t max = sizeof(*reply) + comm->size * sizeof(uint16_t);
+        if (comm_post(comm, comm->world_ranks[0], &req, sizeof(req)) < 0 ||
+            comm_take(comm, comm->world_ranks[0], reply, max) < (int)sizeof(*reply)) {
+            goto out;
+        }
+    }
+
+    // Ids are never reused, so a message cannot reach a later communicator
+    pthread_mutex_lock(&cc->lock);
+    if (reply->next_id > cc->next_id) cc->next_id = reply->next_id;
+    pthread_mutex_unlock(&cc->lock);
+    if (reply->status < 0) {
+        set_error("Out of communicator ids");
+        goto out;
+    }
+    ret = 0;
+    if (reply->id < RDMA_MAX_COMMS) {
+        *newcomm = comm_create(ctx, reply->id, reply->rank, reply->size, reply->world_ranks);
+        if (!*newcomm) ret = -1;
+    }
+
+out:
+    free(reply);
+    return ret;
+}
+
+int rdma_comm_rank(const rdma_comm *comm) {
+    return comm->rank;
+}
+
+int rdma_comm_size(const rdma_comm *comm) {
+    return comm->size;
+}
+
+// Send a message of up to rdma_max_msg_size to a rank of the communicator
+int rdma_comm_send(rdma_comm *comm, int rank, const void *data, size_t len) {
+    if (!comm || rank < 0 || rank >= comm->size || rank == comm->rank) {
+        set_error("Invalid destination rank");
+        return -1;
+    }
+    return comm_post(comm, comm->world_ranks[rank], data, len);
+}
+
+// Receive the next message a rank of the communicator sent, returns its length
+int rdma_comm_recv(rdma_comm *comm, int rank, void *data, size_t max_len) {
+    if (!comm || rank < 0 || rank >= comm->size || rank == comm->rank) {
+        set_error("Invalid source rank");
+        return -1;
+    }
+    return comm_take(comm, comm->world_ranks[rank], data, max_len);
+}
+
+// Barrier over the members: gather a token at rank 0, then release everyone
+int rdma_comm_barrier(rdma_comm *comm) {
+    char token = 0;
+
+    if (comm->rank != 0) {
+        if (rdma_comm_send(comm, 0, &token, 1) < 0) return -1;
+        return rdma_comm_recv(comm, 0, &token, 1) < 0 ? -1 : 0;
+    }
+    for (int r = 1; r < comm->size; r++) {
+        if (rdma_comm_recv(comm, r, &token, 1) < 0) return -1;
+    }
+    for (int r = 1; r < comm->size; r++) {
+        if (rdma_comm_send(comm, r, &token, 1) < 0) return -1;
+    }
+    return 0;
+}
+
+// Broadcast 'len' bytes from 'root' to every member, in slot sized chunks
+int rdma_comm_bcast(rdma_comm *comm, int root, void *data, size_t len) {
+    if (!comm || root < 0 || root >= comm->size) {
+        set_error("Invalid root rank");
+        return -1;
+    }
+
+    size_t off = 0;
+    do {
+        size_t n = len - off < RECV_SLOT_SIZE ? len - off : RECV_SLOT_SIZE;
+        char *chunk = (char *)data + off;
+
+        if (comm->rank != root) {
+            if (rdma_comm_recv(comm, root, chunk, n) != (int)n) {
+                set_error("Short broadcast chunk");
+                return -1;
+            }
+        } else {
+            for (int r = 0; r < comm->size; r++) {
+                if (r != root && rdma_comm_send(comm, r, chunk, n) < 0) return -1;
+            }
+        }
+        off += n;
+    } while (off < len);
+    return 0;
+}
+
+// Serve completions and relays, for a server that takes part in no collective
+int rdma_comm_progress(rdma_context *ctx) {
+    if (!ctx || !ctx->comm) {
+        set_error("Communicators need the RC transport");
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->comm->lock);
+    int ret = progress(ctx);
+    pthread_mutex_unlock(&ctx->comm->lock);
+    return ret;
+}
+
+// Release a communicator, messages still queued for it are dropped
+void rdma_comm_free(rdma_comm *comm) {
+    if (!comm) return;
+    rdma_context *ctx = comm->ctx;
+    struct rdma_comm_ctx *cc = ctx->comm;
+
+    pthread_mutex_lock(&cc->lock);
+    int slot;
+    while ((slot = cc->inbox_head[comm->id]) >= 0) {
+        cc->inbox_head[comm->id] = ctx->slots[slot].next;
+        release_slot(ctx, slot);
+    }
+    cc->inbox_tail[comm->id] = -1;
+    if (comm->stage_mr) {
+        ibv_dereg_mr(comm->stage_mr);
+    }
+    if (cc->world == comm) cc->world = NULL;
+    pthread_mutex_unlock(&cc->lock);
+
+    free(comm->stage);
+    free(comm->world_ranks);
+    free(comm);
+}
+
+void comm_cleanup(rdma_context *ctx) {
+    struct rdma_comm_ctx *cc = ctx->comm;
+    if (!cc) return;
+
+    rdma_comm_free(cc->world);
+    pthread_mutex_destroy(&cc->lock);
+    free(cc);
+    ctx->comm = NULL;
+}
@@ -0,0 +1,223 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <dirent.h>
+
+// Port counters from sysfs. 'counters' holds the standard IB port counters,
+// 'hw_counters' the driver specific ones. Every file is kept as a raw counter
+// and the ones below are also folded into the summary fields.
+
+#define SYSFS_IB_DIR "/sys/class/infiniband"
+
+static const struct {
+    const char *name;
+    size_t field;           // Offset of the summary field in rdma_counters
+    uint64_t scale;
+} counter_map[] = {
+    // Standard port counters, data is counted in 4-byte words
+    {"port_xmit_data", offsetof(rdma_counters, tx_bytes), 4},
+    {"port_rcv_data", offsetof(rdma_counters, rx_bytes), 4},
+    {"port_xmit_packets", offsetof(rdma_counters, tx_packets), 1},
+    {"port_rcv_packets", offsetof(rdma_counters, rx_packets), 1},
+    // rxe
+    {"sent_pkts", offsetof(rdma_counters, tx_packets), 1},
+    {"rcvd_pkts", offsetof(rdma_counters, rx_packets), 1},
+    {"completer_retry_err", offsetof(rdma_counters, retransmits), 1},
+    {"rcvd_rnr_err", offsetof(rdma_counters, rnr_naks), 1},
+    {"send_rnr_err", offsetof(rdma_counters, rnr_naks), 1},
+    {"out_of_seq_request", offsetof(rdma_counters, out_of_sequence), 1},
+    {"rcvd_seq_err", offsetof(rdma_counters, out_of_sequence), 1},
+    // mlx5, an RNR NAK within the retry count is answered with a retransmit.
+    // packet_seq_err counts sequence error NAKs, the receiver's
+    // out_of_sequence already counts those events once
+    {"local_ack_timeout_err", offsetof(rdma_counters, retransmits), 1},
+    {"rnr_nak_retry_err", offsetof(rdma_counters, retransmits), 1},
+    {"rnr_nak_retry_err", offsetof(rdma_counters, rnr_naks), 1},
+    {"out_of_sequence", offsetof(rdma_counters, out_of_sequence), 1},
+    {"np_cnp_sent", offsetof(rdma_counters, cnp_sent), 1},
+    {"rp_cnp_handled", offsetof(rdma_counters, cnp_handled), 1},
+    {"np_ecn_marked_roce_packets", offsetof(rdma_counters, ecn_marked), 1},
+};
+
+#define NUM_COUNTER_MAP (int)(sizeof(counter_map) / sizeof(counter_map[0]))
+
+static void add_summary(rdma_counters *c, const char *name, uint64_t value) {
+    for (int i = 0; i < NUM_COUNTER_MAP; i++) {
+        if (strcmp(counter_map[i].name, name) == 0) {
+            *(uint64_t *)((char *)c + counter_map[i].field) += value * counter_map[i].scale;
+        }
+    }
+}
+
+// Read every counter file of one sysfs directory, missing directories are skipped
+static void read_counter_dir(rdma_counters *c, const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        // 'lifespan' is the refresh period of hw_counters, not a counter
+        if (ent->d_name[0] == '.' || strcmp(ent->d_name, "lifespan") == 0) continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+
+        uint64_t value;
+        int ok = fscanf(f, "%" SCNu64, &value) == 1;
+        fclose(f);
+        if (!ok) continue;
+
+        c->hw_available = true;
+        add_summary(c, ent->d_name, value);
+        if (c->num_raw < RDMA_MAX_HW_COUNTERS) {
+            rdma_hw_counter *raw = &c->raw[c->num_raw++];
+            size_t len = strnlen(ent->d_name, sizeof(raw->name) - 1);
+            memcpy(raw->name, ent->d_name, len);
+            raw->name[len] = '\0';
+            raw->value = value;
+        }
+    }
+    closedir(dir);
+}
+
+// Snapshot the port counters and the library statistics
+int rdma_read_counters(rdma_context *ctx, rdma_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->timestamp_ns = now_ns();
+
+    const char *dev = ibv_get_device_name(ctx->context->device);
+    char path[256];
+    snprintf(path, sizeof(path), SYSFS_IB_DIR "/%s/ports/%d/counters", dev, ctx->dev_port);
+    read_counter_dir(counters, path);
+    snprintf(path, sizeof(path), SYSFS_IB_DIR "/%s/ports/%d/hw_counters", dev, ctx->dev_port);
+    read_counter_dir(counters, path);
+
+    if (!counters->hw_available) {
+        log_info("no port counters for %s port %d in sysfs", dev, ctx->dev_port);
+    }
+    return rdma_get_stats(ctx, &counters->lib);
+}
+
+static void peer_stats_delta(const rdma_peer_stats *before, const rdma_peer_stats *after,
+                             rdma_peer_stats *delta) {
+    for (int op = 0; op < RDMA_OP_COUNT; op++) {
+        delta->ops[op].messages = after->ops[op].messages - before->ops[op].messages;
+        delta->ops[op].bytes = after->ops[op].bytes - before->ops[op].bytes;
+        for (int b = 0; b < RDMA_HIST_BUCKETS; b++) {
+            delta->ops[op].latency_hist[b] =
+                after->ops[op].latency_hist[b] - before->ops[op].latency_hist[b];
+        }
+    }
+    delta->posted_wrs = after->posted_wrs - before->posted_wrs;
+    delta->empty_polls = after->empty_polls - before->empty_polls;
+    delta->rnr_events = after->rnr_events - before->rnr_events;
+    delta->retransmits = after->retransmits - before->retransmits;
+    delta->reconnects = after->reconnects - before->reconnects;
+    delta->connect_ns = after->connect_ns;
+    delta->straggles = after->straggles - before->straggles;
+    delta->paced_ns = after->paced_ns - before->paced_ns;
+    for (int b = 0; b < RDMA_HIST_BUCKETS; b++) {
+        delta->wire_hist[b] = after->wire_hist[b] - before->wire_hist[b];
+        delta->deliver_hist[b] = after->deliver_hist[b] - before->deliver_hist[b];
+    }
+}
+
+// Subtract two snapshots, peers connected in between count from zero
+int rdma_counters_delta(const rdma_counters *before, const rdma_counters *after,
+                        rdma_counters *delta) {
+    memset(delta, 0, sizeof(*delta));
+    delta->timestamp_ns = after->timestamp_ns - before->timestamp_ns;
+    delta->hw_available = before->hw_available && after->hw_available;
+
+    delta->tx_bytes = after->tx_bytes - before->tx_bytes;
+    delta->rx_bytes = after->rx_bytes - before->rx_bytes;
+    delta->tx_packets = after->tx_packets - before->tx_packets;
+    delta->rx_packets = after->rx_packets - before->rx_packets;
+    delta->retransmits = after->retransmits - before->retransmits;
+    delta->rnr_naks = after->rnr_naks - before->rnr_naks;
+    delta->out_of_sequence = after->out_of_sequence - before->out_of_sequence;
+    delta->cnp_sent = after->cnp_sent - before->cnp_sent;
+    delta->cnp_handled = after->cnp_handled - before->cnp_handled;
+    delta->ecn_marked = after->ecn_marked - before->ecn_marked;
+
+    for (int i = 0; i < after->num_raw; i++) {
+        uint64_t prev = 0;
+        for (int j = 0; j < before->num_raw; j++) {
+            if (strcmp(before->raw[j].name, after->raw[i].name) == 0) {
+                prev = before->raw[j].value;
+                break;
+            }
+        }
+        delta->raw[i] = after->raw[i];
+        delta->raw[i].value -= prev;
+    }
+    delta->num_raw = after->num_raw;
+
+    const rdma_stats *a = &before->lib, *b = &after->lib;
+    rdma_stats *d = &delta->lib;
+    d->cq_polls = b->cq_polls - a->cq_polls;
+    d->empty_polls = b->empty_polls - a->empty_polls;
+    d->posted_recvs = b->posted_recvs - a->posted_recvs;
+    if (b->num_peers == 0) return 0;
+
+    d->peers = calloc(b->num_peers, sizeof(*d->peers));
+    if (!d->peers) {
+        set_error("Failed to allocate statistics delta");
+        return -1;
+    }
+    static const rdma_peer_stats zero;
+    for (int i = 0; i < b->num_peers; i++) {
+        peer_stats_delta(i < a->num_peers ? &a->peers[i] : &zero, &b->peers[i], &d->peers[i]);
+    }
+    d->num_peers = b->num_peers;
+    return 0;
+}
+
+void rdma_free_counters(rdma_counters *counters) {
+    rdma_free_stats(&counters->lib);
+}
+
+// Print the network side next to the host side of a snapshot or delta
+void rdma_print_counters(FILE *out, const rdma_counters *counters) {
+    static const char *op_names[RDMA_OP_COUNT] = {"send", "recv", "bcast", "alltoall", "atomic"};
+    const rdma_stats *lib = &counters->lib;
+
+    if (counters->hw_available) {
+        fprintf(out, "hw:  tx %" PRIu64 " B / %" PRIu64 " pkts, rx %" PRIu64 " B / %" PRIu64
+                " pkts, retransmits %" PRIu64 ", rnr naks %" PRIu64 ", out of sequence %" PRIu64
+                ", cnp sent %" PRIu64 ", cnp handled %" PRIu64 ", ecn %" PRIu64 "\n",
+                counters->tx_bytes, counters->tx_packets, counters->rx_bytes,
+                counters->rx_packets, counters->retransmits, counters->rnr_naks,
+                counters->out_of_sequence, counters->cnp_sent, counters->cnp_handled,
+                counters->ecn_marked);
+    } else {
+        fprintf(out, "hw:  no port counters available\n");
+    }
+
+    rdma_peer_stats total = {0};
+    for (int i = 0; i < lib->num_peers; i++) {
+        const rdma_peer_stats *p = &lib->peers[i];
+        for (int op = 0; op < RDMA_OP_COUNT; op++) {
+            total.ops[op].messages += p->ops[op].messages;
+            total.ops[op].bytes += p->ops[op].bytes;
+        }
+        total.posted_wrs += p->posted_wrs;
+        total.rnr_events += p->rnr_events;
+        total.retransmits += p->retransmits;
+    }
+
+    fprintf(out, "lib:");
+    for (int op = 0; op < RDMA_OP_COUNT; op++) {
+        if (total.ops[op].messages == 0) continue;
+        fprintf(out, " %s %" PRIu64 " / %" PRIu64 " B,", op_names[op],
+                total.ops[op].messages, total.ops[op].bytes);
+    }
+    fprintf(out, " posted wrs %" PRIu64 ", cq polls %" PRIu64 " (%" PRIu64 " empty), "
+            "rnr events %" PRIu64 ", retransmits %" PRIu64 "\n",
+            total.posted_wrs, lib->cq_polls, lib->empty_polls, total.rnr_events,
+            total.retransmits);
+}
@@ -0,0 +1,247 @@
+#ifndef RDMA_INTERNAL_H
+#define RDMA_INTERNAL_H
+
+#include "rdma_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+
+// Helpers shared between the library modules, not part of the public API
+
+// Work request identifiers carry the request kind in the top byte
+#define WRID_KIND_SHIFT 56
+#define WRID(kind, val) (((uint64_t)(kind) << WRID_KIND_SHIFT) | (uint64_t)(val))
+#define WRID_KIND(wr_id) ((int)((wr_id) >> WRID_KIND_SHIFT))
+#define WRID_VAL(wr_id) ((wr_id) & ((1ULL << WRID_KIND_SHIFT) - 1))
+
+enum {
+    WR_KIND_RECV = 1,
+    WR_KIND_SEND = 2,
+    WR_KIND_UD_SEND = 3,
+    WR_KIND_UD_ACK = 4,
+    WR_KIND_MCAST = 5,
+    WR_KIND_CTRL = 6,
+    WR_KIND_RELAY = 7,
+    WR_KIND_DRAIN = 8       // Marker behind the flushed work of a released QP
+};
+
+// Log levels: messages above RDMA_LOG_LEVEL compile to nothing
+#define RDMA_LOG_NONE 0
+#define RDMA_LOG_ERROR 1
+#define RDMA_LOG_WARN 2
+#define RDMA_LOG_INFO 3
+#define RDMA_LOG_DEBUG 4
+
+#ifndef RDMA_LOG_LEVEL
+#define RDMA_LOG_LEVEL RDMA_LOG_WARN
+#endif
+
+#define RDMA_LOG(level, tag, fmt, ...) do { \
+        if (RDMA_LOG_LEVEL >= (level)) fprintf(stderr, "rdma %s: " fmt "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define log_error(fmt, ...) RDMA_LOG(RDMA_LOG_ERROR, "error", fmt, ##__VA_ARGS__)
+#define log_warn(fmt, ...) RDMA_LOG(RDMA_LOG_WARN, "warn", fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...) RDMA_LOG(RDMA_LOG_INFO, "info", fmt, ##__VA_ARGS__)
+#define log_debug(fmt, ...) RDMA_LOG(RDMA_LOG_DEBUG, "debug", fmt, ##__VA_ARGS__)
+
+// Statistics are relaxed atomic adds, -DRDMA_STATS=0 removes them
+#ifndef RDMA_STATS
+#define RDMA_STATS 1
+#endif
+
+#if RDMA_STATS
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+#define POLL_BATCH 16
+#define GRH_SIZE 40         // Every UD receive starts with the GRH
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Timeline tracing, -DRDMA_TRACE=0 removes it
+#ifndef RDMA_TRACE
+#define RDMA_TRACE 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t trace_ticks(void) {
+    return __rdtsc();
+}
+#else
+static inline uint64_t trace_ticks(void) {
+    return now_ns();
+}
+#endif
+
+#if RDMA_TRACE
+#define TRACE(ph, name, peer, arg) do { \
+        if (trace_enabled) trace_record(ph, name, peer, arg); \
+    } while (0)
+#else
+#define TRACE(ph, name, peer, arg) ((void)0)
+#endif
+
+#define TRACE_BEGIN(name, peer) TRACE('B', name, peer, 0)
+#define TRACE_END(name, peer) TRACE('E', name, peer, 0)
+#define TRACE_INSTANT(name, peer, arg) TRACE('i', name, peer, arg)
+
+// Start time of a measured operation, free when statistics are compiled out
+static inline uint64_t stat_start(void) {
+    return RDMA_STATS ? now_ns() : 0;
+}
+
+// Count a latency in its log2 bucket
+static inline void stat_hist(uint64_t *hist, uint64_t ns) {
+#if RDMA_STATS
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    STAT_ADD(hist[bucket < RDMA_HIST_BUCKETS ? bucket : RDMA_HIST_BUCKETS - 1], 1);
+#else
+    (void)hist;
+    (void)ns;
+#endif
+}
+
+// Account one completed operation towards a peer
+static inline void stat_op(rdma_peer_conn *peer, rdma_op op, size_t bytes, uint64_t start_ns) {
+#if RDMA_STATS
+    rdma_op_stats *s = &peer->stats.ops[op];
+
+    STAT_ADD(s->messages, 1);
+    STAT_ADD(s->bytes, bytes);
+    stat_hist(s->latency_hist, now_ns() - start_ns);
+#else
+    (void)peer;
+    (void)op;
+    (void)bytes;
+    (void)start_ns;
+#endif
+}
+
+// Receive slots are posted at their base, the payload starts at the slot offset
+static inline char *slot_base(rdma_context *ctx, int slot) {
+    return (char *)ctx->srq_buf + (size_t)slot * RECV_SLOT_SIZE;
+}
+
+static inline char *slot_data(rdma_context *ctx, int slot) {
+    return slot_base(ctx, slot) + ctx->slots[slot].offset;
+}
+
+// A flushed send of the QP that qp_release is draining, not a failure
+static inline bool wc_drained(rdma_context *ctx, struct ibv_wc *wc) {
+    return ctx->drain_qpn && wc->qp_num == ctx->drain_qpn && wc->status == IBV_WC_WR_FLUSH_ERR;
+}
+
+// rdma_lib.c
+void set_error(const char *fmt, ...);
+void release_slot(rdma_context *ctx, int slot);
+void queue_recv(rdma_context *ctx, int peer_idx, int slot);
+int progress(rdma_context *ctx);
+int wait_sends(rdma_context *ctx, int peer_idx);
+int post_signaled(rdma_context *ctx, int peer_idx, struct ibv_send_wr *wr);
+int post_send(rdma_context *ctx, int peer_idx, const void *buf, size_t len, uint32_t lkey,
+              bool more);
+int post_ctrl(rdma_context *ctx, int peer_idx, struct ibv_send_wr *wr);
+int wait_ctrl(rdma_context *ctx, int peer_idx);
+bool find_lkey(rdma_context *ctx, const void *addr, size_t len, uint32_t *lkey);
+typedef int (*recv_visit_fn)(void *arg, const void *chunk, size_t len);
+int recv_visit(rdma_context *ctx, int peer_idx, recv_visit_fn fn, void *arg);
+
+// rdma_ud.c
+struct ibv_qp *create_ud_qp(rdma_context *ctx, uint32_t qkey);
+struct ibv_ah *create_ah(rdma_context *ctx, const uint8_t *gid, uint16_t lid);
+size_t ud_payload_limit(rdma_context *ctx);
+int ud_init(rdma_context *ctx);
+void ud_cleanup(rdma_context *ctx);
+int ud_add_peer(rdma_context *ctx, rdma_peer_conn *peer);
+void ud_remove_peer(rdma_context *ctx, rdma_peer_conn *peer);
+int ud_post_send(rdma_context *ctx, int peer_idx, const void *buf, size_t len, bool more);
+int ud_post_ctrl(rdma_context *ctx, int peer_idx, const void *buf, size_t len);
+int ud_handle_recv(rdma_context *ctx, struct ibv_wc *wc, int slot);
+int ud_handle_send(rdma_context *ctx, struct ibv_wc *wc);
+int ud_progress(rdma_context *ctx);
+
+// rdma_mcast.c
+bool mcast_active(rdma_context *ctx);
+int mcast_broadcast(rdma_context *ctx, const void *data, size_t len);
+int mcast_recv(rdma_context *ctx, void *data, size_t max_len);
+int mcast_handle_recv(rdma_context *ctx, struct ibv_wc *wc, int slot);
+int mcast_handle_send(rdma_context *ctx, struct ibv_wc *wc);
+void mcast_cleanup(rdma_context *ctx);
+
+// rdma_plan.c
+void plan_notify(rdma_context *ctx, uint32_t imm);
+void plan_cleanup(rdma_context *ctx);
+
+// rdma_codec.c
+void codec_cleanup(rdma_context *ctx);
+
+// rdma_comm.c
+#define COMM_IMM_FLAG 0x80000000u     // The immediate routes a communicator message
+
+int comm_init(rdma_context *ctx);
+int comm_handle_recv(rdma_context *ctx, int slot, uint32_t imm);
+int comm_handle_relay(rdma_context *ctx, struct ibv_wc *wc);
+int comm_relay(rdma_context *ctx);
+void comm_cleanup(rdma_context *ctx);
+
+// rdma_rate.c
+void rate_peer_connected(rdma_context *ctx, int peer_idx);
+int pace_wait(rdma_context *ctx, int peer_idx, size_t bytes);
+void rate_cleanup(rdma_context *ctx);
+
+// Hold a send back until the rate limits admit it, free without limits
+static inline int pace(rdma_context *ctx, int peer_idx, size_t bytes) {
+    if (!ctx->pacer && !ctx->peers[peer_idx].pacer) return 0;
+    return pace_wait(ctx, peer_idx, bytes);
+}
+
+// rdma_timestamp.c
+int ts_create_cq(rdma_context *ctx, int depth, bool timestamps);
+void ts_destroy_cq(rdma_context *ctx);
+int ts_poll_cq(rdma_context *ctx, struct ibv_wc *wc, uint64_t *ts, int max);
+void ts_send_completed(rdma_context *ctx, rdma_peer_conn *peer, uint64_t ts);
+
+// Post time of a send, 0 unless completions are timestamped
+static inline uint64_t ts_post_time(rdma_context *ctx) {
+    return ctx->ts_source != RDMA_TS_OFF ? now_ns() : 0;
+}
+
+// Remember the post time of a send until its completion
+static inline void ts_send_posted(rdma_context *ctx, rdma_peer_conn *peer, uint64_t posted) {
+    if (!posted) return;
+    if (!peer->post_ns) {
+        peer->post_ns = malloc(ctx->tune.send_wr * sizeof(*peer->post_ns));
+        if (!peer->post_ns) return;
+        peer->post_head = peer->post_tail = 0;
+    }
+    // Signaled sends complete in order and never exceed the send queue depth
+    peer->post_ns[peer->post_tail++ % ctx->tune.send_wr] = posted;
+}
+
+// rdma_trace.c
+extern bool trace_enabled;
+extern volatile sig_atomic_t trace_dump_pending;
+void trace_record(char ph, const char *name, int peer, uint32_t arg);
+void trace_cleanup(rdma_context *ctx);
+
+// rdma_numa.c
+int numa_init(rdma_context *ctx, const rdma_init_attr *attr);
+void numa_cleanup(rdma_context *ctx);
+
+// rdma_profile.c
+int tune_resolve(const rdma_init_attr *attr, rdma_tuning *t);
+
+// rdma_atomic.c
+int atomic_init(rdma_context *ctx);
+void atomic_cleanup(rdma_context *ctx);
+
+#endif /* RDMA_INTERNAL_H */
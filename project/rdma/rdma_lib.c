@@ -1,19 +1,25 @@
-#include "rdma_lib.h"
+#include "rdma_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 
-// Global error buffer
-static char error_buf[1024];
+#define SRQ_POST_BATCH 64
+#define SRQ_REFILL_MIN 8            // Refill without waiting for the limit event
+#define ASYNC_CHECK_INTERVAL 1024   // Empty polls between async event checks
+#define QP_DRAIN_TIMEOUT_NS 1000000000ULL   // Flush of a released QP
+
+// Per thread, so threads on different communicators keep their own errors
+static __thread char error_buf[1024];
 
 // Internal helper functions
-static void set_error(const char *fmt, ...) {
+void set_error(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     vsnprintf(error_buf, sizeof(error_buf), fmt, args);
@@ -25,17 +31,17 @@ const char* rdma_get_error(void) {
     return error_buf;
 }
 
-// Create Queue Pair (QP)
-static struct ibv_qp* create_qp(rdma_context *ctx) {
+// Create Queue Pair (QP), receives are served by the context SRQ. Control
+// QPs only carry small inline messages and single one-sided operations
+static struct ibv_qp* create_qp(rdma_context *ctx, bool ctrl) {
     struct ibv_qp_init_attr qp_attr = {
         .send_cq = ctx->cq,
         .recv_cq = ctx->cq,
+        .srq = ctx->srq,
         .cap = {
-            .max_send_wr = MAX_WR,
-            .max_recv_wr = MAX_WR,
-            .max_send_sge = MAX_SGE,
-            .max_recv_sge = MAX_SGE,
-            .max_inline_data = MAX_INLINE_DATA
+            .max_send_wr = ctrl ? CTRL_WR : ctx->tune.send_wr,
+            .max_send_sge = ctrl ? 1 : ctx->max_send_sge,
+            .max_inline_data = ctrl ? MAX_INLINE_DATA : ctx->tune.inline_size
         },
         .qp_type = IBV_QPT_RC,
         .sq_sig_all = 1  // Generate completion for all send operations
@@ -57,7 +63,8 @@ static int modify_qp_to_init(struct ibv_qp *qp, int port) {
         .port_num = port,
         .qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
                           IBV_ACCESS_REMOTE_READ |
-                          IBV_ACCESS_REMOTE_WRITE
+                          IBV_ACCESS_REMOTE_WRITE |
+                          IBV_ACCESS_REMOTE_ATOMIC
     };
 
     int flags = IBV_QP_STATE |
@@ -73,15 +80,17 @@ static int modify_qp_to_init(struct ibv_qp *qp, int port) {
 }
 
 
-// Transition QP to RTR (Ready to Receive) state
-static int modify_qp_to_rtr(struct ibv_qp *qp, rdma_conn_info *remote_info, int port) {
+// Transition QP to RTR (Ready to Receive) state towards 'dest_qp_num' of the
+// remote side, with the priority of its channel
+static int modify_qp_to_rtr(struct ibv_qp *qp, rdma_conn_info *remote_info, uint32_t dest_qp_num,
+                            int port, const rdma_channel_attr *ch) {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
     
     // Basic QP attributes
     attr.qp_state = IBV_QPS_RTR;
     attr.path_mtu = IBV_MTU_1024;
-    attr.dest_qp_num = remote_info->qp_num;
+    attr.dest_qp_num = dest_qp_num;
     attr.rq_psn = remote_info->psn;
     attr.max_dest_rd_atomic = 1;
     attr.min_rnr_timer = 12;
@@ -89,7 +98,7 @@ static int modify_qp_to_rtr(struct ibv_qp *qp, rdma_conn_info *remote_info, int
     // Address handle attributes
     attr.ah_attr.is_global = 1;
     attr.ah_attr.dlid = 0;  // Use 0 for RoCE
-    attr.ah_attr.sl = 0;
+    attr.ah_attr.sl = ch->sl;
     attr.ah_attr.src_path_bits = 0;
     attr.ah_attr.port_num = port;
     
@@ -97,7 +106,7 @@ static int modify_qp_to_rtr(struct ibv_qp *qp, rdma_conn_info *remote_info, int
     attr.ah_attr.grh.flow_label = 0;
     attr.ah_attr.grh.sgid_index = 0;
     attr.ah_attr.grh.hop_limit = 1;
-    attr.ah_attr.grh.traffic_class = 0;
+    attr.ah_attr.grh.traffic_class = ch->traffic_class;
     
     // Copy remote GID
     memcpy(&attr.ah_attr.grh.dgid, remote_info->gid, sizeof(union ibv_gid));
@@ -142,65 +151,689 @@ static int modify_qp_to_rts(struct ibv_qp *qp, uint32_t psn) {
     return 0;
 }
 
-// Post a receive work request
-static int post_recv(rdma_context *ctx, int peer_idx, void *buf, size_t len) {
-    struct ibv_sge sge = {
-        .addr = (uint64_t)buf,
-        .length = len,
-        .lkey = ctx->mr->lkey
+// Create a QP and move it to INIT
+static struct ibv_qp *qp_create_init(rdma_context *ctx, bool ctrl) {
+    struct ibv_qp *qp = create_qp(ctx, ctrl);
+    if (!qp) return NULL;
+    if (modify_qp_to_init(qp, ctx->dev_port)) {
+        ibv_destroy_qp(qp);
+        return NULL;
+    }
+    return qp;
+}
+
+// Take a bulk or control QP from its pool, pooled QPs are already in INIT
+static struct ibv_qp *qp_acquire(rdma_context *ctx, bool ctrl) {
+    rdma_qp_pool *pool = ctrl ? &ctx->ctrl_pool : &ctx->qp_pool;
+    if (pool->len > 0) {
+        return pool->qps[--pool->len];
+    }
+    return qp_create_init(ctx, ctrl);
+}
+
+// Flush the outstanding work of a QP in the error state. Its completions
+// stay in the shared CQ after a reset, so they are polled here while the QP
+// number still maps to its peer, up to a marker posted behind them
+static int qp_drain(rdma_context *ctx, struct ibv_qp *qp) {
+    struct ibv_qp_attr attr = {
+        .qp_state = IBV_QPS_ERR
     };
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) return -1;
 
-    struct ibv_recv_wr wr = {
-        .wr_id = peer_idx,
-        .sg_list = &sge,
-        .num_sge = 1
+    struct ibv_send_wr wr = {
+        .wr_id = WRID(WR_KIND_DRAIN, qp->qp_num),
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED
+    };
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(qp, &wr, &bad_wr)) return -1;
+
+    ctx->drain_qpn = qp->qp_num;
+    uint64_t deadline = now_ns() + QP_DRAIN_TIMEOUT_NS;
+    while (ctx->drain_qpn) {
+        // Failures of other peers stay recorded in their state
+        progress(ctx);
+        if (now_ns() > deadline) {
+            ctx->drain_qpn = 0;
+            log_warn("QP %u did not flush, destroying it", qp->qp_num);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Recycle a QP through the error state and RESET into INIT, destroy it if
+// the pool is full or its work did not flush. A destroyed QP is drained as
+// well, the completions it already generated would outlive it
+static void qp_release(rdma_context *ctx, struct ibv_qp *qp, bool ctrl) {
+    rdma_qp_pool *pool = ctrl ? &ctx->ctrl_pool : &ctx->qp_pool;
+    struct ibv_qp_attr attr = {
+        .qp_state = IBV_QPS_RESET
     };
 
-    struct ibv_recv_wr *bad_wr;
-    if (ibv_post_recv(ctx->peers[peer_idx].qp, &wr, &bad_wr)) {
-        set_error("Failed to post receive: %s", strerror(errno));
+    if (qp_drain(ctx, qp) == 0 &&
+        pool->len < pool->cap &&
+        ibv_modify_qp(qp, &attr, IBV_QP_STATE) == 0 &&
+        modify_qp_to_init(qp, ctx->dev_port) == 0) {
+        pool->qps[pool->len++] = qp;
+        return;
+    }
+    ibv_destroy_qp(qp);
+}
+
+// Create a pool and fill it with 'prealloc' QPs
+static int qp_pool_init(rdma_context *ctx, bool ctrl, int prealloc) {
+    rdma_qp_pool *pool = ctrl ? &ctx->ctrl_pool : &ctx->qp_pool;
+    pool->cap = prealloc > QP_POOL_SIZE ? prealloc : QP_POOL_SIZE;
+    pool->qps = calloc(pool->cap, sizeof(*pool->qps));
+    if (!pool->qps) {
+        set_error("Failed to allocate QP pool");
         return -1;
     }
+
+    while (pool->len < prealloc) {
+        struct ibv_qp *qp = qp_create_init(ctx, ctrl);
+        if (!qp) return -1;
+        pool->qps[pool->len++] = qp;
+    }
+    return 0;
+}
+
+// Destroy the pooled QPs
+static void qp_pool_cleanup(rdma_qp_pool *pool) {
+    for (int i = 0; i < pool->len; i++) {
+        ibv_destroy_qp(pool->qps[i]);
+    }
+    free(pool->qps);
+    *pool = (rdma_qp_pool){0};
+}
+
+// Map a QP number to a hash table bucket (capacity is a power of two)
+static int qpn_hash(uint32_t qpn, int cap) {
+    return (int)((qpn * 2654435761u) & (uint32_t)(cap - 1));
+}
+
+// Register one QP number of a peer in the lookup table
+static void qpn_map_add(rdma_context *ctx, uint32_t qpn, int peer_idx) {
+    int h = qpn_hash(qpn, ctx->qpn_map_cap);
+    while (ctx->qpn_map[h] >= 0) {
+        h = (h + 1) & (ctx->qpn_map_cap - 1);
+    }
+    ctx->qpn_map[h] = peer_idx;
+}
+
+// Register the bulk and control QP numbers of a peer
+static void qpn_map_insert(rdma_context *ctx, int peer_idx) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    qpn_map_add(ctx, peer->qp->qp_num, peer_idx);
+    if (peer->ctrl_qp) {
+        qpn_map_add(ctx, peer->ctrl_qp->qp_num, peer_idx);
+    }
+}
+
+// Find the peer owning a local QP number, -1 if unknown
+static int qpn_map_lookup(rdma_context *ctx, uint32_t qpn) {
+    if (!ctx->qpn_map) return -1;
+
+    int h = qpn_hash(qpn, ctx->qpn_map_cap);
+    while (ctx->qpn_map[h] >= 0) {
+        rdma_peer_conn *peer = &ctx->peers[ctx->qpn_map[h]];
+        if ((peer->qp && peer->qp->qp_num == qpn) ||
+            (peer->ctrl_qp && peer->ctrl_qp->qp_num == qpn)) {
+            return ctx->qpn_map[h];
+        }
+        h = (h + 1) & (ctx->qpn_map_cap - 1);
+    }
+    return -1;
+}
+
+// Rebuild the lookup table at twice the QP count of a full peer table
+static int qpn_map_rebuild(rdma_context *ctx) {
+    int cap = ctx->peer_cap * 4;
+    if (cap != ctx->qpn_map_cap) {
+        int *map = realloc(ctx->qpn_map, cap * sizeof(*map));
+        if (!map) {
+            set_error("Failed to grow QP lookup table");
+            return -1;
+        }
+        ctx->qpn_map = map;
+        ctx->qpn_map_cap = cap;
+    }
+
+    for (int i = 0; i < cap; i++) {
+        ctx->qpn_map[i] = -1;
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        if (ctx->peers[i].qp) {
+            qpn_map_insert(ctx, i);
+        }
+    }
     return 0;
 }
 
-// Wait for work completion
-static int wait_for_completion(rdma_context *ctx) {
-    struct ibv_wc wc;
-    int num_comp;
+// Make room in the peer table for one more peer
+static int reserve_peer(rdma_context *ctx) {
+    if (ctx->num_peers < ctx->peer_cap) return 0;
 
-    do {
-        num_comp = ibv_poll_cq(ctx->cq, 1, &wc);
-    } while (num_comp == 0);
+    int new_cap = ctx->peer_cap ? ctx->peer_cap * 2 : PEER_TABLE_INIT;
+    rdma_peer_conn *peers = realloc(ctx->peers, new_cap * sizeof(*peers));
+    if (!peers) {
+        set_error("Failed to grow peer table");
+        return -1;
+    }
+
+    memset(peers + ctx->peer_cap, 0, (new_cap - ctx->peer_cap) * sizeof(*peers));
+    ctx->peers = peers;
+
+    int *order = realloc(ctx->ready_order, new_cap * sizeof(*order));
+    if (order) ctx->ready_order = order;
+    uint64_t *delays = realloc(ctx->ready_delays, new_cap * sizeof(*delays));
+    if (delays) ctx->ready_delays = delays;
+    if (!order || !delays) {
+        set_error("Failed to grow peer table");
+        return -1;
+    }
+
+    for (int i = ctx->peer_cap; i < new_cap; i++) {
+        peers[i].sock = -1;
+        peers[i].recv_head = -1;
+        peers[i].recv_tail = -1;
+        peers[i].ctrl_head = -1;
+        peers[i].ctrl_tail = -1;
+    }
+    ctx->peer_cap = new_cap;
+
+    return qpn_map_rebuild(ctx);
+}
+
+// Post free receive slots to the SRQ in chained batches
+static int refill_srq(rdma_context *ctx) {
+    while (ctx->free_slots >= 0) {
+        struct ibv_sge sges[SRQ_POST_BATCH];
+        struct ibv_recv_wr wrs[SRQ_POST_BATCH];
+        int n = 0;
+
+        for (int slot = ctx->free_slots; slot >= 0 && n < SRQ_POST_BATCH;
+             slot = ctx->slots[slot].next, n++) {
+            sges[n] = (struct ibv_sge){
+                .addr = (uint64_t)slot_base(ctx, slot),
+                .length = RECV_SLOT_SIZE,
+                .lkey = ctx->srq_mr->lkey
+            };
+            wrs[n] = (struct ibv_recv_wr){
+                .wr_id = WRID(WR_KIND_RECV, slot),
+                .sg_list = &sges[n],
+                .num_sge = 1
+            };
+            if (n > 0) wrs[n - 1].next = &wrs[n];
+        }
+
+        struct ibv_recv_wr *bad_wr = NULL;
+        int ret = ibv_post_srq_recv(ctx->srq, wrs, &bad_wr);
+        int posted = ret ? (int)(bad_wr - wrs) : n;
+
+        for (int i = 0; i < posted; i++) {
+            ctx->free_slots = ctx->slots[ctx->free_slots].next;
+        }
+        ctx->srq_posted += posted;
+        STAT_ADD(ctx->posted_recvs, posted);
+
+        if (ret) {
+            set_error("Failed to post SRQ receive: %s", strerror(ret));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Arm the SRQ low watermark so the device raises SRQ_LIMIT_REACHED
+static int arm_srq_limit(rdma_context *ctx) {
+    struct ibv_srq_attr attr = {
+        .srq_limit = ctx->srq_depth > SRQ_LIMIT * 4 ? SRQ_LIMIT : ctx->srq_depth / 4
+    };
+
+    if (ibv_modify_srq(ctx->srq, &attr, IBV_SRQ_LIMIT)) {
+        set_error("Failed to arm SRQ limit: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Return a consumed slot to the free list
+void release_slot(rdma_context *ctx, int slot) {
+    ctx->slots[slot].next = ctx->free_slots;
+    ctx->free_slots = slot;
+
+    // Devices that never raise the limit event still must not run dry
+    if (ctx->srq_posted < SRQ_REFILL_MIN) {
+        refill_srq(ctx);
+    }
+}
+
+// Detach the oldest received slot of a peer, -1 if none is queued
+static int pop_recv(rdma_peer_conn *peer, rdma_recv_slot *slots) {
+    int slot = peer->recv_head;
+    if (slot < 0) return -1;
+
+    peer->recv_head = slots[slot].next;
+    if (peer->recv_head < 0) {
+        peer->recv_tail = -1;
+    }
+    return slot;
+}
+
+// Take the oldest control message of a peer, -1 if none
+static int pop_ctrl(rdma_peer_conn *peer, rdma_recv_slot *slots) {
+    int slot = peer->ctrl_head;
+    if (slot < 0) return -1;
+
+    peer->ctrl_head = slots[slot].next;
+    if (peer->ctrl_head < 0) {
+        peer->ctrl_tail = -1;
+    }
+    return slot;
+}
+
+// Drain pending async events, refilling the SRQ when its limit is reached
+static int handle_async_events(rdma_context *ctx) {
+    struct ibv_async_event event;
+    bool refill = false;
+
+    while (ibv_get_async_event(ctx->context, &event) == 0) {
+        switch (event.event_type) {
+        case IBV_EVENT_SRQ_LIMIT_REACHED:
+            refill = true;
+            break;
+        case IBV_EVENT_QP_FATAL:
+        case IBV_EVENT_QP_REQ_ERR:
+        case IBV_EVENT_QP_ACCESS_ERR: {
+            int peer_idx = qpn_map_lookup(ctx, event.element.qp->qp_num);
+            if (peer_idx >= 0) {
+                ctx->peers[peer_idx].state = RDMA_CONN_ERROR;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        ibv_ack_async_event(&event);
+    }
+
+    if (refill) {
+        if (refill_srq(ctx) < 0) return -1;
+        if (arm_srq_limit(ctx) < 0) return -1;
+    }
+    return 0;
+}
+
+// Queue a received slot until the application consumes it, control messages
+// in a queue of their own
+void queue_recv(rdma_context *ctx, int peer_idx, int slot) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    TRACE_INSTANT("recv_complete", peer_idx, ctx->slots[slot].len);
+
+    int *head = ctx->slots[slot].ctrl ? &peer->ctrl_head : &peer->recv_head;
+    int *tail = ctx->slots[slot].ctrl ? &peer->ctrl_tail : &peer->recv_tail;
+
+    ctx->slots[slot].next = -1;
+    if (*tail >= 0) {
+        ctx->slots[*tail].next = slot;
+    } else {
+        *head = slot;
+    }
+    *tail = slot;
+}
+
+// Account for a single work completion, 'ts' is its timestamp or 0
+static int handle_completion(rdma_context *ctx, struct ibv_wc *wc, uint64_t ts) {
+    uint64_t val = WRID_VAL(wc->wr_id);
+
+    switch (WRID_KIND(wc->wr_id)) {
+    case WR_KIND_RECV: {
+        int slot = (int)val;
+        ctx->srq_posted--;
+        ctx->slots[slot].arrival_ns = ts;
+
+        if (wc->status != IBV_WC_SUCCESS) {
+            release_slot(ctx, slot);
+            set_error("Receive failed with status: %d", wc->status);
+            return -1;
+        }
 
+        // Writes of a plan leave their data in place and only notify
+        if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            release_slot(ctx, slot);
+            plan_notify(ctx, ntohl(wc->imm_data));
+            return 0;
+        }
+
+        // Datagrams carry their own header and are ordered by the UD layer
+        if (ctx->ud_qp && wc->qp_num == ctx->ud_qp->qp_num) {
+            return ud_handle_recv(ctx, wc, slot);
+        }
+        if (ctx->mcast_qp && wc->qp_num == ctx->mcast_qp->qp_num) {
+            return mcast_handle_recv(ctx, wc, slot);
+        }
+
+        int peer_idx = qpn_map_lookup(ctx, wc->qp_num);
+        if (peer_idx < 0) {
+            release_slot(ctx, slot);
+            return 0;
+        }
+
+        // Streamed chunks other than the last one carry an immediate
+        rdma_peer_conn *peer = &ctx->peers[peer_idx];
+        ctx->slots[slot].len = wc->byte_len;
+        ctx->slots[slot].offset = 0;
+        if ((wc->wc_flags & IBV_WC_WITH_IMM) && (ntohl(wc->imm_data) & COMM_IMM_FLAG)) {
+            return comm_handle_recv(ctx, slot, ntohl(wc->imm_data));
+        }
+        ctx->slots[slot].more = wc->wc_flags & IBV_WC_WITH_IMM;
+        ctx->slots[slot].ctrl = peer->ctrl_qp && wc->qp_num == peer->ctrl_qp->qp_num;
+        queue_recv(ctx, peer_idx, slot);
+        return 0;
+    }
+    case WR_KIND_SEND: {
+        rdma_peer_conn *peer = &ctx->peers[val];
+        peer->send_inflight--;
+        TRACE_INSTANT("send_complete", (int)val, wc->status);
+        if (ts) {
+            ts_send_completed(ctx, peer, ts);
+        }
+
+        if (wc->status != IBV_WC_SUCCESS && !wc_drained(ctx, wc)) {
+            if (wc->status == IBV_WC_RNR_RETRY_EXC_ERR) {
+                STAT_ADD(peer->stats.rnr_events, 1);
+            }
+            peer->state = RDMA_CONN_ERROR;
+            set_error("Send failed with status: %d", wc->status);
+            log_error("send to peer %llu failed: %s", (unsigned long long)val,
+                      ibv_wc_status_str(wc->status));
+            return -1;
+        }
+        return 0;
+    }
+    case WR_KIND_CTRL: {
+        rdma_peer_conn *peer = &ctx->peers[val];
+        peer->ctrl_inflight--;
+
+        if (wc->status != IBV_WC_SUCCESS && !wc_drained(ctx, wc)) {
+            peer->state = RDMA_CONN_ERROR;
+            set_error("Control send failed with status: %d", wc->status);
+            log_error("control send to peer %llu failed: %s", (unsigned long long)val,
+                      ibv_wc_status_str(wc->status));
+            return -1;
+        }
+        return 0;
+    }
+    case WR_KIND_RELAY:
+        return comm_handle_relay(ctx, wc);
+    case WR_KIND_UD_SEND:
+    case WR_KIND_UD_ACK:
+        return ud_handle_send(ctx, wc);
+    case WR_KIND_MCAST:
+        return mcast_handle_send(ctx, wc);
+    case WR_KIND_DRAIN:
+        if (val == ctx->drain_qpn) ctx->drain_qpn = 0;
+        return 0;
+    default:
+        set_error("Unexpected work completion 0x%llx", (unsigned long long)wc->wr_id);
+        return -1;
+    }
+}
+
+// Poll the CQ once and dispatch completions, returns completions handled
+int progress(rdma_context *ctx) {
+    struct ibv_wc wc[POLL_BATCH];
+    uint64_t ts[POLL_BATCH];
+
+    int num_comp = ts_poll_cq(ctx, wc, ts, POLL_BATCH);
     if (num_comp < 0) {
         set_error("Failed to poll CQ");
         return -1;
     }
+    STAT_ADD(ctx->cq_polls, 1);
+    if (num_comp == 0) {
+        STAT_ADD(ctx->empty_polls, 1);
+    }
+
+    // Trace dumps requested by signal are written from here
+    if (RDMA_TRACE && trace_dump_pending) {
+        rdma_trace_dump(ctx);
+    }
+
+    // Dispatch everything that was polled before reporting a failure
+    int ret = num_comp;
+    for (int i = 0; i < num_comp; i++) {
+        if (handle_completion(ctx, &wc[i], ts[i]) < 0) {
+            ret = -1;
+        }
+    }
+
+    // Datagram acknowledgements and retransmits are driven from here
+    if (ctx->transport == RDMA_TRANSPORT_UD && ud_progress(ctx) < 0) {
+        ret = -1;
+    }
+
+    // The server passes communicator messages between clients on
+    if (ctx->is_server && comm_relay(ctx) < 0) {
+        ret = -1;
+    }
+
+    if (num_comp == 0 && ++ctx->idle_polls % ASYNC_CHECK_INTERVAL == 0) {
+        if (handle_async_events(ctx) < 0) ret = -1;
+    }
+    return ret;
+}
+
+// Progress until a control message from the peer is queued, returns its slot
+static int wait_ctrl_recv(rdma_context *ctx, int peer_idx) {
+    while (ctx->peers[peer_idx].ctrl_head < 0) {
+        if (ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        if (progress(ctx) < 0) return -1;
+    }
+    return ctx->peers[peer_idx].ctrl_head;
+}
+
+// Progress until a message from the peer is queued, returns its slot
+static int wait_recv(rdma_context *ctx, int peer_idx) {
+    while (ctx->peers[peer_idx].recv_head < 0) {
+        if (ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        int ret = progress(ctx);
+        if (ret < 0) return -1;
+        if (ret == 0) {
+            STAT_ADD(ctx->peers[peer_idx].stats.empty_polls, 1);
+        }
+    }
+
+    // Time from the completion to the application seeing it
+    int slot = ctx->peers[peer_idx].recv_head;
+    if (RDMA_STATS && ctx->slots[slot].arrival_ns) {
+        stat_hist(ctx->peers[peer_idx].stats.deliver_hist, now_ns() - ctx->slots[slot].arrival_ns);
+    }
+    return slot;
+}
+
+// Progress until every signaled send to the peer has completed
+int wait_sends(rdma_context *ctx, int peer_idx) {
+    while (ctx->peers[peer_idx].send_inflight > 0) {
+        int ret = progress(ctx);
+        if (ret < 0) return -1;
+        if (ret == 0) {
+            STAT_ADD(ctx->peers[peer_idx].stats.empty_polls, 1);
+        }
+    }
+    return 0;
+}
+
+// Total bytes described by a gather list
+static inline uint32_t sgl_length(const struct ibv_sge *sgl, int num_sge) {
+    uint32_t len = 0;
+    for (int i = 0; i < num_sge; i++) {
+        len += sgl[i].length;
+    }
+    return len;
+}
+
+// Post a prepared work request to a peer's RC QP as a signaled send
+int post_signaled(rdma_context *ctx, int peer_idx, struct ibv_send_wr *wr) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    uint64_t posted = ts_post_time(ctx);
+
+    if (pace(ctx, peer_idx, sgl_length(wr->sg_list, wr->num_sge)) < 0) return -1;
+
+    wr->wr_id = WRID(WR_KIND_SEND, peer_idx);
+    wr->send_flags |= IBV_SEND_SIGNALED;
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(peer->qp, wr, &bad_wr)) {
+        set_error("Failed to post send");
+        return -1;
+    }
+    peer->send_inflight++;
+    ts_send_posted(ctx, peer, posted);
+    STAT_ADD(peer->stats.posted_wrs, 1);
+    return 0;
+}
+
+// Post a signaled RC send gathering from registered segments. 'more' marks a
+// chunk that further chunks of the same message follow
+static int post_send_sgl(rdma_context *ctx, int peer_idx, struct ibv_sge *sgl, int num_sge,
+                         bool more) {
+    size_t len = sgl_length(sgl, num_sge);
+    TRACE_INSTANT("post_send", peer_idx, len);
+
+    // Small sends are copied into the work request, saving the NIC a DMA read
+    struct ibv_send_wr wr = {
+        .sg_list = sgl,
+        .num_sge = num_sge,
+        .opcode = more ? IBV_WR_SEND_WITH_IMM : IBV_WR_SEND,
+        .send_flags = len <= ctx->tune.inline_size ? IBV_SEND_INLINE : 0
+    };
+    return post_signaled(ctx, peer_idx, &wr);
+}
+
+// Post a signaled send from registered memory
+int post_send(rdma_context *ctx, int peer_idx, const void *buf, size_t len, uint32_t lkey,
+              bool more) {
+    if (ctx->transport == RDMA_TRANSPORT_UD) {
+        return ud_post_send(ctx, peer_idx, buf, len, more);
+    }
+
+    struct ibv_sge sge = {
+        .addr = (uint64_t)buf,
+        .length = len,
+        .lkey = lkey
+    };
+    return post_send_sgl(ctx, peer_idx, &sge, 1, more);
+}
+
+// Post a work request on the control QP of a peer. It is neither paced nor
+// queued behind bulk sends, only the small control send queue can hold it up
+int post_ctrl(rdma_context *ctx, int peer_idx, struct ibv_send_wr *wr) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+
+    while (peer->ctrl_inflight >= CTRL_WR) {
+        if (peer->state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        if (progress(ctx) < 0) return -1;
+    }
 
-    if (wc.status != IBV_WC_SUCCESS) {
-        set_error("Work completion failed with status: %d", wc.status);
+    wr->wr_id = WRID(WR_KIND_CTRL, peer_idx);
+    wr->send_flags |= IBV_SEND_SIGNALED;
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(peer->ctrl_qp, wr, &bad_wr)) {
+        set_error("Failed to post control send");
         return -1;
     }
+    peer->ctrl_inflight++;
+    STAT_ADD(peer->stats.posted_wrs, 1);
+    return 0;
+}
+
+// Progress until every control send to the peer completed
+int wait_ctrl(rdma_context *ctx, int peer_idx) {
+    while (ctx->peers[peer_idx].ctrl_inflight > 0) {
+        if (progress(ctx) < 0) return -1;
+    }
+    return 0;
+}
 
-    return wc.wr_id;
+// Check whether a memory region covers [addr, addr + len)
+static bool mr_covers(const struct ibv_mr *mr, const void *addr, size_t len) {
+    if (!mr || (const char *)addr < (const char *)mr->addr) return false;
+    size_t start = (const char *)addr - (const char *)mr->addr;
+    return start <= mr->length && len <= mr->length - start;
+}
+
+// Find the local key of registered memory covering a buffer
+bool find_lkey(rdma_context *ctx, const void *addr, size_t len, uint32_t *lkey) {
+    if (mr_covers(ctx->mr, addr, len)) {
+        *lkey = ctx->mr->lkey;
+        return true;
+    }
+    if (mr_covers(ctx->srq_mr, addr, len)) {
+        *lkey = ctx->srq_mr->lkey;
+        return true;
+    }
+    for (int i = 0; i < ctx->num_user_mrs; i++) {
+        if (mr_covers(ctx->user_mrs[i], addr, len)) {
+            *lkey = ctx->user_mrs[i]->lkey;
+            return true;
+        }
+    }
+    return false;
 }
 
 // Initialize RDMA context
 rdma_context* rdma_init(const char *ip, int port, size_t buf_size, bool is_server) {
+    rdma_init_attr attr = {
+        .ip = ip,
+        .port = port,
+        .buf_size = buf_size,
+        .is_server = is_server,
+        .transport = RDMA_TRANSPORT_RC
+    };
+    return rdma_init_ex(&attr);
+}
+
+// Initialize RDMA context with explicit attributes
+rdma_context* rdma_init_ex(const rdma_init_attr *attr) {
+    const char *ip = attr->ip;
+    size_t buf_size = attr->buf_size;
+
     rdma_context *ctx = calloc(1, sizeof(rdma_context));
     if (!ctx) {
         set_error("Failed to allocate context");
         return NULL;
     }
 
+    // Queue depths and thresholds from the profile and the environment
+    if (tune_resolve(attr, &ctx->tune) < 0) {
+        free(ctx);
+        return NULL;
+    }
+
     // Store basic information
     strncpy(ctx->ip, ip, sizeof(ctx->ip) - 1);
     ctx->ip[sizeof(ctx->ip) - 1] = '\0';
-    ctx->port = port;
-    ctx->is_server = is_server;
+    ctx->port = attr->port;
+    ctx->is_server = attr->is_server;
     ctx->dev_port = DEFAULT_PORT;
     ctx->buf_size = buf_size;
+    ctx->chunk_size = ctx->tune.chunk_size;
+    ctx->ctrl_class = attr->ctrl;
+    ctx->bulk_class = attr->bulk;
+    ctx->transport = attr->transport;
 
     // Get IB device list
     int num_devices;
@@ -249,12 +882,15 @@ rdma_context* rdma_init(const char *ip, int port, size_t buf_size, bool is_serve
         goto cleanup_context;
     }
 
-    printf("Device: %s\n", ibv_get_device_name(ib_dev));
-    printf("Port: %d\n", ctx->dev_port);
-    printf("Port LID: %d\n", ctx->port_attr.lid);
-    printf("GID[0]: %.16lx:%.16lx\n", 
-           be64toh(gid.global.subnet_prefix), 
-           be64toh(gid.global.interface_id));
+    log_info("device %s port %d LID %d GID[0] %.16lx:%.16lx",
+             ibv_get_device_name(ib_dev), ctx->dev_port, ctx->port_attr.lid,
+             be64toh(gid.global.subnet_prefix),
+             be64toh(gid.global.interface_id));
+
+    // Queues and buffers allocated from here on land next to the NIC
+    if (numa_init(ctx, attr) < 0) {
+        goto cleanup_context;
+    }
 
     // Rest of initialization...
     ctx->pd = ibv_alloc_pd(ctx->context);
@@ -263,9 +899,21 @@ rdma_context* rdma_init(const char *ip, int port, size_t buf_size, bool is_serve
         goto cleanup_context;
     }
 
-    ctx->cq = ibv_create_cq(ctx->context, CQ_DEPTH, NULL, NULL, 0);
-    if (!ctx->cq) {
-        set_error("Failed to create CQ");
+    if (ibv_query_device(ctx->context, &ctx->dev_attr)) {
+        set_error("Failed to query device: %s", strerror(errno));
+        goto cleanup_pd;
+    }
+
+    if (ctx->dev_attr.max_srq <= 0) {
+        set_error("Device does not support shared receive queues");
+        goto cleanup_pd;
+    }
+    ctx->max_send_sge = ctx->dev_attr.max_sge < MAX_SGE ? ctx->dev_attr.max_sge : MAX_SGE;
+    ctx->srq_depth = ctx->dev_attr.max_srq_wr < (int)ctx->tune.srq_depth ? ctx->dev_attr.max_srq_wr
+                                                                          : (int)ctx->tune.srq_depth;
+
+    // The CQ absorbs every posted receive plus the outstanding sends
+    if (ts_create_cq(ctx, ctx->tune.cq_depth + ctx->srq_depth, attr->timestamps) < 0) {
         goto cleanup_pd;
     }
 
@@ -285,41 +933,276 @@ rdma_context* rdma_init(const char *ip, int port, size_t buf_size, bool is_serve
         goto cleanup_buffer;
     }
 
-    ibv_free_device_list(dev_list);
-    return ctx;
+    // Shared receive queue used by every peer QP
+    struct ibv_srq_init_attr srq_attr = {
+        .attr = {
+            .max_wr = ctx->srq_depth,
+            .max_sge = 1        // Receive slots are contiguous
+        }
+    };
+    ctx->srq = ibv_create_srq(ctx->pd, &srq_attr);
+    if (!ctx->srq) {
+        set_error("Failed to create SRQ: %s", strerror(errno));
+        goto cleanup_mr;
+    }
 
-cleanup_buffer:
-    free(ctx->comm_buf);
-cleanup_cq:
-    ibv_destroy_cq(ctx->cq);
-cleanup_pd:
+    ctx->srq_buf = aligned_alloc(4096, (size_t)ctx->srq_depth * RECV_SLOT_SIZE);
+    if (!ctx->srq_buf) {
+        set_error("Failed to allocate receive slots");
+        goto cleanup_srq;
+    }
+
+    ctx->srq_mr = ibv_reg_mr(ctx->pd, ctx->srq_buf, (size_t)ctx->srq_depth * RECV_SLOT_SIZE,
+                             IBV_ACCESS_LOCAL_WRITE);
+    if (!ctx->srq_mr) {
+        set_error("Failed to register receive slots");
+        goto cleanup_srq_buf;
+    }
+
+    ctx->slots = calloc(ctx->srq_depth, sizeof(*ctx->slots));
+    if (!ctx->slots) {
+        set_error("Failed to allocate receive slot table");
+        goto cleanup_srq_mr;
+    }
+    for (int i = 0; i < ctx->srq_depth; i++) {
+        ctx->slots[i].next = i + 1 < ctx->srq_depth ? i + 1 : -1;
+    }
+    ctx->free_slots = 0;
+
+    if (refill_srq(ctx) < 0 || arm_srq_limit(ctx) < 0) {
+        goto cleanup_slots;
+    }
+
+    // Async events are drained from the progress loop without blocking
+    int flags = fcntl(ctx->context->async_fd, F_GETFL);
+    if (flags < 0 || fcntl(ctx->context->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        set_error("Failed to make async event channel non-blocking");
+        goto cleanup_slots;
+    }
+
+    if (ctx->transport == RDMA_TRANSPORT_RC &&
+        (qp_pool_init(ctx, false, ctx->tune.qp_pool) < 0 ||
+         qp_pool_init(ctx, true, ctx->tune.qp_pool) < 0)) {
+        goto cleanup_qp_pool;
+    }
+
+    if (atomic_init(ctx) < 0) {
+        goto cleanup_qp_pool;
+    }
+
+    if (ctx->transport == RDMA_TRANSPORT_UD && ud_init(ctx) < 0) {
+        goto cleanup_atomic;
+    }
+
+    if (ctx->transport == RDMA_TRANSPORT_RC && comm_init(ctx) < 0) {
+        goto cleanup_atomic;
+    }
+
+    const char *trace_path = getenv("RDMA_TRACE");
+    if (trace_path && *trace_path && rdma_trace_enable(ctx, trace_path) < 0) {
+        log_warn("tracing disabled: %s", rdma_get_error());
+    }
+
+    ibv_free_device_list(dev_list);
+    return ctx;
+
+cleanup_atomic:
+    atomic_cleanup(ctx);
+cleanup_qp_pool:
+    qp_pool_cleanup(&ctx->ctrl_pool);
+    qp_pool_cleanup(&ctx->qp_pool);
+cleanup_slots:
+    free(ctx->slots);
+cleanup_srq_mr:
+    ibv_dereg_mr(ctx->srq_mr);
+cleanup_srq_buf:
+    free(ctx->srq_buf);
+cleanup_srq:
+    ibv_destroy_srq(ctx->srq);
+cleanup_mr:
+    ibv_dereg_mr(ctx->mr);
+cleanup_buffer:
+    free(ctx->comm_buf);
+cleanup_cq:
+    ts_destroy_cq(ctx);
+cleanup_pd:
     ibv_dealloc_pd(ctx->pd);
 cleanup_context:
+    numa_cleanup(ctx);
     ibv_close_device(ctx->context);
     ibv_free_device_list(dev_list);
     free(ctx);
     return NULL;
 }
 
-// Client connection to peer
-int rdma_connect_peer(rdma_context *ctx, const char *peer_ip, int peer_port) {
-    if (ctx->num_peers >= MAX_PEERS) {
-        set_error("Maximum number of peers reached");
+// Opening message of the connecting side. A reconnect only carries what
+// changes, the rest of the connection info is cached from the first connection
+typedef struct {
+    uint32_t kind;          // HELLO_*
+    uint32_t peer_id;       // Reconnect: index under which the receiver tracks the sender
+    uint32_t qp_num;
+    uint32_t psn;
+    uint32_t ctrl_qp_num;
+} conn_hello;
+
+enum {
+    HELLO_CONNECT,          // Followed by the full rdma_conn_info
+    HELLO_RECONNECT,
+    HELLO_ACCEPT,           // Reconnect replies
+    HELLO_REJECT
+};
+
+// Return the QPs of a peer to their pools
+static void release_peer_qps(rdma_context *ctx, rdma_peer_conn *peer) {
+    if (peer->qp) {
+        qp_release(ctx, peer->qp, false);
+        peer->qp = NULL;
+    }
+    if (peer->ctrl_qp) {
+        qp_release(ctx, peer->ctrl_qp, true);
+        peer->ctrl_qp = NULL;
+    }
+}
+
+// Take a QP and fill in the local connection info of a peer
+static int prepare_peer(rdma_context *ctx, rdma_peer_conn *peer, int peer_idx) {
+    uint32_t qp_num;
+
+    if (ctx->transport == RDMA_TRANSPORT_UD) {
+        // Every peer is reached through the single UD QP of the context
+        qp_num = ctx->ud_qp->qp_num;
+    } else {
+        peer->qp = qp_acquire(ctx, false);
+        if (!peer->qp) return -1;
+        peer->ctrl_qp = qp_acquire(ctx, true);
+        if (!peer->ctrl_qp) {
+            release_peer_qps(ctx, peer);
+            return -1;
+        }
+        qp_num = peer->qp->qp_num;
+    }
+
+    union ibv_gid gid;
+    if (ibv_query_gid(ctx->context, ctx->dev_port, 0, &gid)) {
+        set_error("Failed to query GID");
+        release_peer_qps(ctx, peer);
         return -1;
     }
 
-    rdma_peer_conn *peer = &ctx->peers[ctx->num_peers];
+    peer->local_info = (rdma_conn_info){
+        .qp_num = qp_num,
+        .lid = ctx->port_attr.lid,
+        .psn = rand() & 0xFFFFFF,
+        .peer_id = peer_idx,
+        .atomic_addr = (uint64_t)ctx->atomic_buf,
+        .atomic_rkey = ctx->atomic_mr ? ctx->atomic_mr->rkey : 0,
+        .ctrl_qp_num = peer->ctrl_qp ? peer->ctrl_qp->qp_num : 0
+    };
+    memcpy(peer->local_info.gid, &gid, sizeof(gid));
+    memcpy(peer->local_info.ip, ctx->ip, sizeof(peer->local_info.ip) - 1);
+    peer->local_info.ip[sizeof(peer->local_info.ip) - 1] = '\0';
+    peer->local_info.port = ctx->port;
+    return 0;
+}
 
-    // Create socket and connect to server
-    peer->sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (peer->sock < 0) {
+// Bring the transport of a peer up once its remote info is known
+static int activate_peer(rdma_context *ctx, int peer_idx, uint64_t start) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+
+    if (ctx->transport == RDMA_TRANSPORT_UD) {
+        if (ud_add_peer(ctx, peer) < 0) return -1;
+    } else {
+        if (!peer->remote_info.ctrl_qp_num) {
+            set_error("Peer %d has no control QP", peer_idx);
+            return -1;
+        }
+
+        // Move both QPs to RTR and RTS states, each with its channel's priority
+        if (modify_qp_to_rtr(peer->qp, &peer->remote_info, peer->remote_info.qp_num,
+                             ctx->dev_port, &ctx->bulk_class)) return -1;
+        if (modify_qp_to_rts(peer->qp, peer->local_info.psn)) return -1;
+        if (modify_qp_to_rtr(peer->ctrl_qp, &peer->remote_info, peer->remote_info.ctrl_qp_num,
+                             ctx->dev_port, &ctx->ctrl_class)) return -1;
+        if (modify_qp_to_rts(peer->ctrl_qp, peer->local_info.psn)) return -1;
+        rate_peer_connected(ctx, peer_idx);
+
+        // A reconnected peer already has a stale entry under its old QP number
+        if (peer_idx < ctx->num_peers) {
+            if (qpn_map_rebuild(ctx) < 0) return -1;
+        } else {
+            qpn_map_insert(ctx, peer_idx);
+        }
+    }
+
+    peer->state = RDMA_CONN_CONNECTED;
+    peer->stats.connect_ns = now_ns() - start;
+    return 0;
+}
+
+// Give the QPs of a failed connect or reconnect back and close its socket
+static void abort_connect(rdma_context *ctx, rdma_peer_conn *peer) {
+    release_peer_qps(ctx, peer);
+    if (peer->ud) {
+        ud_remove_peer(ctx, peer);
+    }
+    close(peer->sock);
+    peer->sock = -1;
+    peer->state = RDMA_CONN_INIT;
+}
+
+// Exchange connection info over the peer socket and bring the transport up
+static int establish_peer(rdma_context *ctx, rdma_peer_conn *peer, bool send_first, uint64_t start) {
+    int peer_idx = ctx->num_peers;
+
+    if (prepare_peer(ctx, peer, peer_idx) < 0) goto fail;
+    peer->dialed = send_first;
+
+    // The connecting side sends its info first, behind the opening message
+    if (send_first) {
+        struct {
+            conn_hello hello;
+            rdma_conn_info info;
+        } msg = {
+            .hello = { .kind = HELLO_CONNECT },
+            .info = peer->local_info
+        };
+        if (write(peer->sock, &msg, sizeof(msg)) != sizeof(msg)) {
+            set_error("Failed to send local info");
+            goto fail;
+        }
+    }
+
+    if (read(peer->sock, &peer->remote_info, sizeof(peer->remote_info)) != sizeof(peer->remote_info)) {
+        set_error("Failed to receive remote info");
+        goto fail;
+    }
+
+    if (!send_first &&
+        write(peer->sock, &peer->local_info, sizeof(peer->local_info)) != sizeof(peer->local_info)) {
+        set_error("Failed to send local info");
+        goto fail;
+    }
+
+    if (activate_peer(ctx, peer_idx, start) < 0) goto fail;
+    ctx->num_peers++;
+    return peer_idx;
+
+fail:
+    abort_connect(ctx, peer);
+    return -1;
+}
+
+// Open a TCP connection to a listening peer
+static int dial_peer(const char *peer_ip, int peer_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         set_error("Failed to create socket");
         return -1;
     }
 
     // Set socket options
     int option = 1;
-    setsockopt(peer->sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
 
     // Connect to server
     struct sockaddr_in server_addr = {
@@ -328,61 +1211,146 @@ int rdma_connect_peer(rdma_context *ctx, const char *peer_ip, int peer_port) {
     };
     if (inet_pton(AF_INET, peer_ip, &server_addr.sin_addr) != 1) {
         set_error("Invalid server IP address");
-        close(peer->sock);
+        close(sock);
         return -1;
     }
-// [Previous code remains the same until the connect() call in rdma_connect_peer]
 
-    if (connect(peer->sock, (struct sockaddr *)&server_addr, sizeof(server_addr))) {
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr))) {
         set_error("Failed to connect to server");
-        close(peer->sock);
+        close(sock);
         return -1;
     }
+    return sock;
+}
 
-    // Create QP for this peer
-    peer->qp = create_qp(ctx);
-    if (!peer->qp) return -1;
+// Client connection to peer
+int rdma_connect_peer(rdma_context *ctx, const char *peer_ip, int peer_port) {
+    if (reserve_peer(ctx) < 0) {
+        return -1;
+    }
 
-    // Initialize QP
-    if (modify_qp_to_init(peer->qp, ctx->dev_port)) return -1;
+    uint64_t start = now_ns();
+    rdma_peer_conn *peer = &ctx->peers[ctx->num_peers];
+    peer->sock = dial_peer(peer_ip, peer_port);
+    if (peer->sock < 0) {
+        return -1;
+    }
 
-    // Exchange connection information
-    union ibv_gid gid;
-    if (ibv_query_gid(ctx->context, ctx->dev_port, 0, &gid)) {
-        set_error("Failed to query GID");
+    return establish_peer(ctx, peer, true, start);
+}
+
+// Reconnect a known peer with one small exchange on a new socket
+int rdma_reconnect_peer(rdma_context *ctx, int peer_idx) {
+    if (peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
         return -1;
     }
 
-    // Prepare local connection info
-    peer->local_info = (rdma_conn_info){
-        .qp_num = peer->qp->qp_num,
-        .lid = ctx->port_attr.lid,
-        .psn = rand() & 0xFFFFFF
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    if (!peer->dialed) {
+        set_error("Peer %d connected to us and has to reconnect itself", peer_idx);
+        return -1;
+    }
+    if (peer->state != RDMA_CONN_INIT) {
+        rdma_disconnect_peer(ctx, peer_idx);
+    }
+
+    uint64_t start = now_ns();
+    peer->sock = dial_peer(peer->remote_info.ip, peer->remote_info.port);
+    if (peer->sock < 0) {
+        return -1;
+    }
+
+    if (prepare_peer(ctx, peer, peer_idx) < 0) {
+        abort_connect(ctx, peer);
+        return -1;
+    }
+
+    conn_hello hello = {
+        .kind = HELLO_RECONNECT,
+        .peer_id = peer->remote_info.peer_id,
+        .qp_num = peer->local_info.qp_num,
+        .psn = peer->local_info.psn,
+        .ctrl_qp_num = peer->local_info.ctrl_qp_num
     };
-    memcpy(peer->local_info.gid, &gid, sizeof(gid));
-    memcpy(peer->local_info.ip, ctx->ip, sizeof(peer->local_info.ip) - 1);
-    peer->local_info.ip[sizeof(peer->local_info.ip) - 1] = '\0';
-    peer->local_info.port = ctx->port;
+    if (write(peer->sock, &hello, sizeof(hello)) != sizeof(hello) ||
+        read(peer->sock, &hello, sizeof(hello)) != sizeof(hello)) {
+        set_error("Failed to exchange reconnect info");
+        abort_connect(ctx, peer);
+        return -1;
+    }
+    if (hello.kind != HELLO_ACCEPT) {
+        set_error("Peer %d does not know us anymore, connect it again", peer_idx);
+        abort_connect(ctx, peer);
+        return -1;
+    }
 
-    // Send our info first
-    if (write(peer->sock, &peer->local_info, sizeof(peer->local_info)) != sizeof(peer->local_info)) {
-        set_error("Failed to send local info");
+    peer->remote_info.qp_num = hello.qp_num;
+    peer->remote_info.psn = hello.psn;
+    peer->remote_info.ctrl_qp_num = hello.ctrl_qp_num;
+    if (activate_peer(ctx, peer_idx, start) < 0) {
+        abort_connect(ctx, peer);
         return -1;
     }
 
-    // Then receive server's info
-    if (read(peer->sock, &peer->remote_info, sizeof(peer->remote_info)) != sizeof(peer->remote_info)) {
-        set_error("Failed to receive remote info");
+    STAT_ADD(peer->stats.reconnects, 1);
+    log_info("reconnected peer %d in %.1f us", peer_idx, peer->stats.connect_ns / 1e3);
+    return peer_idx;
+}
+
+// Serve a reconnect on an accepted socket, the transport is up before the
+// reply so the peer can send as soon as it has it
+static int accept_reconnect(rdma_context *ctx, int sock, const conn_hello *hello, uint64_t start) {
+    conn_hello reply = { .kind = HELLO_REJECT };
+
+    // The index comes off the wire, bound it before it becomes one
+    if (hello->peer_id >= (uint32_t)ctx->num_peers || ctx->peers[hello->peer_id].dialed) {
+        if (write(sock, &reply, sizeof(reply)) != sizeof(reply)) {
+            log_warn("failed to reject reconnect for unknown peer %u", hello->peer_id);
+        }
+        close(sock);
+        set_error("Reconnect for unknown peer %u", hello->peer_id);
         return -1;
     }
+    int peer_idx = (int)hello->peer_id;
 
-    // Move QP to RTR and RTS states
-    if (modify_qp_to_rtr(peer->qp, &peer->remote_info, ctx->dev_port)) return -1;
-    if (modify_qp_to_rts(peer->qp, peer->local_info.psn)) return -1;
+    // The peer may have gone away without us noticing
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    if (peer->state != RDMA_CONN_INIT) {
+        rdma_disconnect_peer(ctx, peer_idx);
+    }
+    peer->sock = sock;
+
+    if (prepare_peer(ctx, peer, peer_idx) < 0) goto fail;
+    peer->remote_info.qp_num = hello->qp_num;
+    peer->remote_info.psn = hello->psn;
+    peer->remote_info.ctrl_qp_num = hello->ctrl_qp_num;
+    if (activate_peer(ctx, peer_idx, start) < 0) goto fail;
+
+    reply = (conn_hello){
+        .kind = HELLO_ACCEPT,
+        .peer_id = peer_idx,
+        .qp_num = peer->local_info.qp_num,
+        .psn = peer->local_info.psn,
+        .ctrl_qp_num = peer->local_info.ctrl_qp_num
+    };
+    if (write(sock, &reply, sizeof(reply)) != sizeof(reply)) {
+        set_error("Failed to send reconnect info");
+        abort_connect(ctx, peer);
+        return -1;
+    }
 
-    peer->state = RDMA_CONN_CONNECTED;
-    ctx->num_peers++;
-    return ctx->num_peers - 1;
+    STAT_ADD(peer->stats.reconnects, 1);
+    log_info("peer %d reconnected in %.1f us", peer_idx, peer->stats.connect_ns / 1e3);
+    return peer_idx;
+
+fail:
+    reply.kind = HELLO_REJECT;
+    if (write(sock, &reply, sizeof(reply)) != sizeof(reply)) {
+        log_warn("failed to reject reconnect of peer %d", peer_idx);
+    }
+    abort_connect(ctx, peer);
+    return -1;
 }
 
 // Server accepting peer connection
@@ -392,8 +1360,7 @@ int rdma_accept_peer(rdma_context *ctx) {
         return -1;
     }
 
-    if (ctx->num_peers >= MAX_PEERS) {
-        set_error("Maximum number of peers reached");
+    if (reserve_peer(ctx) < 0) {
         return -1;
     }
 
@@ -444,57 +1411,137 @@ int rdma_accept_peer(rdma_context *ctx) {
         return -1;
     }
 
-    // Create QP for this peer
-    peer->qp = create_qp(ctx);
-    if (!peer->qp) return -1;
-
-    // Initialize QP
-    if (modify_qp_to_init(peer->qp, ctx->dev_port)) return -1;
-
-    // Exchange connection information
-    union ibv_gid gid;
-    if (ibv_query_gid(ctx->context, ctx->dev_port, 0, &gid)) {
-        set_error("Failed to query GID");
+    uint64_t start = now_ns();
+    conn_hello hello;
+    if (read(peer->sock, &hello, sizeof(hello)) != sizeof(hello)) {
+        set_error("Failed to receive connection request");
+        close(peer->sock);
+        peer->sock = -1;
         return -1;
     }
 
-    peer->local_info = (rdma_conn_info){
-        .qp_num = peer->qp->qp_num,
-        .lid = ctx->port_attr.lid,
-        .psn = rand() & 0xFFFFFF
+    if (hello.kind == HELLO_RECONNECT) {
+        int sock = peer->sock;
+        peer->sock = -1;
+        return accept_reconnect(ctx, sock, &hello, start);
+    }
+    return establish_peer(ctx, peer, false, start);
+}
+
+// Send data to peer
+int rdma_send(rdma_context *ctx, int peer_idx, const void *data, size_t len) {
+    struct iovec iov = {
+        .iov_base = (void *)data,
+        .iov_len = len
     };
-    memcpy(peer->local_info.gid, &gid, sizeof(gid));
-    memcpy(peer->local_info.ip, ctx->ip, sizeof(peer->local_info.ip) - 1);
-    peer->local_info.ip[sizeof(peer->local_info.ip) - 1] = '\0';
-    peer->local_info.port = ctx->port;
+    return rdma_sendv(ctx, peer_idx, &iov, 1);
+}
 
-    // Receive client's info first
-    if (read(peer->sock, &peer->remote_info, sizeof(peer->remote_info)) != sizeof(peer->remote_info)) {
-        set_error("Failed to receive remote info");
-        return -1;
+// Position in an iovec array
+typedef struct {
+    const struct iovec *iov;
+    int iovcnt;
+    int i;
+    size_t off;
+} iov_cursor;
+
+// Contiguous bytes at the cursor, at most 'max', skipping empty entries
+static size_t iov_peek(iov_cursor *c, size_t max, const char **ptr) {
+    while (c->i < c->iovcnt && c->off == c->iov[c->i].iov_len) {
+        c->i++;
+        c->off = 0;
     }
+    if (c->i == c->iovcnt) return 0;
+    size_t len = c->iov[c->i].iov_len - c->off;
+    *ptr = (const char *)c->iov[c->i].iov_base + c->off;
+    return len < max ? len : max;
+}
 
-    // Then send our info
-    if (write(peer->sock, &peer->local_info, sizeof(peer->local_info)) != sizeof(peer->local_info)) {
-        set_error("Failed to send local info");
+// Chunk size of streamed sends
+static size_t stream_chunk(rdma_context *ctx) {
+    size_t max = rdma_max_msg_size(ctx);
+    return ctx->chunk_size && ctx->chunk_size < max ? ctx->chunk_size : max;
+}
+
+// Send a message larger than one receive slot as a train of chunks, all but
+// the last marked 'more'. Chunks in registered memory go out as they are,
+// others are copied into one of the bounce buffers comm_buf is cut into; a
+// buffer is refilled once its previous send completed, so copying chunk i+1
+// overlaps the NIC sending chunk i. Datagrams are copied out when posted
+static int send_stream(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt,
+                       size_t total) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    size_t chunk = stream_chunk(ctx);
+    size_t send_wr = ctx->tune.send_wr;
+    int nbufs = (int)(ctx->buf_size / chunk < send_wr ? ctx->buf_size / chunk : send_wr);
+    if (nbufs == 0) {
+        set_error("Chunks of %zu bytes exceed the %zu byte bounce area", chunk, ctx->buf_size);
         return -1;
     }
 
-    // Move QP to RTR and RTS states
-    if (modify_qp_to_rtr(peer->qp, &peer->remote_info, ctx->dev_port)) return -1;
-    if (modify_qp_to_rts(peer->qp, peer->local_info.psn)) return -1;
+    iov_cursor cur = {.iov = iov, .iovcnt = iovcnt};
+    unsigned next_buf = 0;
+    for (size_t sent = 0; sent < total;) {
+        size_t n = total - sent < chunk ? total - sent : chunk;
+        bool more = sent + n < total;
+
+        // Zero-copy when every piece of the chunk is registered and gets an SGE
+        struct ibv_sge sgl[MAX_SGE];
+        int num_sge = 0;
+        bool direct = ctx->transport == RDMA_TRANSPORT_RC;
+        iov_cursor probe = cur;
+        for (size_t left = n; left > 0 && direct;) {
+            const char *ptr;
+            size_t len = iov_peek(&probe, left, &ptr);
+            uint32_t lkey;
+            if (num_sge == ctx->max_send_sge || !find_lkey(ctx, ptr, len, &lkey)) {
+                direct = false;
+                break;
+            }
+            sgl[num_sge++] = (struct ibv_sge){.addr = (uint64_t)ptr, .length = len, .lkey = lkey};
+            probe.off += len;
+            left -= len;
+        }
 
-    peer->state = RDMA_CONN_CONNECTED;
-    ctx->num_peers++;
-    return ctx->num_peers - 1;
+        while (ctx->transport == RDMA_TRANSPORT_RC && peer->send_inflight >= nbufs) {
+            if (peer->state != RDMA_CONN_CONNECTED) {
+                set_error("Peer %d not connected", peer_idx);
+                return -1;
+            }
+            if (progress(ctx) < 0) return -1;
+        }
+
+        int ret;
+        if (direct) {
+            cur = probe;
+            ret = post_send_sgl(ctx, peer_idx, sgl, num_sge, more);
+        } else {
+            char *buf = (char *)ctx->comm_buf + (next_buf++ % nbufs) * chunk;
+            for (size_t copied = 0; copied < n;) {
+                const char *ptr;
+                size_t len = iov_peek(&cur, n - copied, &ptr);
+                memmove(buf + copied, ptr, len);
+                cur.off += len;
+                copied += len;
+            }
+            ret = post_send(ctx, peer_idx, buf, n, ctx->mr->lkey, more);
+        }
+        if (ret < 0) return -1;
+        sent += n;
+    }
+    return wait_sends(ctx, peer_idx);
 }
 
-// Send data to peer
-int rdma_send(rdma_context *ctx, int peer_idx, const void *data, size_t len) {
+// Send one message gathered from several buffers
+int rdma_sendv(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt) {
     if (peer_idx >= ctx->num_peers || peer_idx < 0) {
         set_error("Invalid peer index");
         return -1;
     }
+    if (iovcnt < 0) {
+        set_error("Invalid iovec count");
+        return -1;
+    }
 
     rdma_peer_conn *peer = &ctx->peers[peer_idx];
     if (peer->state != RDMA_CONN_CONNECTED) {
@@ -502,38 +1549,73 @@ int rdma_send(rdma_context *ctx, int peer_idx, const void *data, size_t len) {
         return -1;
     }
 
-    // Copy data to registered memory
-    memcpy(ctx->comm_buf, data, len);
+    uint64_t start = stat_start();
 
-    // Post send
-    struct ibv_sge sge = {
-        .addr = (uint64_t)ctx->comm_buf,
-        .length = len,
-        .lkey = ctx->mr->lkey
-    };
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > rdma_max_msg_size(ctx)) {
+        if (send_stream(ctx, peer_idx, iov, iovcnt, total) < 0) return -1;
+        stat_op(peer, RDMA_OP_SEND, total, start);
+        return total;
+    }
 
-    struct ibv_send_wr wr = {
-        .wr_id = peer_idx,
-        .sg_list = &sge,
-        .num_sge = 1,
-        .opcode = IBV_WR_SEND,
-        .send_flags = IBV_SEND_SIGNALED
-    };
+    // Registered buffers go to the NIC as they are when every one gets an SGE
+    bool direct = ctx->transport == RDMA_TRANSPORT_RC && iovcnt <= ctx->max_send_sge;
+    struct ibv_sge sgl[MAX_SGE];
+    int num_sge = 0;
+    size_t staged = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        uint32_t lkey;
+        if (iov[i].iov_len == 0) continue;
+
+        if (direct && find_lkey(ctx, iov[i].iov_base, iov[i].iov_len, &lkey)) {
+            sgl[num_sge++] = (struct ibv_sge){
+                .addr = (uint64_t)iov[i].iov_base,
+                .length = iov[i].iov_len,
+                .lkey = lkey
+            };
+            continue;
+        }
 
-    struct ibv_send_wr *bad_wr;
-    if (ibv_post_send(peer->qp, &wr, &bad_wr)) {
-        set_error("Failed to post send");
-        return -1;
+        // Copy everything else into registered memory
+        if (iov[i].iov_len > ctx->buf_size - staged) {
+            set_error("Message of %zu bytes exceeds the staging buffer", staged + iov[i].iov_len);
+            return -1;
+        }
+        char *dst = (char *)ctx->comm_buf + staged;
+        memmove(dst, iov[i].iov_base, iov[i].iov_len);
+        staged += iov[i].iov_len;
+
+        // Consecutive staged buffers are contiguous and share one SGE
+        if (num_sge > 0 && sgl[num_sge - 1].addr + sgl[num_sge - 1].length == (uint64_t)dst) {
+            sgl[num_sge - 1].length += iov[i].iov_len;
+        } else {
+            sgl[num_sge++] = (struct ibv_sge){
+                .addr = (uint64_t)dst,
+                .length = iov[i].iov_len,
+                .lkey = ctx->mr->lkey
+            };
+        }
     }
 
+    int ret = direct ? post_send_sgl(ctx, peer_idx, sgl, num_sge, false)
+                     : post_send(ctx, peer_idx, ctx->comm_buf, staged, ctx->mr->lkey, false);
+    if (ret < 0) return -1;
+
     // Wait for completion
-    if (wait_for_completion(ctx) < 0) return -1;
+    if (wait_sends(ctx, peer_idx) < 0) return -1;
 
-    return len;
+    stat_op(peer, RDMA_OP_SEND, total, start);
+    return total;
 }
 
-// Receive data from peer
-int rdma_recv(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
+// Consume the next message of a peer, scattering it over 'iov'. The chunks of
+// a streamed message are consumed up to the last one; bytes beyond the
+// buffers are dropped
+static int recv_message(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt) {
     if (peer_idx >= ctx->num_peers || peer_idx < 0) {
         set_error("Invalid peer index");
         return -1;
@@ -545,210 +1627,504 @@ int rdma_recv(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
         return -1;
     }
 
-    // Post receive buffer
-    if (post_recv(ctx, peer_idx, ctx->comm_buf, max_len) < 0) {
-        return -1;
-    }
+    // Messages land in contiguous SRQ slots, so the scatter is done here
+    uint64_t start = stat_start();
+    iov_cursor cur = {.iov = iov, .iovcnt = iovcnt};
+    size_t copied = 0;
+    bool more;
+    do {
+        if (wait_recv(ctx, peer_idx) < 0) {
+            return -1;
+        }
+        int slot = pop_recv(peer, ctx->slots);
+        const char *src = slot_data(ctx, slot);
+        size_t left = ctx->slots[slot].len;
+        more = ctx->slots[slot].more;
+
+        const char *dst;
+        size_t len;
+        while (left > 0 && (len = iov_peek(&cur, left, &dst)) > 0) {
+            memcpy((char *)dst, src, len);
+            cur.off += len;
+            src += len;
+            left -= len;
+            copied += len;
+        }
+        release_slot(ctx, slot);
+    } while (more);
 
-    // Wait for completion
-    if (wait_for_completion(ctx) < 0) {
+    stat_op(peer, RDMA_OP_RECV, copied, start);
+    return copied;
+}
+
+// Hand the chunks of the next message from a peer to 'fn' straight from
+// their receive slots, returns the message length
+int recv_visit(rdma_context *ctx, int peer_idx, recv_visit_fn fn, void *arg) {
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    if (peer->state != RDMA_CONN_CONNECTED) {
+        set_error("Peer not connected");
         return -1;
     }
 
-    // Copy received data to user buffer
-    memcpy(data, ctx->comm_buf, max_len);
-    return max_len;
-}
-
-// Broadcast data to all peers
-int rdma_broadcast(rdma_context *ctx, const void *data, size_t len) {
-    for (int i = 0; i < ctx->num_peers; i++) {
-        if (rdma_send(ctx, i, data, len) < 0) {
+    uint64_t start = stat_start();
+    size_t total = 0;
+    bool more;
+    do {
+        if (wait_recv(ctx, peer_idx) < 0) {
             return -1;
         }
+        int slot = pop_recv(peer, ctx->slots);
+        size_t len = ctx->slots[slot].len;
+        more = ctx->slots[slot].more;
+
+        int ret = fn(arg, slot_data(ctx, slot), len);
+        release_slot(ctx, slot);
+        if (ret < 0) return -1;
+        total += len;
+    } while (more);
+
+    stat_op(peer, RDMA_OP_RECV, total, start);
+    return total;
+}
+
+// Receive data from peer
+int rdma_recv(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
+    struct iovec iov = {
+        .iov_base = data,
+        .iov_len = max_len
+    };
+    return recv_message(ctx, peer_idx, &iov, 1);
+}
+
+// Receive one message scattered over several buffers
+int rdma_recvv(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt) {
+    return recv_message(ctx, peer_idx, iov, iovcnt);
+}
+
+// Send a control message on the peer's control channel
+int rdma_send_ctrl(rdma_context *ctx, int peer_idx, const void *data, size_t len) {
+    if (!ctx || peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
+        return -1;
     }
-    return len;
+    if (len > RDMA_CTRL_MAX_MSG) {
+        set_error("Control message of %zu bytes exceeds %d", len, RDMA_CTRL_MAX_MSG);
+        return -1;
+    }
+    if (ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+        set_error("Peer %d not connected", peer_idx);
+        return -1;
+    }
+    TRACE_INSTANT("post_ctrl", peer_idx, len);
+
+    // Datagrams keep their order, the header marks them as control messages
+    if (ctx->transport == RDMA_TRANSPORT_UD) {
+        return ud_post_ctrl(ctx, peer_idx, data, len);
+    }
+
+    // Inline: the data is copied at post time and needs no registration
+    struct ibv_sge sge = {
+        .addr = (uint64_t)data,
+        .length = len
+    };
+    struct ibv_send_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_INLINE
+    };
+    return post_ctrl(ctx, peer_idx, &wr);
 }
 
-// Sequential all-to-all communication
-int rdma_sequential_alltoall(rdma_context *ctx, const void *send_buf, void *recv_buf, size_t msg_size) {
-    if (!ctx || !send_buf || !recv_buf || !msg_size || ctx->num_peers <= 0) {
-        set_error("Invalid parameters");
+// Receive the next control message of a peer
+int rdma_recv_ctrl(rdma_context *ctx, int peer_idx, void *data, size_t max_len) {
+    if (!ctx || peer_idx >= ctx->num_peers || peer_idx < 0) {
+        set_error("Invalid peer index");
         return -1;
     }
 
-    // Setup buffers in registered memory
-    char *rdma_send_buf = ctx->comm_buf;
-    char *rdma_recv_buf = rdma_send_buf + BUFFER_SIZE;
-    char *rdma_combined = rdma_send_buf + (BUFFER_SIZE * 2);
-    
-    // Clear all buffers
-    memset(rdma_send_buf, 0, BUFFER_SIZE);
-    memset(rdma_recv_buf, 0, BUFFER_SIZE);
-    memset(rdma_combined, 0, BUFFER_SIZE);
+    int slot = wait_ctrl_recv(ctx, peer_idx);
+    if (slot < 0) return -1;
+    pop_ctrl(&ctx->peers[peer_idx], ctx->slots);
 
-    // Copy our message to send buffer
-    memcpy(rdma_send_buf, send_buf, msg_size);
+    size_t len = ctx->slots[slot].len;
+    if (len > max_len) {
+        release_slot(ctx, slot);
+        set_error("Control message of %zu bytes exceeds the buffer of %zu", len, max_len);
+        return -1;
+    }
+    memcpy(data, slot_data(ctx, slot), len);
+    release_slot(ctx, slot);
+    return (int)len;
+}
 
-    if (ctx->is_server) {
-        printf("SERVER: Starting gather phase from %d peers\n", ctx->num_peers);
-        
-        // Post receives from all clients
-        for (int i = 0; i < ctx->num_peers; i++) {
-            struct ibv_sge recv_sge = {
-                .addr = (uint64_t)(rdma_recv_buf + (i * msg_size)),
-                .length = msg_size,
-                .lkey = ctx->mr->lkey
-            };
+// Register application memory for zero-copy sends
+int rdma_reg_buffer(rdma_context *ctx, void *addr, size_t len) {
+    if (ctx->num_user_mrs == ctx->user_mr_cap) {
+        int cap = ctx->user_mr_cap ? ctx->user_mr_cap * 2 : 8;
+        struct ibv_mr **mrs = realloc(ctx->user_mrs, cap * sizeof(*mrs));
+        if (!mrs) {
+            set_error("Failed to grow registration table");
+            return -1;
+        }
+        ctx->user_mrs = mrs;
+        ctx->user_mr_cap = cap;
+    }
 
-            struct ibv_recv_wr recv_wr = {
-                .wr_id = i,
-                .sg_list = &recv_sge,
-                .num_sge = 1
-            };
+    struct ibv_mr *mr = ibv_reg_mr(ctx->pd, addr, len, IBV_ACCESS_LOCAL_WRITE);
+    if (!mr) {
+        set_error("Failed to register buffer: %s", strerror(errno));
+        return -1;
+    }
+    ctx->user_mrs[ctx->num_user_mrs++] = mr;
+    return 0;
+}
 
-            struct ibv_recv_wr *bad_recv_wr;
-            if (ibv_post_recv(ctx->peers[i].qp, &recv_wr, &bad_recv_wr)) {
-                set_error("Failed to post receive");
+// Deregister memory registered with rdma_reg_buffer
+int rdma_dereg_buffer(rdma_context *ctx, void *addr) {
+    for (int i = 0; i < ctx->num_user_mrs; i++) {
+        if (ctx->user_mrs[i]->addr == addr) {
+            if (ibv_dereg_mr(ctx->user_mrs[i])) {
+                set_error("Failed to deregister buffer");
                 return -1;
             }
+            ctx->user_mrs[i] = ctx->user_mrs[--ctx->num_user_mrs];
+            return 0;
         }
+    }
+    set_error("Buffer is not registered");
+    return -1;
+}
+
+// Broadcast data to all peers
+int rdma_broadcast(rdma_context *ctx, const void *data, size_t len) {
+    uint64_t start = stat_start();
 
-        // Wait for all receives
+    if (mcast_active(ctx)) {
+        if (mcast_broadcast(ctx, data, len) < 0) return -1;
+    } else {
         for (int i = 0; i < ctx->num_peers; i++) {
-            struct ibv_wc wc;
-            while (ibv_poll_cq(ctx->cq, 1, &wc) == 0);
-            if (wc.status != IBV_WC_SUCCESS) {
-                set_error("Receive failed with status: %d", wc.status);
+            if (rdma_send(ctx, i, data, len) < 0) {
                 return -1;
             }
-            printf("SERVER: Received from peer %d: '%s'\n", 
-                   (int)wc.wr_id, rdma_recv_buf + (wc.wr_id * msg_size));
         }
+    }
 
-        // Combine messages in temporary buffer
-        char *temp_buf = malloc(BUFFER_SIZE);
-        if (!temp_buf) {
-            set_error("Failed to allocate temporary buffer");
+    for (int i = 0; i < ctx->num_peers; i++) {
+        stat_op(&ctx->peers[i], RDMA_OP_BCAST, len, start);
+    }
+    return len;
+}
+
+// Receive a broadcast from the server
+int rdma_broadcast_recv(rdma_context *ctx, void *data, size_t max_len) {
+    if (ctx->is_server || ctx->num_peers <= 0) {
+        set_error("Broadcasts are received by clients from their server");
+        return -1;
+    }
+
+    if (mcast_active(ctx)) {
+        uint64_t start = stat_start();
+        int len = mcast_recv(ctx, data, max_len);
+        if (len >= 0) {
+            stat_op(&ctx->peers[0], RDMA_OP_RECV, len, start);
+        }
+        return len;
+    }
+    return rdma_recv(ctx, 0, data, max_len);
+}
+
+// Largest message a single send can deliver
+size_t rdma_max_msg_size(rdma_context *ctx) {
+    if (ctx->transport == RDMA_TRANSPORT_UD) {
+        return ud_payload_limit(ctx);
+    }
+    return RECV_SLOT_SIZE;
+}
+
+// Barrier over the server and its clients: gather a token, then release everyone
+int rdma_barrier(rdma_context *ctx) {
+    char token = 0;
+
+    if (!ctx->is_server) {
+        if (ctx->num_peers <= 0) {
+            set_error("Not connected to a server");
             return -1;
         }
-        memset(temp_buf, 0, BUFFER_SIZE);
+        TRACE_BEGIN("barrier", 0);
+        if (rdma_send_ctrl(ctx, 0, &token, sizeof(token)) < 0) return -1;
+        if (rdma_recv_ctrl(ctx, 0, &token, sizeof(token)) < 0) return -1;
+        TRACE_END("barrier", 0);
+        return 0;
+    }
+
+    TRACE_BEGIN("barrier", -1);
+    for (int i = 0; i < ctx->num_peers; i++) {
+        if (rdma_recv_ctrl(ctx, i, &token, sizeof(token)) < 0) return -1;
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        if (rdma_send_ctrl(ctx, i, &token, sizeof(token)) < 0) return -1;
+    }
+    TRACE_END("barrier", -1);
+    return 0;
+}
+
+// Combined all-to-all result, built in the caller's buffer and described as a
+// gather list over the original blocks so the NIC can send it without a copy
+typedef struct {
+    char *out;
+    size_t len;
+    struct ibv_sge sgl[MAX_SGE];
+    int num_sge;
+    bool fits;              // Every segment got its own SGE
+} combine_state;
+
+// Append a registered segment to the combined result, truncated at 'limit'
+static void combine_append(rdma_context *ctx, combine_state *c, const void *data,
+                           size_t len, uint32_t lkey, size_t limit) {
+    if (c->len >= limit) return;
+    if (len > limit - c->len) len = limit - c->len;
+    if (len == 0) return;
+
+    memcpy(c->out + c->len, data, len);
+    c->len += len;
+
+    if (c->num_sge < ctx->max_send_sge) {
+        c->sgl[c->num_sge++] = (struct ibv_sge){
+            .addr = (uint64_t)data,
+            .length = len,
+            .lkey = lkey
+        };
+    } else {
+        c->fits = false;
+    }
+}
+
+// Append the block of peer 'i' to the combined all-to-all result
+static void combine_block(rdma_context *ctx, combine_state *c, const char *seps, int i) {
+    int slot = ctx->peers[i].recv_head;
+
+    combine_append(ctx, c, seps, 2, ctx->mr->lkey, BUFFER_SIZE - 1);
+    combine_append(ctx, c, slot_data(ctx, slot),
+                   strnlen(slot_data(ctx, slot), ctx->slots[slot].len),
+                   ctx->srq_mr->lkey, BUFFER_SIZE - 1);
+}
+
+// Wait for the block of every peer, recording the arrival order in
+// ctx->ready_order and combining blocks in index order as they become
+// available. Returns the number of peers or -1
+static int gather_ready(rdma_context *ctx, combine_state *c, const char *seps, uint64_t start) {
+    int num_ready = 0;
+    int combined = 0;
 
-        // Start with server's message
-        int pos = snprintf(temp_buf, BUFFER_SIZE, "%s", (char*)send_buf);
-        
-        // Add each client's message
+    for (int i = 0; i < ctx->num_peers; i++) {
+        ctx->peers[i].ready_ns = 0;
+    }
+
+    while (num_ready < ctx->num_peers) {
         for (int i = 0; i < ctx->num_peers; i++) {
-            pos += snprintf(temp_buf + pos, BUFFER_SIZE - pos, "; %s", 
-                          rdma_recv_buf + (i * msg_size));
+            rdma_peer_conn *peer = &ctx->peers[i];
+            if (peer->ready_ns) continue;
+
+            if (peer->recv_head < 0) {
+                if (peer->state != RDMA_CONN_CONNECTED) {
+                    set_error("Peer %d not connected", i);
+                    return -1;
+                }
+                continue;
+            }
+
+            // Completion timestamps order arrivals within one poll as well
+            int slot = peer->recv_head;
+            uint64_t arrival = ctx->slots[slot].arrival_ns;
+            peer->ready_ns = arrival > start ? arrival : now_ns();
+            ctx->ready_order[num_ready++] = i;
+            TRACE_INSTANT("gathered", i, ctx->slots[slot].len);
+            log_debug("server: received from peer %d: '%.*s'",
+                      i, (int)ctx->slots[slot].len, slot_data(ctx, slot));
         }
 
-        // Add final semicolon
-        if (pos < BUFFER_SIZE - 2) {
-            strcat(temp_buf, ";");
+        while (combined < ctx->num_peers && ctx->peers[combined].ready_ns) {
+            combine_block(ctx, c, seps, combined++);
         }
 
-        memcpy(rdma_combined, temp_buf, BUFFER_SIZE);
-        free(temp_buf);
-        
-        printf("SERVER: Combined message: '%s'\n", rdma_combined);
+        if (num_ready < ctx->num_peers && progress(ctx) < 0) return -1;
+    }
+    return num_ready;
+}
 
-        // Send combined message to all clients
-        for (int i = 0; i < ctx->num_peers; i++) {
-            struct ibv_sge send_sge = {
-                .addr = (uint64_t)rdma_combined,
-                .length = BUFFER_SIZE,
-                .lkey = ctx->mr->lkey
-            };
+static int cmp_delay(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-            struct ibv_send_wr send_wr = {
-                .wr_id = i + ctx->num_peers,
-                .sg_list = &send_sge,
-                .num_sge = 1,
-                .opcode = IBV_WR_SEND,
-                .send_flags = IBV_SEND_SIGNALED
-            };
+// Fold this all-to-all's arrival delays into each peer's history and flag the
+// peers whose history is far behind the median, the wait of a stage follows them
+static void flag_stragglers(rdma_context *ctx, uint64_t start) {
+    int n = ctx->num_peers;
+
+    for (int i = 0; i < n; i++) {
+        rdma_peer_conn *peer = &ctx->peers[i];
+        uint64_t delay = peer->ready_ns - start;
+        peer->delay_ewma_ns = peer->delay_ewma_ns ?
+            (peer->delay_ewma_ns * 7 + delay) / 8 : delay;
+        ctx->ready_delays[i] = peer->delay_ewma_ns;
+    }
+    if (n < 3) return;
 
-            struct ibv_send_wr *bad_send_wr;
-            if (ibv_post_send(ctx->peers[i].qp, &send_wr, &bad_send_wr)) {
-                set_error("Failed to send");
-                return -1;
-            }
+    qsort(ctx->ready_delays, n, sizeof(*ctx->ready_delays), cmp_delay);
+    uint64_t median = ctx->ready_delays[n / 2];
+    uint64_t limit = median * STRAGGLER_FACTOR;
+    if (limit < STRAGGLER_MIN_US * 1000ULL) {
+        limit = STRAGGLER_MIN_US * 1000ULL;
+    }
 
-            struct ibv_wc wc;
-            while (ibv_poll_cq(ctx->cq, 1, &wc) == 0);
-            if (wc.status != IBV_WC_SUCCESS) {
-                set_error("Send failed with status: %d", wc.status);
-                return -1;
-            }
-        }
+    for (int i = 0; i < n; i++) {
+        rdma_peer_conn *peer = &ctx->peers[i];
+        if (peer->delay_ewma_ns <= limit) continue;
 
-        // Copy combined result to server's receive buffer
-        memcpy(recv_buf, rdma_combined, BUFFER_SIZE);
+        STAT_ADD(peer->stats.straggles, 1);
+        TRACE_INSTANT("straggler", i, peer->delay_ewma_ns);
+        log_debug("peer %d is a straggler: %.1f us behind the start, median %.1f us",
+                  i, peer->delay_ewma_ns / 1e3, median / 1e3);
+    }
+}
 
-    } else {
-        printf("CLIENT: Sending message: '%s'\n", (char*)send_buf);
+// Sequential all-to-all communication
+int rdma_sequential_alltoall(rdma_context *ctx, const void *send_buf, void *recv_buf, size_t msg_size) {
+    if (!ctx || !send_buf || !recv_buf || !msg_size || ctx->num_peers <= 0) {
+        set_error("Invalid parameters");
+        return -1;
+    }
 
-        // Post receive for combined message
-        struct ibv_sge recv_sge = {
-            .addr = (uint64_t)rdma_recv_buf,
-            .length = BUFFER_SIZE,
-            .lkey = ctx->mr->lkey
-        };
+    uint64_t start = stat_start();
+    TRACE_BEGIN("alltoall", -1);
 
-        struct ibv_recv_wr recv_wr = {
-            .wr_id = 0,
-            .sg_list = &recv_sge,
-            .num_sge = 1
-        };
+    // Receives are served by the SRQ; comm_buf only stages what is not registered
+    char *rdma_send_buf = ctx->comm_buf;
+    char *rdma_seps = rdma_send_buf + BUFFER_SIZE;
+    char *rdma_combined = rdma_send_buf + (BUFFER_SIZE * 2);
 
-        struct ibv_recv_wr *bad_recv_wr;
-        if (ibv_post_recv(ctx->peers[0].qp, &recv_wr, &bad_recv_wr)) {
-            set_error("Failed to post receive");
-            return -1;
+    // Our own block goes out from the caller's buffer when it is registered
+    const char *own = send_buf;
+    uint32_t own_lkey;
+    if (!find_lkey(ctx, send_buf, msg_size, &own_lkey)) {
+        memcpy(rdma_send_buf, send_buf, msg_size);
+        own = rdma_send_buf;
+        own_lkey = ctx->mr->lkey;
+    }
+
+    if (ctx->is_server) {
+        log_debug("server: starting gather phase from %d peers", ctx->num_peers);
+
+        // Separators live in registered memory so they can be gathered too
+        memcpy(rdma_seps, "; ", 3);
+        memcpy(rdma_seps + 3, ";", 2);
+
+        // Start with server's message, then "; <block>" per client and a closing ";".
+        // Blocks are combined as soon as all blocks before them are in, so only
+        // the ones behind a straggler are left once it arrives
+        combine_state c = {.out = recv_buf, .fits = true};
+        combine_append(ctx, &c, own, strnlen(own, msg_size), own_lkey, BUFFER_SIZE - 1);
+
+        TRACE_BEGIN("gather", -1);
+        int num_ready = gather_ready(ctx, &c, rdma_seps, start);
+        TRACE_END("gather", -1);
+        if (num_ready < 0) return -1;
+        flag_stragglers(ctx, start);
+
+        TRACE_BEGIN("combine", -1);
+        if (c.len < BUFFER_SIZE - 2) {
+            combine_append(ctx, &c, rdma_seps + 3, 1, ctx->mr->lkey, BUFFER_SIZE - 1);
         }
 
-        // Send our message to server
-        struct ibv_sge send_sge = {
-            .addr = (uint64_t)rdma_send_buf,
-            .length = msg_size,
-            .lkey = ctx->mr->lkey
-        };
+        // The terminating NUL goes on the wire as well
+        combine_append(ctx, &c, rdma_seps + 4, 1, ctx->mr->lkey, BUFFER_SIZE);
+
+        log_debug("server: combined message: '%s'", (char*)recv_buf);
+        TRACE_END("combine", -1);
+        TRACE_BEGIN("send", -1);
+
+        // Send combined message to all clients, gathered straight from the blocks
+        // when possible, otherwise from one contiguous registered copy
+        int ret = 0;
+        if (mcast_active(ctx)) {
+            ret = mcast_broadcast(ctx, recv_buf, c.len);
+        } else {
+            bool gather = ctx->transport == RDMA_TRANSPORT_RC && c.fits;
+            const char *src = recv_buf;
+            uint32_t lkey;
+            if (!gather && !find_lkey(ctx, recv_buf, c.len, &lkey)) {
+                memcpy(rdma_combined, recv_buf, c.len);
+                src = rdma_combined;
+                lkey = ctx->mr->lkey;
+            }
 
-        struct ibv_send_wr send_wr = {
-            .wr_id = 1,
-            .sg_list = &send_sge,
-            .num_sge = 1,
-            .opcode = IBV_WR_SEND,
-            .send_flags = IBV_SEND_SIGNALED
-        };
+            // Peers get the result in the order they became ready, the
+            // longest waiting first
+            for (int k = 0; k < ctx->num_peers && ret == 0; k++) {
+                int i = ctx->ready_order[k];
+                ret = gather ? post_send_sgl(ctx, i, c.sgl, c.num_sge, false)
+                             : post_send(ctx, i, src, c.len, lkey, false);
+            }
+            for (int k = 0; k < ctx->num_peers; k++) {
+                if (wait_sends(ctx, ctx->ready_order[k]) < 0) ret = -1;
+            }
+        }
+
+        TRACE_END("send", -1);
+
+        // The sends gathered from the slots, only now can they return to the SRQ
+        for (int i = 0; i < ctx->num_peers; i++) {
+            int slot = pop_recv(&ctx->peers[i], ctx->slots);
+            if (ret == 0) {
+                stat_op(&ctx->peers[i], RDMA_OP_ALLTOALL, ctx->slots[slot].len + c.len, start);
+            }
+            release_slot(ctx, slot);
+        }
+        if (ret < 0) return -1;
+
+    } else {
+        log_debug("client: sending message: '%s'", (char*)send_buf);
 
-        struct ibv_send_wr *bad_send_wr;
-        if (ibv_post_send(ctx->peers[0].qp, &send_wr, &bad_send_wr)) {
-            set_error("Failed to send");
+        // Send our message to server, the combined reply lands in the SRQ
+        TRACE_BEGIN("send", 0);
+        if (post_send(ctx, 0, own, msg_size, own_lkey, false) < 0) {
             return -1;
         }
 
         // Wait for send completion
-        struct ibv_wc wc;
-        while (ibv_poll_cq(ctx->cq, 1, &wc) == 0);
-        if (wc.status != IBV_WC_SUCCESS) {
-            set_error("Send failed with status: %d", wc.status);
+        if (wait_sends(ctx, 0) < 0) {
             return -1;
         }
+        TRACE_END("send", 0);
+        TRACE_BEGIN("recv", 0);
 
         // Wait for receive of combined message
-        while (ibv_poll_cq(ctx->cq, 1, &wc) == 0);
-        if (wc.status != IBV_WC_SUCCESS) {
-            set_error("Receive failed with status: %d", wc.status);
-            return -1;
-        }
+        size_t len;
+        if (mcast_active(ctx)) {
+            int ret = mcast_recv(ctx, recv_buf, BUFFER_SIZE);
+            if (ret < 0) {
+                return -1;
+            }
+            len = ret;
+        } else {
+            if (wait_recv(ctx, 0) < 0) {
+                return -1;
+            }
+            int slot = pop_recv(&ctx->peers[0], ctx->slots);
 
-        // Copy combined result to client's receive buffer
-        memcpy(recv_buf, rdma_recv_buf, BUFFER_SIZE);
-        printf("CLIENT: Received combined: '%s'\n", (char*)recv_buf);
+            // Copy combined result to client's receive buffer
+            len = ctx->slots[slot].len < BUFFER_SIZE ? ctx->slots[slot].len : BUFFER_SIZE;
+            memcpy(recv_buf, slot_data(ctx, slot), len);
+            release_slot(ctx, slot);
+        }
+        log_debug("client: received combined: '%s'", (char*)recv_buf);
+        TRACE_END("recv", 0);
+        stat_op(&ctx->peers[0], RDMA_OP_ALLTOALL, msg_size + len, start);
     }
 
+    TRACE_END("alltoall", -1);
     return 0;
 }
 
@@ -767,12 +2143,28 @@ int rdma_disconnect_peer(rdma_context *ctx, int peer_idx) {
         peer->sock = -1;
     }
 
-    // Destroy QP
-    if (peer->qp) {
-        ibv_destroy_qp(peer->qp);
-        peer->qp = NULL;
+    // Return the QPs to the pools for the next connection once their work
+    // flushed, relays for the peer are dropped in the meantime
+    peer->state = RDMA_CONN_INIT;
+    release_peer_qps(ctx, peer);
+
+    if (peer->ud) {
+        ud_remove_peer(ctx, peer);
     }
 
+    // Return unconsumed messages to the SRQ
+    int slot;
+    while ((slot = pop_recv(peer, ctx->slots)) >= 0) {
+        release_slot(ctx, slot);
+    }
+    while ((slot = pop_ctrl(peer, ctx->slots)) >= 0) {
+        release_slot(ctx, slot);
+    }
+
+    // Only sends of a QP destroyed without a flush can still be counted
+    peer->send_inflight = 0;
+    peer->ctrl_inflight = 0;
+    peer->post_head = peer->post_tail;
     peer->state = RDMA_CONN_INIT;
     return 0;
 }
@@ -781,27 +2173,97 @@ int rdma_disconnect_peer(rdma_context *ctx, int peer_idx) {
 void rdma_cleanup(rdma_context *ctx) {
     if (!ctx) return;
 
+    // The trace names the rank after its peers, write it before they go
+    trace_cleanup(ctx);
+
+    // Serve outstanding multicast repairs while the peers are still connected
+    mcast_cleanup(ctx);
+
     // Disconnect all peers
     for (int i = 0; i < ctx->num_peers; i++) {
         rdma_disconnect_peer(ctx, i);
     }
+    plan_cleanup(ctx);
+    codec_cleanup(ctx);
+    comm_cleanup(ctx);
+    qp_pool_cleanup(&ctx->ctrl_pool);
+    qp_pool_cleanup(&ctx->qp_pool);
+    rate_cleanup(ctx);
 
     // Cleanup RDMA resources
+    ud_cleanup(ctx);
+    atomic_cleanup(ctx);
+    if (ctx->srq) {
+        ibv_destroy_srq(ctx->srq);
+    }
+    if (ctx->srq_mr) {
+        ibv_dereg_mr(ctx->srq_mr);
+    }
+    free(ctx->srq_buf);
+    free(ctx->slots);
+    for (int i = 0; i < ctx->num_peers; i++) {
+        free(ctx->peers[i].post_ns);
+    }
+    free(ctx->peers);
+    free(ctx->ready_order);
+    free(ctx->ready_delays);
+    free(ctx->qpn_map);
+    for (int i = 0; i < ctx->num_user_mrs; i++) {
+        ibv_dereg_mr(ctx->user_mrs[i]);
+    }
+    free(ctx->user_mrs);
     if (ctx->mr) {
         ibv_dereg_mr(ctx->mr);
     }
     if (ctx->comm_buf) {
         free(ctx->comm_buf);
     }
-    if (ctx->cq) {
-        ibv_destroy_cq(ctx->cq);
-    }
+    ts_destroy_cq(ctx);
     if (ctx->pd) {
         ibv_dealloc_pd(ctx->pd);
     }
     if (ctx->context) {
         ibv_close_device(ctx->context);
     }
+    numa_cleanup(ctx);
 
     free(ctx);
-}
\ No newline at end of file
+}
+
+// Snapshot the statistics of the context and every peer
+int rdma_get_stats(rdma_context *ctx, rdma_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->cq_polls = __atomic_load_n(&ctx->cq_polls, __ATOMIC_RELAXED);
+    stats->empty_polls = __atomic_load_n(&ctx->empty_polls, __ATOMIC_RELAXED);
+    stats->posted_recvs = __atomic_load_n(&ctx->posted_recvs, __ATOMIC_RELAXED);
+
+    if (ctx->num_peers == 0) return 0;
+
+    stats->peers = malloc(ctx->num_peers * sizeof(*stats->peers));
+    if (!stats->peers) {
+        set_error("Failed to allocate statistics snapshot");
+        return -1;
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        memcpy(&stats->peers[i], &ctx->peers[i].stats, sizeof(stats->peers[i]));
+    }
+    stats->num_peers = ctx->num_peers;
+    return 0;
+}
+
+// Release a statistics snapshot
+void rdma_free_stats(rdma_stats *stats) {
+    free(stats->peers);
+    stats->peers = NULL;
+    stats->num_peers = 0;
+}
+
+// Zero all statistics
+void rdma_reset_stats(rdma_context *ctx) {
+    ctx->cq_polls = 0;
+    ctx->empty_polls = 0;
+    ctx->posted_recvs = 0;
+    for (int i = 0; i < ctx->num_peers; i++) {
+        memset(&ctx->peers[i].stats, 0, sizeof(ctx->peers[i].stats));
+    }
+}
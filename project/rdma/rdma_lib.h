@@ -4,16 +4,178 @@
 #include <infiniband/verbs.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Constants for RDMA settings
-#define MAX_PEERS 64
+#define PEER_TABLE_INIT 16    // Initial peer table capacity, grows on demand
 #define DEFAULT_PORT 1
-#define MAX_SGE 1
+#define MAX_SGE 16            // Gather entries per send, clamped to the device limit
 #define MAX_WR 128
+#define QP_POOL_SIZE 16       // Released RC QPs kept in INIT for the next connection
 #define CQ_DEPTH 256
 #define MAX_INLINE_DATA 256
+#define CTRL_WR 16            // Send queue depth of a peer's control QP
+#define RDMA_CTRL_MAX_MSG MAX_INLINE_DATA   // Control messages are always sent inline
 #define BUFFER_SIZE 4096
 
+// Shared receive queue settings
+#define SRQ_DEPTH 512                 // Receive slots shared by all peers
+#define SRQ_LIMIT 64                  // Low watermark that arms SRQ_LIMIT_REACHED
+#define RECV_SLOT_SIZE BUFFER_SIZE    // Size of a single receive slot
+
+// Unreliable Datagram transport settings
+#define UD_WINDOW 64                  // Unacknowledged datagrams per peer
+#define UD_SEND_SLOTS 256             // Retransmit buffers shared by all peers
+#define UD_RTO_US 2000                // Initial retransmit timeout
+#define UD_RTO_MAX_US 100000          // Retransmit timeout backoff cap
+#define UD_MAX_RETRIES 20             // Retransmits before a peer is declared dead
+
+// Multicast broadcast settings
+#define MCAST_HISTORY 4               // Broadcasts the root keeps for repair
+#define MCAST_MAX_FRAGS 32            // Datagrams per multicast broadcast
+#define MCAST_NACK_US 500             // Receiver silence before asking for a repair
+
+// Timeline trace settings
+#define TRACE_RING_EVENTS 65536       // Events kept per thread, older ones are overwritten
+
+// Persistent plan settings
+#define RDMA_MAX_PLANS 256            // Plan ids travel in 8 bits of an immediate
+#define RDMA_PLAN_MAX_WINDOW 4096     // Stages a windowed plan may keep in flight
+
+// Sequential all-to-all settings
+#define STRAGGLER_FACTOR 4            // Arrival delay over the median that marks a straggler
+#define STRAGGLER_MIN_US 20           // Delays below this never make a straggler
+
+// Rate limit settings
+#define RATE_DEFAULT_BURST 65536      // Bytes a rate limited sender may send back to back
+
+// Communicator settings
+#define RDMA_MAX_COMMS 1024           // Communicator ids travel in 10 bits of an immediate
+#define RDMA_COMM_MAX_RANKS 1024      // World ranks travel in 10 bits of an immediate
+#define RDMA_COMM_UNDEFINED (-1)      // Split color of ranks that join no communicator
+
+// Allreduce settings
+#define RDMA_REDUCE_MAX_ELEM 64       // Largest element of a custom reduction
+
+// Remote atomics settings
+#define ATOMIC_WINDOW_SIZE 4096       // Bytes of each context open to remote atomics
+#define RDMA_HOME_SELF -1             // Peer index of the calling rank's own window
+
+// Transport used for all peers of a context
+typedef enum {
+    RDMA_TRANSPORT_RC,      // One reliable connected QP per peer
+    RDMA_TRANSPORT_UD       // One datagram QP per context, reliability in software
+} rdma_transport;
+
+// Runtime queue depths and thresholds of a context. The defaults are the
+// constants above; a profile written by rdma_tune, rdma_init_attr and the
+// RDMA_<KEY> environment variables replace them
+typedef struct {
+    uint32_t send_wr;       // Send queue depth of bulk QPs (MAX_WR)
+    uint32_t cq_depth;      // CQ entries on top of one per receive slot (CQ_DEPTH)
+    uint32_t srq_depth;     // Receive slots, clamped to the device (SRQ_DEPTH)
+    uint32_t inline_size;   // Bulk sends up to this size go inline (0: none)
+    uint32_t chunk_size;    // Chunk of streamed sends (0: rdma_max_msg_size)
+    uint32_t qp_pool;       // RC QPs created up front for later connections
+} rdma_tuning;
+
+// One key of a tuning profile, shared by the profile parser and rdma_tune
+typedef struct {
+    const char *key;        // Name in a profile
+    const char *env;        // Environment override, RDMA_ and the key in upper case
+    size_t field;           // Offset of the uint32_t in rdma_tuning
+    uint32_t min;
+    uint32_t max;
+} rdma_tuning_key;
+
+// Element types and reductions of rdma_allreduce
+typedef enum {
+    RDMA_DTYPE_FLOAT32,
+    RDMA_DTYPE_FLOAT64,
+    RDMA_DTYPE_INT32,
+    RDMA_DTYPE_INT64,
+    RDMA_DTYPE_COUNT
+} rdma_dtype;
+
+typedef enum {
+    RDMA_REDUCE_SUM,
+    RDMA_REDUCE_PROD,
+    RDMA_REDUCE_MIN,
+    RDMA_REDUCE_MAX
+} rdma_reduce_op;
+
+// Placement of the threads and memory of a context (rdma_init_attr.affinity)
+typedef enum {
+    RDMA_AFFINITY_NONE,     // Wherever the scheduler and first touch put them
+    RDMA_AFFINITY_NODE,     // Pinned to the CPUs of the NIC's NUMA node, memory on that node
+    RDMA_AFFINITY_CORE      // Memory on the NIC's node, rdma_pin_thread takes one NIC-local core
+} rdma_affinity;
+
+// Where the NIC, the calling thread and the NIC's interrupts are placed
+typedef struct {
+    char device[64];
+    rdma_affinity affinity;
+    int numa_node;          // Node of the NIC, -1 if unknown
+    int local_cpus;         // CPUs local to the NIC
+    char local_cpulist[256];
+    char thread_cpulist[256];   // CPUs the calling thread may run on
+    int thread_cpu;         // CPU the calling thread runs on now
+    bool memory_bound;      // Allocations of the context's thread prefer the NIC's node
+    int irqs;               // Interrupt vectors of the NIC
+    int irqs_local;         // Vectors bound to NIC-local CPUs only
+    int irqs_on_thread;     // Vectors that may fire on the thread's CPUs
+} rdma_placement;
+
+// Clock that timestamps completions (rdma_init_attr.timestamps)
+typedef enum {
+    RDMA_TS_OFF,            // Completions are not timestamped
+    RDMA_TS_HOST,           // Host clock read when a batch of completions is polled
+    RDMA_TS_DEVICE          // NIC completion timestamps converted to the host clock
+} rdma_ts_source;
+
+// Codec of coded sends and broadcasts (rdma_set_codec)
+typedef enum {
+    RDMA_CODEC_NONE,
+    RDMA_CODEC_LZ,          // Lossless LZ77 block codec with LZ4-style sequences
+    RDMA_CODEC_SHUFFLE_RLE, // Lossless byte shuffle of 32-bit words and run-length coding
+    RDMA_CODEC_FP16,        // Lossy, float32 arrays as IEEE half
+    RDMA_CODEC_BF16,        // Lossy, float32 arrays as bfloat16
+    RDMA_CODEC_INT8,        // Lossy, float32 arrays as int8 with one scale per chunk
+    RDMA_CODEC_TOPK,        // Lossy, the largest-magnitude float32 values of each chunk
+    RDMA_CODEC_COUNT
+} rdma_codec;
+
+typedef struct {
+    rdma_codec codec;
+    bool always;            // Lossless codecs: compress even when the link is faster
+    float topk_ratio;       // Fraction of values RDMA_CODEC_TOPK keeps (0: 1%)
+} rdma_codec_attr;
+
+// Codec activity and the estimates behind the lossless on/off decision
+typedef struct {
+    uint64_t raw_bytes;     // Bytes handed to coded sends and broadcasts
+    uint64_t wire_bytes;    // Bytes sent for them, chunk headers included
+    uint64_t chunks;
+    uint64_t compressed_chunks;
+    double link_gbps;       // Measured from streams sent raw
+    double encode_gbps;     // Measured from streams sent encoded
+    double ratio;           // Encoded / raw bytes
+    bool active;            // The configured codec is currently applied
+} rdma_codec_stats;
+
+// Packet priority of a channel. On RoCE the traffic class carries the DSCP
+// (dscp << 2) and switches map it to a priority; on InfiniBand the service
+// level selects the virtual lane
+typedef struct {
+    uint8_t traffic_class;
+    uint8_t sl;
+} rdma_channel_attr;
+
 // Connection states
 typedef enum {
     RDMA_CONN_INIT,
@@ -30,64 +192,547 @@ typedef struct {
     uint8_t gid[16];
     char ip[16];
     int port;
+    uint32_t peer_id;       // Index under which the sender tracks the receiver
+    uint64_t atomic_addr;   // Atomic window of the sender (0 if unavailable)
+    uint32_t atomic_rkey;
+    uint32_t ctrl_qp_num;   // Control QP of the sender (RC transport only)
 } rdma_conn_info;
 
+// Operation kinds tracked by the statistics
+typedef enum {
+    RDMA_OP_SEND,           // rdma_send / rdma_sendv
+    RDMA_OP_RECV,           // rdma_recv / rdma_recvv / rdma_broadcast_recv
+    RDMA_OP_BCAST,          // rdma_broadcast, counted for every receiving peer
+    RDMA_OP_ALLTOALL,       // rdma_sequential_alltoall, counted for every peer
+    RDMA_OP_ATOMIC,         // Atomics and accesses to a peer's atomic window
+    RDMA_OP_COUNT
+} rdma_op;
+
+#define RDMA_HIST_BUCKETS 32  // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+
+// Counters of one operation kind
+typedef struct {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t latency_hist[RDMA_HIST_BUCKETS];
+} rdma_op_stats;
+
+// Counters of one peer
+typedef struct {
+    rdma_op_stats ops[RDMA_OP_COUNT];
+    uint64_t posted_wrs;    // Send work requests posted towards the peer
+    uint64_t empty_polls;   // CQ polls that found nothing while waiting on the peer
+    uint64_t rnr_events;    // Sends that ran out of RNR retries
+    uint64_t retransmits;   // Datagrams sent again after a timeout (UD transport)
+    uint64_t reconnects;    // Connections restored from the cached connection info
+    uint64_t connect_ns;    // Duration of the latest connection setup
+    uint64_t straggles;     // All-to-alls in which the peer was flagged as a straggler
+    uint64_t paced_ns;      // Time sends waited for the software rate limit
+    // Timestamp mode only, same bucketing as latency_hist
+    uint64_t wire_hist[RDMA_HIST_BUCKETS];      // RC send post to its completion
+    uint64_t deliver_hist[RDMA_HIST_BUCKETS];   // Receive completion to the application
+} rdma_peer_stats;
+
+// Snapshot returned by rdma_get_stats
+typedef struct {
+    uint64_t cq_polls;
+    uint64_t empty_polls;
+    uint64_t posted_recvs;  // Receive WRs posted to the SRQ
+    int num_peers;
+    rdma_peer_stats *peers; // Released with rdma_free_stats
+} rdma_stats;
+
+#define RDMA_MAX_HW_COUNTERS 128  // Raw sysfs counters kept per snapshot
+
+// One counter file of the port's 'counters' or 'hw_counters' directory
+typedef struct {
+    char name[48];
+    uint64_t value;
+} rdma_hw_counter;
+
+// Port and hardware counters together with the library statistics, taken by
+// rdma_read_counters. The summary sums whichever counters the driver exposes
+// (rxe and mlx5 name them differently) and stays 0 where none exist
+typedef struct {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC, elapsed time in a delta
+    bool hw_available;      // False if sysfs exposes no counters for the port
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t rx_packets;
+    uint64_t retransmits;   // Requests sent again after an ACK timeout or an RNR NAK
+    uint64_t rnr_naks;
+    uint64_t out_of_sequence;   // Packets received out of sequence
+    uint64_t cnp_sent;      // Congestion notifications sent as notification point
+    uint64_t cnp_handled;   // Congestion notifications the sender slowed down for
+    uint64_t ecn_marked;    // Received packets carrying an ECN mark
+    int num_raw;
+    rdma_hw_counter raw[RDMA_MAX_HW_COUNTERS];
+    rdma_stats lib;         // Released with rdma_free_counters
+} rdma_counters;
+
+struct rdma_ud_peer;
+struct rdma_ud_ctx;
+struct rdma_mcast_ctx;
+struct rdma_clock_ctx;
+struct rdma_codec_ctx;
+struct rdma_pacer;
+struct rdma_comm_ctx;
+struct rdma_numa_ctx;
+typedef struct rdma_plan rdma_plan;
+typedef struct rdma_comm rdma_comm;
+typedef struct rdma_bucketer rdma_bucketer;
+
+// Custom reduction: dst[i] = dst[i] op src[i] for 'count' elements. 'src'
+// points into a receive slot and need not be aligned for the element type
+typedef void (*rdma_reduce_fn)(void *dst, const void *src, size_t count, void *arg);
+
 // Per-peer connection context
 typedef struct {
-    struct ibv_qp *qp;
+    struct ibv_qp *qp;      // Bulk data QP
+    struct ibv_qp *ctrl_qp; // Control message QP (RC transport only)
     rdma_conn_info local_info;
     rdma_conn_info remote_info;
     rdma_conn_state state;
     int sock;
+    int recv_head;          // First received slot not yet consumed (-1 if none)
+    int recv_tail;          // Last received slot not yet consumed (-1 if none)
+    int send_inflight;      // Signaled sends not yet completed
+    int ctrl_head;          // First received control message not yet consumed (-1 if none)
+    int ctrl_tail;
+    int ctrl_inflight;      // Control messages not yet completed
+    bool dialed;            // This side opened the connection and starts reconnects
+    uint64_t ready_ns;      // Arrival of its block in the running all-to-all (0: pending)
+    uint64_t delay_ewma_ns; // Smoothed arrival delay of its all-to-all blocks
+    struct rdma_ud_peer *ud;    // Datagram reliability state (UD transport only)
+    struct rdma_pacer *pacer;   // Send rate limit of the peer (rdma_set_rate_limit)
+    rdma_peer_stats stats;
+    uint64_t *post_ns;      // Post times of in-flight sends (timestamp mode)
+    unsigned post_head;
+    unsigned post_tail;
 } rdma_peer_conn;
 
+// Receive slot backing one shared receive queue entry
+typedef struct {
+    uint32_t len;           // Payload bytes received into the slot
+    uint16_t offset;        // Payload offset from the slot base
+    bool more;              // Further chunks of the same message follow
+    bool ctrl;              // Arrived on the control channel
+    uint32_t imm;           // Routing of a communicator message
+    int next;               // Next slot in the free list or a peer's receive queue
+    uint64_t arrival_ns;    // Completion time in timestamp mode, 0 otherwise
+} rdma_recv_slot;
+
+// Idle RC QPs in INIT state, taken by new connections
+typedef struct {
+    struct ibv_qp **qps;
+    int len;
+    int cap;
+} rdma_qp_pool;
+
 // Main RDMA context
 typedef struct {
     struct ibv_context *context;
     struct ibv_pd *pd;
     struct ibv_cq *cq;
+    struct ibv_cq_ex *cq_ex;    // Extended CQ behind 'cq' with device timestamps
+    struct rdma_clock_ctx *clock;
+    rdma_ts_source ts_source;
     struct ibv_port_attr port_attr;
     struct ibv_mr *mr;
-    rdma_peer_conn peers[MAX_PEERS];
+    struct ibv_device_attr dev_attr;
+    int max_send_sge;       // Gather entries per RC send supported by the device
+    struct ibv_mr **user_mrs;   // Application buffers registered with rdma_reg_buffer
+    int num_user_mrs;
+    int user_mr_cap;
+    rdma_peer_conn *peers;
+    int peer_cap;
+    int *qpn_map;           // Open addressing table: QP number -> peer index
+    rdma_qp_pool qp_pool;   // Bulk QPs
+    rdma_qp_pool ctrl_pool; // Control QPs
+    uint32_t drain_qpn;     // QP flushing on its way into a pool, 0 otherwise
+    rdma_channel_attr ctrl_class;
+    rdma_channel_attr bulk_class;
+    int *ready_order;       // All-to-all scratch: peers in arrival order (peer_cap entries)
+    uint64_t *ready_delays; // All-to-all scratch: arrival delays (peer_cap entries)
+    int qpn_map_cap;
+    struct ibv_srq *srq;
+    struct ibv_mr *srq_mr;
+    void *srq_buf;
+    rdma_recv_slot *slots;
+    int srq_depth;
+    int srq_posted;         // Slots currently posted to the SRQ
+    int free_slots;         // Head of the free slot list (-1 if empty)
+    unsigned idle_polls;    // Empty CQ polls, paces async event checks
+    uint64_t cq_polls;      // Statistics not tied to a single peer
+    uint64_t empty_polls;
+    uint64_t posted_recvs;
+    rdma_transport transport;
+    struct ibv_qp *ud_qp;   // Datagram QP shared by all peers (UD transport only)
+    struct rdma_ud_ctx *ud;
+    struct ibv_qp *mcast_qp;    // Multicast UD QP (after rdma_mcast_enable)
+    struct rdma_mcast_ctx *mcast;
+    rdma_plan **plans;      // Persistent plans by id (RDMA_MAX_PLANS entries)
+    struct rdma_codec_ctx *codec;   // Coded send state, created on first use
+    struct rdma_pacer *pacer;   // Send rate limit of the whole context
+    struct rdma_comm_ctx *comm; // Communicator inboxes and relays (RC transport only)
+    struct rdma_numa_ctx *numa; // NIC placement (rdma_init_attr.affinity)
+    void *atomic_buf;       // Atomic window followed by a local scratch area
+    struct ibv_mr *atomic_mr;
     void *comm_buf;
     size_t buf_size;
+    size_t chunk_size;      // Chunk of streamed sends, 0 for rdma_max_msg_size
     int num_peers;
     bool is_server;
     char ip[16];
     int port;
     int dev_port;
+    rdma_tuning tune;       // Effective tuning (rdma_get_tuning)
 } rdma_context;
 
+// Context creation attributes
+typedef struct {
+    const char *ip;
+    int port;
+    size_t buf_size;
+    bool is_server;
+    rdma_transport transport;
+    bool timestamps;        // Timestamp completions, the NIC clock if available
+    size_t chunk_size;      // Chunk of sends above rdma_max_msg_size (0: the tuning)
+    int qp_pool;            // RC QPs created up front (0: the tuning)
+    rdma_channel_attr ctrl; // Priority of control messages, barriers and atomics
+    rdma_channel_attr bulk; // Priority of everything else
+    rdma_affinity affinity; // Thread and memory placement, RDMA_AFFINITY overrides it
+    bool steer_irqs;        // Also move the NIC's interrupts to its local CPUs (needs root)
+    const char *profile;    // Tuning profile to load (NULL: $RDMA_PROFILE, if set)
+    const rdma_tuning *tuning;  // Tuning that replaces the profile (NULL: none)
+} rdma_init_attr;
+
+// Queued (MCS-style) lock kept in the atomic window of its home peer.
+// Layout at 'offset': the queue tail followed by one {locked, next} node per
+// rank, the home's included
+#define RDMA_LOCK_SIZE(ranks) (sizeof(uint64_t) * (1 + 2 * (size_t)(ranks)))
+
+typedef struct {
+    int home;               // Peer index of the rank holding the lock words, or RDMA_HOME_SELF
+    size_t offset;          // Window offset of the lock words
+    uint64_t id;            // Queue node of this rank (1-based, 0 means none)
+} rdma_lock;
+
+// Work queue owned by one rank and drained by the others with remote atomics.
+// Layout at 'offset': head, tail and 'capacity' task words
+#define RDMA_WORKQ_SIZE(capacity) (sizeof(uint64_t) * (2 + (size_t)(capacity)))
+
+typedef struct {
+    int home;               // Peer index of the owner, RDMA_HOME_SELF on the owner itself
+    size_t offset;          // Window offset of the queue words
+    uint32_t capacity;
+} rdma_workq;
+
 // Public API Functions
 
 // Initialize RDMA context
 rdma_context* rdma_init(const char *ip, int port, size_t buf_size, bool is_server);
 
+// Initialize RDMA context with explicit attributes
+rdma_context* rdma_init_ex(const rdma_init_attr *attr);
+
 // Connect to a peer (client side)
 int rdma_connect_peer(rdma_context *ctx, const char *peer_ip, int peer_port);
 
-// Accept a peer connection (server side)
+// Accept a peer connection (server side), returns the index of a known peer
+// that reconnects and a new index otherwise
 int rdma_accept_peer(rdma_context *ctx);
 
-// Send data to a peer
+// Reconnect a disconnected peer with the connection info cached from its
+// first connection. Only the side that connected can reconnect, the other
+// side serves it with rdma_accept_peer. Returns peer_idx
+int rdma_reconnect_peer(rdma_context *ctx, int peer_idx);
+
+// Send data to a peer. Messages above rdma_max_msg_size are streamed in
+// chunks through the bounce buffers in comm_buf and arrive as one message
 int rdma_send(rdma_context *ctx, int peer_idx, const void *data, size_t len);
 
 // Receive data from a peer
 int rdma_recv(rdma_context *ctx, int peer_idx, void *data, size_t max_len);
 
+// Send one message gathered from several buffers. Buffers registered with
+// rdma_reg_buffer are read by the NIC directly, others are staged in comm_buf
+int rdma_sendv(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt);
+
+// Receive one message scattered over several buffers
+int rdma_recvv(rdma_context *ctx, int peer_idx, const struct iovec *iov, int iovcnt);
+
+// Register application memory so sends can gather from it without a copy
+int rdma_reg_buffer(rdma_context *ctx, void *addr, size_t len);
+
+// Deregister memory registered with rdma_reg_buffer
+int rdma_dereg_buffer(rdma_context *ctx, void *addr);
+
 // Broadcast data to all peers
 int rdma_broadcast(rdma_context *ctx, const void *data, size_t len);
 
+// Receive a message sent with rdma_broadcast by the server
+int rdma_broadcast_recv(rdma_context *ctx, void *data, size_t max_len);
+
+// Switch broadcasts to hardware multicast, collective over server and clients.
+// Returns 1 if multicast is used, 0 if broadcasts stay unicast, -1 on error
+int rdma_mcast_enable(rdma_context *ctx);
+
+// Largest message delivered in a single receive slot, larger sends are chunked
+size_t rdma_max_msg_size(rdma_context *ctx);
+
+// Block until the server and all of its clients have entered the barrier
+int rdma_barrier(rdma_context *ctx);
+
 // Perform sequential all-to-all communication
 int rdma_sequential_alltoall(rdma_context *ctx, const void *send_buf, void *recv_buf, size_t msg_size);
 
+// Get the local atomic window (ATOMIC_WINDOW_SIZE bytes), NULL if unavailable
+void *rdma_atomic_window(rdma_context *ctx);
+
+// Atomically add to a 64-bit word of a peer's atomic window, returning its old value.
+// RDMA_HOME_SELF works on our own window with CPU atomics; as the NIC's
+// atomics must exclude them, the device has to report IBV_ATOMIC_GLOB
+int rdma_fetch_add(rdma_context *ctx, int peer_idx, size_t offset, uint64_t add, uint64_t *old);
+
+// Atomically swap a 64-bit word of a peer's atomic window if it equals 'compare'
+int rdma_cmp_swap(rdma_context *ctx, int peer_idx, size_t offset,
+                  uint64_t compare, uint64_t swap, uint64_t *old);
+
+// Draw the next value of a global ticket counter kept by 'home'
+int rdma_ticket_next(rdma_context *ctx, int home, size_t offset, uint64_t *ticket);
+
+// Distributed lock whose words live at 'offset' in the window of 'home', with
+// a queue node for each of 'max_ranks' ranks counting the home
+int rdma_lock_init(rdma_context *ctx, rdma_lock *lock, int home, size_t offset, int max_ranks);
+int rdma_lock_acquire(rdma_context *ctx, rdma_lock *lock);
+int rdma_lock_release(rdma_context *ctx, rdma_lock *lock);
+
+// Work-stealing queue: the owner pushes locally, other ranks steal with remote
+// atomics. Push and steal return 1 on success, 0 if full/empty, -1 on error
+int rdma_workq_init(rdma_context *ctx, rdma_workq *q, int home, size_t offset, uint32_t capacity);
+int rdma_workq_push(rdma_context *ctx, const rdma_workq *q, uint64_t task);
+int rdma_workq_steal(rdma_context *ctx, const rdma_workq *q, uint64_t *task);
+
+// Send and receive a control message of up to RDMA_CTRL_MAX_MSG bytes. Control
+// messages use their own QP and traffic class, never wait behind bulk sends
+// and are received apart from the messages of rdma_recv
+int rdma_send_ctrl(rdma_context *ctx, int peer_idx, const void *data, size_t len);
+int rdma_recv_ctrl(rdma_context *ctx, int peer_idx, void *data, size_t max_len);
+
 // Disconnect a peer
 int rdma_disconnect_peer(rdma_context *ctx, int peer_idx);
 
 // Clean up RDMA context and resources
 void rdma_cleanup(rdma_context *ctx);
 
+// Snapshot the per-peer, per-operation statistics
+int rdma_get_stats(rdma_context *ctx, rdma_stats *stats);
+
+// Release a snapshot taken with rdma_get_stats
+void rdma_free_stats(rdma_stats *stats);
+
+// Zero all statistics
+void rdma_reset_stats(rdma_context *ctx);
+
+// Create a persistent all-to-all plan for repeated stages of fixed 'size' byte
+// blocks (collective over the server and all clients, RC only). Buffers are
+// registered and work requests built once. After a stage recv_buf holds the
+// block of every rank: the server is rank 0, clients follow its peer order,
+// so recv_len must be at least (clients + 1) * size bytes. A rank that cannot
+// take part, a smaller buffer included, refuses the plan and the call then
+// fails on every rank instead of leaving the others waiting
+int rdma_alltoall_init(rdma_context *ctx, const void *send_buf, void *recv_buf, size_t recv_len,
+                       size_t size, rdma_plan **plan);
+
+// Create a plan that keeps up to 'window' stages in flight. The plan owns a
+// send and a receive slot per stage: fill rdma_plan_send_buf before every
+// rdma_plan_start, read rdma_plan_result after every rdma_plan_wait
+int rdma_alltoall_init_window(rdma_context *ctx, size_t size, int window, rdma_plan **plan);
+
+// Start a stage, its send block must not change until the stage is waited
+// for. Fails when 'window' stages are already in flight
+int rdma_plan_start(rdma_plan *plan);
+
+// Complete the oldest stage in flight, stages complete in start order
+int rdma_plan_wait(rdma_plan *plan);
+
+// Send block of the next stage to start
+void *rdma_plan_send_buf(rdma_plan *plan);
+
+// Blocks of all ranks from the last completed stage, valid until 'window'
+// more stages have started
+const void *rdma_plan_result(rdma_plan *plan);
+
+// Stages started and not yet waited for
+int rdma_plan_inflight(const rdma_plan *plan);
+
+// Rank of this process in the plan and number of ranks
+int rdma_plan_rank(const rdma_plan *plan);
+int rdma_plan_num_ranks(const rdma_plan *plan);
+
+// Release a plan, no stage may be in flight
+void rdma_plan_free(rdma_plan *plan);
+
+// Codec applied by the coded sends and broadcasts of this context, NULL for
+// none. Receivers decode whatever codec each chunk names
+int rdma_set_codec(rdma_context *ctx, const rdma_codec_attr *attr);
+
+// Send, receive and broadcast messages of any length as chunks encoded with
+// the context's codec. Encoding overlaps transmission; lossy codecs need
+// float32 data. Receives return the decoded length
+int rdma_send_coded(rdma_context *ctx, int peer_idx, const void *data, size_t len);
+int rdma_recv_coded(rdma_context *ctx, int peer_idx, void *data, size_t max_len);
+int rdma_broadcast_coded(rdma_context *ctx, const void *data, size_t len);
+int rdma_broadcast_recv_coded(rdma_context *ctx, void *data, size_t max_len);
+
+// Codec counters and link/encoder estimates of the context
+int rdma_get_codec_stats(rdma_context *ctx, rdma_codec_stats *stats);
+
+// Cap the send rate towards a peer, or of the whole context with peer_idx -1,
+// in bytes per second (0 removes the limit). 'burst' bytes may leave back to
+// back (0: RATE_DEFAULT_BURST). Returns 1 if the NIC paces the traffic and 0 if
+// the library holds sends back itself
+int rdma_set_rate_limit(rdma_context *ctx, int peer_idx, uint64_t bytes_per_sec, uint32_t burst);
+
+// Communicator of the server (rank 0) and all of its clients (peer index + 1
+// on the server), collective over all of them. Communicators share the
+// device, QPs and receive slots of the context but never see each other's
+// messages. Threads may use different communicators of one context at the
+// same time; everything else about a context stays single threaded. RC only
+rdma_comm *rdma_comm_world(rdma_context *ctx);
+
+// Split a communicator, collective over its members: members passing the same
+// color form a new one, ranked by key and then by their rank in 'comm'. Color
+// RDMA_COMM_UNDEFINED yields NULL. Splits that share a rank must not overlap
+int rdma_comm_split(rdma_comm *comm, int color, int key, rdma_comm **newcomm);
+
+// Rank of this process in the communicator and number of members
+int rdma_comm_rank(const rdma_comm *comm);
+int rdma_comm_size(const rdma_comm *comm);
+
+// Send and receive a message of up to rdma_max_msg_size between members.
+// Receives return the message length
+int rdma_comm_send(rdma_comm *comm, int rank, const void *data, size_t len);
+int rdma_comm_recv(rdma_comm *comm, int rank, void *data, size_t max_len);
+
+// Collectives over the members of a communicator
+int rdma_comm_barrier(rdma_comm *comm);
+int rdma_comm_bcast(rdma_comm *comm, int root, void *data, size_t len);
+
+// Serve completions once, so a server in no communicator still relays
+// messages between its clients
+int rdma_comm_progress(rdma_context *ctx);
+
+// Release a communicator, the world communicator is released with its context
+void rdma_comm_free(rdma_comm *comm);
+
+// Bytes of one element, 0 for an unknown type
+size_t rdma_dtype_size(rdma_dtype dtype);
+
+// Reduce 'count' elements of every rank into 'buf' on every rank, collective
+// over the server and all clients. The server folds the contributions in
+// peer order straight out of its receive slots; register 'buf' to send it
+// without staging
+int rdma_allreduce(rdma_context *ctx, void *buf, size_t count, rdma_dtype dtype,
+                   rdma_reduce_op op);
+
+// rdma_allreduce over elements of 'esize' bytes, reduced by 'fn'
+int rdma_allreduce_fn(rdma_context *ctx, void *buf, size_t count, size_t esize,
+                      rdma_reduce_fn fn, void *arg);
+
+// Fuse many small tensors into few allreduces. Tensors are added once, in
+// backward order, and packed into registered buckets of 'bucket_bytes' (a
+// larger tensor gets a bucket of its own). Every round, mark each tensor
+// ready when its gradient is final: a bucket is reduced as soon as all of
+// its tensors are ready and every bucket before it was reduced, and the
+// result is copied back into the tensors. All ranks must add the same
+// tensors in the same order
+int rdma_bucketer_create(rdma_context *ctx, size_t bucket_bytes, rdma_dtype dtype,
+                         rdma_reduce_op op, rdma_bucketer **bucketer);
+
+// Add a tensor of 'count' elements, returns its index
+int rdma_bucketer_add(rdma_bucketer *bucketer, void *data, size_t count);
+
+// Pack a tensor into its bucket and reduce the buckets that became full
+int rdma_bucketer_ready(rdma_bucketer *bucketer, int tensor);
+
+// End a round: reduce the remaining buckets, with the current contents of
+// tensors that were not marked ready
+int rdma_bucketer_flush(rdma_bucketer *bucketer);
+
+// Buckets of the layout and allreduces issued so far
+int rdma_bucketer_num_buckets(const rdma_bucketer *bucketer);
+uint64_t rdma_bucketer_allreduces(const rdma_bucketer *bucketer);
+
+// Deregister and release the buckets
+void rdma_bucketer_free(rdma_bucketer *bucketer);
+
+// Fill in the compiled-in default tuning
+void rdma_tuning_defaults(rdma_tuning *tuning);
+
+// Read a profile of 'key = value' lines over 'tuning'; keys it leaves out
+// keep their value, unknown keys are skipped with a warning
+int rdma_load_profile(const char *path, rdma_tuning *tuning);
+
+// Write a profile, each line of 'comment' becomes a header comment
+int rdma_save_profile(const char *path, const rdma_tuning *tuning, const char *comment);
+
+// Tuning the context runs with after the profile and overrides
+int rdma_get_tuning(rdma_context *ctx, rdma_tuning *tuning);
+
+// Keys of a profile in the order rdma_save_profile writes them
+const rdma_tuning_key *rdma_tuning_keys(int *count);
+
+// Key named 'key', NULL if there is none
+const rdma_tuning_key *rdma_find_tuning_key(const char *key);
+
+// Field of 'tuning' that 'key' sets
+uint32_t *rdma_tuning_field(rdma_tuning *tuning, const rdma_tuning_key *key);
+
+// Pin the calling thread, e.g. a progress thread, to the CPUs the context
+// was placed on. In core mode this is the only way onto the core, as every
+// context of the process picks the same one. Does nothing for RDMA_AFFINITY_NONE
+int rdma_pin_thread(rdma_context *ctx);
+
+// Report the NIC's node and local CPUs, the calling thread's CPUs and memory
+// policy and where the NIC's interrupts may fire
+int rdma_get_placement(rdma_context *ctx, rdma_placement *placement);
+
+// Print a placement report
+void rdma_print_placement(FILE *out, const rdma_placement *placement);
+
+// Clock that timestamps the completions of the context
+rdma_ts_source rdma_timestamp_source(rdma_context *ctx);
+
+// Snapshot the port and hardware counters of the context's device along with
+// the library statistics. Take one before and one after a collective or
+// region and subtract them with rdma_counters_delta
+int rdma_read_counters(rdma_context *ctx, rdma_counters *counters);
+
+// Compute 'after - before'; raw counters are matched by name
+int rdma_counters_delta(const rdma_counters *before, const rdma_counters *after,
+                        rdma_counters *delta);
+
+// Release a snapshot or delta
+void rdma_free_counters(rdma_counters *counters);
+
+// Print the summary and library totals of a snapshot or delta
+void rdma_print_counters(FILE *out, const rdma_counters *counters);
+
+// Record a timeline of posts, completions and collective phases. The trace is
+// written to '<path>.rank<N>.json' (Chrome trace format) at rdma_cleanup, on
+// rdma_trace_dump, or at the next progress after SIGUSR1. RDMA_TRACE=<path>
+// in the environment enables it from rdma_init
+int rdma_trace_enable(rdma_context *ctx, const char *path);
+int rdma_trace_dump(rdma_context *ctx);
+
 // Get last error message
 const char* rdma_get_error(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* RDMA_LIB_H */
\ No newline at end of file
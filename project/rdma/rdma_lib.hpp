@@ -0,0 +1,406 @@
+#ifndef RDMA_LIB_HPP
+#define RDMA_LIB_HPP
+
+// Header-only C++17/20 interface of rdma_lib. Contexts, communicators and
+// registrations release themselves when they go out of scope, buffers are
+// spans of their element type instead of a pointer and a byte count, and
+// errors are thrown as rdma::Error with the library's message.
+//
+// Communicators and registrations must not outlive their Context, so
+// declare the Context first. Reduction kernels are instantiated for the
+// element type and operator, so a typed allreduce runs without a type or
+// operator switch.
+
+#include "rdma_lib.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace rdma {
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+// Contiguous view for C++17, the subset of std::span used here
+template <class T>
+class span {
+public:
+    constexpr span() noexcept = default;
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    template <std::size_t N>
+    constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+
+    // Temporaries only bind to spans of const elements, as with std::span
+    template <class C, class = std::enable_if_t<
+                  std::is_convertible_v<decltype(std::data(std::declval<C &>())), T *> &&
+                  (std::is_const_v<T> || std::is_lvalue_reference_v<C>)>>
+    constexpr span(C &&container) : data_(std::data(container)), size_(std::size(container)) {}
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+class Error : public std::runtime_error {
+public:
+    Error() : std::runtime_error(rdma_get_error()) {}
+    explicit Error(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Reductions of allreduce. Any other default constructible 'T op(T, T)'
+// callable works as well
+struct Sum {};
+struct Prod {};
+struct Min {};
+struct Max {};
+
+namespace detail {
+
+inline int check(int ret) {
+    if (ret < 0) throw Error();
+    return ret;
+}
+
+// Elements travel as their bytes
+template <class T>
+constexpr void check_element() {
+    static_assert(std::is_trivially_copyable_v<T>, "rdma elements must be trivially copyable");
+}
+
+// Number of whole elements in a received message
+template <class T>
+std::size_t elements(int bytes) {
+    if (bytes % sizeof(T)) {
+        throw Error("Received " + std::to_string(bytes) + " bytes, not a whole number of " +
+                    std::to_string(sizeof(T)) + " byte elements");
+    }
+    return bytes / sizeof(T);
+}
+
+// dst[i] = dst[i] op src[i], instantiated per type and operator. 'src' is a
+// receive slot and may be unaligned: byte sized types are read in place,
+// others through memcpy, which compiles to plain loads
+template <class T, class Op>
+void reduce_kernel(void *dst, const void *src, std::size_t count, void * /* arg */) {
+    T *d = static_cast<T *>(dst);
+    const unsigned char *s = static_cast<const unsigned char *>(src);
+    for (std::size_t i = 0; i < count; i++) {
+        T b;
+        if constexpr (alignof(T) == 1) {
+            b = reinterpret_cast<const T *>(s)[i];
+        } else {
+            std::memcpy(&b, s + i * sizeof(T), sizeof(T));
+        }
+
+        if constexpr (std::is_same_v<Op, Sum>) {
+            d[i] = d[i] + b;
+        } else if constexpr (std::is_same_v<Op, Prod>) {
+            d[i] = d[i] * b;
+        } else if constexpr (std::is_same_v<Op, Min>) {
+            d[i] = b < d[i] ? b : d[i];
+        } else if constexpr (std::is_same_v<Op, Max>) {
+            d[i] = d[i] < b ? b : d[i];
+        } else {
+            d[i] = Op{}(d[i], b);
+        }
+    }
+}
+
+} // namespace detail
+
+// A context with its device resources, released by rdma_cleanup
+class Context {
+public:
+    explicit Context(const rdma_init_attr &attr) : ctx_(rdma_init_ex(&attr)) {
+        if (!ctx_) throw Error();
+    }
+    Context(const char *ip, int port, std::size_t buf_size, bool is_server)
+        : ctx_(rdma_init(ip, port, buf_size, is_server)) {
+        if (!ctx_) throw Error();
+    }
+
+    Context(Context &&) noexcept = default;
+    Context &operator=(Context &&) noexcept = default;
+
+    // Connect a client (server side) or to a server, returns the peer index
+    int accept() { return detail::check(rdma_accept_peer(get())); }
+    int connect(const char *ip, int port) { return detail::check(rdma_connect_peer(get(), ip, port)); }
+
+    void barrier() { detail::check(rdma_barrier(get())); }
+
+    template <class T>
+    void send(int peer, span<const T> data) {
+        detail::check_element<T>();
+        detail::check(rdma_send(get(), peer, data.data(), data.size_bytes()));
+    }
+
+    // Returns the number of elements received
+    template <class T>
+    std::size_t recv(int peer, span<T> data) {
+        detail::check_element<T>();
+        return detail::elements<T>(detail::check(rdma_recv(get(), peer, data.data(), data.size_bytes())));
+    }
+
+    rdma_context *get() const noexcept { return ctx_.get(); }
+    int num_peers() const noexcept { return ctx_->num_peers; }
+    bool is_server() const noexcept { return ctx_->is_server; }
+
+private:
+    struct Deleter {
+        void operator()(rdma_context *ctx) const noexcept { rdma_cleanup(ctx); }
+    };
+    std::unique_ptr<rdma_context, Deleter> ctx_;
+};
+
+// Memory registered with a context while the region lives, so sends read
+// it without a copy
+class MemoryRegion {
+public:
+    MemoryRegion() noexcept = default;
+
+    template <class T>
+    MemoryRegion(Context &ctx, span<T> memory)
+        : ctx_(ctx.get()), addr_(const_cast<std::remove_const_t<T> *>(memory.data())) {
+        detail::check(rdma_reg_buffer(ctx_, addr_, memory.size_bytes()));
+    }
+
+    MemoryRegion(const MemoryRegion &) = delete;
+    MemoryRegion &operator=(const MemoryRegion &) = delete;
+
+    MemoryRegion(MemoryRegion &&other) noexcept
+        : ctx_(std::exchange(other.ctx_, nullptr)), addr_(other.addr_) {}
+
+    MemoryRegion &operator=(MemoryRegion &&other) noexcept {
+        if (this != &other) {
+            reset();
+            ctx_ = std::exchange(other.ctx_, nullptr);
+            addr_ = other.addr_;
+        }
+        return *this;
+    }
+
+    ~MemoryRegion() { reset(); }
+
+    void reset() noexcept {
+        if (ctx_) rdma_dereg_buffer(ctx_, addr_);
+        ctx_ = nullptr;
+    }
+
+private:
+    rdma_context *ctx_ = nullptr;
+    void *addr_ = nullptr;
+};
+
+// A communicator. The world communicator belongs to its context, split
+// communicators are freed with the object
+class Comm {
+public:
+    Comm() noexcept = default;
+
+    static Comm world(Context &ctx) {
+        rdma_comm *comm = rdma_comm_world(ctx.get());
+        if (!comm) throw Error();
+        return Comm(comm, false);
+    }
+
+    // An empty communicator for RDMA_COMM_UNDEFINED
+    Comm split(int color, int key) const {
+        rdma_comm *comm;
+        detail::check(rdma_comm_split(comm_, color, key, &comm));
+        return Comm(comm, true);
+    }
+
+    Comm(const Comm &) = delete;
+    Comm &operator=(const Comm &) = delete;
+
+    Comm(Comm &&other) noexcept
+        : comm_(std::exchange(other.comm_, nullptr)), owned_(other.owned_) {}
+
+    Comm &operator=(Comm &&other) noexcept {
+        if (this != &other) {
+            reset();
+            comm_ = std::exchange(other.comm_, nullptr);
+            owned_ = other.owned_;
+        }
+        return *this;
+    }
+
+    ~Comm() { reset(); }
+
+    void reset() noexcept {
+        if (owned_) rdma_comm_free(comm_);
+        comm_ = nullptr;
+    }
+
+    explicit operator bool() const noexcept { return comm_ != nullptr; }
+    int rank() const { return rdma_comm_rank(comm_); }
+    int size() const { return rdma_comm_size(comm_); }
+    rdma_comm *get() const noexcept { return comm_; }
+
+    void barrier() { detail::check(rdma_comm_barrier(comm_)); }
+
+    // Messages are limited to one receive slot (RECV_SLOT_SIZE bytes)
+    template <class T>
+    void send(int rank, span<const T> data) {
+        detail::check_element<T>();
+        detail::check(rdma_comm_send(comm_, rank, data.data(), data.size_bytes()));
+    }
+
+    template <class T>
+    std::size_t recv(int rank, span<T> data) {
+        detail::check_element<T>();
+        return detail::elements<T>(detail::check(rdma_comm_recv(comm_, rank, data.data(), data.size_bytes())));
+    }
+
+    template <class T>
+    void bcast(int root, span<T> data) {
+        detail::check_element<T>();
+        detail::check(rdma_comm_bcast(comm_, root, data.data(), data.size_bytes()));
+    }
+
+private:
+    Comm(rdma_comm *comm, bool owned) noexcept : comm_(comm), owned_(owned) {}
+
+    rdma_comm *comm_ = nullptr;
+    bool owned_ = false;
+};
+
+// Completion of one started stage of a plan. Move-only; waiting for a
+// stage also completes the stages started before it, and a request that
+// is dropped unfinished is waited for in its destructor
+class Request {
+public:
+    Request() noexcept = default;
+
+    Request(const Request &) = delete;
+    Request &operator=(const Request &) = delete;
+
+    Request(Request &&other) noexcept
+        : plan_(std::exchange(other.plan_, nullptr)), done_(other.done_), stage_(other.stage_) {}
+
+    Request &operator=(Request &&other) noexcept {
+        if (this != &other) {
+            finish();
+            plan_ = std::exchange(other.plan_, nullptr);
+            done_ = other.done_;
+            stage_ = other.stage_;
+        }
+        return *this;
+    }
+
+    ~Request() { finish(); }
+
+    bool valid() const noexcept { return plan_ != nullptr; }
+
+    void wait() {
+        if (!plan_) throw Error("Request has no pending stage");
+        while (*done_ <= stage_) {
+            detail::check(rdma_plan_wait(plan_));
+            ++*done_;
+        }
+        plan_ = nullptr;
+    }
+
+private:
+    template <class T>
+    friend class Alltoall;
+
+    Request(rdma_plan *plan, uint64_t *done, uint64_t stage) noexcept
+        : plan_(plan), done_(done), stage_(stage) {}
+
+    void finish() noexcept {
+        if (!plan_) return;
+        try {
+            wait();
+        } catch (const Error &) {
+            plan_ = nullptr;
+        }
+    }
+
+    rdma_plan *plan_ = nullptr;
+    uint64_t *done_ = nullptr;      // Stages of the plan completed so far
+    uint64_t stage_ = 0;
+};
+
+// Persistent all-to-all over the server and its clients: every rank
+// contributes 'send', and 'recv' holds the block of rank r at r * send.size()
+// after each stage. Collective; the buffers stay registered with the plan,
+// and the plan must outlive its requests
+template <class T>
+class Alltoall {
+public:
+    Alltoall(Context &ctx, span<const T> send, span<T> recv) {
+        detail::check_element<T>();
+        // A short receive span is refused by the library on every rank
+        if (send.empty()) throw Error("All-to-all send span is empty");
+        rdma_plan *plan;
+        detail::check(rdma_alltoall_init(ctx.get(), send.data(), recv.data(),
+                                         recv.size_bytes(), send.size_bytes(), &plan));
+        plan_.reset(plan);
+        done_ = std::make_unique<uint64_t>(0);
+    }
+
+    Request start() {
+        detail::check(rdma_plan_start(plan_.get()));
+        return Request(plan_.get(), done_.get(), started_++);
+    }
+
+    // One stage, start to finish
+    void run() { start().wait(); }
+
+    int rank() const { return rdma_plan_rank(plan_.get()); }
+    int ranks() const { return rdma_plan_num_ranks(plan_.get()); }
+
+private:
+    struct Deleter {
+        void operator()(rdma_plan *plan) const noexcept { rdma_plan_free(plan); }
+    };
+    std::unique_ptr<rdma_plan, Deleter> plan_;
+    std::unique_ptr<uint64_t> done_;    // Stays put when the plan is moved
+    uint64_t started_ = 0;
+};
+
+// One-off all-to-all; repeated exchanges should keep an Alltoall plan
+template <class T>
+void alltoall(Context &ctx, span<const T> send, span<T> recv) {
+    Alltoall<T>(ctx, send, recv).run();
+}
+
+// Reduce 'data' elementwise over every rank, in place, with the kernel of
+// T and Op
+template <class T, class Op = Sum>
+void allreduce(Context &ctx, span<T> data) {
+    detail::check_element<T>();
+    static_assert(sizeof(T) <= RDMA_REDUCE_MAX_ELEM, "allreduce element too large");
+    detail::check(rdma_allreduce_fn(ctx.get(), data.data(), data.size(), sizeof(T),
+                                    &detail::reduce_kernel<T, Op>, nullptr));
+}
+
+} // namespace rdma
+
+#endif /* RDMA_LIB_HPP */
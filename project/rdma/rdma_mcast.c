@@ -0,0 +1,615 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+// Hardware multicast broadcast: the root sends every fragment once to a
+// multicast GID and the fabric replicates it. Receivers ask for missing
+// fragments with NACKs that the root repairs by unicast, and acknowledge
+// every consumed broadcast so the root can recycle its history.
+
+#define MCAST_QKEY 0x22222222
+#define MCAST_CTRL_ID MCAST_HISTORY     // wr_id value of receiver control sends
+#define MCAST_LINGER_MS 200             // Root wait for late NACKs at cleanup
+
+enum {
+    MCAST_PKT_DATA = 1,
+    MCAST_PKT_NACK = 2,
+    MCAST_PKT_ACK = 3
+};
+
+// Header prepended to every multicast datagram
+typedef struct {
+    uint16_t type;
+    uint16_t frag;          // DATA: fragment index
+    uint16_t nfrags;        // DATA: fragments in the broadcast
+    uint16_t len;           // DATA: payload bytes in this fragment
+    uint32_t epoch;         // Broadcast sequence number
+    uint32_t offset;        // DATA: fragment offset in the message
+    uint32_t total;         // DATA: message length
+    uint32_t peer_id;       // NACK/ACK: index under which the root tracks the receiver
+    uint32_t missing;       // NACK: bitmap of fragments still missing
+} __attribute__((packed)) mcast_hdr;
+
+// Join handshake exchanged over the regular message path
+typedef struct {
+    uint32_t qpn;
+    uint32_t status;        // Receiver: attached to the group, root: multicast in use
+} mcast_join_msg;
+
+// Broadcast retained by the root until every receiver consumed it
+typedef struct {
+    int nfrags;
+    int posts;              // WRs posted from this entry and not yet completed
+    int acks;               // Receivers that consumed this epoch
+} mcast_tx;
+
+// Fragments of one epoch held by a receiver until they are complete
+typedef struct {
+    uint32_t epoch;
+    int nfrags;             // 0 until the first fragment arrives
+    uint32_t total;
+    uint32_t received;      // Bitmap of fragments held
+    int slot[MCAST_MAX_FRAGS];
+} mcast_rx;
+
+// Receiver as seen by the root
+typedef struct {
+    struct ibv_ah *ah;
+    uint32_t qpn;
+    uint32_t acked;         // Next epoch this receiver has not consumed
+} mcast_member;
+
+struct rdma_mcast_ctx {
+    bool active;            // Multicast in use, unicast fan-out otherwise
+    bool is_root;
+    union ibv_gid mgid;
+    bool attached;
+    size_t frag_payload;
+    int sq_outstanding;
+
+    // Root state
+    struct ibv_ah *group_ah;
+    void *tx_buf;
+    struct ibv_mr *tx_mr;
+    size_t frag_stride;     // Header plus payload of one fragment
+    mcast_tx tx[MCAST_HISTORY];
+    uint32_t tx_epoch;      // Next epoch to broadcast
+    uint32_t tx_retired;    // Oldest epoch not yet consumed by every receiver
+    mcast_member *members;  // Indexed by peer index
+    int num_members;
+
+    // Receiver state
+    struct ibv_ah *root_ah;
+    uint32_t root_qpn;
+    uint32_t root_id;       // Index under which the root tracks this receiver
+    uint32_t rx_epoch;      // Next epoch to deliver
+    mcast_rx rx[MCAST_HISTORY];
+};
+
+static uint32_t frag_mask(int nfrags) {
+    return nfrags >= 32 ? 0xFFFFFFFFu : (1u << nfrags) - 1;
+}
+
+static mcast_hdr *tx_frag(struct rdma_mcast_ctx *m, uint32_t epoch, int frag) {
+    size_t entry = epoch % MCAST_HISTORY;
+    return (mcast_hdr *)((char *)m->tx_buf +
+                         (entry * MCAST_MAX_FRAGS + frag) * m->frag_stride);
+}
+
+bool mcast_active(rdma_context *ctx) {
+    return ctx->mcast && ctx->mcast->active;
+}
+
+// Group GID derived from the root address so concurrent jobs do not collide
+static void make_group_gid(union ibv_gid *mgid, const char *root_ip, int root_port) {
+    struct in_addr addr = { 0 };
+    inet_pton(AF_INET, root_ip, &addr);
+
+    memset(mgid, 0, sizeof(*mgid));
+    mgid->raw[0] = 0xff;
+    mgid->raw[1] = 0x0e;
+    memcpy(&mgid->raw[8], &addr, 4);
+    mgid->raw[12] = (root_port >> 8) & 0xff;
+    mgid->raw[13] = root_port & 0xff;
+}
+
+// Post one fragment of a retained broadcast to the group or a single receiver
+static int post_frag(rdma_context *ctx, uint32_t epoch, int frag,
+                     struct ibv_ah *ah, uint32_t qpn) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    mcast_hdr *hdr = tx_frag(m, epoch, frag);
+
+    struct ibv_sge sge = {
+        .addr = (uint64_t)hdr,
+        .length = sizeof(*hdr) + hdr->len,
+        .lkey = m->tx_mr->lkey
+    };
+
+    struct ibv_send_wr wr = {
+        .wr_id = WRID(WR_KIND_MCAST, epoch % MCAST_HISTORY),
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+        .wr.ud = {
+            .ah = ah,
+            .remote_qpn = qpn,
+            .remote_qkey = MCAST_QKEY
+        }
+    };
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(ctx->mcast_qp, &wr, &bad_wr)) {
+        set_error("Failed to post multicast send");
+        return -1;
+    }
+    m->tx[epoch % MCAST_HISTORY].posts++;
+    m->sq_outstanding++;
+    return 0;
+}
+
+// Send a NACK or ACK from a receiver to the root
+static int send_ctrl(rdma_context *ctx, uint16_t type, uint32_t epoch, uint32_t missing) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    if (m->sq_outstanding >= (int)ctx->tune.send_wr) return 0;
+
+    mcast_hdr hdr = {
+        .type = type,
+        .epoch = epoch,
+        .peer_id = m->root_id,
+        .missing = missing
+    };
+
+    struct ibv_sge sge = {
+        .addr = (uint64_t)&hdr,
+        .length = sizeof(hdr)
+    };
+
+    struct ibv_send_wr wr = {
+        .wr_id = WRID(WR_KIND_MCAST, MCAST_CTRL_ID),
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE,
+        .wr.ud = {
+            .ah = m->root_ah,
+            .remote_qpn = m->root_qpn,
+            .remote_qkey = MCAST_QKEY
+        }
+    };
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(ctx->mcast_qp, &wr, &bad_wr)) {
+        set_error("Failed to post multicast control message");
+        return -1;
+    }
+    m->sq_outstanding++;
+    return 0;
+}
+
+// Account an ACK: the receiver consumed every epoch up to and including 'epoch'
+static void root_handle_ack(struct rdma_mcast_ctx *m, mcast_member *mem, uint32_t epoch) {
+    if ((int32_t)(epoch - m->tx_epoch) >= 0) return;
+
+    for (uint32_t e = mem->acked; (int32_t)(epoch - e) >= 0; e++) {
+        if ((int32_t)(e - m->tx_retired) >= 0 && (int32_t)(e - m->tx_epoch) < 0) {
+            m->tx[e % MCAST_HISTORY].acks++;
+        }
+    }
+    if ((int32_t)(epoch + 1 - mem->acked) > 0) {
+        mem->acked = epoch + 1;
+    }
+
+    while (m->tx_retired != m->tx_epoch &&
+           m->tx[m->tx_retired % MCAST_HISTORY].acks >= m->num_members) {
+        m->tx_retired++;
+    }
+}
+
+// Repair the fragments a receiver reported missing by unicast
+static int root_handle_nack(rdma_context *ctx, mcast_member *mem, uint32_t epoch, uint32_t missing) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+
+    if ((int32_t)(epoch - m->tx_retired) < 0 || (int32_t)(epoch - m->tx_epoch) >= 0) {
+        return 0;
+    }
+
+    missing &= frag_mask(m->tx[epoch % MCAST_HISTORY].nfrags);
+    for (int f = 0; missing; f++, missing >>= 1) {
+        if (!(missing & 1)) continue;
+        // The receiver NACKs again if the send queue is full right now
+        if (m->sq_outstanding >= (int)ctx->tune.send_wr) break;
+        if (post_frag(ctx, epoch, f, mem->ah, mem->qpn) < 0) return -1;
+    }
+    return 0;
+}
+
+// Hold a received fragment until its broadcast is complete
+static void recv_handle_data(rdma_context *ctx, mcast_hdr *hdr, int slot) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    int32_t ahead = (int32_t)(hdr->epoch - m->rx_epoch);
+
+    if (ahead < 0) {
+        // Already consumed: the root is probing for a lost ACK
+        release_slot(ctx, slot);
+        send_ctrl(ctx, MCAST_PKT_ACK, m->rx_epoch - 1, 0);
+        return;
+    }
+    if (ahead >= MCAST_HISTORY || hdr->nfrags == 0 || hdr->nfrags > MCAST_MAX_FRAGS ||
+        hdr->frag >= hdr->nfrags) {
+        release_slot(ctx, slot);
+        return;
+    }
+
+    mcast_rx *rx = &m->rx[hdr->epoch % MCAST_HISTORY];
+    if (rx->nfrags == 0 || rx->epoch != hdr->epoch) {
+        for (int f = 0; f < rx->nfrags; f++) {
+            if (rx->received & (1u << f)) release_slot(ctx, rx->slot[f]);
+        }
+        rx->epoch = hdr->epoch;
+        rx->nfrags = hdr->nfrags;
+        rx->total = hdr->total;
+        rx->received = 0;
+    }
+
+    if (rx->received & (1u << hdr->frag)) {
+        release_slot(ctx, slot);
+        return;
+    }
+    rx->slot[hdr->frag] = slot;
+    rx->received |= 1u << hdr->frag;
+}
+
+// Handle a datagram received on the multicast QP
+int mcast_handle_recv(rdma_context *ctx, struct ibv_wc *wc, int slot) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    mcast_hdr *hdr = (mcast_hdr *)(slot_base(ctx, slot) + GRH_SIZE);
+
+    if (!m || wc->byte_len < GRH_SIZE + sizeof(*hdr)) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    if (m->is_root) {
+        int ret = 0;
+        if (hdr->peer_id < (uint32_t)m->num_members &&
+            m->members[hdr->peer_id].qpn == wc->src_qp) {
+            mcast_member *mem = &m->members[hdr->peer_id];
+            if (hdr->type == MCAST_PKT_ACK) {
+                root_handle_ack(m, mem, hdr->epoch);
+            } else if (hdr->type == MCAST_PKT_NACK) {
+                ret = root_handle_nack(ctx, mem, hdr->epoch, hdr->missing);
+            }
+        }
+        release_slot(ctx, slot);
+        return ret;
+    }
+
+    if (hdr->type != MCAST_PKT_DATA || wc->src_qp != m->root_qpn ||
+        wc->byte_len < GRH_SIZE + sizeof(*hdr) + hdr->len) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    ctx->slots[slot].len = hdr->len;
+    ctx->slots[slot].offset = GRH_SIZE + sizeof(*hdr);
+    recv_handle_data(ctx, hdr, slot);
+    return 0;
+}
+
+// Handle a send completion on the multicast QP
+int mcast_handle_send(rdma_context *ctx, struct ibv_wc *wc) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    int entry = (int)WRID_VAL(wc->wr_id);
+
+    if (!m) return 0;
+    m->sq_outstanding--;
+    if (entry < MCAST_HISTORY) {
+        m->tx[entry].posts--;
+    }
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        set_error("Multicast send failed with status: %d", wc->status);
+        return -1;
+    }
+    return 0;
+}
+
+// Root side: send a message once to the multicast group
+int mcast_broadcast(rdma_context *ctx, const void *data, size_t len) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+
+    if (len > MCAST_MAX_FRAGS * m->frag_payload) {
+        set_error("Broadcast of %zu bytes exceeds the multicast limit of %zu",
+                  len, MCAST_MAX_FRAGS * m->frag_payload);
+        return -1;
+    }
+
+    // Wait for a free history entry; probe receivers whose ACK went missing
+    uint32_t epoch = m->tx_epoch;
+    uint64_t last = now_ns();
+    while (epoch - m->tx_retired >= MCAST_HISTORY || m->tx[epoch % MCAST_HISTORY].posts > 0) {
+        int n = progress(ctx);
+        if (n < 0) return -1;
+        if (n > 0) {
+            last = now_ns();
+        } else if (m->tx_retired != m->tx_epoch && now_ns() - last > MCAST_NACK_US * 4000ULL) {
+            uint32_t oldest = m->tx_retired;
+            if (m->sq_outstanding < (int)ctx->tune.send_wr &&
+                post_frag(ctx, oldest, m->tx[oldest % MCAST_HISTORY].nfrags - 1,
+                          m->group_ah, 0xFFFFFF) < 0) {
+                return -1;
+            }
+            last = now_ns();
+        }
+    }
+
+    // Lay the message out as header + payload per fragment
+    int nfrags = len ? (int)((len + m->frag_payload - 1) / m->frag_payload) : 1;
+    for (int f = 0; f < nfrags; f++) {
+        size_t off = f * m->frag_payload;
+        size_t chunk = len - off < m->frag_payload ? len - off : m->frag_payload;
+        mcast_hdr *hdr = tx_frag(m, epoch, f);
+        *hdr = (mcast_hdr){
+            .type = MCAST_PKT_DATA,
+            .frag = f,
+            .nfrags = nfrags,
+            .len = chunk,
+            .epoch = epoch,
+            .offset = off,
+            .total = len
+        };
+        memcpy(hdr + 1, (const char *)data + off, chunk);
+    }
+    m->tx[epoch % MCAST_HISTORY] = (mcast_tx){ .nfrags = nfrags };
+    m->tx_epoch++;
+
+    for (int f = 0; f < nfrags; f++) {
+        while (m->sq_outstanding >= (int)ctx->tune.send_wr) {
+            if (progress(ctx) < 0) return -1;
+        }
+        if (post_frag(ctx, epoch, f, m->group_ah, 0xFFFFFF) < 0) return -1;
+    }
+    return len;
+}
+
+// Receiver side: deliver the next broadcast, NACKing fragments that do not show up
+int mcast_recv(rdma_context *ctx, void *data, size_t max_len) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    mcast_rx *rx = &m->rx[m->rx_epoch % MCAST_HISTORY];
+    uint64_t interval = MCAST_NACK_US * 1000ULL;
+    uint64_t last = now_ns();
+
+    while (rx->nfrags == 0 || rx->epoch != m->rx_epoch || rx->received != frag_mask(rx->nfrags)) {
+        if (ctx->peers[0].state != RDMA_CONN_CONNECTED) {
+            set_error("Broadcast root not connected");
+            return -1;
+        }
+
+        int n = progress(ctx);
+        if (n < 0) return -1;
+        if (n > 0) {
+            last = now_ns();
+            continue;
+        }
+
+        // Silence: report what is missing, backing off while the root is busy
+        uint64_t now = now_ns();
+        if (now - last > interval) {
+            uint32_t missing = rx->nfrags && rx->epoch == m->rx_epoch ?
+                               frag_mask(rx->nfrags) & ~rx->received : 0xFFFFFFFFu;
+            if (send_ctrl(ctx, MCAST_PKT_NACK, m->rx_epoch, missing) < 0) return -1;
+            last = now;
+            if (interval < MCAST_NACK_US * 64000ULL) interval *= 2;
+        }
+    }
+
+    // Reassemble into the caller's buffer and hand the slots back
+    for (int f = 0; f < rx->nfrags; f++) {
+        int slot = rx->slot[f];
+        mcast_hdr *hdr = (mcast_hdr *)(slot_base(ctx, slot) + GRH_SIZE);
+        if (hdr->offset < max_len) {
+            size_t chunk = max_len - hdr->offset < hdr->len ? max_len - hdr->offset : hdr->len;
+            memcpy((char *)data + hdr->offset, slot_data(ctx, slot), chunk);
+        }
+        release_slot(ctx, slot);
+    }
+
+    size_t total = rx->total < max_len ? rx->total : max_len;
+    rx->nfrags = 0;
+    rx->received = 0;
+
+    if (send_ctrl(ctx, MCAST_PKT_ACK, m->rx_epoch, 0) < 0) return -1;
+    m->rx_epoch++;
+    return total;
+}
+
+// Root: register the broadcast history and address every receiver
+static int setup_root(rdma_context *ctx, mcast_join_msg *joins) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+
+    m->frag_stride = sizeof(mcast_hdr) + m->frag_payload;
+    size_t size = MCAST_HISTORY * MCAST_MAX_FRAGS * m->frag_stride;
+    m->tx_buf = aligned_alloc(4096, (size + 4095) & ~(size_t)4095);
+    if (!m->tx_buf) {
+        set_error("Failed to allocate multicast history");
+        return -1;
+    }
+
+    m->tx_mr = ibv_reg_mr(ctx->pd, m->tx_buf, size, IBV_ACCESS_LOCAL_WRITE);
+    if (!m->tx_mr) {
+        set_error("Failed to register multicast history");
+        return -1;
+    }
+
+    m->group_ah = create_ah(ctx, m->mgid.raw, 0);
+    if (!m->group_ah) return -1;
+
+    m->members = calloc(ctx->num_peers, sizeof(*m->members));
+    if (!m->members) {
+        set_error("Failed to allocate multicast members");
+        return -1;
+    }
+    m->num_members = ctx->num_peers;
+
+    for (int i = 0; i < ctx->num_peers; i++) {
+        m->members[i].qpn = joins[i].qpn;
+        m->members[i].ah = create_ah(ctx, ctx->peers[i].remote_info.gid,
+                                     ctx->peers[i].remote_info.lid);
+        if (!m->members[i].ah) return -1;
+    }
+    return 0;
+}
+
+// Tear down everything but the context struct
+static void release_mcast(rdma_context *ctx) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+
+    for (int i = 0; i < MCAST_HISTORY; i++) {
+        for (int f = 0; f < m->rx[i].nfrags; f++) {
+            if (m->rx[i].received & (1u << f)) release_slot(ctx, m->rx[i].slot[f]);
+        }
+        m->rx[i].nfrags = 0;
+    }
+    for (int i = 0; i < m->num_members; i++) {
+        if (m->members[i].ah) ibv_destroy_ah(m->members[i].ah);
+    }
+    free(m->members);
+    m->members = NULL;
+    m->num_members = 0;
+
+    if (m->group_ah) ibv_destroy_ah(m->group_ah);
+    if (m->root_ah) ibv_destroy_ah(m->root_ah);
+    m->group_ah = m->root_ah = NULL;
+
+    if (m->attached) {
+        ibv_detach_mcast(ctx->mcast_qp, &m->mgid, 0);
+        m->attached = false;
+    }
+    if (ctx->mcast_qp) {
+        ibv_destroy_qp(ctx->mcast_qp);
+        ctx->mcast_qp = NULL;
+    }
+    if (m->tx_mr) ibv_dereg_mr(m->tx_mr);
+    free(m->tx_buf);
+    m->tx_mr = NULL;
+    m->tx_buf = NULL;
+    m->active = false;
+}
+
+// Switch rdma_broadcast to hardware multicast (collective over all peers)
+int rdma_mcast_enable(rdma_context *ctx) {
+    if (ctx->mcast) {
+        return ctx->mcast->active;
+    }
+    if (ctx->num_peers <= 0 || (!ctx->is_server && ctx->num_peers != 1)) {
+        set_error("Multicast needs a server with clients or a client with its server");
+        return -1;
+    }
+
+    struct rdma_mcast_ctx *m = calloc(1, sizeof(*m));
+    if (!m) {
+        set_error("Failed to allocate multicast state");
+        return -1;
+    }
+    ctx->mcast = m;
+    m->is_root = ctx->is_server;
+
+    size_t mtu = 128u << ctx->port_attr.active_mtu;
+    if (mtu > RECV_SLOT_SIZE - GRH_SIZE) mtu = RECV_SLOT_SIZE - GRH_SIZE;
+    m->frag_payload = mtu - sizeof(mcast_hdr);
+
+    if (m->is_root) {
+        make_group_gid(&m->mgid, ctx->ip, ctx->port);
+    } else {
+        make_group_gid(&m->mgid, ctx->peers[0].remote_info.ip, ctx->peers[0].remote_info.port);
+    }
+
+    // Devices without multicast support fall back to unicast fan-out
+    bool usable = ctx->dev_attr.max_mcast_grp > 0;
+    if (usable) {
+        ctx->mcast_qp = create_ud_qp(ctx, MCAST_QKEY);
+        usable = ctx->mcast_qp != NULL;
+    }
+    if (usable && !m->is_root) {
+        m->attached = ibv_attach_mcast(ctx->mcast_qp, &m->mgid, 0) == 0;
+        usable = m->attached;
+    }
+
+    mcast_join_msg local = {
+        .qpn = ctx->mcast_qp ? ctx->mcast_qp->qp_num : 0,
+        .status = usable
+    };
+
+    if (m->is_root) {
+        mcast_join_msg *joins = calloc(ctx->num_peers, sizeof(*joins));
+        if (!joins) {
+            set_error("Failed to allocate multicast join table");
+            goto err;
+        }
+
+        // Every receiver must have joined the group for multicast to be used
+        for (int i = 0; i < ctx->num_peers; i++) {
+            if (rdma_recv(ctx, i, &joins[i], sizeof(joins[i])) < 0) {
+                free(joins);
+                goto err;
+            }
+            usable = usable && joins[i].status;
+        }
+        if (usable && setup_root(ctx, joins) < 0) {
+            usable = false;
+        }
+        free(joins);
+
+        local.status = usable;
+        for (int i = 0; i < ctx->num_peers; i++) {
+            if (rdma_send(ctx, i, &local, sizeof(local)) < 0) goto err;
+        }
+    } else {
+        mcast_join_msg reply;
+        if (rdma_send(ctx, 0, &local, sizeof(local)) < 0) goto err;
+        if (rdma_recv(ctx, 0, &reply, sizeof(reply)) < 0) goto err;
+
+        usable = usable && reply.status;
+        if (usable) {
+            m->root_qpn = reply.qpn;
+            m->root_id = ctx->peers[0].remote_info.peer_id;
+            m->root_ah = create_ah(ctx, ctx->peers[0].remote_info.gid,
+                                   ctx->peers[0].remote_info.lid);
+            // The root already committed to multicast, so this is fatal
+            if (!m->root_ah) goto err;
+        }
+    }
+
+    if (!usable) {
+        release_mcast(ctx);
+        return 0;
+    }
+    m->active = true;
+    return 1;
+
+err:
+    release_mcast(ctx);
+    free(m);
+    ctx->mcast = NULL;
+    return -1;
+}
+
+// Let receivers repair the last broadcasts, then release multicast resources
+void mcast_cleanup(rdma_context *ctx) {
+    struct rdma_mcast_ctx *m = ctx->mcast;
+    if (!m) return;
+
+    if (m->active && m->is_root) {
+        uint64_t deadline = now_ns() + MCAST_LINGER_MS * 1000000ULL;
+        while (m->tx_retired != m->tx_epoch && now_ns() < deadline) {
+            if (progress(ctx) < 0) break;
+        }
+    }
+
+    release_mcast(ctx);
+    free(m);
+    ctx->mcast = NULL;
+}
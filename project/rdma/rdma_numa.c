@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// Placement of the communication path next to the NIC. The NIC's NUMA node
+// and local CPUs come from sysfs: the PCI device of a hardware NIC, or the
+// netdev a software device (rxe, siw) is bound to. The thread that creates
+// the context prefers that node for memory, so the CQ and QP rings the
+// provider allocates, the receive slots and every registered buffer are
+// placed there as they are first touched. In node mode it is also pinned to
+// the node's CPUs; a single core is only taken by threads that ask for it,
+// since every context of the process would pick the same one. Cleanup gives
+// the creating thread its previous CPUs and memory policy back.
+
+#define SYSFS_IB_DIR "/sys/class/infiniband"
+#define CPULIST_MAX 256
+
+struct rdma_numa_ctx {
+    rdma_affinity affinity;
+    int node;               // NIC node, -1 if unknown
+    cpu_set_t local;        // CPUs of the NIC's node
+    cpu_set_t pin;          // CPUs threads of the context are pinned to
+    pid_t tid;              // Thread that created the context
+    bool pinned;            // That thread runs on 'pin' instead of 'saved_cpus'
+    cpu_set_t saved_cpus;
+    int saved_mode;         // Its memory policy before the context
+    unsigned long saved_nodes[(CPU_SETSIZE + 63) / 64];
+    char sysfs_dev[256];    // Device directory with numa_node and msi_irqs
+    bool memory_bound;
+};
+
+// Read the first line of a sysfs file, false if it does not exist
+static bool read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    bool ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    if (ok) buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+// Parse a kernel CPU list such as "0-7,16-23"
+static void parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long lo = strtol(list, &end, 10);
+        if (end == list) break;
+        long hi = lo;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void format_cpulist(const cpu_set_t *set, char *buf, size_t len) {
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && n < len; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) hi++;
+        n += snprintf(buf + n, len - n, hi > c ? "%s%d-%d" : "%s%d", n ? "," : "", c, hi);
+        c = hi;
+    }
+}
+
+// Find the sysfs directory that describes the NIC's placement
+static bool find_sysfs_dev(const char *dev, char *path, size_t len) {
+    char probe[512];
+    char parent[64];
+
+    snprintf(path, len, SYSFS_IB_DIR "/%s/device", dev);
+    snprintf(probe, sizeof(probe), "%s/numa_node", path);
+    if (access(probe, R_OK) == 0) return true;
+
+    // Software devices name the netdev they run on
+    snprintf(probe, sizeof(probe), SYSFS_IB_DIR "/%s/parent", dev);
+    if (!read_line(probe, parent, sizeof(parent))) return false;
+    snprintf(path, len, "/sys/class/net/%s/device", parent);
+    snprintf(probe, sizeof(probe), "%s/numa_node", path);
+    return access(probe, R_OK) == 0;
+}
+
+// Visit the interrupt vectors of the NIC with their current affinity
+static int for_each_irq(struct rdma_numa_ctx *n, void (*fn)(void *arg, int irq, const cpu_set_t *cpus),
+                        void *arg) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/msi_irqs", n->sysfs_dev);
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        char list[CPULIST_MAX];
+        cpu_set_t cpus;
+        snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", ent->d_name);
+        if (!read_line(path, list, sizeof(list))) continue;
+        parse_cpulist(list, &cpus);
+        fn(arg, atoi(ent->d_name), &cpus);
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static void collect_irq_cpus(void *arg, int irq, const cpu_set_t *cpus) {
+    (void)irq;
+    CPU_OR((cpu_set_t *)arg, (cpu_set_t *)arg, cpus);
+}
+
+// One local CPU for a polling thread, preferring the highest one that
+// serves none of the NIC's interrupts, so polling and interrupt work (and
+// the softirq that drives a software device) do not share a core
+static int pick_core(struct rdma_numa_ctx *n, const cpu_set_t *allowed) {
+    cpu_set_t irq_cpus;
+    CPU_ZERO(&irq_cpus);
+    for_each_irq(n, collect_irq_cpus, &irq_cpus);
+
+    int fallback = -1;
+    for (int c = CPU_SETSIZE - 1; c >= 0; c--) {
+        if (!CPU_ISSET(c, &n->local) || !CPU_ISSET(c, allowed)) continue;
+        if (!CPU_ISSET(c, &irq_cpus)) return c;
+        if (fallback < 0) fallback = c;
+    }
+    return fallback;
+}
+
+struct irq_steer {
+    const cpu_set_t *target;
+    int moved;
+};
+
+// Move one vector onto the target CPUs, needs CAP_SYS_ADMIN
+static void steer_irq(void *arg, int irq, const cpu_set_t *cpus) {
+    struct irq_steer *s = arg;
+    if (CPU_EQUAL(cpus, s->target)) return;
+
+    char path[64];
+    char list[CPULIST_MAX];
+    snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+    format_cpulist(s->target, list, sizeof(list));
+    FILE *f = fopen(path, "w");
+    if (!f || fputs(list, f) < 0) {
+        log_debug("cannot steer irq %d: %s", irq, strerror(errno));
+    } else {
+        s->moved++;
+    }
+    if (f) fclose(f);
+}
+
+static rdma_affinity affinity_from_env(rdma_affinity affinity) {
+    const char *env = getenv("RDMA_AFFINITY");
+    if (!env || !*env) return affinity;
+    if (strcmp(env, "none") == 0) return RDMA_AFFINITY_NONE;
+    if (strcmp(env, "node") == 0) return RDMA_AFFINITY_NODE;
+    if (strcmp(env, "core") == 0) return RDMA_AFFINITY_CORE;
+    log_warn("ignoring RDMA_AFFINITY=%s", env);
+    return affinity;
+}
+
+// Discover the NIC's placement and move the calling thread next to it.
+// Called before any queue or buffer of the context is allocated
+int numa_init(rdma_context *ctx, const rdma_init_attr *attr) {
+    rdma_affinity affinity = affinity_from_env(attr->affinity);
+    if (affinity == RDMA_AFFINITY_NONE) return 0;
+
+    struct rdma_numa_ctx *n = calloc(1, sizeof(*n));
+    if (!n) {
+        set_error("Failed to allocate placement state");
+        return -1;
+    }
+    n->affinity = affinity;
+    n->node = -1;
+    n->tid = (pid_t)syscall(SYS_gettid);
+    ctx->numa = n;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        set_error("Failed to query CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+    n->pin = allowed;
+    n->saved_cpus = allowed;
+
+    const char *dev = ibv_get_device_name(ctx->context->device);
+    char path[512];
+    char line[CPULIST_MAX] = "";
+    if (!find_sysfs_dev(dev, n->sysfs_dev, sizeof(n->sysfs_dev))) {
+        log_warn("no NUMA information for %s, threads and memory stay unplaced", dev);
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/numa_node", n->sysfs_dev);
+    if (read_line(path, line, sizeof(line))) n->node = atoi(line);
+
+    // A device without an affine node is local to every CPU
+    line[0] = '\0';
+    snprintf(path, sizeof(path), "%s/local_cpulist", n->sysfs_dev);
+    if (!read_line(path, line, sizeof(line)) && n->node >= 0) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n->node);
+        read_line(path, line, sizeof(line));
+    }
+    parse_cpulist(line, &n->local);
+    if (CPU_COUNT(&n->local) == 0) n->local = allowed;
+
+    CPU_AND(&n->pin, &n->local, &allowed);
+    if (affinity == RDMA_AFFINITY_CORE) {
+        int core = pick_core(n, &allowed);
+        CPU_ZERO(&n->pin);
+        if (core >= 0) CPU_SET(core, &n->pin);
+    }
+    if (CPU_COUNT(&n->pin) == 0) {
+        log_warn("no NIC-local CPU available to %s, threads stay unpinned", dev);
+        n->pin = allowed;
+    }
+
+    // Contexts of one process all pick the same core, so in core mode only
+    // the threads that call rdma_pin_thread move there
+    if (affinity == RDMA_AFFINITY_NODE && rdma_pin_thread(ctx) < 0) return -1;
+
+    // Everything the thread touches from now on prefers the NIC's node
+    if (n->node >= 0 && n->node < CPU_SETSIZE) {
+        unsigned long mask[(CPU_SETSIZE + 63) / 64] = {0};
+        mask[n->node / 64] = 1UL << (n->node % 64);
+        if (syscall(SYS_get_mempolicy, &n->saved_mode, n->saved_nodes,
+                    sizeof(n->saved_nodes) * 8, NULL, 0) < 0) {
+            log_warn("cannot query the memory policy: %s", strerror(errno));
+        } else if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) == 0) {
+            n->memory_bound = true;
+        } else {
+            log_warn("cannot prefer node %d for memory: %s", n->node, strerror(errno));
+        }
+    }
+
+    if (attr->steer_irqs) {
+        // Interrupts stay off the polling core when there is a core to spare
+        cpu_set_t target = n->local;
+        if (affinity == RDMA_AFFINITY_CORE && CPU_COUNT(&target) > 1) {
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &n->pin)) CPU_CLR(c, &target);
+            }
+        }
+        struct irq_steer s = {.target = &target};
+        for_each_irq(n, steer_irq, &s);
+        log_info("steered %d NIC interrupts to NIC-local CPUs", s.moved);
+    }
+    return 0;
+}
+
+// Pin the calling thread where the context's polling belongs
+int rdma_pin_thread(rdma_context *ctx) {
+    if (!ctx || !ctx->numa) return 0;
+    if (sched_setaffinity(0, sizeof(ctx->numa->pin), &ctx->numa->pin) < 0) {
+        set_error("Failed to pin thread: %s", strerror(errno));
+        return -1;
+    }
+    if ((pid_t)syscall(SYS_gettid) == ctx->numa->tid) ctx->numa->pinned = true;
+    return 0;
+}
+
+struct irq_census {
+    const cpu_set_t *local;
+    const cpu_set_t *pinned;
+    int local_irqs;
+    int pinned_irqs;
+};
+
+static void count_irq(void *arg, int irq, const cpu_set_t *cpus) {
+    struct irq_census *c = arg;
+    cpu_set_t both;
+    (void)irq;
+
+    CPU_AND(&both, cpus, c->local);
+    if (CPU_EQUAL(&both, cpus)) c->local_irqs++;
+    CPU_AND(&both, cpus, c->pinned);
+    if (CPU_COUNT(&both) > 0) c->pinned_irqs++;
+}
+
+// Report where the NIC, the calling thread, its memory and the NIC's
+// interrupts are placed right now
+int rdma_get_placement(rdma_context *ctx, rdma_placement *p) {
+    if (!ctx || !p) {
+        set_error("Invalid arguments");
+        return -1;
+    }
+    memset(p, 0, sizeof(*p));
+
+    const char *dev = ibv_get_device_name(ctx->context->device);
+    snprintf(p->device, sizeof(p->device), "%s", dev);
+    p->affinity = ctx->numa ? ctx->numa->affinity : RDMA_AFFINITY_NONE;
+
+    struct rdma_numa_ctx probe = {.node = -1};
+    struct rdma_numa_ctx *n = ctx->numa;
+    if (!n) {
+        // Unplaced contexts still report where the NIC is
+        n = &probe;
+        if (find_sysfs_dev(dev, n->sysfs_dev, sizeof(n->sysfs_dev))) {
+            char path[512];
+            char line[CPULIST_MAX];
+            snprintf(path, sizeof(path), "%s/numa_node", n->sysfs_dev);
+            if (read_line(path, line, sizeof(line))) n->node = atoi(line);
+            snprintf(path, sizeof(path), "%s/local_cpulist", n->sysfs_dev);
+            if (read_line(path, line, sizeof(line))) parse_cpulist(line, &n->local);
+        }
+    }
+    p->numa_node = n->node;
+    p->local_cpus = CPU_COUNT(&n->local);
+    format_cpulist(&n->local, p->local_cpulist, sizeof(p->local_cpulist));
+    p->memory_bound = n->memory_bound;
+
+    cpu_set_t pinned;
+    if (sched_getaffinity(0, sizeof(pinned), &pinned) < 0) {
+        set_error("Failed to query CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+    format_cpulist(&pinned, p->thread_cpulist, sizeof(p->thread_cpulist));
+    p->thread_cpu = sched_getcpu();
+
+    struct irq_census census = {.local = &n->local, .pinned = &pinned};
+    p->irqs = for_each_irq(n, count_irq, &census);
+    p->irqs_local = census.local_irqs;
+    p->irqs_on_thread = census.pinned_irqs;
+    return 0;
+}
+
+void rdma_print_placement(FILE *out, const rdma_placement *p) {
+    static const char *modes[] = {"none", "node", "core"};
+
+    if (p->numa_node >= 0) {
+        fprintf(out, "nic:    %s on node %d, local cpus %s\n", p->device, p->numa_node,
+                p->local_cpulist);
+    } else {
+        fprintf(out, "nic:    %s, no NUMA node%s%s\n", p->device,
+                p->local_cpus ? ", local cpus " : "", p->local_cpulist);
+    }
+    fprintf(out, "thread: affinity %s, cpus %s, running on %d\n", modes[p->affinity],
+            p->thread_cpulist, p->thread_cpu);
+    fprintf(out, "memory: %s\n", p->memory_bound ? "preferred on the NIC's node" : "default policy");
+    if (p->irqs) {
+        fprintf(out, "irqs:   %d, %d NIC-local, %d may interrupt the thread's cpus\n",
+                p->irqs, p->irqs_local, p->irqs_on_thread);
+    } else {
+        fprintf(out, "irqs:   none visible\n");
+    }
+}
+
+// Give the creating thread its CPUs and memory policy back. Its CPUs can be
+// restored from any thread, its memory policy only from itself
+void numa_cleanup(rdma_context *ctx) {
+    struct rdma_numa_ctx *n = ctx->numa;
+    if (!n) return;
+
+    if (n->pinned && sched_setaffinity(n->tid, sizeof(n->saved_cpus), &n->saved_cpus) < 0) {
+        log_debug("cannot restore the CPUs of thread %d: %s", (int)n->tid, strerror(errno));
+    }
+    if (n->memory_bound) {
+        if ((pid_t)syscall(SYS_gettid) != n->tid) {
+            log_warn("memory policy of thread %d stays on node %d, cleanup ran on another thread",
+                     (int)n->tid, n->node);
+        } else if (syscall(SYS_set_mempolicy, n->saved_mode, n->saved_nodes,
+                           sizeof(n->saved_nodes) * 8) < 0) {
+            log_warn("cannot restore the memory policy: %s", strerror(errno));
+        }
+    }
+    free(ctx->numa);
+    ctx->numa = NULL;
+}
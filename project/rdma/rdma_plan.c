@@ -0,0 +1,547 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+// Persistent all-to-all plans. Every rank contributes a fixed-size block and
+// receives the blocks of all ranks. Buffers are registered and the work
+// requests built once; a stage only patches the immediate and rings doorbells.
+//
+// Clients RDMA-write their block into a staging area of the server, the server
+// writes the full result into every client's receive buffer. Writes carry an
+// immediate (plan id, stage) that consumes one SRQ entry and tells the
+// receiver the data is in place.
+//
+// Buffers are rings of 'ring' slots indexed by stage. A plan over the caller's
+// buffers has a window of one stage and reuses them for every stage (stride
+// 0); a windowed plan owns its slots and keeps up to 'window' stages in
+// flight. Before a write is posted, the write to the same peer 'ring - window'
+// stages earlier must have completed: that write's slots are the next ones a
+// client running ahead can reach, so slots are never overwritten while the NIC
+// still reads them, even when the server is still sending a stage to slower
+// clients.
+
+#define PLAN_ID_SHIFT 24
+#define PLAN_SEQ_MASK ((1u << PLAN_ID_SHIFT) - 1)
+
+struct rdma_plan {
+    rdma_context *ctx;
+    int id;                 // Index in ctx->plans, travels in the immediate
+    size_t size;            // Bytes contributed by every rank
+    size_t recv_len;        // Capacity of the caller's receive buffer
+    int nranks;
+    int rank;               // 0 is the server, clients follow its peer order
+    int window;             // Stages that may be in flight
+    uint32_t ring;          // Slots per buffer, a power of two
+    char *send_buf;
+    char *recv_buf;
+    size_t send_stride;     // 0 when the caller's buffers serve every stage
+    size_t recv_stride;
+    char *owned;            // Slots of a windowed plan
+    struct ibv_mr *send_mr;
+    struct ibv_mr *recv_mr;
+    char *staging;          // Server only, 'ring' slots of nranks blocks
+    struct ibv_mr *staging_mr;
+    uint32_t *remote_ids;   // Plan id of the receiver of every work request
+    struct ibv_sge *sges;
+    struct ibv_send_wr *wrs;    // Per slot: 1 (client) or one per client
+    unsigned *arrived;      // Notifications received per slot
+    uint64_t *start_ns;     // Start of the stage using each slot
+    uint32_t started;       // Stages started
+    uint32_t completed;     // Stages waited for
+};
+
+// Buffer descriptor exchanged once when a plan is created
+typedef struct {
+    uint64_t addr;
+    uint64_t stride;
+    uint32_t rkey;
+    uint32_t plan_id;
+    uint32_t nranks;
+    uint32_t rank;
+    uint32_t window;
+    uint64_t size;
+} plan_desc;
+
+// A write with immediate landed, credit the plan it belongs to
+void plan_notify(rdma_context *ctx, uint32_t imm) {
+    uint32_t id = imm >> PLAN_ID_SHIFT;
+    rdma_plan *plan = ctx->plans ? ctx->plans[id] : NULL;
+    if (!plan) {
+        log_warn("notification 0x%x for unknown plan %u", imm, id);
+        return;
+    }
+    plan->arrived[imm & (plan->ring - 1)]++;
+}
+
+static size_t plan_result_size(const rdma_plan *plan) {
+    return (size_t)plan->nranks * plan->size;
+}
+
+// Allocate the slots of a windowed plan and register both buffers
+static int plan_register(rdma_plan *plan) {
+    rdma_context *ctx = plan->ctx;
+    size_t send_len = plan->size, recv_len = plan_result_size(plan);
+
+    if (!plan->send_buf) {
+        size_t len = plan->ring * (send_len + recv_len);
+        plan->owned = aligned_alloc(4096, (len + 4095) & ~(size_t)4095);
+        if (!plan->owned) {
+            set_error("Failed to allocate plan buffers");
+            return -1;
+        }
+        memset(plan->owned, 0, len);
+        plan->send_buf = plan->owned;
+        plan->recv_buf = plan->owned + plan->ring * send_len;
+        plan->send_stride = send_len;
+        plan->recv_stride = recv_len;
+        send_len *= plan->ring;
+        recv_len *= plan->ring;
+    }
+
+    plan->send_mr = ibv_reg_mr(ctx->pd, plan->send_buf, send_len, IBV_ACCESS_LOCAL_WRITE);
+    if (!plan->send_mr) {
+        set_error("Failed to register plan send buffer: %s", strerror(errno));
+        return -1;
+    }
+    plan->recv_mr = ibv_reg_mr(ctx->pd, plan->recv_buf, recv_len,
+                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!plan->recv_mr) {
+        set_error("Failed to register plan receive buffer: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Per-plan tables sized by the ring and the number of write targets
+static int plan_alloc_wrs(rdma_plan *plan, int targets, int sges_per_wr) {
+    plan->wrs = calloc(plan->ring * targets, sizeof(*plan->wrs));
+    plan->sges = calloc(plan->ring * targets * sges_per_wr, sizeof(*plan->sges));
+    plan->remote_ids = calloc(targets, sizeof(*plan->remote_ids));
+    plan->arrived = calloc(plan->ring, sizeof(*plan->arrived));
+    plan->start_ns = calloc(plan->ring, sizeof(*plan->start_ns));
+    if (!plan->wrs || !plan->sges || !plan->remote_ids || !plan->arrived || !plan->start_ns) {
+        set_error("Failed to allocate plan work requests");
+        return -1;
+    }
+    return 0;
+}
+
+// Reserve a plan id in the context
+static int plan_attach(rdma_context *ctx, rdma_plan *plan) {
+    if (!ctx->plans) {
+        ctx->plans = calloc(RDMA_MAX_PLANS, sizeof(*ctx->plans));
+        if (!ctx->plans) {
+            set_error("Failed to allocate plan table");
+            return -1;
+        }
+    }
+    for (int i = 0; i < RDMA_MAX_PLANS; i++) {
+        if (!ctx->plans[i]) {
+            ctx->plans[i] = plan;
+            plan->id = i;
+            return 0;
+        }
+    }
+    set_error("Too many plans (%d)", RDMA_MAX_PLANS);
+    return -1;
+}
+
+// Server: everything a plan needs locally before its descriptors go out
+static int plan_setup_server(rdma_plan *plan) {
+    rdma_context *ctx = plan->ctx;
+    size_t result = plan_result_size(plan);
+
+    if (ctx->max_send_sge < 2) {
+        set_error("Plans need two gather entries per send");
+        return -1;
+    }
+    if (plan->recv_buf && plan->recv_len < result) {
+        set_error("Plan receive buffer of %zu bytes, %d ranks need %zu",
+                  plan->recv_len, plan->nranks, result);
+        return -1;
+    }
+    if (plan_register(plan) < 0 || plan_alloc_wrs(plan, ctx->num_peers, 2) < 0) return -1;
+
+    size_t staging_len = plan->ring * result;
+    plan->staging = aligned_alloc(4096, (staging_len + 4095) & ~(size_t)4095);
+    if (!plan->staging) {
+        set_error("Failed to allocate plan staging area");
+        return -1;
+    }
+    plan->staging_mr = ibv_reg_mr(ctx->pd, plan->staging, staging_len,
+                                  IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!plan->staging_mr) {
+        set_error("Failed to register plan staging area: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Server: descriptors out, descriptors in, then a verdict for every client.
+// A rank that cannot take part answers with an empty descriptor; the server
+// still reads every client's answer before the verdict, so all ranks fail
+// together and no descriptor is left behind for a later receive
+static int plan_init_server(rdma_plan *plan, bool attached) {
+    rdma_context *ctx = plan->ctx;
+    int nclients = ctx->num_peers;
+    size_t result = plan_result_size(plan);
+    int ret = attached ? plan_setup_server(plan) : -1;
+    bool refused = ret < 0;
+
+    for (int i = 0; i < nclients; i++) {
+        plan_desc desc = {0};
+        if (!refused) {
+            desc = (plan_desc){
+                .addr = (uint64_t)plan->staging,
+                .stride = result,
+                .rkey = plan->staging_mr->rkey,
+                .plan_id = plan->id,
+                .nranks = plan->nranks,
+                .rank = i + 1,
+                .window = plan->window,
+                .size = plan->size
+            };
+        }
+        if (rdma_send(ctx, i, &desc, sizeof(desc)) < 0) ret = -1;
+    }
+    // Clients told of a refusal do not answer
+    if (refused) return -1;
+
+    for (int i = 0; i < nclients; i++) {
+        plan_desc desc;
+        if (rdma_recv(ctx, i, &desc, sizeof(desc)) != (int)sizeof(desc)) {
+            set_error("Failed to receive plan descriptor from peer %d", i);
+            ret = -1;
+            continue;
+        }
+        if (desc.size != plan->size) {
+            set_error("Peer %d refused the plan", i);
+            ret = -1;
+            continue;
+        }
+        plan->remote_ids[i] = desc.plan_id;
+
+        // Our block from the send slot, the clients' blocks from the staging slot
+        for (uint32_t r = 0; r < plan->ring; r++) {
+            struct ibv_sge *sge = &plan->sges[2 * (r * nclients + i)];
+            sge[0] = (struct ibv_sge){
+                .addr = (uint64_t)(plan->send_buf + r * plan->send_stride),
+                .length = plan->size,
+                .lkey = plan->send_mr->lkey
+            };
+            sge[1] = (struct ibv_sge){
+                .addr = (uint64_t)(plan->staging + r * result + plan->size),
+                .length = result - plan->size,
+                .lkey = plan->staging_mr->lkey
+            };
+            plan->wrs[r * nclients + i] = (struct ibv_send_wr){
+                .sg_list = sge,
+                .num_sge = 2,
+                .opcode = IBV_WR_RDMA_WRITE_WITH_IMM,
+                .wr.rdma = {.remote_addr = desc.addr + r * desc.stride, .rkey = desc.rkey}
+            };
+        }
+    }
+
+    uint32_t commit = ret == 0;
+    for (int i = 0; i < nclients; i++) {
+        if (rdma_send(ctx, i, &commit, sizeof(commit)) < 0) ret = -1;
+    }
+    return ret;
+}
+
+// Client: everything a plan needs locally once the server described it
+static int plan_setup_client(rdma_plan *plan, const plan_desc *desc) {
+    if (desc->size != plan->size || desc->window != (uint32_t)plan->window) {
+        set_error("Plan shape %zu bytes x %d stages differs from the server's %llu x %u",
+                  plan->size, plan->window, (unsigned long long)desc->size, desc->window);
+        return -1;
+    }
+    plan->nranks = desc->nranks;
+    plan->rank = desc->rank;
+
+    if (plan->recv_buf && plan->recv_len < plan_result_size(plan)) {
+        set_error("Plan receive buffer of %zu bytes, %d ranks need %zu",
+                  plan->recv_len, plan->nranks, plan_result_size(plan));
+        return -1;
+    }
+    if (plan_register(plan) < 0 || plan_alloc_wrs(plan, 1, 1) < 0) return -1;
+
+    plan->remote_ids[0] = desc->plan_id;
+    for (uint32_t r = 0; r < plan->ring; r++) {
+        plan->sges[r] = (struct ibv_sge){
+            .addr = (uint64_t)(plan->send_buf + r * plan->send_stride),
+            .length = plan->size,
+            .lkey = plan->send_mr->lkey
+        };
+        plan->wrs[r] = (struct ibv_send_wr){
+            .sg_list = &plan->sges[r],
+            .num_sge = 1,
+            .opcode = IBV_WR_RDMA_WRITE_WITH_IMM,
+            .wr.rdma = {
+                .remote_addr = desc->addr + r * desc->stride + plan->rank * plan->size,
+                .rkey = desc->rkey
+            }
+        };
+    }
+    return 0;
+}
+
+// Client: learn the shape from the server, describe our receive buffer or
+// refuse with an empty descriptor, then wait for the server's verdict
+static int plan_init_client(rdma_plan *plan, bool attached) {
+    rdma_context *ctx = plan->ctx;
+
+    plan_desc desc;
+    if (rdma_recv(ctx, 0, &desc, sizeof(desc)) != (int)sizeof(desc)) {
+        set_error("Failed to receive plan descriptor from the server");
+        return -1;
+    }
+    if (desc.size == 0) {
+        set_error("Plan refused by the server");
+        return -1;
+    }
+
+    int ret = attached ? plan_setup_client(plan, &desc) : -1;
+    plan_desc ours = {0};
+    if (ret == 0) {
+        ours = (plan_desc){
+            .addr = (uint64_t)plan->recv_buf,
+            .stride = plan->recv_stride,
+            .rkey = plan->recv_mr->rkey,
+            .plan_id = plan->id,
+            .window = plan->window,
+            .size = plan->size
+        };
+    }
+    if (rdma_send(ctx, 0, &ours, sizeof(ours)) < 0) return -1;
+
+    uint32_t commit;
+    if (rdma_recv(ctx, 0, &commit, sizeof(commit)) != (int)sizeof(commit)) {
+        set_error("Failed to receive plan verdict from the server");
+        return -1;
+    }
+    if (ret == 0 && !commit) {
+        set_error("Plan refused by another rank");
+        return -1;
+    }
+    return ret;
+}
+
+// Common part of the plan constructors, NULL buffers make the plan own its slots
+static int plan_create(rdma_context *ctx, const void *send_buf, void *recv_buf,
+                       size_t recv_len, size_t size, int window, rdma_plan **plan_out) {
+    if (ctx->transport != RDMA_TRANSPORT_RC) {
+        set_error("Plans need the RC transport");
+        return -1;
+    }
+
+    rdma_plan *plan = calloc(1, sizeof(*plan));
+    if (!plan) {
+        set_error("Failed to allocate plan");
+        return -1;
+    }
+    plan->ctx = ctx;
+    plan->id = -1;
+    plan->size = size;
+    plan->send_buf = (char *)send_buf;
+    plan->recv_buf = recv_buf;
+    plan->recv_len = recv_len;
+    plan->nranks = ctx->num_peers + 1;
+    plan->window = window;
+
+    // Leave 'ring - window' stages between a slot's reuse and the oldest one in flight
+    plan->ring = 2;
+    while (plan->ring < 2 * (uint32_t)window) plan->ring *= 2;
+
+    // A plan without an id still takes part, so its peers fail with it
+    bool attached = plan_attach(ctx, plan) == 0;
+    if ((ctx->is_server ? plan_init_server(plan, attached) : plan_init_client(plan, attached)) < 0) {
+        rdma_plan_free(plan);
+        return -1;
+    }
+
+    *plan_out = plan;
+    return 0;
+}
+
+// Create a persistent all-to-all plan over the caller's buffers
+int rdma_alltoall_init(rdma_context *ctx, const void *send_buf, void *recv_buf, size_t recv_len,
+                       size_t size, rdma_plan **plan_out) {
+    if (!ctx || !send_buf || !recv_buf || !size || !plan_out || ctx->num_peers <= 0) {
+        set_error("Invalid parameters");
+        return -1;
+    }
+    return plan_create(ctx, send_buf, recv_buf, recv_len, size, 1, plan_out);
+}
+
+// Create a plan keeping up to 'window' stages in flight in its own slots
+int rdma_alltoall_init_window(rdma_context *ctx, size_t size, int window, rdma_plan **plan_out) {
+    if (!ctx || !size || !plan_out || ctx->num_peers <= 0 ||
+        window < 1 || window > RDMA_PLAN_MAX_WINDOW) {
+        set_error("Invalid parameters");
+        return -1;
+    }
+    return plan_create(ctx, NULL, NULL, 0, size, window, plan_out);
+}
+
+// Progress until the write of 'ring - window' stages ago to the peer completed
+static int plan_wait_credit(rdma_plan *plan, int peer_idx) {
+    rdma_context *ctx = plan->ctx;
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    int credits = plan->ring - plan->window;
+
+    while (peer->send_inflight >= credits) {
+        if (peer->state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        if (progress(ctx) < 0) return -1;
+    }
+    return 0;
+}
+
+// Post the prepared writes of one slot to every target for stage 'seq'
+static int plan_post(rdma_plan *plan, struct ibv_send_wr *wrs, int count, uint32_t seq) {
+    for (int i = 0; i < count; i++) {
+        if (plan_wait_credit(plan, i) < 0) return -1;
+        wrs[i].imm_data = htonl(plan->remote_ids[i] << PLAN_ID_SHIFT | (seq & PLAN_SEQ_MASK));
+        if (post_signaled(plan->ctx, i, &wrs[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Begin the next stage; its send block must not change until the stage is waited for
+int rdma_plan_start(rdma_plan *plan) {
+    if (plan->started - plan->completed >= (uint32_t)plan->window) {
+        set_error("Plan window of %d stages is full", plan->window);
+        return -1;
+    }
+    uint32_t seq = ++plan->started;
+    uint32_t slot = seq & (plan->ring - 1);
+    plan->start_ns[slot] = stat_start();
+    TRACE_INSTANT("plan_start", -1, seq);
+
+    // The server sends once every block has arrived, in rdma_plan_wait
+    if (plan->ctx->is_server) return 0;
+    return plan_post(plan, &plan->wrs[slot], 1, seq);
+}
+
+// Progress until 'count' notifications for a slot have arrived
+static int plan_wait_arrivals(rdma_plan *plan, uint32_t slot, unsigned count) {
+    rdma_context *ctx = plan->ctx;
+
+    while (plan->arrived[slot] < count) {
+        int ret = progress(ctx);
+        if (ret < 0) return -1;
+        if (ret > 0) continue;
+
+        for (int i = 0; i < ctx->num_peers; i++) {
+            if (ctx->peers[i].state != RDMA_CONN_CONNECTED) {
+                set_error("Peer %d not connected", i);
+                return -1;
+            }
+        }
+    }
+    plan->arrived[slot] -= count;
+    return 0;
+}
+
+// Finish the oldest stage in flight, its result is then at rdma_plan_result
+int rdma_plan_wait(rdma_plan *plan) {
+    rdma_context *ctx = plan->ctx;
+    if (plan->completed == plan->started) {
+        set_error("Plan stage not started");
+        return -1;
+    }
+    uint32_t seq = plan->completed + 1;
+    uint32_t slot = seq & (plan->ring - 1);
+    size_t result = plan_result_size(plan);
+    char *out = plan->recv_buf + slot * plan->recv_stride;
+
+    // The caller may reuse its own buffers after this returns, our slots wait
+    bool drain = plan->send_stride == 0;
+
+    if (ctx->is_server) {
+        int nclients = ctx->num_peers;
+        const char *staged = plan->staging + slot * result;
+
+        if (plan_wait_arrivals(plan, slot, nclients) < 0) return -1;
+        int ret = plan_post(plan, &plan->wrs[slot * nclients], nclients, seq);
+
+        // Our own copy is assembled while the NIC sends
+        memcpy(out, plan->send_buf + slot * plan->send_stride, plan->size);
+        memcpy(out + plan->size, staged + plan->size, result - plan->size);
+
+        for (int i = 0; i < nclients && drain; i++) {
+            if (wait_sends(ctx, i) < 0) ret = -1;
+        }
+        if (ret < 0) return -1;
+        for (int i = 0; i < nclients; i++) {
+            stat_op(&ctx->peers[i], RDMA_OP_ALLTOALL, result + plan->size, plan->start_ns[slot]);
+        }
+    } else {
+        if (plan_wait_arrivals(plan, slot, 1) < 0) return -1;
+        if (drain && wait_sends(ctx, 0) < 0) return -1;
+        stat_op(&ctx->peers[0], RDMA_OP_ALLTOALL, result + plan->size, plan->start_ns[slot]);
+    }
+
+    plan->completed = seq;
+    TRACE_INSTANT("plan_done", -1, seq);
+    return 0;
+}
+
+// Send block of the next stage to start
+void *rdma_plan_send_buf(rdma_plan *plan) {
+    return plan->send_buf + ((plan->started + 1) & (plan->ring - 1)) * plan->send_stride;
+}
+
+// Result of the last stage waited for
+const void *rdma_plan_result(rdma_plan *plan) {
+    return plan->recv_buf + (plan->completed & (plan->ring - 1)) * plan->recv_stride;
+}
+
+int rdma_plan_inflight(const rdma_plan *plan) {
+    return plan->started - plan->completed;
+}
+
+int rdma_plan_rank(const rdma_plan *plan) {
+    return plan->rank;
+}
+
+int rdma_plan_num_ranks(const rdma_plan *plan) {
+    return plan->nranks;
+}
+
+// Release a plan, no stage may be in flight
+void rdma_plan_free(rdma_plan *plan) {
+    if (!plan) return;
+
+    rdma_context *ctx = plan->ctx;
+    if (plan->id >= 0) {
+        ctx->plans[plan->id] = NULL;
+    }
+    if (plan->staging_mr) ibv_dereg_mr(plan->staging_mr);
+    if (plan->recv_mr) ibv_dereg_mr(plan->recv_mr);
+    if (plan->send_mr) ibv_dereg_mr(plan->send_mr);
+    free(plan->staging);
+    free(plan->owned);
+    free(plan->wrs);
+    free(plan->sges);
+    free(plan->remote_ids);
+    free(plan->arrived);
+    free(plan->start_ns);
+    free(plan);
+}
+
+// Release the plans the application did not free before the context goes
+void plan_cleanup(rdma_context *ctx) {
+    if (!ctx->plans) return;
+    for (int i = 0; i < RDMA_MAX_PLANS; i++) {
+        rdma_plan_free(ctx->plans[i]);
+    }
+    free(ctx->plans);
+    ctx->plans = NULL;
+}
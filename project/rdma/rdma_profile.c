@@ -0,0 +1,167 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <ctype.h>
+
+// Tuning profiles: the runtime values of the queue depths and thresholds
+// that used to be fixed at compile time. A profile is a text file of
+// 'key = value' lines, written by rdma_tune for one device and cluster.
+// Each key can also be set with an environment variable named RDMA_ and the
+// key in upper case, e.g. RDMA_SEND_WR=256, which wins over the profile.
+
+static const rdma_tuning_key profile_keys[] = {
+    {"send_wr", "RDMA_SEND_WR", offsetof(rdma_tuning, send_wr), 1, 32768},
+    {"cq_depth", "RDMA_CQ_DEPTH", offsetof(rdma_tuning, cq_depth), 1, 1 << 20},
+    {"srq_depth", "RDMA_SRQ_DEPTH", offsetof(rdma_tuning, srq_depth), SRQ_LIMIT * 2, 65535},
+    {"inline_size", "RDMA_INLINE_SIZE", offsetof(rdma_tuning, inline_size), 0, 4096},
+    {"chunk_size", "RDMA_CHUNK_SIZE", offsetof(rdma_tuning, chunk_size), 0, 1U << 30},
+    {"qp_pool", "RDMA_QP_POOL", offsetof(rdma_tuning, qp_pool), 0, 4096},
+};
+
+#define NUM_PROFILE_KEYS (int)(sizeof(profile_keys) / sizeof(profile_keys[0]))
+
+const rdma_tuning_key *rdma_tuning_keys(int *count) {
+    if (count) *count = NUM_PROFILE_KEYS;
+    return profile_keys;
+}
+
+const rdma_tuning_key *rdma_find_tuning_key(const char *key) {
+    for (int i = 0; i < NUM_PROFILE_KEYS; i++) {
+        if (strcmp(profile_keys[i].key, key) == 0) return &profile_keys[i];
+    }
+    return NULL;
+}
+
+uint32_t *rdma_tuning_field(rdma_tuning *t, const rdma_tuning_key *key) {
+    return (uint32_t *)((char *)t + key->field);
+}
+
+void rdma_tuning_defaults(rdma_tuning *t) {
+    t->send_wr = MAX_WR;
+    t->cq_depth = CQ_DEPTH;
+    t->srq_depth = SRQ_DEPTH;
+    t->inline_size = 0;
+    t->chunk_size = 0;
+    t->qp_pool = 0;
+}
+
+// Parse and range check the value of key 'k'
+static int set_key(rdma_tuning *t, const rdma_tuning_key *k, const char *value,
+                   const char *origin) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(value, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (errno || end == value || *end || v < k->min || v > k->max) {
+        set_error("%s: %s must be between %u and %u", origin, k->key, k->min, k->max);
+        return -1;
+    }
+    *rdma_tuning_field(t, k) = (uint32_t)v;
+    return 0;
+}
+
+// Read a profile over 't', keys the profile leaves out keep their value
+int rdma_load_profile(const char *path, rdma_tuning *t) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        set_error("Failed to open profile %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char line[256];
+    char origin[300];
+    int lineno = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (!*key) continue;
+
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            set_error("%s:%d: expected 'key = value'", path, lineno);
+            ret = -1;
+            break;
+        }
+        char *end = eq;
+        while (end > key && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+
+        // Keys of newer libraries are skipped, so profiles stay usable
+        const rdma_tuning_key *k = rdma_find_tuning_key(key);
+        if (!k) {
+            log_warn("%s:%d: unknown key '%s'", path, lineno, key);
+            continue;
+        }
+        snprintf(origin, sizeof(origin), "%s:%d", path, lineno);
+        ret = set_key(t, k, eq + 1, origin);
+    }
+    fclose(f);
+    return ret;
+}
+
+// Write 't' as a profile, 'comment' lines go into its header
+int rdma_save_profile(const char *path, const rdma_tuning *t, const char *comment) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        set_error("Failed to create profile %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# rdma tuning profile\n");
+    for (const char *c = comment; c && *c;) {
+        size_t len = strcspn(c, "\n");
+        fprintf(f, "# %.*s\n", (int)len, c);
+        c += len + (c[len] == '\n');
+    }
+    for (int i = 0; i < NUM_PROFILE_KEYS; i++) {
+        fprintf(f, "%s = %u\n", profile_keys[i].key,
+                *rdma_tuning_field((rdma_tuning *)t, &profile_keys[i]));
+    }
+
+    if (fclose(f) != 0) {
+        set_error("Failed to write profile %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Tuning of a new context: defaults, then the profile, the attributes and
+// finally the environment
+int tune_resolve(const rdma_init_attr *attr, rdma_tuning *t) {
+    rdma_tuning_defaults(t);
+
+    const char *path = attr->profile ? attr->profile : getenv("RDMA_PROFILE");
+    if (path && *path && rdma_load_profile(path, t) < 0) return -1;
+
+    if (attr->tuning) *t = *attr->tuning;
+    if (attr->chunk_size) t->chunk_size = (uint32_t)attr->chunk_size;
+    if (attr->qp_pool) t->qp_pool = (uint32_t)attr->qp_pool;
+
+    for (int i = 0; i < NUM_PROFILE_KEYS; i++) {
+        const rdma_tuning_key *k = &profile_keys[i];
+        const char *value = getenv(k->env);
+        if (value && *value && set_key(t, k, value, k->env) < 0) return -1;
+
+        uint32_t v = *rdma_tuning_field(t, k);
+        if (v < k->min || v > k->max) {
+            set_error("%s must be between %u and %u", k->key, k->min, k->max);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_get_tuning(rdma_context *ctx, rdma_tuning *t) {
+    if (!ctx || !t) {
+        set_error("Invalid arguments");
+        return -1;
+    }
+    *t = ctx->tune;
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Send rate limits per peer and per context. A peer limit goes to the NIC's
+// packet pacer with ibv_modify_qp_rate_limit where the device supports it;
+// otherwise, and always for the context limit of RC peers, a token bucket in
+// the send path holds posts back. The bucket may go into debt by one message,
+// so a burst of large sends is spread at the configured rate instead of being
+// split into chunks.
+
+#define RATE_PKT_SIZE 1024          // Typical packet for the NIC pacer, the path MTU
+
+struct rdma_pacer {
+    uint64_t rate;          // Bytes per second
+    uint64_t burst;         // Bytes that may leave back to back
+    int64_t tokens;         // Bytes that may be sent now, negative while in debt
+    uint64_t last_ns;       // Time of the last refill
+    bool hw;                // The NIC enforces the limit, the bucket is unused
+};
+
+// Add the tokens earned since the last refill
+static void pacer_refill(struct rdma_pacer *p, uint64_t now) {
+    unsigned __int128 earned = (unsigned __int128)(now - p->last_ns) * p->rate / 1000000000ULL;
+    if (earned == 0) return;
+
+    // Keep the fraction of a byte not earned yet for the next refill
+    if ((__int128)p->tokens + (__int128)earned >= (__int128)p->burst) {
+        p->tokens = (int64_t)p->burst;
+        p->last_ns = now;
+    } else {
+        p->tokens += (int64_t)earned;
+        p->last_ns += (uint64_t)(earned * 1000000000ULL / p->rate);
+    }
+}
+
+// Hand a limit to the NIC pacer of a QP in RTS, false if it cannot enforce it
+static bool pacer_apply_hw(struct ibv_qp *qp, const struct rdma_pacer *p) {
+    uint64_t kbps = p ? p->rate * 8 / 1000 : 0;
+    if (p && (kbps == 0 || kbps > UINT32_MAX)) return false;
+
+    struct ibv_qp_rate_limit_attr attr = {
+        .rate_limit = (uint32_t)kbps,
+        .max_burst_sz = p ? (uint32_t)p->burst : 0,
+        .typical_pkt_sz = RATE_PKT_SIZE
+    };
+    int ret = ibv_modify_qp_rate_limit(qp, &attr);
+    if (ret && p) {
+        log_debug("NIC rate limit unavailable (%s), pacing in software", strerror(ret));
+    }
+    return ret == 0;
+}
+
+// QP that carries the traffic a limit applies to, NULL if only software fits
+static struct ibv_qp *pacer_qp(rdma_context *ctx, int peer_idx) {
+    if (peer_idx < 0) {
+        // Only a datagram context sends everything through one QP
+        return ctx->ud_qp;
+    }
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    return peer->state == RDMA_CONN_CONNECTED ? peer->qp : NULL;
+}
+
+// Set or remove the send rate limit of a peer or of the whole context
+int rdma_set_rate_limit(rdma_context *ctx, int peer_idx, uint64_t bytes_per_sec, uint32_t burst) {
+    if (!ctx || peer_idx >= ctx->num_peers || peer_idx < -1) {
+        set_error("Invalid peer index");
+        return -1;
+    }
+
+    struct rdma_pacer **slot = peer_idx < 0 ? &ctx->pacer : &ctx->peers[peer_idx].pacer;
+    struct ibv_qp *qp = pacer_qp(ctx, peer_idx);
+
+    if (bytes_per_sec == 0) {
+        if (*slot && (*slot)->hw && qp) {
+            pacer_apply_hw(qp, NULL);
+        }
+        free(*slot);
+        *slot = NULL;
+        return 0;
+    }
+
+    if (!*slot) {
+        *slot = calloc(1, sizeof(**slot));
+        if (!*slot) {
+            set_error("Failed to allocate rate limiter");
+            return -1;
+        }
+    }
+
+    struct rdma_pacer *p = *slot;
+    p->rate = bytes_per_sec;
+    p->burst = burst ? burst : RATE_DEFAULT_BURST;
+    p->tokens = (int64_t)p->burst;
+    p->last_ns = now_ns();
+    p->hw = qp && pacer_apply_hw(qp, p);
+
+    log_info("%s rate limit %.1f MB/s, burst %llu B, %s",
+             peer_idx < 0 ? "context" : "peer", bytes_per_sec / 1e6,
+             (unsigned long long)p->burst, p->hw ? "NIC pacer" : "software pacer");
+    return p->hw ? 1 : 0;
+}
+
+// A peer got a new QP, move its limit over to the NIC pacer again
+void rate_peer_connected(rdma_context *ctx, int peer_idx) {
+    struct rdma_pacer *p = ctx->peers[peer_idx].pacer;
+    if (!p || !ctx->peers[peer_idx].qp) return;
+
+    p->hw = pacer_apply_hw(ctx->peers[peer_idx].qp, p);
+    p->tokens = (int64_t)p->burst;
+    p->last_ns = now_ns();
+}
+
+// Wait until the limits of the peer and the context admit 'bytes' more
+int pace_wait(rdma_context *ctx, int peer_idx, size_t bytes) {
+    struct rdma_pacer *p = ctx->peers[peer_idx].pacer;
+    struct rdma_pacer *c = ctx->pacer;
+    if (p && p->hw) p = NULL;
+    if (c && c->hw) c = NULL;
+    if (!p && !c) return 0;
+
+    uint64_t now = now_ns();
+    uint64_t start = now;
+    for (;;) {
+        if (p) pacer_refill(p, now);
+        if (c) pacer_refill(c, now);
+        if ((!p || p->tokens >= 0) && (!c || c->tokens >= 0)) break;
+
+        if (ctx->peers[peer_idx].state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        // Completions keep being served while the send is held back
+        if (progress(ctx) < 0) return -1;
+        now = now_ns();
+    }
+
+    if (p) p->tokens -= (int64_t)bytes;
+    if (c) c->tokens -= (int64_t)bytes;
+    if (now != start) {
+        STAT_ADD(ctx->peers[peer_idx].stats.paced_ns, now - start);
+        TRACE_INSTANT("paced", peer_idx, (uint32_t)((now - start) / 1000));
+    }
+    return 0;
+}
+
+// Release the limits of the context and of every peer
+void rate_cleanup(rdma_context *ctx) {
+    for (int i = 0; i < ctx->num_peers; i++) {
+        free(ctx->peers[i].pacer);
+        ctx->peers[i].pacer = NULL;
+    }
+    free(ctx->pacer);
+    ctx->pacer = NULL;
+}
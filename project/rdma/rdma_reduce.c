@@ -0,0 +1,368 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Allreduce over the server and its clients, and a bucketing layer that
+// fuses many small tensors into few large allreduces. Clients stream their
+// buffer to the server, which reduces every chunk straight out of its
+// receive slot into the result and streams the result back. Buckets are
+// registered once, so neither direction stages through comm_buf.
+
+struct rdma_bucket {
+    char *buf;
+    size_t cap;
+    size_t len;
+    int first_tensor;       // Tensors of a bucket are consecutive
+    int num_tensors;
+    int num_ready;
+};
+
+struct rdma_bucket_tensor {
+    void *data;
+    size_t bytes;
+    int bucket;
+    size_t offset;          // Offset of the tensor in its bucket
+    bool ready;
+};
+
+struct rdma_bucketer {
+    rdma_context *ctx;
+    rdma_dtype dtype;
+    rdma_reduce_op op;
+    size_t bucket_bytes;
+    struct rdma_bucket_tensor *tensors;
+    int num_tensors;
+    int tensor_cap;
+    struct rdma_bucket *buckets;
+    int num_buckets;
+    int bucket_cap;
+    int next;               // Bucket whose allreduce is launched next
+    bool started;           // A tensor of the current round was marked ready
+    uint64_t allreduces;
+};
+
+static const size_t dtype_sizes[RDMA_DTYPE_COUNT] = {4, 8, 4, 8};
+
+size_t rdma_dtype_size(rdma_dtype dtype) {
+    return dtype >= 0 && dtype < RDMA_DTYPE_COUNT ? dtype_sizes[dtype] : 0;
+}
+
+// Elementwise dst = dst op src for 'n' elements of one type. Chunks from the
+// wire need not be aligned, so elements are loaded with memcpy, which the
+// compiler turns into plain (vectorized) loads
+#define REDUCE_LOOP(T, dst, src, n, expr) do { \
+        T *d_ = (T *)(dst); \
+        const char *s_ = (const char *)(src); \
+        for (size_t i_ = 0; i_ < (n); i_++) { \
+            T a = d_[i_], b; \
+            memcpy(&b, s_ + i_ * sizeof(T), sizeof(T)); \
+            d_[i_] = (expr); \
+        } \
+    } while (0)
+
+#define REDUCE_TYPE(T, dst, src, n, op) do { \
+        switch (op) { \
+        case RDMA_REDUCE_SUM: REDUCE_LOOP(T, dst, src, n, a + b); break; \
+        case RDMA_REDUCE_PROD: REDUCE_LOOP(T, dst, src, n, a * b); break; \
+        case RDMA_REDUCE_MIN: REDUCE_LOOP(T, dst, src, n, b < a ? b : a); break; \
+        case RDMA_REDUCE_MAX: REDUCE_LOOP(T, dst, src, n, b > a ? b : a); break; \
+        } \
+    } while (0)
+
+static void reduce(void *dst, const void *src, size_t n, rdma_dtype dtype, rdma_reduce_op op) {
+    switch (dtype) {
+    case RDMA_DTYPE_FLOAT32: REDUCE_TYPE(float, dst, src, n, op); break;
+    case RDMA_DTYPE_FLOAT64: REDUCE_TYPE(double, dst, src, n, op); break;
+    case RDMA_DTYPE_INT32: REDUCE_TYPE(int32_t, dst, src, n, op); break;
+    case RDMA_DTYPE_INT64: REDUCE_TYPE(int64_t, dst, src, n, op); break;
+    default: break;
+    }
+}
+
+// Kernel of rdma_allreduce: one of the built-in types and reductions
+struct builtin_op {
+    rdma_dtype dtype;
+    rdma_reduce_op op;
+};
+
+static void builtin_reduce(void *dst, const void *src, size_t count, void *arg) {
+    const struct builtin_op *b = arg;
+    reduce(dst, src, count, b->dtype, b->op);
+}
+
+// Reduction of one incoming message into the result, chunk by chunk. An
+// element split between two chunks is completed in 'carry'
+struct reduce_state {
+    char *dst;
+    size_t off;
+    size_t len;
+    size_t esize;
+    rdma_reduce_fn fn;
+    void *arg;
+    char carry[RDMA_REDUCE_MAX_ELEM];
+    size_t carry_len;
+};
+
+static int reduce_chunk(void *arg, const void *chunk, size_t len) {
+    struct reduce_state *st = arg;
+    const char *src = chunk;
+
+    if (st->off + st->carry_len + len > st->len) {
+        set_error("Allreduce contribution exceeds %zu bytes", st->len);
+        return -1;
+    }
+    if (st->carry_len) {
+        size_t n = st->esize - st->carry_len < len ? st->esize - st->carry_len : len;
+        memcpy(st->carry + st->carry_len, src, n);
+        st->carry_len += n;
+        src += n;
+        len -= n;
+        if (st->carry_len < st->esize) return 0;
+        st->fn(st->dst + st->off, st->carry, 1, st->arg);
+        st->off += st->esize;
+        st->carry_len = 0;
+    }
+
+    size_t whole = len / st->esize;
+    if (whole) st->fn(st->dst + st->off, src, whole, st->arg);
+    st->off += whole * st->esize;
+    st->carry_len = len - whole * st->esize;
+    memcpy(st->carry, src + whole * st->esize, st->carry_len);
+    return 0;
+}
+
+// Reduce 'count' elements of every rank into 'buf' on every rank
+int rdma_allreduce(rdma_context *ctx, void *buf, size_t count, rdma_dtype dtype,
+                   rdma_reduce_op op) {
+    if (op < RDMA_REDUCE_SUM || op > RDMA_REDUCE_MAX) {
+        set_error("Invalid allreduce arguments");
+        return -1;
+    }
+    struct builtin_op b = {.dtype = dtype, .op = op};
+    return rdma_allreduce_fn(ctx, buf, count, rdma_dtype_size(dtype), builtin_reduce, &b);
+}
+
+// Same with the caller's kernel for elements of 'esize' bytes
+int rdma_allreduce_fn(rdma_context *ctx, void *buf, size_t count, size_t esize,
+                      rdma_reduce_fn fn, void *arg) {
+    if (!ctx || (!buf && count) || esize == 0 || esize > RDMA_REDUCE_MAX_ELEM || !fn) {
+        set_error("Invalid allreduce arguments");
+        return -1;
+    }
+    if (ctx->num_peers <= 0) return 0;
+    size_t len = count * esize;
+    TRACE_BEGIN("allreduce", -1);
+
+    if (!ctx->is_server) {
+        if (rdma_send(ctx, 0, buf, len) < 0) return -1;
+        int n = rdma_recv(ctx, 0, buf, len);
+        if (n < 0) return -1;
+        if ((size_t)n != len) {
+            set_error("Allreduce result of %d bytes, expected %zu", n, len);
+            return -1;
+        }
+        TRACE_END("allreduce", -1);
+        return 0;
+    }
+
+    // Contributions are folded in peer order, so results do not depend on timing
+    for (int i = 0; i < ctx->num_peers; i++) {
+        struct reduce_state st = {
+            .dst = buf, .len = len, .esize = esize, .fn = fn, .arg = arg
+        };
+        if (recv_visit(ctx, i, reduce_chunk, &st) < 0) return -1;
+        if (st.off != len || st.carry_len) {
+            set_error("Allreduce contribution of peer %d is %zu bytes, expected %zu",
+                      i, st.off + st.carry_len, len);
+            return -1;
+        }
+    }
+    for (int i = 0; i < ctx->num_peers; i++) {
+        if (rdma_send(ctx, i, buf, len) < 0) return -1;
+    }
+    TRACE_END("allreduce", -1);
+    return 0;
+}
+
+int rdma_bucketer_create(rdma_context *ctx, size_t bucket_bytes, rdma_dtype dtype,
+                         rdma_reduce_op op, rdma_bucketer **bucketer) {
+    if (!ctx || !bucketer || bucket_bytes == 0 || rdma_dtype_size(dtype) == 0 ||
+        op < RDMA_REDUCE_SUM || op > RDMA_REDUCE_MAX) {
+        set_error("Invalid bucketer arguments");
+        return -1;
+    }
+
+    rdma_bucketer *b = calloc(1, sizeof(*b));
+    if (!b) {
+        set_error("Failed to allocate bucketer");
+        return -1;
+    }
+    b->ctx = ctx;
+    b->dtype = dtype;
+    b->op = op;
+    b->bucket_bytes = bucket_bytes;
+    *bucketer = b;
+    return 0;
+}
+
+// Open a new bucket large enough for 'bytes', registered for zero-copy sends
+static int bucket_open(rdma_bucketer *b, size_t bytes) {
+    if (b->num_buckets == b->bucket_cap) {
+        int cap = b->bucket_cap ? b->bucket_cap * 2 : 8;
+        struct rdma_bucket *buckets = realloc(b->buckets, cap * sizeof(*buckets));
+        if (!buckets) {
+            set_error("Failed to grow bucket table");
+            return -1;
+        }
+        b->buckets = buckets;
+        b->bucket_cap = cap;
+    }
+
+    struct rdma_bucket *bk = &b->buckets[b->num_buckets];
+    memset(bk, 0, sizeof(*bk));
+    bk->first_tensor = b->num_tensors;
+    bk->cap = bytes > b->bucket_bytes ? bytes : b->bucket_bytes;
+    bk->buf = aligned_alloc(4096, (bk->cap + 4095) & ~(size_t)4095);
+    if (!bk->buf) {
+        set_error("Failed to allocate bucket of %zu bytes", bk->cap);
+        return -1;
+    }
+    if (rdma_reg_buffer(b->ctx, bk->buf, bk->cap) < 0) {
+        free(bk->buf);
+        return -1;
+    }
+    b->num_buckets++;
+    return 0;
+}
+
+// Register a tensor; tensors are added in the order their gradients become
+// ready (backward order) and fill buckets in that order
+int rdma_bucketer_add(rdma_bucketer *b, void *data, size_t count) {
+    size_t bytes = count * rdma_dtype_size(b->dtype);
+    if (!data || count == 0) {
+        set_error("Invalid tensor");
+        return -1;
+    }
+    if (b->started || b->allreduces) {
+        set_error("Tensors must be added before the first one is ready");
+        return -1;
+    }
+
+    struct rdma_bucket *last = b->num_buckets ? &b->buckets[b->num_buckets - 1] : NULL;
+    if (!last || last->len + bytes > last->cap) {
+        if (bucket_open(b, bytes) < 0) return -1;
+        last = &b->buckets[b->num_buckets - 1];
+    }
+
+    if (b->num_tensors == b->tensor_cap) {
+        int cap = b->tensor_cap ? b->tensor_cap * 2 : 64;
+        struct rdma_bucket_tensor *tensors = realloc(b->tensors, cap * sizeof(*tensors));
+        if (!tensors) {
+            set_error("Failed to grow tensor table");
+            return -1;
+        }
+        b->tensors = tensors;
+        b->tensor_cap = cap;
+    }
+
+    struct rdma_bucket_tensor *t = &b->tensors[b->num_tensors];
+    t->data = data;
+    t->bytes = bytes;
+    t->bucket = b->num_buckets - 1;
+    t->offset = last->len;
+    t->ready = false;
+    last->len += bytes;
+    last->num_tensors++;
+    return b->num_tensors++;
+}
+
+// Allreduce a full bucket and scatter the result back into its tensors
+static int bucket_reduce(rdma_bucketer *b, int idx) {
+    struct rdma_bucket *bk = &b->buckets[idx];
+
+    if (rdma_allreduce(b->ctx, bk->buf, bk->len / rdma_dtype_size(b->dtype), b->dtype, b->op) < 0) {
+        return -1;
+    }
+    b->allreduces++;
+
+    for (int i = bk->first_tensor; i < bk->first_tensor + bk->num_tensors; i++) {
+        struct rdma_bucket_tensor *t = &b->tensors[i];
+        memcpy(t->data, bk->buf + t->offset, t->bytes);
+        t->ready = false;
+    }
+    bk->num_ready = 0;
+    return 0;
+}
+
+// Launch the buckets that are full, in bucket order so every rank issues
+// the same sequence of allreduces
+static int launch_ready(rdma_bucketer *b) {
+    while (b->next < b->num_buckets &&
+           b->buckets[b->next].num_ready == b->buckets[b->next].num_tensors) {
+        if (bucket_reduce(b, b->next) < 0) return -1;
+        b->next++;
+    }
+    if (b->next == b->num_buckets) {
+        b->next = 0;
+        b->started = false;
+    }
+    return 0;
+}
+
+// Pack a tensor whose gradient is final; its bucket is reduced once full
+int rdma_bucketer_ready(rdma_bucketer *b, int tensor) {
+    if (tensor < 0 || tensor >= b->num_tensors) {
+        set_error("Invalid tensor index %d", tensor);
+        return -1;
+    }
+    struct rdma_bucket_tensor *t = &b->tensors[tensor];
+    if (t->ready) {
+        set_error("Tensor %d marked ready twice", tensor);
+        return -1;
+    }
+
+    struct rdma_bucket *bk = &b->buckets[t->bucket];
+    memcpy(bk->buf + t->offset, t->data, t->bytes);
+    t->ready = true;
+    bk->num_ready++;
+    b->started = true;
+    return launch_ready(b);
+}
+
+// Reduce the buckets still pending, with the current contents of tensors
+// that were never marked ready
+int rdma_bucketer_flush(rdma_bucketer *b) {
+    if (!b->started) return 0;
+
+    do {
+        struct rdma_bucket *bk = &b->buckets[b->next];
+        for (int i = bk->first_tensor; i < bk->first_tensor + bk->num_tensors; i++) {
+            struct rdma_bucket_tensor *t = &b->tensors[i];
+            if (t->ready) continue;
+            memcpy(bk->buf + t->offset, t->data, t->bytes);
+            t->ready = true;
+            bk->num_ready++;
+        }
+        if (launch_ready(b) < 0) return -1;
+    } while (b->started);
+    return 0;
+}
+
+int rdma_bucketer_num_buckets(const rdma_bucketer *b) {
+    return b->num_buckets;
+}
+
+uint64_t rdma_bucketer_allreduces(const rdma_bucketer *b) {
+    return b->allreduces;
+}
+
+void rdma_bucketer_free(rdma_bucketer *b) {
+    if (!b) return;
+    for (int i = 0; i < b->num_buckets; i++) {
+        rdma_dereg_buffer(b->ctx, b->buckets[i].buf);
+        free(b->buckets[i].buf);
+    }
+    free(b->buckets);
+    free(b->tensors);
+    free(b);
+}
@@ -0,0 +1,174 @@
+#include "rdma_internal.h"
+#include <string.h>
+#include <errno.h>
+
+// Completion timestamps. With a device clock the CQ is created with
+// ibv_create_cq_ex and every completion carries the NIC's free-running
+// counter, converted to CLOCK_MONOTONIC through an anchor pair taken with
+// ibv_query_rt_values_ex. Devices without one (rxe) fall back to reading the
+// host clock once per polled batch, which still includes the polling delay.
+
+#define CLOCK_REANCHOR_NS 1000000000ULL     // Limits drift between the two clocks
+
+struct rdma_clock_ctx {
+    uint64_t mask;          // Valid bits of a device timestamp
+    double ns_per_tick;
+    uint64_t anchor_raw;    // Device clock read at anchor_ns
+    uint64_t anchor_ns;
+};
+
+// Pair the device clock with the host clock
+static int clock_anchor(rdma_context *ctx) {
+    struct rdma_clock_ctx *c = ctx->clock;
+    struct ibv_values_ex values = {.comp_mask = IBV_VALUES_MASK_RAW_CLOCK};
+
+    uint64_t before = now_ns();
+    int err = ibv_query_rt_values_ex(ctx->context, &values);
+    uint64_t after = now_ns();
+    if (err) {
+        set_error("Failed to read the device clock: %s", strerror(err));
+        return -1;
+    }
+
+    c->anchor_raw = ((uint64_t)values.raw_clock.tv_sec * 1000000000ULL +
+                     values.raw_clock.tv_nsec) & c->mask;
+    c->anchor_ns = before + (after - before) / 2;
+    return 0;
+}
+
+// Convert a device timestamp, which may predate the anchor slightly
+static uint64_t clock_to_ns(const struct rdma_clock_ctx *c, uint64_t raw) {
+    uint64_t ticks = (raw - c->anchor_raw) & c->mask;
+    if (ticks > c->mask / 2) {
+        ticks = (c->anchor_raw - raw) & c->mask;
+        return c->anchor_ns - (uint64_t)(ticks * c->ns_per_tick);
+    }
+    return c->anchor_ns + (uint64_t)(ticks * c->ns_per_tick);
+}
+
+// Extended CQ reporting device timestamps, fails if the device has no clock
+static int create_device_cq(rdma_context *ctx, int depth) {
+    struct ibv_device_attr_ex attr;
+    if (ibv_query_device_ex(ctx->context, NULL, &attr)) {
+        set_error("Failed to query device: %s", strerror(errno));
+        return -1;
+    }
+    if (!attr.completion_timestamp_mask || !attr.hca_core_clock) {
+        set_error("Device has no completion clock");
+        return -1;
+    }
+
+    ctx->clock = calloc(1, sizeof(*ctx->clock));
+    if (!ctx->clock) {
+        set_error("Failed to allocate clock state");
+        return -1;
+    }
+    ctx->clock->mask = attr.completion_timestamp_mask;
+    ctx->clock->ns_per_tick = 1e6 / attr.hca_core_clock;   // hca_core_clock is in kHz
+    if (clock_anchor(ctx) < 0) goto cleanup_clock;
+
+    struct ibv_cq_init_attr_ex cq_attr = {
+        .cqe = depth,
+        .wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM | IBV_WC_EX_WITH_QP_NUM |
+                    IBV_WC_EX_WITH_SRC_QP | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP
+    };
+    ctx->cq_ex = ibv_create_cq_ex(ctx->context, &cq_attr);
+    if (!ctx->cq_ex) {
+        set_error("Failed to create timestamping CQ: %s", strerror(errno));
+        goto cleanup_clock;
+    }
+    ctx->cq = ibv_cq_ex_to_cq(ctx->cq_ex);
+    return 0;
+
+cleanup_clock:
+    free(ctx->clock);
+    ctx->clock = NULL;
+    return -1;
+}
+
+// Create the context CQ, timestamping completions if requested
+int ts_create_cq(rdma_context *ctx, int depth, bool timestamps) {
+    ctx->ts_source = RDMA_TS_OFF;
+    if (timestamps) {
+        if (create_device_cq(ctx, depth) == 0) {
+            ctx->ts_source = RDMA_TS_DEVICE;
+            return 0;
+        }
+        log_info("no device timestamps (%s), using the host clock", rdma_get_error());
+        ctx->ts_source = RDMA_TS_HOST;
+    }
+
+    ctx->cq = ibv_create_cq(ctx->context, depth, NULL, NULL, 0);
+    if (!ctx->cq) {
+        set_error("Failed to create CQ");
+        return -1;
+    }
+    return 0;
+}
+
+void ts_destroy_cq(rdma_context *ctx) {
+    if (ctx->cq) {
+        ibv_destroy_cq(ctx->cq);
+        ctx->cq = NULL;
+        ctx->cq_ex = NULL;
+    }
+    free(ctx->clock);
+    ctx->clock = NULL;
+}
+
+// Poll up to 'max' completions and their timestamps (0 when off)
+int ts_poll_cq(rdma_context *ctx, struct ibv_wc *wc, uint64_t *ts, int max) {
+    if (!ctx->cq_ex) {
+        int n = ibv_poll_cq(ctx->cq, max, wc);
+        if (n > 0) {
+            uint64_t now = ctx->ts_source == RDMA_TS_HOST ? now_ns() : 0;
+            for (int i = 0; i < n; i++) ts[i] = now;
+        }
+        return n;
+    }
+
+    struct ibv_cq_ex *cq = ctx->cq_ex;
+    struct ibv_poll_cq_attr attr = {0};
+    int ret = ibv_start_poll(cq, &attr);
+    if (ret == ENOENT) return 0;
+    if (ret) return -1;
+
+    int n = 0;
+    do {
+        struct ibv_wc *w = &wc[n];
+        w->wr_id = cq->wr_id;
+        w->status = cq->status;
+        w->opcode = ibv_wc_read_opcode(cq);
+        w->vendor_err = ibv_wc_read_vendor_err(cq);
+        w->byte_len = ibv_wc_read_byte_len(cq);
+        w->qp_num = ibv_wc_read_qp_num(cq);
+        w->src_qp = ibv_wc_read_src_qp(cq);
+        w->wc_flags = ibv_wc_read_wc_flags(cq);
+        if (w->wc_flags & IBV_WC_WITH_IMM) {
+            w->imm_data = ibv_wc_read_imm_data(cq);
+        }
+        ts[n] = clock_to_ns(ctx->clock, ibv_wc_read_completion_ts(cq));
+        n++;
+    } while (n < max && ibv_next_poll(cq) == 0);
+    ibv_end_poll(cq);
+
+    // Re-anchor outside the poll window, only on batches that found work
+    if (now_ns() - ctx->clock->anchor_ns > CLOCK_REANCHOR_NS && clock_anchor(ctx) < 0) {
+        log_warn("%s", rdma_get_error());
+    }
+    return n;
+}
+
+// Account the wire time of the oldest in-flight send of a peer
+void ts_send_completed(rdma_context *ctx, rdma_peer_conn *peer, uint64_t ts) {
+    if (!peer->post_ns || peer->post_head == peer->post_tail) return;
+
+    uint64_t posted = peer->post_ns[peer->post_head++ % ctx->tune.send_wr];
+    if (ts > posted) {
+        stat_hist(peer->stats.wire_hist, ts - posted);
+    }
+}
+
+rdma_ts_source rdma_timestamp_source(rdma_context *ctx) {
+    return ctx->ts_source;
+}
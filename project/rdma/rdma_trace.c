@@ -0,0 +1,194 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+
+// Timeline tracing: events are appended to a ring buffer owned by the
+// recording thread, so the hot path takes no locks. Timestamps are raw TSC
+// ticks, calibrated against CLOCK_MONOTONIC when the trace is written and
+// anchored to CLOCK_REALTIME so files of different ranks line up when merged.
+
+typedef struct {
+    uint64_t ticks;
+    const char *name;       // String literal, never copied
+    int32_t peer;
+    uint32_t arg;
+    char ph;                // Chrome trace phase: B, E or i
+} trace_event;
+
+typedef struct trace_ring {
+    trace_event events[TRACE_RING_EVENTS];
+    uint64_t head;          // Events ever recorded, the ring keeps the newest
+    int tid;
+    struct trace_ring *next;
+} trace_ring;
+
+bool trace_enabled;
+volatile sig_atomic_t trace_dump_pending;
+
+static char trace_path[256];
+static trace_ring *trace_rings;
+static int trace_next_tid;
+static int trace_generation;        // Bumped when the rings are freed
+static __thread trace_ring *trace_local;
+static __thread int trace_local_generation;
+
+// Calibration anchor taken when tracing starts
+static uint64_t anchor_ticks;
+static uint64_t anchor_mono_ns;
+static uint64_t anchor_real_ns;
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Register the ring of the calling thread on first use
+static trace_ring *trace_ring_get(void) {
+    if (trace_local && trace_local_generation == trace_generation) return trace_local;
+
+    trace_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->tid = __atomic_fetch_add(&trace_next_tid, 1, __ATOMIC_RELAXED);
+
+    // Lock-free push onto the list walked by the dump
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+    }
+    trace_local = ring;
+    trace_local_generation = trace_generation;
+    return ring;
+}
+
+void trace_record(char ph, const char *name, int peer, uint32_t arg) {
+    trace_ring *ring = trace_ring_get();
+    if (!ring) return;
+
+    trace_event *ev = &ring->events[ring->head % TRACE_RING_EVENTS];
+    ev->ticks = trace_ticks();
+    ev->name = name;
+    ev->peer = peer;
+    ev->arg = arg;
+    ev->ph = ph;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_signal(int sig) {
+    (void)sig;
+    trace_dump_pending = 1;
+}
+
+// Start recording, the trace is written to '<path>.rank<N>.json'
+int rdma_trace_enable(rdma_context *ctx, const char *path) {
+    (void)ctx;
+    if (!RDMA_TRACE) {
+        set_error("Tracing was compiled out (RDMA_TRACE=0)");
+        return -1;
+    }
+    if (strlen(path) >= sizeof(trace_path)) {
+        set_error("Trace path too long");
+        return -1;
+    }
+    strcpy(trace_path, path);
+
+    anchor_ticks = trace_ticks();
+    anchor_mono_ns = now_ns();
+    anchor_real_ns = realtime_ns();
+
+    // Writing a file is not async-signal-safe, the signal only requests a dump
+    struct sigaction sa = {.sa_handler = trace_signal};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL)) {
+        set_error("Failed to install trace signal handler: %s", strerror(errno));
+        return -1;
+    }
+
+    trace_enabled = true;
+    return 0;
+}
+
+// Rank shown as the trace process: the server is 0, clients follow in accept order
+static int trace_rank(rdma_context *ctx) {
+    if (ctx->is_server || ctx->num_peers == 0) return 0;
+    return ctx->peers[0].remote_info.peer_id + 1;
+}
+
+// Write every ring as Chrome trace JSON
+int rdma_trace_dump(rdma_context *ctx) {
+    trace_dump_pending = 0;
+    if (!trace_path[0]) {
+        set_error("Tracing is not enabled");
+        return -1;
+    }
+
+    int rank = trace_rank(ctx);
+    char file[sizeof(trace_path) + 32];
+    snprintf(file, sizeof(file), "%s.rank%d.json", trace_path, rank);
+
+    FILE *out = fopen(file, "w");
+    if (!out) {
+        set_error("Failed to open trace file %s: %s", file, strerror(errno));
+        return -1;
+    }
+
+    // Ticks per nanosecond over the whole recording
+    uint64_t ticks = trace_ticks() - anchor_ticks;
+    uint64_t mono = now_ns() - anchor_mono_ns;
+    double ns_per_tick = ticks ? (double)mono / ticks : 1.0;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(out, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"rank %d (%s)\"}}",
+            rank, rank, ctx->is_server ? "server" : "client");
+
+    for (trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        for (uint64_t i = first; i < head; i++) {
+            trace_event *ev = &ring->events[i % TRACE_RING_EVENTS];
+            // Only the offset from the anchor goes through a double, the
+            // epoch would lose the low bits of its 53-bit mantissa
+            double offset = (double)(int64_t)(ev->ticks - anchor_ticks) * ns_per_tick;
+            int64_t offset_ns = (int64_t)(offset < 0 ? offset - 0.5 : offset + 0.5);
+            uint64_t ts_ns = (uint64_t)((int64_t)anchor_real_ns + offset_ns);
+
+            fprintf(out, ",\n  {\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %d, \"tid\": %d, "
+                    "\"ts\": %" PRIu64 ".%03u, %s\"args\": {\"peer\": %d, \"arg\": %u}}",
+                    ev->name, ev->ph, rank, ring->tid, ts_ns / 1000, (unsigned)(ts_ns % 1000),
+                    ev->ph == 'i' ? "\"s\": \"t\", " : "", ev->peer, ev->arg);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out)) {
+        set_error("Failed to write trace file %s", file);
+        return -1;
+    }
+    log_info("trace written to %s", file);
+    return 0;
+}
+
+// Write the trace at cleanup and release the rings
+void trace_cleanup(rdma_context *ctx) {
+    if (!trace_enabled) return;
+
+    if (rdma_trace_dump(ctx) < 0) {
+        log_warn("%s", rdma_get_error());
+    }
+    trace_enabled = false;
+
+    trace_ring *ring = __atomic_exchange_n(&trace_rings, NULL, __ATOMIC_ACQ_REL);
+    while (ring) {
+        trace_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace_local = NULL;
+    trace_generation++;
+    trace_path[0] = '\0';
+}
@@ -0,0 +1,319 @@
+#include "rdma_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Offline autotuner for the runtime tuning of rdma_lib. Like rdma_bench it
+// forks a client and acts as the server, so it runs on one machine or
+// against the local NIC of a cluster node. Starting from the defaults it
+// sweeps one knob at a time, keeps the best measured value, and writes the
+// result as a profile that rdma_init loads with RDMA_PROFILE=<file>.
+
+#define PORT 5556
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_BW_SIZE (1UL << 20)
+#define DEFAULT_LAT_SIZE 64
+#define DEFAULT_ITERS 200
+#define DEFAULT_BUF_SIZE (256UL << 10)
+#define WARMUP_ITERS 20
+#define MIN_GAIN 1.02           // A value must beat the current one by 2% to replace it
+#define CONNECT_RETRIES 500
+#define CONNECT_RETRY_US 10000
+
+typedef enum {
+    METRIC_BW,              // Streaming throughput, higher is better
+    METRIC_LATENCY          // Ping-pong round trip, lower is better
+} tune_metric;
+
+// One knob and the values tried for it
+typedef struct {
+    const char *key;        // Profile key, see rdma_tuning_keys
+    tune_metric metric;
+    uint32_t values[8];
+    int count;
+} tune_sweep;
+
+static const tune_sweep sweeps[] = {
+    {"send_wr", METRIC_BW, {16, 32, 64, 128, 256, 512}, 6},
+    {"chunk_size", METRIC_BW, {1024, 2048, 0}, 3},
+    {"cq_depth", METRIC_BW, {64, 128, 256, 512, 1024}, 5},
+    {"srq_depth", METRIC_BW, {128, 256, 512, 1024, 2048}, 5},
+    {"inline_size", METRIC_LATENCY, {0, 32, 64, 128, 256}, 5},
+};
+
+#define NUM_SWEEPS (int)(sizeof(sweeps) / sizeof(sweeps[0]))
+
+typedef struct {
+    const char *ip;
+    int port;
+    size_t bw_size;
+    size_t lat_size;
+    size_t buf_size;
+    int iters;
+    const char *output;
+} tune_opts;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a <ip>        address of the RDMA netdev (default %s)\n"
+            "  -p <port>      TCP port for connection setup (default %d)\n"
+            "  -s <bytes>     message size of the throughput runs (default %lu)\n"
+            "  -l <bytes>     message size of the latency runs (default %d)\n"
+            "  -b <bytes>     communication buffer of the tuned contexts (default %lu)\n"
+            "  -i <iters>     iterations per measurement (default %d)\n"
+            "  -o <file>      profile to write (default rdma.profile)\n",
+            prog, DEFAULT_IP, PORT, DEFAULT_BW_SIZE, DEFAULT_LAT_SIZE, DEFAULT_BUF_SIZE,
+            DEFAULT_ITERS);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Profiles and overrides in the environment would skew every measurement
+static void clear_tuning_env(void) {
+    unsetenv("RDMA_PROFILE");
+    int count;
+    const rdma_tuning_key *keys = rdma_tuning_keys(&count);
+    for (int i = 0; i < count; i++) {
+        unsetenv(keys[i].env);
+    }
+}
+
+static rdma_context *setup_context(const tune_opts *opts, const rdma_tuning *t, bool is_server) {
+    rdma_init_attr attr = {
+        .ip = opts->ip,
+        .port = opts->port,
+        .buf_size = opts->buf_size,
+        .is_server = is_server,
+        .transport = RDMA_TRANSPORT_RC,
+        .tuning = t
+    };
+    rdma_context *ctx = rdma_init_ex(&attr);
+    if (!ctx) {
+        fprintf(stderr, "Failed to initialize RDMA: %s\n", rdma_get_error());
+        return NULL;
+    }
+
+    if (is_server) {
+        if (rdma_accept_peer(ctx) < 0) {
+            fprintf(stderr, "Failed to accept client: %s\n", rdma_get_error());
+            goto err;
+        }
+    } else {
+        int retries = 0;
+        while (rdma_connect_peer(ctx, opts->ip, opts->port) < 0) {
+            if (++retries == CONNECT_RETRIES) {
+                fprintf(stderr, "Failed to connect to server: %s\n", rdma_get_error());
+                goto err;
+            }
+            usleep(CONNECT_RETRY_US);
+        }
+    }
+    return ctx;
+
+err:
+    rdma_cleanup(ctx);
+    return NULL;
+}
+
+// Run one measurement on either side. The server streams or bounces
+// messages and reports bytes/s or the median round trip in ns
+static int run_side(const tune_opts *opts, const rdma_tuning *t, tune_metric metric,
+                    bool is_server, double *score) {
+    size_t size = metric == METRIC_BW ? opts->bw_size : opts->lat_size;
+    char *buf = malloc(size);
+    uint64_t *samples = malloc(opts->iters * sizeof(*samples));
+    rdma_context *ctx = NULL;
+    char ack = 0;
+    int ret = -1;
+
+    if (!buf || !samples) {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        goto out;
+    }
+    memset(buf, 'a', size);
+    ctx = setup_context(opts, t, is_server);
+    if (!ctx || rdma_barrier(ctx) < 0) goto out;
+
+    for (int i = 0; i < WARMUP_ITERS + opts->iters; i++) {
+        uint64_t start = clock_ns();
+        if (metric == METRIC_LATENCY) {
+            if (is_server) {
+                if (rdma_send(ctx, 0, buf, size) < 0 || rdma_recv(ctx, 0, buf, size) < 0) goto out;
+            } else {
+                if (rdma_recv(ctx, 0, buf, size) < 0 || rdma_send(ctx, 0, buf, size) < 0) goto out;
+            }
+        } else if (is_server) {
+            if (rdma_send(ctx, 0, buf, size) < 0) goto out;
+        } else if (rdma_recv(ctx, 0, buf, size) < 0) {
+            goto out;
+        }
+        if (i >= WARMUP_ITERS) samples[i - WARMUP_ITERS] = clock_ns() - start;
+    }
+
+    // Throughput counts until the receiver has everything
+    if (metric == METRIC_BW) {
+        if (is_server) {
+            if (rdma_recv(ctx, 0, &ack, 1) < 0) goto out;
+        } else if (rdma_send(ctx, 0, &ack, 1) < 0) {
+            goto out;
+        }
+    }
+
+    if (is_server) {
+        if (metric == METRIC_LATENCY) {
+            qsort(samples, opts->iters, sizeof(*samples), cmp_u64);
+            *score = (double)samples[opts->iters / 2];
+        } else {
+            uint64_t total = 0;
+            for (int i = 0; i < opts->iters; i++) total += samples[i];
+            *score = total ? (double)size * opts->iters * 1e9 / total : 0;
+        }
+    }
+    ret = 0;
+
+out:
+    if (ret < 0 && ctx) fprintf(stderr, "Measurement failed: %s\n", rdma_get_error());
+    rdma_cleanup(ctx);
+    free(buf);
+    free(samples);
+    return ret;
+}
+
+// Measure one configuration with a freshly forked client
+static int measure(const tune_opts *opts, const rdma_tuning *t, tune_metric metric, double *score) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        exit(run_side(opts, t, metric, false, NULL) < 0 ? 1 : 0);
+    }
+
+    int ret = run_side(opts, t, metric, true, score);
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static bool better(tune_metric metric, double score, double best) {
+    return metric == METRIC_BW ? score > best * MIN_GAIN : score * MIN_GAIN < best;
+}
+
+static void print_score(tune_metric metric, double score) {
+    if (metric == METRIC_BW) {
+        printf("%8.3f GB/s", score / 1e9);
+    } else {
+        printf("%8.2f us rtt", score / 1000.0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    tune_opts opts = {
+        .ip = DEFAULT_IP,
+        .port = PORT,
+        .bw_size = DEFAULT_BW_SIZE,
+        .lat_size = DEFAULT_LAT_SIZE,
+        .buf_size = DEFAULT_BUF_SIZE,
+        .iters = DEFAULT_ITERS,
+        .output = "rdma.profile"
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:s:l:b:i:o:h")) != -1) {
+        switch (opt) {
+        case 'a': opts.ip = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 's': opts.bw_size = strtoul(optarg, NULL, 0); break;
+        case 'l': opts.lat_size = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.buf_size = strtoul(optarg, NULL, 0); break;
+        case 'i': opts.iters = atoi(optarg); break;
+        case 'o': opts.output = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.bw_size == 0 || opts.lat_size == 0 || opts.buf_size == 0 || opts.iters <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    clear_tuning_env();
+
+    rdma_tuning best;
+    rdma_tuning_defaults(&best);
+
+    // Coordinate descent: each knob is swept with the best values found so far
+    char report[2048];
+    size_t rlen = snprintf(report, sizeof(report),
+                           "measured with rdma_tune -s %zu -l %zu -b %zu -i %d",
+                           opts.bw_size, opts.lat_size, opts.buf_size, opts.iters);
+    for (int s = 0; s < NUM_SWEEPS; s++) {
+        const tune_sweep *sw = &sweeps[s];
+        const rdma_tuning_key *key = rdma_find_tuning_key(sw->key);
+        uint32_t current = *rdma_tuning_field(&best, key);
+        double best_score = 0;
+        uint32_t best_value = current;
+        bool have_current = false;
+
+        // The value in use is measured first, the others have to beat it
+        uint32_t values[9] = {current};
+        int count = 1;
+        for (int v = 0; v < sw->count; v++) {
+            if (sw->values[v] != current) values[count++] = sw->values[v];
+        }
+
+        for (int v = 0; v < count; v++) {
+            rdma_tuning t = best;
+            double score;
+            *rdma_tuning_field(&t, key) = values[v];
+            printf("%-12s %8u  ", sw->key, values[v]);
+            if (measure(&opts, &t, sw->metric, &score) < 0) {
+                printf("failed\n");
+                continue;
+            }
+            print_score(sw->metric, score);
+            printf("\n");
+
+            if (!have_current || better(sw->metric, score, best_score)) {
+                best_score = score;
+                best_value = values[v];
+                have_current = true;
+            }
+        }
+        if (!have_current) {
+            fprintf(stderr, "No %s value could be measured\n", sw->key);
+            return 1;
+        }
+
+        *rdma_tuning_field(&best, key) = best_value;
+        if (rlen < sizeof(report)) {
+            rlen += snprintf(report + rlen, sizeof(report) - rlen, "\n%s %u: %s %.3f",
+                             sw->key, best_value, sw->metric == METRIC_BW ? "GB/s" : "rtt us",
+                             sw->metric == METRIC_BW ? best_score / 1e9 : best_score / 1000.0);
+        }
+    }
+
+    if (rdma_save_profile(opts.output, &best, report) < 0) {
+        fprintf(stderr, "%s\n", rdma_get_error());
+        return 1;
+    }
+    printf("Profile written to %s, use it with RDMA_PROFILE=%s\n", opts.output, opts.output);
+    return 0;
+}
@@ -0,0 +1,614 @@
+#include "rdma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Unreliable Datagram transport: one UD QP per context, an address handle
+// per peer and a sliding-window reliability layer (sequence numbers,
+// cumulative + selective ACKs, timer based retransmits) on top of it.
+
+#define UD_QKEY 0x11111111
+
+enum {
+    UD_PKT_DATA = 1,
+    UD_PKT_ACK = 2,
+    UD_PKT_DATA_MORE = 3,   // Data, further chunks of the message follow
+    UD_PKT_CTRL = 4         // Control message, queued apart from the data
+};
+
+// Header prepended to every datagram
+typedef struct {
+    uint32_t peer_id;       // Index under which the receiver tracks the sender
+    uint16_t type;
+    uint16_t len;           // Payload bytes following the header
+    uint32_t seq;           // Sequence number of a data packet
+    uint32_t ack;           // Every sequence number below this was received
+    uint64_t sack;          // Bit i set: ack + 1 + i was received out of order
+} __attribute__((packed)) rdma_ud_hdr;
+
+// Data packet kept until the peer acknowledges it
+typedef struct {
+    uint64_t sent_ns;
+    int peer_idx;
+    uint32_t seq;
+    int retries;
+    int posts;              // Send WRs posted from this buffer and not yet completed
+    bool acked;
+    int next;               // Free list link
+} ud_send_buf;
+
+// Per-peer reliability state
+struct rdma_ud_peer {
+    struct ibv_ah *ah;
+    uint32_t remote_qpn;
+    uint32_t remote_id;     // peer_id stamped on outgoing packets
+    uint32_t snd_next;      // Next sequence number to send
+    uint32_t snd_una;       // Oldest sequence number not cumulatively acked
+    uint64_t rto_ns;
+    int inflight[UD_WINDOW];    // Send buffer per unacked seq, -1 once acked
+    uint32_t rcv_next;      // Next in-order sequence number expected
+    uint64_t rcv_sack;      // Bit i set: rcv_next + 1 + i is held in ooo
+    int ooo[UD_WINDOW];     // Receive slots held for out-of-order packets
+    bool ack_pending;
+};
+
+// Context wide datagram state
+struct rdma_ud_ctx {
+    void *send_buf;
+    struct ibv_mr *send_mr;
+    ud_send_buf *bufs;
+    int free_bufs;
+    size_t pkt_size;        // Header plus maximum payload
+    size_t max_payload;
+    int sq_outstanding;     // WRs posted on the UD QP and not yet completed
+    int inflight;           // Data packets waiting for an ACK, all peers
+    int *ack_list;          // Peers owed a standalone ACK after this poll batch
+    int ack_count;
+    int ack_cap;
+    uint64_t last_scan_ns;
+};
+
+static char *buf_data(struct rdma_ud_ctx *ud, int b) {
+    return (char *)ud->send_buf + (size_t)b * ud->pkt_size;
+}
+
+// Largest payload a single datagram can carry on this port
+size_t ud_payload_limit(rdma_context *ctx) {
+    size_t mtu = 128u << ctx->port_attr.active_mtu;
+    if (mtu > RECV_SLOT_SIZE - GRH_SIZE) {
+        mtu = RECV_SLOT_SIZE - GRH_SIZE;
+    }
+    return mtu - sizeof(rdma_ud_hdr);
+}
+
+// Create a UD QP on the shared SRQ and bring it to RTS
+struct ibv_qp *create_ud_qp(rdma_context *ctx, uint32_t qkey) {
+    struct ibv_qp_init_attr qp_attr = {
+        .send_cq = ctx->cq,
+        .recv_cq = ctx->cq,
+        .srq = ctx->srq,
+        .cap = {
+            .max_send_wr = ctx->tune.send_wr,
+            .max_send_sge = 1,
+            .max_inline_data = MAX_INLINE_DATA
+        },
+        .qp_type = IBV_QPT_UD,
+        .sq_sig_all = 1
+    };
+
+    struct ibv_qp *qp = ibv_create_qp(ctx->pd, &qp_attr);
+    if (!qp) {
+        set_error("Failed to create UD QP: %s", strerror(errno));
+        return NULL;
+    }
+
+    struct ibv_qp_attr attr = {
+        .qp_state = IBV_QPS_INIT,
+        .pkey_index = 0,
+        .port_num = ctx->dev_port,
+        .qkey = qkey
+    };
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+        set_error("Failed to modify UD QP to INIT: %s", strerror(errno));
+        goto err;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+        set_error("Failed to modify UD QP to RTR: %s", strerror(errno));
+        goto err;
+    }
+
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = rand() & 0xFFFFFF;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+        set_error("Failed to modify UD QP to RTS: %s", strerror(errno));
+        goto err;
+    }
+    return qp;
+
+err:
+    ibv_destroy_qp(qp);
+    return NULL;
+}
+
+// Create an address handle for a unicast or multicast destination GID
+struct ibv_ah *create_ah(rdma_context *ctx, const uint8_t *gid, uint16_t lid) {
+    struct ibv_ah_attr ah_attr = {
+        .is_global = 1,
+        .dlid = lid,
+        .sl = ctx->bulk_class.sl,
+        .src_path_bits = 0,
+        .port_num = ctx->dev_port,
+        .grh = {
+            .sgid_index = 0,
+            .hop_limit = 1,
+            .traffic_class = ctx->bulk_class.traffic_class
+        }
+    };
+    memcpy(&ah_attr.grh.dgid, gid, sizeof(union ibv_gid));
+
+    struct ibv_ah *ah = ibv_create_ah(ctx->pd, &ah_attr);
+    if (!ah) {
+        set_error("Failed to create address handle: %s", strerror(errno));
+    }
+    return ah;
+}
+
+// Set up the UD QP and the shared retransmit buffers
+int ud_init(rdma_context *ctx) {
+    struct rdma_ud_ctx *ud = calloc(1, sizeof(*ud));
+    if (!ud) {
+        set_error("Failed to allocate UD state");
+        return -1;
+    }
+    ctx->ud = ud;
+
+    ud->max_payload = ud_payload_limit(ctx);
+    ud->pkt_size = sizeof(rdma_ud_hdr) + ud->max_payload;
+
+    ud->send_buf = aligned_alloc(4096, UD_SEND_SLOTS * ud->pkt_size);
+    ud->bufs = calloc(UD_SEND_SLOTS, sizeof(*ud->bufs));
+    if (!ud->send_buf || !ud->bufs) {
+        set_error("Failed to allocate UD send buffers");
+        goto err;
+    }
+
+    ud->send_mr = ibv_reg_mr(ctx->pd, ud->send_buf, UD_SEND_SLOTS * ud->pkt_size,
+                             IBV_ACCESS_LOCAL_WRITE);
+    if (!ud->send_mr) {
+        set_error("Failed to register UD send buffers");
+        goto err;
+    }
+
+    for (int i = 0; i < UD_SEND_SLOTS; i++) {
+        ud->bufs[i].next = i + 1 < UD_SEND_SLOTS ? i + 1 : -1;
+    }
+    ud->free_bufs = 0;
+
+    ctx->ud_qp = create_ud_qp(ctx, UD_QKEY);
+    if (!ctx->ud_qp) goto err;
+
+    return 0;
+
+err:
+    ud_cleanup(ctx);
+    return -1;
+}
+
+// Release the UD QP and buffers
+void ud_cleanup(rdma_context *ctx) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    if (!ud) return;
+
+    if (ctx->ud_qp) {
+        ibv_destroy_qp(ctx->ud_qp);
+        ctx->ud_qp = NULL;
+    }
+    if (ud->send_mr) {
+        ibv_dereg_mr(ud->send_mr);
+    }
+    free(ud->send_buf);
+    free(ud->bufs);
+    free(ud->ack_list);
+    free(ud);
+    ctx->ud = NULL;
+}
+
+// Create the address handle and reliability state for a new peer
+int ud_add_peer(rdma_context *ctx, rdma_peer_conn *peer) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+
+    // Every connected peer may be owed an ACK in the same poll batch
+    if (ud->ack_cap < ctx->peer_cap) {
+        int *list = realloc(ud->ack_list, ctx->peer_cap * sizeof(*list));
+        if (!list) {
+            set_error("Failed to grow UD ACK list");
+            return -1;
+        }
+        ud->ack_list = list;
+        ud->ack_cap = ctx->peer_cap;
+    }
+
+    struct rdma_ud_peer *p = calloc(1, sizeof(*p));
+    if (!p) {
+        set_error("Failed to allocate UD peer state");
+        return -1;
+    }
+
+    p->ah = create_ah(ctx, peer->remote_info.gid, peer->remote_info.lid);
+    if (!p->ah) {
+        free(p);
+        return -1;
+    }
+
+    p->remote_qpn = peer->remote_info.qp_num;
+    p->remote_id = peer->remote_info.peer_id;
+    p->rto_ns = UD_RTO_US * 1000ULL;
+    for (int i = 0; i < UD_WINDOW; i++) {
+        p->inflight[i] = -1;
+        p->ooo[i] = -1;
+    }
+
+    peer->ud = p;
+    return 0;
+}
+
+static void free_buf(struct rdma_ud_ctx *ud, int b) {
+    ud->bufs[b].next = ud->free_bufs;
+    ud->free_bufs = b;
+}
+
+// Drop all reliability state of a disconnected peer
+void ud_remove_peer(rdma_context *ctx, rdma_peer_conn *peer) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    struct rdma_ud_peer *p = peer->ud;
+
+    for (int i = 0; i < UD_WINDOW; i++) {
+        int b = p->inflight[i];
+        if (b >= 0) {
+            // Buffers still referenced by a posted WR are freed on completion
+            ud->bufs[b].acked = true;
+            ud->inflight--;
+            if (ud->bufs[b].posts == 0) free_buf(ud, b);
+        }
+        if (p->ooo[i] >= 0) {
+            release_slot(ctx, p->ooo[i]);
+        }
+    }
+
+    ibv_destroy_ah(p->ah);
+    free(p);
+    peer->ud = NULL;
+}
+
+// Post (or re-post) a data packet to its peer
+static int post_buf(rdma_context *ctx, int b) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    ud_send_buf *sb = &ud->bufs[b];
+    struct rdma_ud_peer *p = ctx->peers[sb->peer_idx].ud;
+    rdma_ud_hdr *hdr = (rdma_ud_hdr *)buf_data(ud, b);
+
+    // Refresh the piggybacked ACK while no WR is reading the buffer
+    if (sb->posts == 0) {
+        hdr->ack = p->rcv_next;
+        hdr->sack = p->rcv_sack;
+    }
+
+    struct ibv_sge sge = {
+        .addr = (uint64_t)hdr,
+        .length = sizeof(*hdr) + hdr->len,
+        .lkey = ud->send_mr->lkey
+    };
+
+    struct ibv_send_wr wr = {
+        .wr_id = WRID(WR_KIND_UD_SEND, b),
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+        .wr.ud = {
+            .ah = p->ah,
+            .remote_qpn = p->remote_qpn,
+            .remote_qkey = UD_QKEY
+        }
+    };
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(ctx->ud_qp, &wr, &bad_wr)) {
+        set_error("Failed to post UD send");
+        return -1;
+    }
+
+    sb->posts++;
+    sb->sent_ns = now_ns();
+    STAT_ADD(ctx->peers[sb->peer_idx].stats.posted_wrs, 1);
+    ud->sq_outstanding++;
+    p->ack_pending = false;
+    return 0;
+}
+
+// Queue a payload on the reliable datagram stream of a peer
+static int ud_post(rdma_context *ctx, int peer_idx, const void *buf, size_t len, uint16_t type) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    struct rdma_ud_peer *p = peer->ud;
+
+    if (len > ud->max_payload) {
+        set_error("Message of %zu bytes exceeds the UD payload limit of %zu", len, ud->max_payload);
+        return -1;
+    }
+    if (type != UD_PKT_CTRL && pace(ctx, peer_idx, len) < 0) return -1;
+
+    // Backpressure: window space, a retransmit buffer and a send queue entry
+    while (p->snd_next - p->snd_una >= UD_WINDOW || ud->free_bufs < 0 ||
+           ud->sq_outstanding >= (int)ctx->tune.send_wr) {
+        if (peer->state != RDMA_CONN_CONNECTED) {
+            set_error("Peer %d not connected", peer_idx);
+            return -1;
+        }
+        if (progress(ctx) < 0) return -1;
+    }
+
+    int b = ud->free_bufs;
+    ud->free_bufs = ud->bufs[b].next;
+    ud->bufs[b] = (ud_send_buf){
+        .peer_idx = peer_idx,
+        .seq = p->snd_next,
+        .next = -1
+    };
+
+    rdma_ud_hdr *hdr = (rdma_ud_hdr *)buf_data(ud, b);
+    *hdr = (rdma_ud_hdr){
+        .peer_id = p->remote_id,
+        .type = type,
+        .len = len,
+        .seq = p->snd_next
+    };
+    memcpy(hdr + 1, buf, len);
+
+    p->inflight[p->snd_next % UD_WINDOW] = b;
+    p->snd_next++;
+    peer->send_inflight++;
+    ud->inflight++;
+
+    return post_buf(ctx, b);
+}
+
+// Queue a message or a chunk of a streamed one
+int ud_post_send(rdma_context *ctx, int peer_idx, const void *buf, size_t len, bool more) {
+    TRACE_INSTANT("post_send", peer_idx, len);
+    return ud_post(ctx, peer_idx, buf, len, more ? UD_PKT_DATA_MORE : UD_PKT_DATA);
+}
+
+// Queue a control message on the datagram stream, it keeps its place among
+// the data but is received with rdma_recv_ctrl
+int ud_post_ctrl(rdma_context *ctx, int peer_idx, const void *buf, size_t len) {
+    return ud_post(ctx, peer_idx, buf, len, UD_PKT_CTRL);
+}
+
+// Retire one acknowledged data packet
+static void ack_seq(rdma_context *ctx, rdma_peer_conn *peer, uint32_t seq) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    struct rdma_ud_peer *p = peer->ud;
+
+    int b = p->inflight[seq % UD_WINDOW];
+    if (b < 0 || ud->bufs[b].seq != seq) return;
+
+    p->inflight[seq % UD_WINDOW] = -1;
+    ud->bufs[b].acked = true;
+    peer->send_inflight--;
+    ud->inflight--;
+    if (ud->bufs[b].posts == 0) free_buf(ud, b);
+}
+
+// Apply the cumulative and selective ACK carried by any packet
+static void process_ack(rdma_context *ctx, rdma_peer_conn *peer, uint32_t ack, uint64_t sack) {
+    struct rdma_ud_peer *p = peer->ud;
+
+    // Ignore acknowledgements for data that was never sent
+    if ((int32_t)(ack - p->snd_next) > 0) return;
+
+    if ((int32_t)(ack - p->snd_una) > 0) {
+        while (p->snd_una != ack) {
+            ack_seq(ctx, peer, p->snd_una);
+            p->snd_una++;
+        }
+        p->rto_ns = UD_RTO_US * 1000ULL;
+    }
+
+    for (int i = 0; sack && i < 64; i++, sack >>= 1) {
+        uint32_t seq = ack + 1 + i;
+        if ((sack & 1) && (int32_t)(seq - p->snd_next) < 0) {
+            ack_seq(ctx, peer, seq);
+        }
+    }
+}
+
+// Remember that a peer is owed an ACK once the current poll batch is done
+static void schedule_ack(struct rdma_ud_ctx *ud, struct rdma_ud_peer *p, int peer_idx) {
+    if (!p->ack_pending) {
+        p->ack_pending = true;
+        ud->ack_list[ud->ack_count++] = peer_idx;
+    }
+}
+
+// Handle a datagram received into an SRQ slot
+int ud_handle_recv(rdma_context *ctx, struct ibv_wc *wc, int slot) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    rdma_ud_hdr *hdr = (rdma_ud_hdr *)(slot_base(ctx, slot) + GRH_SIZE);
+
+    if (wc->byte_len < GRH_SIZE + sizeof(*hdr) ||
+        wc->byte_len < GRH_SIZE + sizeof(*hdr) + hdr->len ||
+        hdr->peer_id >= (uint32_t)ctx->num_peers) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    // The header names the sender, the source QP confirms it
+    int peer_idx = hdr->peer_id;
+    rdma_peer_conn *peer = &ctx->peers[peer_idx];
+    struct rdma_ud_peer *p = peer->ud;
+    if (!p || p->remote_qpn != wc->src_qp || peer->state != RDMA_CONN_CONNECTED) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    process_ack(ctx, peer, hdr->ack, hdr->sack);
+
+    if (hdr->type != UD_PKT_DATA && hdr->type != UD_PKT_DATA_MORE && hdr->type != UD_PKT_CTRL) {
+        release_slot(ctx, slot);
+        return 0;
+    }
+
+    uint32_t seq = hdr->seq;
+    int32_t diff = (int32_t)(seq - p->rcv_next);
+    ctx->slots[slot].len = hdr->len;
+    ctx->slots[slot].offset = GRH_SIZE + sizeof(*hdr);
+    ctx->slots[slot].more = hdr->type == UD_PKT_DATA_MORE;
+    ctx->slots[slot].ctrl = hdr->type == UD_PKT_CTRL;
+    schedule_ack(ud, p, peer_idx);
+
+    if (diff == 0) {
+        // In order: deliver it and everything it unblocks
+        queue_recv(ctx, peer_idx, slot);
+        p->rcv_next++;
+        while (p->rcv_sack & 1) {
+            queue_recv(ctx, peer_idx, p->ooo[p->rcv_next % UD_WINDOW]);
+            p->ooo[p->rcv_next % UD_WINDOW] = -1;
+            p->rcv_sack >>= 1;
+            p->rcv_next++;
+        }
+        p->rcv_sack >>= 1;
+    } else if (diff > 0 && diff <= UD_WINDOW && !(p->rcv_sack & (1ULL << (diff - 1)))) {
+        // Ahead of a gap: hold the slot until the gap is filled
+        p->ooo[seq % UD_WINDOW] = slot;
+        p->rcv_sack |= 1ULL << (diff - 1);
+    } else {
+        // Duplicate or outside the window, the ACK tells the sender where we are
+        release_slot(ctx, slot);
+    }
+    return 0;
+}
+
+// Handle a send completion on the UD QP
+int ud_handle_send(rdma_context *ctx, struct ibv_wc *wc) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    ud->sq_outstanding--;
+
+    if (WRID_KIND(wc->wr_id) == WR_KIND_UD_SEND) {
+        int b = (int)WRID_VAL(wc->wr_id);
+        ud->bufs[b].posts--;
+        if (ud->bufs[b].acked && ud->bufs[b].posts == 0) {
+            free_buf(ud, b);
+        }
+    }
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        set_error("UD send failed with status: %d", wc->status);
+        return -1;
+    }
+    return 0;
+}
+
+// Send a standalone ACK, inline so no buffer has to outlive the call
+static int send_ack(rdma_context *ctx, int peer_idx) {
+    struct rdma_ud_peer *p = ctx->peers[peer_idx].ud;
+
+    rdma_ud_hdr hdr = {
+        .peer_id = p->remote_id,
+        .type = UD_PKT_ACK,
+        .ack = p->rcv_next,
+        .sack = p->rcv_sack
+    };
+
+    struct ibv_sge sge = {
+        .addr = (uint64_t)&hdr,
+        .length = sizeof(hdr)
+    };
+
+    struct ibv_send_wr wr = {
+        .wr_id = WRID(WR_KIND_UD_ACK, peer_idx),
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE,
+        .wr.ud = {
+            .ah = p->ah,
+            .remote_qpn = p->remote_qpn,
+            .remote_qkey = UD_QKEY
+        }
+    };
+
+    struct ibv_send_wr *bad_wr;
+    if (ibv_post_send(ctx->ud_qp, &wr, &bad_wr)) {
+        set_error("Failed to post UD ACK");
+        return -1;
+    }
+    ctx->ud->sq_outstanding++;
+    STAT_ADD(ctx->peers[peer_idx].stats.posted_wrs, 1);
+    return 0;
+}
+
+// Flush owed ACKs and retransmit packets whose timer expired
+int ud_progress(rdma_context *ctx) {
+    struct rdma_ud_ctx *ud = ctx->ud;
+    int ret = 0;
+
+    // ACKs already piggybacked on a data packet are skipped
+    int kept = 0;
+    for (int i = 0; i < ud->ack_count; i++) {
+        int peer_idx = ud->ack_list[i];
+        struct rdma_ud_peer *p = ctx->peers[peer_idx].ud;
+        if (!p || !p->ack_pending) continue;
+
+        if (ud->sq_outstanding >= (int)ctx->tune.send_wr) {
+            ud->ack_list[kept++] = peer_idx;
+            continue;
+        }
+        if (send_ack(ctx, peer_idx) < 0) ret = -1;
+        p->ack_pending = false;
+    }
+    ud->ack_count = kept;
+
+    if (ud->inflight == 0) return ret;
+
+    // Scan for expired timers at a fraction of the base timeout
+    uint64_t now = now_ns();
+    if (now - ud->last_scan_ns < UD_RTO_US * 250ULL) return ret;
+    ud->last_scan_ns = now;
+
+    for (int i = 0; i < ctx->num_peers; i++) {
+        rdma_peer_conn *peer = &ctx->peers[i];
+        struct rdma_ud_peer *p = peer->ud;
+        if (!p || p->snd_una == p->snd_next) continue;
+
+        bool backoff = false;
+        for (uint32_t seq = p->snd_una; seq != p->snd_next; seq++) {
+            int b = p->inflight[seq % UD_WINDOW];
+            if (b < 0 || ud->bufs[b].posts > 0 || now - ud->bufs[b].sent_ns < p->rto_ns) {
+                continue;
+            }
+            if (ud->bufs[b].retries++ >= UD_MAX_RETRIES) {
+                peer->state = RDMA_CONN_ERROR;
+                set_error("Peer %d stopped acknowledging datagrams", i);
+                ret = -1;
+                break;
+            }
+            if (ud->sq_outstanding >= (int)ctx->tune.send_wr) break;
+            if (post_buf(ctx, b) < 0) {
+                ret = -1;
+                break;
+            }
+            STAT_ADD(peer->stats.retransmits, 1);
+            TRACE_INSTANT("retransmit", i, seq);
+            backoff = true;
+        }
+
+        if (backoff && p->rto_ns < UD_RTO_MAX_US * 1000ULL) {
+            p->rto_ns *= 2;
+        }
+    }
+    return ret;
+}
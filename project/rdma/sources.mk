@@ -0,0 +1,5 @@
+# Library sources linked into every program, included by the Makefiles here
+# and in ../driver and read by ../torch/setup.py
+LIB_SRC = rdma_lib.c rdma_ud.c rdma_mcast.c rdma_atomic.c rdma_trace.c \
+          rdma_counters.c rdma_timestamp.c rdma_plan.c rdma_codec.c rdma_rate.c \
+          rdma_comm.c rdma_numa.c rdma_profile.c rdma_reduce.c
@@ -0,0 +1,546 @@
+#include "process_group_rdma.hpp"
+
+#include <pybind11/chrono.h>
+#include <c10/util/accumulate.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace c10d {
+
+namespace {
+
+std::mutex instance_mutex;
+ProcessGroupRdma *current = nullptr;
+
+const char *env_or(const char *name, const char *fallback) {
+    const char *value = std::getenv(name);
+    return value && *value ? value : fallback;
+}
+
+void check_tensor(const at::Tensor& tensor) {
+    TORCH_CHECK(tensor.device().is_cpu(), "rdma backend only handles CPU tensors");
+    TORCH_CHECK(tensor.is_contiguous(), "rdma backend only handles contiguous tensors");
+}
+
+rdma_dtype to_dtype(at::ScalarType type) {
+    switch (type) {
+    case at::kFloat: return RDMA_DTYPE_FLOAT32;
+    case at::kDouble: return RDMA_DTYPE_FLOAT64;
+    case at::kInt: return RDMA_DTYPE_INT32;
+    case at::kLong: return RDMA_DTYPE_INT64;
+    default: break;
+    }
+    TORCH_CHECK(false, "rdma backend cannot reduce ", type, " tensors");
+    return RDMA_DTYPE_COUNT;
+}
+
+// AVG is a sum, divided locally afterwards
+rdma_reduce_op to_reduce_op(const ReduceOp& op) {
+    switch (op.op_) {
+    case ReduceOp::SUM:
+    case ReduceOp::AVG: return RDMA_REDUCE_SUM;
+    case ReduceOp::PRODUCT: return RDMA_REDUCE_PROD;
+    case ReduceOp::MIN: return RDMA_REDUCE_MIN;
+    case ReduceOp::MAX: return RDMA_REDUCE_MAX;
+    default: break;
+    }
+    TORCH_CHECK(false, "rdma backend does not support this reduce op");
+    return RDMA_REDUCE_SUM;
+}
+
+// Byte offset of the block of every rank along dim 0, plus the total
+std::vector<size_t> split_offsets(const at::Tensor& tensor, const std::vector<int64_t>& splits,
+                                  int size) {
+    TORCH_CHECK(tensor.dim() > 0, "all_to_all needs tensors of at least one dimension");
+    int64_t rows = tensor.size(0);
+    size_t row_bytes = c10::multiply_integers(tensor.sizes().slice(1)) * tensor.element_size();
+    std::vector<size_t> offsets(size + 1, 0);
+
+    if (splits.empty()) {
+        TORCH_CHECK(rows % size == 0, "all_to_all of ", rows, " rows over ", size, " ranks");
+        for (int r = 0; r < size; r++) offsets[r + 1] = offsets[r] + rows / size * row_bytes;
+        return offsets;
+    }
+    TORCH_CHECK((int)splits.size() == size, "all_to_all needs one split size per rank");
+    for (int r = 0; r < size; r++) offsets[r + 1] = offsets[r] + splits[r] * row_bytes;
+    TORCH_CHECK(offsets[size] == rows * row_bytes, "all_to_all split sizes do not add up to ", rows);
+    return offsets;
+}
+
+} // namespace
+
+WorkRdma::WorkRdma(OpType opType, std::vector<at::Tensor> outputs)
+    : Work(-1, opType),
+      future_(c10::make_intrusive<c10::ivalue::Future>(
+          c10::ListType::create(c10::TensorType::get()))) {
+    future_->markCompleted(c10::IValue(outputs));
+    finish();
+}
+
+c10::intrusive_ptr<c10::ivalue::Future> WorkRdma::getFuture() {
+    return future_;
+}
+
+// Rank 0 publishes its address in the store and accepts the other ranks,
+// which connect to it from RDMA_LOCAL_ADDR (default: the server address)
+ProcessGroupRdma::ProcessGroupRdma(const c10::intrusive_ptr<Store>& store, int rank, int size)
+    : Backend(rank, size) {
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex);
+        TORCH_CHECK(!current, "Only one rdma process group per process");
+    }
+
+    try {
+        std::string server;
+        rdma_init_attr attr = {};
+        attr.buf_size = RDMA_PG_BUF_SIZE;
+        attr.is_server = rank == 0;
+        attr.transport = RDMA_TRANSPORT_RC;
+
+        if (rank == 0) {
+            int master_port = std::atoi(env_or("MASTER_PORT", "29500"));
+            server = env_or("RDMA_SERVER_ADDR", env_or("MASTER_ADDR", "127.0.0.1"));
+            attr.ip = server.c_str();
+            attr.port = std::atoi(env_or("RDMA_PORT", std::to_string(master_port + 1).c_str()));
+            ctx_ = rdma_init_ex(&attr);
+            check(ctx_ ? 0 : -1, "init");
+
+            std::string published = server + ":" + std::to_string(attr.port);
+            store->set("rdma_server", std::vector<uint8_t>(published.begin(), published.end()));
+            for (int i = 1; i < size; i++) {
+                check(rdma_accept_peer(ctx_), "accept");
+            }
+        } else {
+            std::vector<uint8_t> published = store->get("rdma_server");
+            std::string address(published.begin(), published.end());
+            size_t colon = address.rfind(':');
+            server = address.substr(0, colon);
+            int port = std::atoi(address.c_str() + colon + 1);
+
+            attr.ip = env_or("RDMA_LOCAL_ADDR", server.c_str());
+            attr.port = port;
+            ctx_ = rdma_init_ex(&attr);
+            check(ctx_ ? 0 : -1, "init");
+
+            // The server listens for one client at a time
+            int retries = 0;
+            while (rdma_connect_peer(ctx_, server.c_str(), port) < 0) {
+                check(++retries == RDMA_PG_CONNECT_RETRIES ? -1 : 0, "connect");
+                std::this_thread::sleep_for(std::chrono::microseconds(RDMA_PG_CONNECT_RETRY_US));
+            }
+        }
+
+        // World ranks follow the accept order, the split puts them in torch order
+        world_ = rdma_comm_world(ctx_);
+        check(world_ ? 0 : -1, "comm_world");
+        check(rdma_comm_split(world_, 0, rank, &comm_), "comm_split");
+
+        // Plans rank the server first and the clients in accept order, like the world
+        if (size > 1) {
+            std::vector<int64_t> ranks(size, 0);
+            ranks[rank] = rdma_comm_rank(world_);
+            check(rdma_allreduce(ctx_, ranks.data(), size, RDMA_DTYPE_INT64, RDMA_REDUCE_SUM),
+                  "rank map");
+            plan_ranks_.assign(ranks.begin(), ranks.end());
+        }
+    } catch (...) {
+        teardown();
+        throw;
+    }
+
+    if (rank == 0 && size > 2) {
+        relay_ = std::thread(&ProcessGroupRdma::relayLoop, this);
+    }
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    current = this;
+}
+
+ProcessGroupRdma::~ProcessGroupRdma() {
+    teardown();
+}
+
+void ProcessGroupRdma::teardown() {
+    stop_ = true;
+    if (relay_.joinable()) relay_.join();
+
+    for (auto& p : plans_) rdma_plan_free(p.plan);
+    for (auto& r : regs_) rdma_dereg_buffer(ctx_, r.addr);
+    for (auto& r : pinned_) rdma_dereg_buffer(ctx_, r.addr);
+    plans_.clear();
+    regs_.clear();
+    pinned_.clear();
+    rdma_comm_free(comm_);
+    rdma_comm_free(world_);
+    rdma_cleanup(ctx_);
+    comm_ = world_ = nullptr;
+    ctx_ = nullptr;
+
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    if (current == this) current = nullptr;
+}
+
+void ProcessGroupRdma::check(int ret, const char *op) {
+    TORCH_CHECK(ret >= 0, "rdma ", op, " failed: ", rdma_get_error());
+}
+
+// Messages between two clients pass through rank 0. While rank 0 is inside
+// the library it relays them from its own progress loop, the rest of the
+// time this thread does
+void ProcessGroupRdma::relayLoop() {
+    while (!stop_.load(std::memory_order_relaxed)) {
+        int ret = 0;
+        if (mutex_.try_lock()) {
+            ret = rdma_comm_progress(ctx_);
+            mutex_.unlock();
+        }
+        if (ret < 0) break;     // The next operation reports the failure
+        if (ret == 0) std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+}
+
+// Tensors are used in place. Storage of at least RDMA_PG_REG_MIN bytes is
+// registered on first use, so sends go out of it without a copy; smaller
+// storage goes through the staging buffer of the library
+void ProcessGroupRdma::registerStorage(const at::Tensor& tensor) {
+    const c10::Storage& storage = tensor.storage();
+    void *addr = const_cast<void *>(storage.data());
+    size_t len = storage.nbytes();
+    if (len < RDMA_PG_REG_MIN) return;
+
+    for (auto& r : pinned_) {
+        if (r.addr == addr && r.len == len) return;
+    }
+    for (auto it = regs_.begin(); it != regs_.end(); ++it) {
+        if (it->addr != addr) continue;
+        if (it->len == len) {
+            regs_.splice(regs_.begin(), regs_, it);
+            return;
+        }
+        // The storage was resized in place
+        rdma_dereg_buffer(ctx_, it->addr);
+        regs_.erase(it);
+        break;
+    }
+
+    if (regs_.size() == RDMA_PG_MAX_REGS) {
+        rdma_dereg_buffer(ctx_, regs_.back().addr);
+        regs_.pop_back();
+    }
+    if (rdma_reg_buffer(ctx_, addr, len) < 0) {
+        TORCH_WARN_ONCE("rdma backend stages tensors, registration failed: ", rdma_get_error());
+        return;
+    }
+    regs_.push_front({addr, len, storage});
+}
+
+void ProcessGroupRdma::registerTensor(const at::Tensor& tensor) {
+    check_tensor(tensor);
+    std::lock_guard<std::mutex> lock(mutex_);
+    const c10::Storage& storage = tensor.storage();
+    void *addr = const_cast<void *>(storage.data());
+
+    for (auto it = regs_.begin(); it != regs_.end(); ++it) {
+        if (it->addr == addr && it->len == storage.nbytes()) {
+            pinned_.splice(pinned_.begin(), regs_, it);
+            return;
+        }
+    }
+    check(rdma_reg_buffer(ctx_, addr, storage.nbytes()), "register");
+    pinned_.push_front({addr, storage.nbytes(), storage});
+}
+
+void ProcessGroupRdma::registerMemory(void *addr, size_t len) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check(rdma_reg_buffer(ctx_, addr, len), "register");
+}
+
+void ProcessGroupRdma::deregisterMemory(void *addr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check(rdma_dereg_buffer(ctx_, addr), "deregister");
+}
+
+// Run one stage of a plan over the 'len' bytes at 'addr', collective. The
+// ranks agree on a plan generation all of them have cached or create a new
+// one; nullptr when their sizes differ or one is not 'regular', then all of
+// them take the pairwise path
+const char *ProcessGroupRdma::planStage(const c10::Storage& storage, const void *addr,
+                                        size_t len, bool regular) {
+    if (getSize() == 1) return nullptr;
+
+    auto hit = std::find_if(plans_.begin(), plans_.end(), [&](const CachedPlan& p) {
+        return p.addr == addr && p.len == len;
+    });
+    int64_t gen = hit != plans_.end() ? hit->gen : -1;
+    int64_t votes[5] = {gen, -gen, (int64_t)len, -(int64_t)len, regular ? 0 : 1};
+    check(rdma_allreduce(ctx_, votes, 5, RDMA_DTYPE_INT64, RDMA_REDUCE_MAX), "plan vote");
+    if (votes[2] != -votes[3] || votes[4] || len == 0) return nullptr;
+
+    if (votes[0] < 0 || votes[0] != -votes[1]) {
+        // The new plan takes the place of ours for this buffer
+        if (hit != plans_.end()) {
+            rdma_plan_free(hit->plan);
+            plans_.erase(hit);
+        }
+        if (plans_.size() == RDMA_PG_MAX_PLANS) {
+            rdma_plan_free(plans_.back().plan);
+            plans_.pop_back();
+        }
+        size_t result_len = len * getSize();
+        CachedPlan entry{nullptr, addr, len, plan_gen_++, storage,
+                         std::make_unique<char[]>(result_len)};
+        check(rdma_alltoall_init(ctx_, addr, entry.result.get(), result_len, len, &entry.plan),
+              "plan");
+        plans_.push_front(std::move(entry));
+    } else {
+        plans_.splice(plans_.begin(), plans_, hit);
+    }
+
+    CachedPlan& cached = plans_.front();
+    check(rdma_plan_start(cached.plan), "plan start");
+    check(rdma_plan_wait(cached.plan), "plan wait");
+    return cached.result.get();
+}
+
+// Buffer of torch rank 'rank' in the result of a plan over 'len' byte buffers
+const char *ProcessGroupRdma::planBlock(const char *result, int rank, size_t len) const {
+    return result + plan_ranks_[rank] * len;
+}
+
+// Send to 'dst' while receiving from 'src', one slot sized message of each
+// at a time, so no rank piles up messages in the receive slots of another.
+// Registered storage goes out in place, the rest through the communicator's
+// stage; received messages are copied out of the slots
+void ProcessGroupRdma::exchange(int dst, const char *send, size_t send_len,
+                                int src, char *recv, size_t recv_len) {
+    size_t sent = 0, received = 0;
+    while (sent < send_len || received < recv_len) {
+        if (sent < send_len) {
+            size_t n = std::min<size_t>(send_len - sent, RECV_SLOT_SIZE);
+            check(rdma_comm_send(comm_, dst, send + sent, n), "send");
+            sent += n;
+        }
+        if (received < recv_len) {
+            size_t n = std::min<size_t>(recv_len - received, RECV_SLOT_SIZE);
+            int len = rdma_comm_recv(comm_, src, recv + received, n);
+            check(len, "recv");
+            TORCH_CHECK((size_t)len == n, "rdma recv of ", len, " bytes from rank ", src,
+                        ", expected ", n);
+            received += n;
+        }
+    }
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::broadcast(
+    std::vector<at::Tensor>& tensors, const BroadcastOptions& opts) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& tensor : tensors) {
+        check_tensor(tensor);
+        size_t len = tensor.nbytes();
+        const char *result = planStage(tensor.storage(), tensor.data_ptr(), len, true);
+        if (result) {
+            if (getRank() != opts.rootRank) {
+                std::memcpy(tensor.data_ptr(), planBlock(result, opts.rootRank, len), len);
+            }
+            continue;
+        }
+        registerStorage(tensor);
+        check(rdma_comm_bcast(comm_, opts.rootRank, tensor.data_ptr(), len), "broadcast");
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::BROADCAST, tensors);
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::allreduce(
+    std::vector<at::Tensor>& tensors, const AllreduceOptions& opts) {
+    rdma_reduce_op op = to_reduce_op(opts.reduceOp);
+    bool average = opts.reduceOp == ReduceOp::AVG;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& tensor : tensors) {
+        check_tensor(tensor);
+        TORCH_CHECK(!average || tensor.is_floating_point(), "rdma backend averages only floats");
+        rdma_dtype dtype = to_dtype(tensor.scalar_type());
+        registerStorage(tensor);
+        check(rdma_allreduce(ctx_, tensor.data_ptr(), tensor.numel(), dtype, op), "all_reduce");
+        if (average) tensor.div_(getSize());
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::ALLREDUCE, tensors);
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::alltoall(
+    std::vector<at::Tensor>& outputTensors,
+    std::vector<at::Tensor>& inputTensors,
+    const AllToAllOptions& /* unused */) {
+    int rank = getRank(), size = getSize();
+    TORCH_CHECK((int)outputTensors.size() == size && (int)inputTensors.size() == size,
+                "all_to_all needs one tensor per rank");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int r = 0; r < size; r++) {
+        check_tensor(inputTensors[r]);
+        check_tensor(outputTensors[r]);
+    }
+
+    // Inputs that are consecutive views of one storage go out in place, others
+    // are gathered into a staging tensor that the next call reuses
+    size_t block = inputTensors[0].nbytes();
+    const char *base = static_cast<const char *>(inputTensors[0].data_ptr());
+    bool regular = true, in_place = true;
+    for (int r = 0; r < size; r++) {
+        regular = regular && inputTensors[r].nbytes() == block && outputTensors[r].nbytes() == block;
+        in_place = in_place && inputTensors[r].storage().is_alias_of(inputTensors[0].storage()) &&
+                   inputTensors[r].data_ptr() == base + r * block;
+    }
+    const c10::Storage *storage = &inputTensors[0].storage();
+    if (regular && !in_place) {
+        if (!stage_.defined() || stage_.nbytes() < block * size) {
+            stage_ = at::empty({(int64_t)(block * size)}, at::kByte);
+        }
+        char *staged = static_cast<char *>(stage_.data_ptr());
+        for (int r = 0; r < size; r++) {
+            std::memcpy(staged + r * block, inputTensors[r].data_ptr(), block);
+        }
+        base = staged;
+        storage = &stage_.storage();
+    }
+
+    // Every rank sent all its blocks, ours is the 'rank'th of each
+    const char *result = planStage(*storage, base, block * size, regular);
+    if (result) {
+        for (int s = 0; s < size; s++) {
+            std::memcpy(outputTensors[s].data_ptr(), planBlock(result, s, block * size) + rank * block,
+                        block);
+        }
+        return c10::make_intrusive<WorkRdma>(OpType::ALLTOALL, outputTensors);
+    }
+
+    for (int r = 0; r < size; r++) {
+        registerStorage(inputTensors[r]);
+    }
+    outputTensors[rank].copy_(inputTensors[rank]);
+
+    // Pairwise: in step s every rank sends to rank + s and receives from rank - s
+    for (int s = 1; s < size; s++) {
+        int dst = (rank + s) % size, src = (rank - s + size) % size;
+        exchange(dst, static_cast<const char *>(inputTensors[dst].data_ptr()),
+                 inputTensors[dst].nbytes(),
+                 src, static_cast<char *>(outputTensors[src].data_ptr()),
+                 outputTensors[src].nbytes());
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::ALLTOALL, outputTensors);
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::alltoall_base(
+    at::Tensor& outputTensor,
+    at::Tensor& inputTensor,
+    std::vector<int64_t>& outputSplitSizes,
+    std::vector<int64_t>& inputSplitSizes,
+    const AllToAllOptions& /* unused */) {
+    int rank = getRank(), size = getSize();
+    check_tensor(outputTensor);
+    check_tensor(inputTensor);
+    TORCH_CHECK(outputTensor.scalar_type() == inputTensor.scalar_type(),
+                "all_to_all tensors of different types");
+    std::vector<size_t> in = split_offsets(inputTensor, inputSplitSizes, size);
+    std::vector<size_t> out = split_offsets(outputTensor, outputSplitSizes, size);
+    TORCH_CHECK(in[rank + 1] - in[rank] == out[rank + 1] - out[rank],
+                "all_to_all block of rank ", rank, " differs in size");
+
+    const char *send = static_cast<const char *>(inputTensor.data_ptr());
+    char *recv = static_cast<char *>(outputTensor.data_ptr());
+
+    // Even splits run as a plan stage over the whole input, in place
+    size_t block = in[1] - in[0];
+    bool regular = true;
+    for (int r = 0; r < size; r++) {
+        regular = regular && in[r + 1] - in[r] == block && out[r + 1] - out[r] == block;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const char *result = planStage(inputTensor.storage(), send, in[size], regular);
+    if (result) {
+        for (int s = 0; s < size; s++) {
+            std::memcpy(recv + out[s], planBlock(result, s, in[size]) + rank * block, block);
+        }
+        return c10::make_intrusive<WorkRdma>(OpType::ALLTOALL_BASE,
+                                             std::vector<at::Tensor>{outputTensor});
+    }
+
+    registerStorage(inputTensor);
+    std::memcpy(recv + out[rank], send + in[rank], in[rank + 1] - in[rank]);
+    for (int s = 1; s < size; s++) {
+        int dst = (rank + s) % size, src = (rank - s + size) % size;
+        exchange(dst, send + in[dst], in[dst + 1] - in[dst],
+                 src, recv + out[src], out[src + 1] - out[src]);
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::ALLTOALL_BASE,
+                                         std::vector<at::Tensor>{outputTensor});
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::barrier(const BarrierOptions& /* unused */) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check(rdma_comm_barrier(comm_), "barrier");
+    return c10::make_intrusive<WorkRdma>(OpType::BARRIER, std::vector<at::Tensor>{});
+}
+
+// Messages from one rank are received in the order they were sent, tags
+// are not matched
+c10::intrusive_ptr<Work> ProcessGroupRdma::send(
+    std::vector<at::Tensor>& tensors, int dstRank, int tag) {
+    TORCH_CHECK(tag == 0, "rdma backend does not match tags");
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& tensor : tensors) {
+        check_tensor(tensor);
+        registerStorage(tensor);
+        exchange(dstRank, static_cast<const char *>(tensor.data_ptr()), tensor.nbytes(),
+                 -1, nullptr, 0);
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::SEND, tensors);
+}
+
+c10::intrusive_ptr<Work> ProcessGroupRdma::recv(
+    std::vector<at::Tensor>& tensors, int srcRank, int tag) {
+    TORCH_CHECK(tag == 0, "rdma backend does not match tags");
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& tensor : tensors) {
+        check_tensor(tensor);
+        exchange(-1, nullptr, 0,
+                 srcRank, static_cast<char *>(tensor.data_ptr()), tensor.nbytes());
+    }
+    return c10::make_intrusive<WorkRdma>(OpType::RECV, tensors);
+}
+
+ProcessGroupRdma *ProcessGroupRdma::instance() {
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    TORCH_CHECK(current, "No rdma process group, call init_process_group(\"rdma\") first");
+    return current;
+}
+
+c10::intrusive_ptr<Backend> ProcessGroupRdma::create(
+    const c10::intrusive_ptr<Store>& store,
+    int rank,
+    int size,
+    const std::chrono::duration<float>& /* timeout, operations block until done */) {
+    py::gil_scoped_release release;
+    return c10::make_intrusive<ProcessGroupRdma>(store, rank, size);
+}
+
+} // namespace c10d
+
+// Any object with the buffer protocol (numpy arrays, bytearrays, memoryviews)
+// is registered in place; the caller keeps it alive until it is deregistered
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("create_backend", &c10d::ProcessGroupRdma::create);
+    m.def("register_buffer", [](py::buffer buffer) {
+        py::buffer_info info = buffer.request();
+        c10d::ProcessGroupRdma::instance()->registerMemory(info.ptr, info.size * info.itemsize);
+    });
+    m.def("deregister_buffer", [](py::buffer buffer) {
+        c10d::ProcessGroupRdma::instance()->deregisterMemory(buffer.request().ptr);
+    });
+    m.def("register_tensor", [](const at::Tensor& tensor) {
+        c10d::ProcessGroupRdma::instance()->registerTensor(tensor);
+    });
+}
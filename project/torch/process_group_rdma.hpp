@@ -0,0 +1,143 @@
+#pragma once
+
+#include <torch/python.h>
+#include <torch/csrc/distributed/c10d/Backend.hpp>
+#include <torch/csrc/distributed/c10d/Store.hpp>
+#include <torch/csrc/distributed/c10d/Types.hpp>
+#include <torch/csrc/distributed/c10d/Work.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "rdma_lib.h"
+
+#define RDMA_PG_BUF_SIZE (4UL << 20)    // Staging buffer of the context
+#define RDMA_PG_REG_MIN (64UL << 10)    // Smaller tensor storage is staged, not registered
+#define RDMA_PG_MAX_REGS 64             // Registered storages kept, least recently used go first
+#define RDMA_PG_MAX_PLANS 16            // Cached plans, least recently used go first
+#define RDMA_PG_CONNECT_RETRIES 500
+#define RDMA_PG_CONNECT_RETRY_US 10000
+
+namespace c10d {
+
+// Every operation runs to completion on the calling thread, so the work
+// handed back is already finished
+class WorkRdma : public Work {
+public:
+    WorkRdma(OpType opType, std::vector<at::Tensor> outputs);
+
+    c10::intrusive_ptr<c10::ivalue::Future> getFuture() override;
+
+private:
+    c10::intrusive_ptr<c10::ivalue::Future> future_;
+};
+
+// CPU backend on rdma_lib. Rank 0 is the server of the star, every other
+// rank connects to it. all_reduce runs rdma_allreduce on the context.
+// broadcast and all_to_all run as a stage of a persistent plan registered
+// on the tensor storage, cached by buffer and size; every rank then writes
+// its whole buffer, so an all_to_all moves the world size times the bytes
+// of a pairwise one, in a single RDMA write per rank and client. Buffers of
+// different sizes on different ranks, uneven splits, barrier and send/recv
+// run on a communicator whose ranks are the torch ranks
+class ProcessGroupRdma : public Backend {
+public:
+    ProcessGroupRdma(const c10::intrusive_ptr<Store>& store, int rank, int size);
+    ~ProcessGroupRdma() override;
+
+    const std::string getBackendName() const override {
+        return "rdma";
+    }
+
+    c10::intrusive_ptr<Work> broadcast(
+        std::vector<at::Tensor>& tensors,
+        const BroadcastOptions& opts = BroadcastOptions()) override;
+
+    c10::intrusive_ptr<Work> allreduce(
+        std::vector<at::Tensor>& tensors,
+        const AllreduceOptions& opts = AllreduceOptions()) override;
+
+    c10::intrusive_ptr<Work> alltoall(
+        std::vector<at::Tensor>& outputTensors,
+        std::vector<at::Tensor>& inputTensors,
+        const AllToAllOptions& opts = AllToAllOptions()) override;
+
+    c10::intrusive_ptr<Work> alltoall_base(
+        at::Tensor& outputTensor,
+        at::Tensor& inputTensor,
+        std::vector<int64_t>& outputSplitSizes,
+        std::vector<int64_t>& inputSplitSizes,
+        const AllToAllOptions& opts = AllToAllOptions()) override;
+
+    c10::intrusive_ptr<Work> barrier(
+        const BarrierOptions& opts = BarrierOptions()) override;
+
+    c10::intrusive_ptr<Work> send(
+        std::vector<at::Tensor>& tensors, int dstRank, int tag) override;
+
+    c10::intrusive_ptr<Work> recv(
+        std::vector<at::Tensor>& tensors, int srcRank, int tag) override;
+
+    // Register memory the caller keeps alive until it is deregistered
+    void registerMemory(void *addr, size_t len);
+    void deregisterMemory(void *addr);
+
+    // Register the whole storage of a tensor, kept until the group is destroyed
+    void registerTensor(const at::Tensor& tensor);
+
+    // The group of this process, there is one per process
+    static ProcessGroupRdma *instance();
+
+    static c10::intrusive_ptr<Backend> create(
+        const c10::intrusive_ptr<Store>& store,
+        int rank,
+        int size,
+        const std::chrono::duration<float>& timeout);
+
+private:
+    struct Registration {
+        void *addr;
+        size_t len;
+        c10::Storage storage;   // Holds the memory so its address is not reused
+    };
+
+    // A plan over one send buffer, paired with the plans of the same
+    // generation on the other ranks
+    struct CachedPlan {
+        rdma_plan *plan;
+        const void *addr;
+        size_t len;
+        int64_t gen;
+        c10::Storage storage;           // Holds the registered send buffer
+        std::unique_ptr<char[]> result; // Every rank's buffer, in plan rank order
+    };
+
+    void check(int ret, const char *op);
+    void registerStorage(const at::Tensor& tensor);
+    const char *planStage(const c10::Storage& storage, const void *addr, size_t len,
+                          bool regular);
+    const char *planBlock(const char *result, int rank, size_t len) const;
+    void exchange(int dst, const char *send, size_t send_len,
+                  int src, char *recv, size_t recv_len);
+    void relayLoop();
+    void teardown();
+
+    rdma_context *ctx_ = nullptr;
+    rdma_comm *world_ = nullptr;
+    rdma_comm *comm_ = nullptr;     // World ranks renumbered to the torch ranks
+    std::mutex mutex_;              // The library is entered by one thread at a time
+    std::thread relay_;
+    std::atomic<bool> stop_{false};
+    std::list<Registration> regs_;  // Most recently used first
+    std::list<Registration> pinned_;
+    std::list<CachedPlan> plans_;   // Most recently used first
+    int64_t plan_gen_ = 0;          // Plans created by the group, equal on every rank
+    std::vector<int> plan_ranks_;   // Plan rank of every torch rank
+    at::Tensor stage_;              // Gathers all_to_all inputs that are not one buffer
+};
+
+} // namespace c10d
@@ -0,0 +1,40 @@
+# Build with: pip install --no-build-isolation .   (from project/torch)
+import os
+
+from setuptools import setup
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+RDMA_DIR = "../rdma"
+
+
+def library_sources():
+    """The library's sources, from the list its Makefiles share"""
+    with open(os.path.join(RDMA_DIR, "sources.mk")) as f:
+        text = f.read().replace("\\\n", " ")
+    for line in text.splitlines():
+        name, _, value = line.partition("=")
+        if name.strip() == "LIB_SRC":
+            return [f"{RDMA_DIR}/{src}" for src in value.split()]
+    raise RuntimeError(f"no LIB_SRC in {RDMA_DIR}/sources.mk")
+
+
+RDMA_SRC = library_sources()
+
+setup(
+    name="torch_rdma",
+    version="0.1",
+    packages=["torch_rdma"],
+    # The library is built as plain C, apart from the C++ flags of the extension
+    libraries=[("rdma", {"sources": RDMA_SRC, "cflags": ["-O2", "-fPIC"]})],
+    ext_modules=[
+        CppExtension(
+            name="torch_rdma._C",
+            sources=["process_group_rdma.cpp"],
+            include_dirs=[RDMA_DIR],
+            extra_compile_args=["-O2"],
+            # After the static library, so its references to ibverbs resolve
+            extra_link_args=["-libverbs", "-pthread"],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
@@ -0,0 +1,30 @@
+"""rdma_lib as a torch.distributed backend.
+
+Importing the package registers the "rdma" backend for CPU tensors:
+
+    import torch_rdma
+    dist.init_process_group("rdma", rank=rank, world_size=world_size)
+"""
+
+import torch
+import torch.distributed as dist
+
+from . import _C
+
+dist.Backend.register_backend("rdma", _C.create_backend, devices=["cpu"])
+
+
+def register(obj):
+    """Register memory with the rdma process group so sends use it in place.
+
+    A tensor registers its whole storage until the group is destroyed. Any
+    other object with the buffer protocol is registered until deregister().
+    """
+    if isinstance(obj, torch.Tensor):
+        _C.register_tensor(obj)
+    else:
+        _C.register_buffer(obj)
+
+
+def deregister(obj):
+    _C.deregister_buffer(obj)
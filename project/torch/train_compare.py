@@ -0,0 +1,185 @@
+import argparse
+import os
+import sys
+import time
+
+import torch
+import torch.distributed as dist
+import torch.multiprocessing as mp
+
+import torch_rdma  # noqa: F401  registers the "rdma" backend
+
+# The lab3 training loop on a small causal transformer over random tokens,
+# so gloo and rdma can be compared on one machine (SoftRoCE) without the
+# dataset. Gradients are synchronized the way lab3 does it: one all_reduce
+# per parameter, then divided by the world size. --check runs each
+# operation the backend implements once and compares the results instead.
+
+VOCAB = 1024
+CONTEXT = 128
+CHECK_SIZES = (7, 5000)     # Within one receive slot, and across several
+
+
+class TinyLM(torch.nn.Module):
+    def __init__(self, hidden, layers):
+        super().__init__()
+        self.embed = torch.nn.Embedding(VOCAB, hidden)
+        layer = torch.nn.TransformerEncoderLayer(hidden, 8, 4 * hidden, batch_first=True)
+        self.blocks = torch.nn.TransformerEncoder(layer, layers)
+        self.head = torch.nn.Linear(hidden, VOCAB)
+        self.register_buffer('mask', torch.nn.Transformer.generate_square_subsequent_mask(CONTEXT))
+
+    def forward(self, inputs):
+        return self.head(self.blocks(self.embed(inputs), mask=self.mask, is_causal=True))
+
+
+def training_loop_fn(rank, args):
+    os.environ.setdefault('MASTER_ADDR', '127.0.0.1')
+    os.environ.setdefault('MASTER_PORT', str(args.port))
+    torch.set_num_threads(args.threads)
+    dist.init_process_group(args.backend, rank=rank, world_size=args.world_size)
+
+    # Same initial weights on every rank, different data per rank
+    torch.manual_seed(0)
+    model = TinyLM(args.hidden, args.layers)
+    optimizer = torch.optim.AdamW(model.parameters(), lr=0.0005, weight_decay=0.1, betas=(0.9, 0.95))
+    loss_fn = torch.nn.CrossEntropyLoss()
+    generator = torch.Generator().manual_seed(rank + 1)
+
+    step_time = comm_time = 0.0
+    for step in range(args.warmup + args.steps):
+        inputs = torch.randint(VOCAB, (args.batch, CONTEXT), generator=generator)
+        start = time.perf_counter()
+
+        optimizer.zero_grad()
+        output = model(inputs)
+        labels = inputs[:, 1:].contiguous()
+        shifted_output = output[:, :-1, :].contiguous()
+        loss = loss_fn(shifted_output.view(-1, VOCAB), labels.view(-1))
+        loss.backward()
+
+        comm_start = time.perf_counter()
+        for param in model.parameters():
+            dist.all_reduce(param.grad.data, op=dist.ReduceOp.SUM)
+            param.grad.data /= args.world_size
+        comm_end = time.perf_counter()
+
+        optimizer.step()
+        if step >= args.warmup:
+            step_time += time.perf_counter() - start
+            comm_time += comm_end - comm_start
+
+    # Identical parameters on every rank show the gradients were reduced right
+    checksum = torch.tensor([sum(p.detach().double().sum().item() for p in model.parameters())],
+                            dtype=torch.float64)
+    reference = checksum.clone()
+    dist.broadcast(reference, 0)
+    dist.barrier()
+
+    if rank == 0:
+        params = sum(p.numel() for p in model.parameters())
+        print(f'{args.backend}: {args.world_size} ranks, {params / 1e6:.1f}M parameters, '
+              f'{len(list(model.parameters()))} tensors')
+        print(f'  step {step_time / args.steps * 1e3:8.2f} ms   all_reduce {comm_time / args.steps * 1e3:8.2f} ms'
+              f'   final loss {loss.item():.4f}')
+    if checksum.item() != reference.item():
+        print(f'rank {rank}: parameters differ from rank 0')
+    dist.destroy_process_group()
+
+
+def check_fn(rank, args):
+    os.environ.setdefault('MASTER_ADDR', '127.0.0.1')
+    os.environ.setdefault('MASTER_PORT', str(args.port))
+    dist.init_process_group(args.backend, rank=rank, world_size=args.world_size)
+    size = args.world_size
+    failed = []
+
+    def expect(name, got, want):
+        if not torch.equal(got, want):
+            failed.append(name)
+
+    for n in CHECK_SIZES:
+        ranks = torch.arange(1, size + 1, dtype=torch.float64)
+
+        t = torch.full((n,), rank + 1.0, dtype=torch.float64)
+        dist.all_reduce(t, op=dist.ReduceOp.SUM)
+        expect(f'all_reduce sum {n}', t, torch.full((n,), ranks.sum().item(), dtype=torch.float64))
+
+        t = torch.full((n,), rank + 1.0, dtype=torch.float64)
+        dist.all_reduce(t, op=dist.ReduceOp.MAX)
+        expect(f'all_reduce max {n}', t, torch.full((n,), float(size), dtype=torch.float64))
+
+        for root in (0, size - 1):
+            want = torch.arange(n, dtype=torch.float64) + root
+            t = want.clone() if rank == root else torch.zeros(n, dtype=torch.float64)
+            dist.broadcast(t, root)
+            expect(f'broadcast from {root} {n}', t, want)
+
+        # Block r of rank q holds q * 1e6 + r * n + i, plus the stage. The
+        # second stage runs on the plan cached for the same buffers
+        send = torch.empty(size * n, dtype=torch.float64)
+        recv = torch.empty(size * n, dtype=torch.float64)
+        want = torch.cat([q * 1e6 + rank * n + torch.arange(n, dtype=torch.float64)
+                          for q in range(size)])
+        for stage in range(2):
+            send.copy_(rank * 1e6 + torch.arange(size * n, dtype=torch.float64) + stage)
+            dist.all_to_all_single(recv, send)
+            expect(f'all_to_all_single {n} stage {stage}', recv, want + stage)
+        send = rank * 1e6 + torch.arange(size * n, dtype=torch.float64)
+
+        # Uneven splits take the pairwise path: rank r gets r + 1 elements of every rank
+        splits = [r + 1 for r in range(size)]
+        uneven = torch.cat([rank * 1e6 + r * n + torch.arange(r + 1, dtype=torch.float64)
+                            for r in range(size)])
+        got = torch.empty(size * (rank + 1), dtype=torch.float64)
+        dist.all_to_all_single(got, uneven, [rank + 1] * size, splits)
+        expect(f'all_to_all_single uneven {n}', got,
+               torch.cat([q * 1e6 + rank * n + torch.arange(rank + 1, dtype=torch.float64)
+                          for q in range(size)]))
+
+        recvs = [torch.empty(n, dtype=torch.float64) for _ in range(size)]
+        dist.all_to_all(recvs, list(send.chunk(size)))
+        expect(f'all_to_all {n}', torch.cat(recvs), want)
+
+        # Rank 0 and the last rank swap a tensor
+        peer = size - 1 - rank
+        if rank in (0, size - 1) and peer != rank:
+            t = torch.arange(n, dtype=torch.float64) + rank
+            if args.backend == 'rdma':
+                torch_rdma.register(t)
+            if rank == 0:
+                dist.send(t, peer)
+                dist.recv(t, peer)
+            else:
+                dist.recv(t, peer)
+                dist.send(t + 0, peer)
+            expect(f'send/recv {n}', t, torch.arange(n, dtype=torch.float64))
+
+    dist.barrier()
+    for name in failed:
+        print(f'rank {rank}: {name} differs')
+    if rank == 0 and not failed:
+        print(f'{args.backend}: all checks passed on {size} ranks')
+    dist.destroy_process_group()
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compare torch.distributed backends on the lab3 loop')
+    parser.add_argument('--backend', default='rdma', choices=['rdma', 'gloo'])
+    parser.add_argument('--world-size', type=int, default=2)
+    parser.add_argument('--steps', type=int, default=20)
+    parser.add_argument('--warmup', type=int, default=3)
+    parser.add_argument('--batch', type=int, default=8)
+    parser.add_argument('--hidden', type=int, default=256)
+    parser.add_argument('--layers', type=int, default=4)
+    parser.add_argument('--threads', type=int, default=2, help='torch threads per rank')
+    parser.add_argument('--port', type=int, default=29500)
+    parser.add_argument('--check', action='store_true', help='check every operation instead of training')
+    args = parser.parse_args()
+
+    try:
+        mp.spawn(check_fn if args.check else training_loop_fn, args=(args,), nprocs=args.world_size)
+    except mp.ProcessExitedException:
+        sys.exit(1)